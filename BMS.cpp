@@ -8,6 +8,52 @@
 #include <cstdlib>
 #include <algorithm>
 #include <ctime>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <chrono>
+#include <random>
+#include <map>
+#include <cmath>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <deque>
+#include <array>
+#include <coroutine>
+#include <utility>
+#include <climits>
+#include <cerrno>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#else
+#include <direct.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
 
 using namespace std;
 
@@ -16,569 +62,10309 @@ const string ACCOUNT_FILE = "bank_accounts.dat";
 const string TRANSACTION_LOG = "bank_transactions.log";
 const string COUNTER_FILE = "account_counter.dat";
 const int MIN_PASSWORD_LENGTH = 4;
-const double SAVINGS_MIN_BALANCE = 100.0;
-const double CURRENT_MIN_BALANCE = 500.0;
+constexpr double SAVINGS_MIN_BALANCE = 100.0;
+constexpr double CURRENT_MIN_BALANCE = 500.0;
+const string PRODUCT_FILE = "bank_products.cfg";
+const long long ACCOUNT_NUMBER_BLOCK = 1000;   // Numbers reserved per counter-file write
+const string UNIQUE_INDEX_FILE = "bank_unique.idx";
+const string UNIQUE_INDEX_MAGIC = "BMSUNIQ1";
+const string JOURNAL_FILE = "bank_journal.log";
+const string SNAPSHOT_MAGIC = "BMSSNAP1";
+const long DEFAULT_RECOVERY_BOUND_MS = 250;     // Override with BMS_RECOVERY_BOUND_MS
+const long DEFAULT_REPLAY_COST_NS = 20000;      // Pessimistic cost of replaying one journal record
+const size_t COMPACTION_STEP = 64;              // Closed-account tombstones compacted per operation
+const string STATS_FILE = "bank_stats.dat";       // Today's flows as of the last checkpoint
+const string STATS_MAGIC = "BMSSTAT1";
+const string STATS_LOG = "bank_stats.log";        // Periodic dumps, see BMS_STATS_INTERVAL
+const string RULES_FILE = "bank_rules.cfg";       // Velocity rules; none configured means none applied
+const string ALERT_LOG = "bank_alerts.log";       // Withdrawals flagged or blocked by a velocity rule
+const string LSM_DIR = "bank_lsm";                // Storage engine files when BMS_STORAGE=lsm
+const long long SHARD_ACCOUNT_RANGE = 100000000;  // Account numbers owned by each shard
+const string SHARD_DIR_PREFIX = "bank_shard";     // Shard i keeps its files in bank_shard<i>
+const string COORDINATOR_LOG = "bank_coordinator.log"; // The router's record of cross-shard transfers
 
-class BankAccount {
-private:
-    string accountNumber;
-    string accountHolderName;
-    string address;
-    string phoneNumber;
-    string email;
-    double balance;
-    string accountType;
-    string password;
-    vector<string> transactionHistory;
+// ================= Span tracing =================
 
-public:
-    // Constructor
-    BankAccount(string accNum = "", string name = "", string addr = "", 
-                string phone = "", string mail = "", double initialDeposit = 0.0, 
-                string type = "Savings", string pwd = "1234")
-        : accountNumber(accNum), accountHolderName(name), address(addr), 
-          phoneNumber(phone), email(mail), balance(initialDeposit), 
-          accountType(type), password(pwd) {
-        if (initialDeposit > 0) {
-            addTransaction("Account opened with initial deposit: " + to_string(initialDeposit) + " BDT");
-        }
-    }
+// Opt-in timeline tracing, built with -DBMS_TRACE and enabled at run time by
+// setting BMS_TRACE_FILE. Each thread records complete spans into its own
+// fixed-size buffer without locking; the buffers are written out as Chrome
+// trace-event JSON at exit, which Perfetto and chrome://tracing can open.
+// Without BMS_TRACE, TRACE_SPAN expands to nothing.
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
 
-    // Getters
-    string getAccountNumber() const { return accountNumber; }
-    string getAccountHolderName() const { return accountHolderName; }
-    double getBalance() const { return balance; }
-    string getAccountType() const { return accountType; }
-    string getPassword() const { return password; }
-    const vector<string>& getTransactionHistory() const { return transactionHistory; }
+#ifdef BMS_TRACE
+struct TraceEvent {
+    const char* name;
+    uint64_t startNs;
+    uint64_t durationNs;
+};
 
-    // Account operations
-    void deposit(double amount) {
-        if (amount > 0) {
-            balance += amount;
-            addTransaction("Deposit: +" + to_string(amount) + " BDT");
-            cout << "Deposit successful. New balance: " << fixed << setprecision(2) << balance << " BDT" << endl;
-        } else {
-            cout << "Invalid deposit amount." << endl;
-        }
-    }
+class TraceBuffer {
+public:
+    static const size_t CAPACITY = 1 << 16;
 
-    bool verifyPassword(const string& pwd) const {
-        return pwd == password;
-    }
+    explicit TraceBuffer(uint32_t threadId) : tid(threadId), events(new TraceEvent[CAPACITY]) {}
 
-    void withdraw(double amount, const string& pwd) {
-        if (!verifyPassword(pwd)) {
-            cout << "Invalid password. Withdrawal failed." << endl;
+    // Only the owning thread records; readers see events below the published count
+    void record(const char* name, uint64_t startNs, uint64_t durationNs) {
+        size_t n = count.load(memory_order_relaxed);
+        if (n == CAPACITY) {
+            dropped.fetch_add(1, memory_order_relaxed);
             return;
         }
+        events[n] = {name, startNs, durationNs};
+        count.store(n + 1, memory_order_release);
+    }
 
-        if (amount <= 0) {
-            cout << "Invalid withdrawal amount." << endl;
-            return;
-        }
+    uint32_t tid;
+    unique_ptr<TraceEvent[]> events;
+    atomic<size_t> count{0};
+    atomic<size_t> dropped{0};
+};
 
-        double minBalance = (accountType == "Savings") ? SAVINGS_MIN_BALANCE : CURRENT_MIN_BALANCE;
-        
-        if (balance - amount < minBalance) {
-            cout << "Withdrawal failed. Minimum balance requirement not met." << endl;
-            cout << "Minimum required balance for " << accountType << " account: " << minBalance << " BDT" << endl;
-            return;
-        }
+class Tracer {
+private:
+    mutex registryMutex;                 // Taken once per thread, never per span
+    vector<unique_ptr<TraceBuffer>> buffers;
+    string path;
+    chrono::steady_clock::time_point origin = chrono::steady_clock::now();
 
-        if (amount <= balance) {
-            balance -= amount;
-            addTransaction("Withdrawal: -" + to_string(amount) + " BDT");
-            cout << "Withdrawal successful. New balance: " << fixed << setprecision(2) << balance << " BDT" << endl;
-        } else {
-            cout << "Insufficient funds." << endl;
+    Tracer() {
+        const char* file = getenv("BMS_TRACE_FILE");
+        if (file && *file) {
+            path = file;
+            enabled = true;
+            atexit([] { Tracer::instance().flush(); });
         }
     }
 
-    void displayAccountInfo() const {
-        cout << "\n=== Account Information ===" << endl;
-        cout << "Account Number: " << accountNumber << endl;
-        cout << "Account Holder: " << accountHolderName << endl;
-        cout << "Address: " << address << endl;
-        cout << "Phone: " << phoneNumber << endl;
-        cout << "Email: " << email << endl;
-        cout << "Account Type: " << accountType << endl;
-        cout << "Current Balance: " << fixed << setprecision(2) << balance << " BDT" << endl;
-        cout << "===========================\n" << endl;
+    TraceBuffer* registerThread() {
+        lock_guard<mutex> lock(registryMutex);
+        buffers.push_back(make_unique<TraceBuffer>((uint32_t)buffers.size() + 1));
+        return buffers.back().get();
     }
 
-    void displayTransactionHistory() const {
-        cout << "\n=== Transaction History ===" << endl;
-        cout << "Account: " << accountNumber << " (" << accountHolderName << ")" << endl;
-        for (const auto& transaction : transactionHistory) {
-            cout << "- " << transaction << endl;
-        }
-        cout << "===========================\n" << endl;
+public:
+    bool enabled = false;
+
+    // Never destroyed, so the atexit flush can still reach every buffer
+    static Tracer& instance() {
+        static Tracer* tracer = new Tracer();
+        return *tracer;
     }
 
-    // Method to save account to file
-    void saveToFile(ofstream& outFile) const {
-        outFile << accountNumber << endl;
-        outFile << accountHolderName << endl;
-        outFile << address << endl;
-        outFile << phoneNumber << endl;
-        outFile << email << endl;
-        outFile << fixed << setprecision(2) << balance << endl;
-        outFile << accountType << endl;
-        outFile << password << endl;
-        
-        // Save transaction history
-        outFile << transactionHistory.size() << endl;
-        for (const auto& transaction : transactionHistory) {
-            outFile << transaction << endl;
-        }
+    uint64_t nowNs() const {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - origin).count();
     }
 
-    // Method to load account from file
-    void loadFromFile(ifstream& inFile) {
-        getline(inFile, accountNumber);
-        getline(inFile, accountHolderName);
-        getline(inFile, address);
-        getline(inFile, phoneNumber);
-        getline(inFile, email);
-        inFile >> balance;
-        inFile.ignore();
-        getline(inFile, accountType);
-        getline(inFile, password);
-        
-        // Load transaction history
-        int transactionCount;
-        inFile >> transactionCount;
-        inFile.ignore();
-        transactionHistory.clear();
-        for (int i = 0; i < transactionCount; ++i) {
-            string transaction;
-            getline(inFile, transaction);
-            transactionHistory.push_back(transaction);
+    // Buffers outlive their threads so spans from finished workers still flush
+    TraceBuffer& threadBuffer() {
+        thread_local TraceBuffer* buffer = registerThread();
+        return *buffer;
+    }
+
+    void flush() {
+        lock_guard<mutex> lock(registryMutex);
+        FILE* out = fopen(path.c_str(), "w");
+        if (!out) return;
+#ifndef _WIN32
+        long pid = (long)getpid();
+#else
+        long pid = 1;
+#endif
+        size_t dropped = 0;
+        fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+        fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":0,\"args\":{\"name\":\"BMS\"}}", pid);
+        for (const auto& buffer : buffers) {
+            fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%u,\"args\":{\"name\":\"%s%u\"}}",
+                    pid, buffer->tid, buffer->tid == 1 ? "main " : "worker ", buffer->tid);
+            size_t n = buffer->count.load(memory_order_acquire);
+            for (size_t i = 0; i < n; ++i) {
+                const TraceEvent& event = buffer->events[i];
+                fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"bms\",\"ph\":\"X\",\"pid\":%ld,\"tid\":%u,"
+                        "\"ts\":%.3f,\"dur\":%.3f}",
+                        event.name, pid, buffer->tid, event.startNs / 1000.0, event.durationNs / 1000.0);
+            }
+            dropped += buffer->dropped.load(memory_order_relaxed);
         }
+        fprintf(out, "\n]}\n");
+        fclose(out);
+        if (dropped > 0) cerr << "Trace buffers overflowed; " << dropped << " spans dropped." << endl;
     }
+};
 
+// Records the enclosing scope as one span; name must be a string literal
+class TraceSpan {
 private:
-    void addTransaction(const string& description) {
-        time_t now = time(0);
-        string dt = ctime(&now);
-        dt.erase(dt.find_last_not_of("\n") + 1); // Remove newline
-        transactionHistory.push_back(dt + " - " + description);
+    const char* name;
+    uint64_t start;
+
+public:
+    explicit TraceSpan(const char* spanName) : name(Tracer::instance().enabled ? spanName : nullptr) {
+        if (name) start = Tracer::instance().nowNs();
     }
+    ~TraceSpan() {
+        if (!name) return;
+        Tracer& tracer = Tracer::instance();
+        tracer.threadBuffer().record(name, start, tracer.nowNs() - start);
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
 };
 
-class BankingSystem {
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(traceSpan_, __LINE__)(name)
+#else
+#define TRACE_SPAN(name) ((void)0)
+#endif
+
+// ================= Hardware counter profiling =================
+
+// Set BMS_PROFILE=1 to print per-region hardware counters at exit, or
+// BMS_PROFILE=<file.csv> to export them. Each PROFILE_REGION reads a
+// per-thread perf_event_open group (cycles, instructions, L1D read misses,
+// LLC misses, branch misses) on entry and exit; counts are inclusive of
+// nested regions. Counters the kernel refuses are reported as "n/a", and
+// with none at all the regions still report calls and wall time.
+#ifdef __linux__
+enum ProfileCounter { PC_CYCLES, PC_INSTRUCTIONS, PC_L1D_MISSES, PC_LLC_MISSES, PC_BRANCH_MISSES, PC_COUNT };
+const char* const PROFILE_COUNTER_NAMES[PC_COUNT] = {"cycles", "instructions", "L1D misses", "LLC misses",
+                                                     "branch misses"};
+
+struct ProfileRegion {
+    const char* name;
+    atomic<uint64_t> calls{0};
+    atomic<uint64_t> wallNs{0};
+    atomic<uint64_t> counters[PC_COUNT] = {};
+};
+
+// One counter group per thread, opened on the thread's first region
+class CounterGroup {
 private:
-    vector<BankAccount> accounts;
-    int accountCounter = 1000; // Starting from ACCT1001
+    int fds[PC_COUNT];
+    int slot[PC_COUNT];     // Position in the group read, -1 if unavailable
+    int opened = 0;
 
-    string generateAccountNumber() {
-        accountCounter++;
-        return "ACCT" + to_string(accountCounter);
+    static int openCounter(uint32_t type, uint64_t config, int groupFd) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        return (int)syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0);
     }
 
-    void loadAccountCounter() {
-        ifstream inFile(COUNTER_FILE);
-        if (inFile) {
-            inFile >> accountCounter;
-            inFile.close();
+public:
+    CounterGroup() {
+        static const uint32_t types[PC_COUNT] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+                                                 PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE};
+        static const uint64_t configs[PC_COUNT] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        int leader = -1;
+        for (int i = 0; i < PC_COUNT; ++i) {
+            fds[i] = openCounter(types[i], configs[i], leader);
+            slot[i] = fds[i] >= 0 ? opened++ : -1;
+            if (leader < 0 && fds[i] >= 0) leader = fds[i];
         }
     }
 
-    void saveAccountCounter() {
-        ofstream outFile(COUNTER_FILE);
-        if (outFile) {
-            outFile << accountCounter;
-            outFile.close();
+    ~CounterGroup() {
+        for (int fd : fds) {
+            if (fd >= 0) ::close(fd);
         }
     }
 
-    BankAccount* findAccount(const string& accNum) {
-        for (auto& account : accounts) {
-            if (account.getAccountNumber() == accNum) {
-                return &account;
+    bool available(int counter) const { return slot[counter] >= 0; }
+    int availableCount() const { return opened; }
+
+    void read(uint64_t values[PC_COUNT]) {
+        uint64_t buffer[1 + PC_COUNT] = {0};
+        int leader = -1;
+        for (int fd : fds) {
+            if (fd >= 0) {
+                leader = fd;
+                break;
             }
         }
-        return nullptr;
+        if (leader < 0 || ::read(leader, buffer, sizeof(buffer)) <= 0) {
+            memset(values, 0, sizeof(uint64_t) * PC_COUNT);
+            return;
+        }
+        for (int i = 0; i < PC_COUNT; ++i) {
+            values[i] = slot[i] >= 0 ? buffer[1 + slot[i]] : 0;
+        }
     }
+};
 
-    void loadAccounts() {
-        ifstream inFile(ACCOUNT_FILE);
-        if (inFile) {
-            while (inFile.peek() != EOF) {
-                BankAccount account;
-                account.loadFromFile(inFile);
-                accounts.push_back(account);
-                
-                // Update counter to highest account number
-                string accNum = account.getAccountNumber().substr(4); // Remove "ACCT"
-                int num = stoi(accNum);
-                if (num >= accountCounter) {
-                    accountCounter = num;
-                }
+class Profiler {
+private:
+    mutex registryMutex;
+    vector<ProfileRegion*> regions;
+    string output;
+    bool counterAvailable[PC_COUNT] = {};
+
+    Profiler() {
+        const char* setting = getenv("BMS_PROFILE");
+        if (setting && *setting && string(setting) != "0") {
+            output = setting;
+            enabled = true;
+            CounterGroup& group = threadGroup();
+            for (int i = 0; i < PC_COUNT; ++i) counterAvailable[i] = group.available(i);
+            if (group.availableCount() == 0) {
+                cerr << "Hardware counters are not available (see /proc/sys/kernel/perf_event_paranoid); "
+                     << "profiling calls and wall time only." << endl;
             }
-            inFile.close();
+            atexit([] { Profiler::instance().report(); });
         }
     }
 
-    void saveAccounts() {
-        ofstream outFile(ACCOUNT_FILE);
-        if (outFile) {
-            for (const auto& account : accounts) {
-                account.saveToFile(outFile);
-            }
-            outFile.close();
-        } else {
-            cerr << "Error saving accounts to file!" << endl;
-        }
+public:
+    bool enabled = false;
+
+    // Never destroyed, so the atexit report can still read the regions
+    static Profiler& instance() {
+        static Profiler* profiler = new Profiler();
+        return *profiler;
     }
 
-    void logTransaction(const string& message) {
-        ofstream logFile(TRANSACTION_LOG, ios::app);
-        if (logFile) {
-            time_t now = time(0);
-            logFile << ctime(&now) << " - " << message << "\n\n";
-            logFile.close();
-        }
+    CounterGroup& threadGroup() {
+        thread_local CounterGroup group;
+        return group;
     }
 
-    void clearScreen() {
-        #ifdef _WIN32
-            system("cls");
-        #else
-            system("clear");
-        #endif
+    ProfileRegion* registerRegion(const char* name) {
+        lock_guard<mutex> lock(registryMutex);
+        regions.push_back(new ProfileRegion());
+        regions.back()->name = name;
+        return regions.back();
     }
 
-    string getHiddenInput() {
-        string input;
-        char ch;
-        while ((ch = getchar()) != '\n') {
-            if (ch == '\b') { // Handle backspace
-                if (!input.empty()) {
-                    input.pop_back();
-                    cout << "\b \b";
+    void report() {
+        lock_guard<mutex> lock(registryMutex);
+        bool csv = output.size() > 4 && output.compare(output.size() - 4, 4, ".csv") == 0;
+        ostringstream table;
+        if (csv) {
+            table << "region,calls,wall_ns";
+            for (const char* counter : PROFILE_COUNTER_NAMES) table << "," << counter;
+            table << "\n";
+        } else {
+            table << "\n=== Hardware counter profile (per call) ===\n"
+                  << left << setw(30) << "region" << right << setw(10) << "calls" << setw(12) << "wall us"
+                  << setw(12) << "cycles" << setw(8) << "IPC" << setw(12) << "L1D miss" << setw(12) << "LLC miss"
+                  << setw(12) << "br miss" << "\n";
+        }
+        for (ProfileRegion* region : regions) {
+            uint64_t calls = region->calls.load();
+            if (calls == 0) continue;
+            uint64_t totals[PC_COUNT];
+            for (int i = 0; i < PC_COUNT; ++i) totals[i] = region->counters[i].load();
+            if (csv) {
+                table << region->name << "," << calls << "," << region->wallNs.load();
+                for (int i = 0; i < PC_COUNT; ++i) {
+                    table << ",";
+                    if (counterAvailable[i]) table << totals[i];
                 }
+                table << "\n";
+                continue;
+            }
+            auto perCall = [&](int counter) {
+                ostringstream cell;
+                if (counterAvailable[counter]) cell << fixed << setprecision(1) << (double)totals[counter] / calls;
+                else cell << "n/a";
+                return cell.str();
+            };
+            ostringstream ipc;
+            if (counterAvailable[PC_CYCLES] && counterAvailable[PC_INSTRUCTIONS] && totals[PC_CYCLES] > 0) {
+                ipc << fixed << setprecision(2) << (double)totals[PC_INSTRUCTIONS] / totals[PC_CYCLES];
             } else {
-                input.push_back(ch);
-                cout << '*';
+                ipc << "n/a";
             }
+            table << left << setw(30) << region->name << right << setw(10) << calls << setw(12) << fixed
+                  << setprecision(2) << region->wallNs.load() / 1000.0 / calls << setw(12) << perCall(PC_CYCLES)
+                  << setw(8) << ipc.str() << setw(12) << perCall(PC_L1D_MISSES) << setw(12)
+                  << perCall(PC_LLC_MISSES) << setw(12) << perCall(PC_BRANCH_MISSES) << "\n";
+        }
+        if (csv) {
+            ofstream outFile(output);
+            outFile << table.str();
+            if (!outFile) cerr << "Error writing profile to " << output << endl;
+        } else {
+            cerr << table.str();
         }
-        return input;
     }
+};
+
+class ProfileScope {
+private:
+    ProfileRegion* region;
+    uint64_t start[PC_COUNT];
+    chrono::steady_clock::time_point startTime;
 
 public:
-    BankingSystem() {
-        loadAccountCounter();
-        loadAccounts();
+    explicit ProfileScope(ProfileRegion* profiled) : region(profiled) {
+        if (!region) return;
+        startTime = chrono::steady_clock::now();
+        Profiler::instance().threadGroup().read(start);
     }
+    ~ProfileScope() {
+        if (!region) return;
+        uint64_t end[PC_COUNT];
+        Profiler::instance().threadGroup().read(end);
+        region->wallNs.fetch_add(
+            chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - startTime).count(),
+            memory_order_relaxed);
+        for (int i = 0; i < PC_COUNT; ++i) region->counters[i].fetch_add(end[i] - start[i], memory_order_relaxed);
+        region->calls.fetch_add(1, memory_order_relaxed);
+    }
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+};
 
-    ~BankingSystem() {
-        saveAccounts();
-        saveAccountCounter();
+// Each call site registers its region once; disabled regions cost one branch
+#define PROFILE_REGION(name)                                                                           \
+    static ProfileRegion* const TRACE_CONCAT(profileRegion_, __LINE__) =                               \
+        Profiler::instance().enabled ? Profiler::instance().registerRegion(name) : nullptr;            \
+    ProfileScope TRACE_CONCAT(profileScope_, __LINE__)(TRACE_CONCAT(profileRegion_, __LINE__))
+#else
+#define PROFILE_REGION(name) ((void)0)
+#endif
+
+// ================= Checksums and durable file I/O =================
+
+// CRC32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has it,
+// otherwise a table-driven software version producing the same value.
+uint32_t crc32cSoftware(uint32_t crc, const unsigned char* data, size_t len) {
+    // Built once, even when several threads get here first
+    static const array<uint32_t, 256> table = [] {
+        array<uint32_t, 256> built{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : (c >> 1);
+            }
+            built[i] = c;
+        }
+        return built;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
     }
+    return ~crc;
+}
 
-    void createNewAccount() {
-        string name, address, phone, email, accountType, password;
-        double initialDeposit;
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32cHardware(uint32_t crc, const unsigned char* data, size_t len) {
+    uint64_t c = ~crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        c = _mm_crc32_u64(c, word);
+        data += 8;
+        len -= 8;
+    }
+    uint32_t c32 = (uint32_t)c;
+    while (len > 0) {
+        c32 = _mm_crc32_u8(c32, *data++);
+        --len;
+    }
+    return ~c32;
+}
+#endif
 
-        clearScreen();
-        cout << "\n=== Create New Account ===" << endl;
+uint32_t crc32c(const string& data) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data.data());
+#if defined(__x86_64__)
+    static const bool hasHardwareCrc = __builtin_cpu_supports("sse4.2");
+    if (hasHardwareCrc) {
+        return crc32cHardware(0, bytes, data.size());
+    }
+#endif
+    return crc32cSoftware(0, bytes, data.size());
+}
 
-        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+string toHex32(uint32_t value) {
+    char buf[9];
+    snprintf(buf, sizeof(buf), "%08x", value);
+    return buf;
+}
 
-        // Name validation
-        while (true) {
-            cout << "Enter full name: ";
-            getline(cin, name);
-            if (!name.empty()) break;
-            cout << "Name cannot be empty. Please try again." << endl;
-        }
+// Crash injection. When the countdown is armed (crash-test harness or
+// BMS_CRASH_AFTER) the process kills itself at the N-th crash point, which
+// may be in the middle of a write so that a torn record is left behind.
+long crashCountdown = -1;
 
-        // Address validation
-        while (true) {
-            cout << "Enter address: ";
-            getline(cin, address);
-            if (!address.empty()) break;
-            cout << "Address cannot be empty. Please try again." << endl;
-        }
+bool crashPointHit() {
+    if (crashCountdown < 0) return false;
+    return crashCountdown-- == 0;
+}
 
-        // Phone validation
-        while (true) {
-            cout << "Enter phone number: ";
-            getline(cin, phone);
-            if (all_of(phone.begin(), phone.end(), ::isdigit)) break;
-            cout << "Phone number must contain only digits. Please try again." << endl;
-        }
+void crashNow() {
+#ifndef _WIN32
+    raise(SIGKILL);
+#endif
+    _Exit(137);
+}
 
-        // Email validation (simple check)
-        while (true) {
-            cout << "Enter email: ";
-            getline(cin, email);
-            if (email.find('@') != string::npos && email.find('.') != string::npos) break;
-            cout << "Invalid email format. Please try again." << endl;
-        }
+void crashPoint() {
+    if (crashPointHit()) crashNow();
+}
 
-        // Account type validation
-        while (true) {
-            cout << "Enter account type (Savings/Current): ";
-            getline(cin, accountType);
-            if (accountType == "Savings" || accountType == "Current") {
-                break;
-            }
-            cout << "Invalid account type. Please enter 'Savings' or 'Current'." << endl;
+#ifndef _WIN32
+bool writeAll(int fd, const string& data) {
+    size_t length = data.size();
+    bool torn = crashPointHit();
+    if (torn) {
+        length = data.empty() ? 0 : (size_t)rand() % data.size();
+    }
+    size_t written = 0;
+    while (written < length) {
+        ssize_t n = ::write(fd, data.data() + written, length - written);
+        if (n < 0) {
+            if (errno == EINTR) continue; // A signal handler ran; nothing was written
+            return false;
         }
+        written += (size_t)n;
+    }
+    if (torn) crashNow();
+    return true;
+}
 
-        // Initial deposit validation
-        double minDeposit = (accountType == "Savings") ? SAVINGS_MIN_BALANCE : CURRENT_MIN_BALANCE;
-        while (true) {
-            cout << "Enter initial deposit amount (minimum " << minDeposit << " BDT): ";
-            if (cin >> initialDeposit) {
-                if (initialDeposit >= minDeposit) {
-                    cin.ignore();
-                    break;
-                }
-                cout << "Minimum deposit for " << accountType << " account is " << minDeposit << " BDT" << endl;
-            } else {
-                cout << "Invalid amount. Please enter a numeric value." << endl;
-                cin.clear();
-                cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            }
-        }
+void syncDirectory(const string& dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        ::close(fd);
+    }
+}
+#endif
 
-        // Password validation
-        cout << "Set a " << MIN_PASSWORD_LENGTH << "-digit password for withdrawals: ";
-        password = getHiddenInput();
-        while (password.length() != MIN_PASSWORD_LENGTH || !all_of(password.begin(), password.end(), ::isdigit)) {
-            cout << "\nPassword must be " << MIN_PASSWORD_LENGTH << " digits. Please try again: ";
-            password = getHiddenInput();
-        }
+// Replaces `path` with `contents` so that readers see either the old file or
+// the new one, never a mix: write temp file, fsync, rename, fsync directory.
+bool publishFileAtomically(const string& path, const string& contents) {
+    TRACE_SPAN("publishFileAtomically");
+    string tmpPath = path + ".tmp";
+#ifndef _WIN32
+    int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = writeAll(fd, contents) && fsync(fd) == 0;
+    ::close(fd);
+    if (!ok) return false;
+    crashPoint();
+    if (rename(tmpPath.c_str(), path.c_str()) != 0) return false;
+    crashPoint();
+    size_t slash = path.find_last_of('/');
+    syncDirectory(slash == string::npos ? "." : path.substr(0, slash));
+    return true;
+#else
+    ofstream outFile(tmpPath, ios::binary | ios::trunc);
+    if (!outFile) return false;
+    outFile << contents;
+    outFile.close();
+    remove(path.c_str());
+    return rename(tmpPath.c_str(), path.c_str()) == 0;
+#endif
+}
 
-        string accNum = generateAccountNumber();
-        accounts.emplace_back(accNum, name, address, phone, email, initialDeposit, accountType, password);
+// A framed record is "<tag> <seq> <length> <crc32c>\n<payload>\n". The length
+// and checksum let a reader detect a torn or corrupted record and stop there.
+string frameRecord(const string& tag, uint64_t seq, const string& payload) {
+    return tag + " " + to_string(seq) + " " + to_string(payload.size()) + " " +
+           toHex32(crc32c(payload)) + "\n" + payload + "\n";
+}
 
-        string successMsg = "Account created: " + accNum + " for " + name;
-        cout << "\n\n" << successMsg << endl;
-        logTransaction(successMsg);
+bool readFramedRecord(istream& in, const string& tag, uint64_t& seq, string& payload) {
+    string header;
+    if (!getline(in, header)) return false;
+    istringstream headerStream(header);
+    string recordTag, crcHex;
+    size_t length = 0;
+    if (!(headerStream >> recordTag >> seq >> length >> crcHex) || recordTag != tag) return false;
+    if (length > (1u << 30)) return false;
+    payload.assign(length, '\0');
+    if (!in.read(&payload[0], (streamsize)length)) return false;
+    if (in.get() != '\n') return false;
+    return toHex32(crc32c(payload)) == crcHex;
+}
 
-        cout << "\n=== Account Created Successfully ===" << endl;
-        cout << "Account Number: " << accNum << endl;
-        cout << "Account Holder: " << name << endl;
-        cout << "Account Type: " << accountType << endl;
-        cout << "Initial Balance: " << fixed << setprecision(2) << initialDeposit << " BDT" << endl;
-        cout << "==================================\n" << endl;
-    }
+// Append-only redo journal. Each mutation is made durable here before it is
+// acknowledged; a checkpoint publishes a full snapshot and then resets the
+// journal to a single checkpoint marker, so recovery only replays the tail.
+class TransactionJournal {
+private:
+#ifndef _WIN32
+    int fd = -1;
+#else
+    ofstream out;
+#endif
 
-    void depositMoney() {
-        string accNum;
-        double amount;
+public:
+    ~TransactionJournal() { close(); }
 
-        clearScreen();
-        cout << "\n=== Deposit Money ===" << endl;
-        cout << "Enter account number: ";
-        cin >> accNum;
+    bool open() {
+#ifndef _WIN32
+        fd = ::open(JOURNAL_FILE.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        return fd >= 0;
+#else
+        out.open(JOURNAL_FILE, ios::binary | ios::app);
+        return (bool)out;
+#endif
+    }
 
-        BankAccount* account = findAccount(accNum);
-        if (account) {
-            cout << "Account holder: " << account->getAccountHolderName() << endl;
-            cout << "Current balance: " << fixed << setprecision(2) << account->getBalance() << " BDT" << endl;
-            
-            while (true) {
-                cout << "Enter deposit amount: ";
-                if (cin >> amount) {
-                    account->deposit(amount);
-                    logTransaction("Deposit to " + accNum + ": " + to_string(amount) + " BDT");
-                    saveAccounts();
-                    break;
-                } else {
-                    cout << "Invalid amount. Please enter a numeric value." << endl;
-                    cin.clear();
-                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
-                }
-            }
-        } else {
-            cout << "Account not found." << endl;
+    void close() {
+#ifndef _WIN32
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
         }
+#else
+        if (out.is_open()) out.close();
+#endif
     }
 
-    void withdrawMoney() {
-        string accNum, password;
-        double amount;
-
-        clearScreen();
-        cout << "\n=== Withdraw Money ===" << endl;
-        cout << "Enter account number: ";
-        cin >> accNum;
+    bool append(uint64_t seq, const string& payload) {
+        TRACE_SPAN("journal.append");
+        crashPoint();
+#ifndef _WIN32
+        if (fd < 0) return false;
+        if (!writeAll(fd, frameRecord("J", seq, payload))) return false;
+        crashPoint();
+        return fdatasync(fd) == 0;
+#else
+        out << frameRecord("J", seq, payload);
+        out.flush();
+        return (bool)out;
+#endif
+    }
 
-        BankAccount* account = findAccount(accNum);
-        if (account) {
-            cout << "Account holder: " << account->getAccountHolderName() << endl;
-            cout << "Current balance: " << fixed << setprecision(2) << account->getBalance() << " BDT" << endl;
-            
-            cout << "Enter your " << MIN_PASSWORD_LENGTH << "-digit password: ";
-            cin.ignore();
-            password = getHiddenInput();
-            cout << endl;
+    // Starts a fresh journal whose first record marks the checkpoint at `seq`.
+    bool resetToCheckpoint(uint64_t seq) {
+        close();
+        bool ok = publishFileAtomically(JOURNAL_FILE, frameRecord("J", seq, "K " + to_string(seq)));
+        return open() && ok;
+    }
 
-            while (true) {
-                cout << "Enter withdrawal amount: ";
-                if (cin >> amount) {
-                    account->withdraw(amount, password);
-                    if (amount > 0 && amount <= account->getBalance() && account->verifyPassword(password)) {
-                        logTransaction("Withdrawal from " + accNum + ": " + to_string(amount) + " BDT");
-                        saveAccounts();
-                    }
-                    break;
-                } else {
-                    cout << "Invalid amount. Please enter a numeric value." << endl;
-                    cin.clear();
-                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
-                }
+    // Truncates a torn tail so later appends follow the last valid record.
+    static void truncateTo(streamoff validBytes) {
+#ifndef _WIN32
+        if (truncate(JOURNAL_FILE.c_str(), (off_t)validBytes) == 0) {
+            int fileFd = ::open(JOURNAL_FILE.c_str(), O_WRONLY);
+            if (fileFd >= 0) {
+                fsync(fileFd);
+                ::close(fileFd);
             }
-        } else {
-            cout << "Account not found." << endl;
         }
+#else
+        (void)validBytes;
+#endif
     }
+};
 
-    void checkBalance() {
-        string accNum;
+string formatAmount(double amount) {
+    char buf[40];
+    snprintf(buf, sizeof(buf), "%.17g", amount);
+    return buf;
+}
 
-        clearScreen();
-        cout << "\n=== Check Balance ===" << endl;
-        cout << "Enter account number: ";
-        cin >> accNum;
+enum class TxStatus {
+    Ok,
+    NotFound,
+    InvalidAmount,
+    BadPassword,
+    BelowMinimum,
+    InsufficientFunds,
+    WithdrawalNotAllowed,
+    LimitExceeded,
+    DuplicateCustomer,
+    StorageError,
+    RuleBlocked,
+    InDoubt
+};
 
-        BankAccount* account = findAccount(accNum);
-        if (account) {
-            cout << "Account holder: " << account->getAccountHolderName() << endl;
-            cout << "Account type: " << account->getAccountType() << endl;
-            cout << "Current balance: " << fixed << setprecision(2) << account->getBalance() << " BDT" << endl;
-        } else {
-            cout << "Account not found." << endl;
-        }
+const char* txStatusName(TxStatus status) {
+    switch (status) {
+        case TxStatus::Ok: return "OK";
+        case TxStatus::NotFound: return "NOT_FOUND";
+        case TxStatus::InvalidAmount: return "INVALID_AMOUNT";
+        case TxStatus::BadPassword: return "BAD_PASSWORD";
+        case TxStatus::BelowMinimum: return "BELOW_MINIMUM";
+        case TxStatus::InsufficientFunds: return "INSUFFICIENT_FUNDS";
+        case TxStatus::WithdrawalNotAllowed: return "WITHDRAWAL_NOT_ALLOWED";
+        case TxStatus::LimitExceeded: return "LIMIT_EXCEEDED";
+        case TxStatus::DuplicateCustomer: return "DUPLICATE_CUSTOMER";
+        case TxStatus::StorageError: return "STORAGE_ERROR";
+        case TxStatus::RuleBlocked: return "BLOCKED_BY_RULE";
+        case TxStatus::InDoubt: return "TRANSFER_IN_DOUBT";
     }
+    return "UNKNOWN";
+}
 
-    void displayAccountDetails() {
-        string accNum;
+// ================= Account products =================
 
-        clearScreen();
-        cout << "\n=== Account Details ===" << endl;
-        cout << "Enter account number: ";
-        cin >> accNum;
+// Compact product code stored in every account instead of the type name.
+// Codes of built-in products are fixed; products loaded from PRODUCT_FILE
+// get the codes after them.
+enum ProductCode : uint8_t {
+    PRODUCT_SAVINGS = 0,
+    PRODUCT_CURRENT = 1,
+    PRODUCT_FIXED_DEPOSIT = 2,
+    PRODUCT_STUDENT = 3,
+    PRODUCT_CORPORATE = 4,
+    BUILTIN_PRODUCT_COUNT = 5
+};
+const uint8_t MAX_PRODUCTS = 32;
 
-        BankAccount* account = findAccount(accNum);
-        if (account) {
-            account->displayAccountInfo();
-        } else {
-            cout << "Account not found." << endl;
-        }
-    }
+// Compile-time policy for each built-in product. A limit of 0 means "none".
+template <ProductCode Code> struct ProductPolicy;
 
-    void viewTransactionHistory() {
-        string accNum;
+template <> struct ProductPolicy<PRODUCT_SAVINGS> {
+    static constexpr const char* name = "Savings";
+    static constexpr double minBalance = SAVINGS_MIN_BALANCE;
+    static constexpr double minOpeningDeposit = SAVINGS_MIN_BALANCE;
+    static constexpr double withdrawalFee = 0.0;
+    static constexpr double maxWithdrawal = 0.0;
+    static constexpr double maxBalance = 0.0;
+    static constexpr double interestRate = 0.035;
+    static constexpr bool allowsWithdrawal = true;
+};
 
-        clearScreen();
-        cout << "\n=== Transaction History ===" << endl;
-        cout << "Enter account number: ";
-        cin >> accNum;
+template <> struct ProductPolicy<PRODUCT_CURRENT> {
+    static constexpr const char* name = "Current";
+    static constexpr double minBalance = CURRENT_MIN_BALANCE;
+    static constexpr double minOpeningDeposit = CURRENT_MIN_BALANCE;
+    static constexpr double withdrawalFee = 0.0;
+    static constexpr double maxWithdrawal = 0.0;
+    static constexpr double maxBalance = 0.0;
+    static constexpr double interestRate = 0.0;
+    static constexpr bool allowsWithdrawal = true;
+};
 
-        BankAccount* account = findAccount(accNum);
-        if (account) {
-            account->displayTransactionHistory();
-        } else {
-            cout << "Account not found." << endl;
-        }
+template <> struct ProductPolicy<PRODUCT_FIXED_DEPOSIT> {
+    static constexpr const char* name = "Fixed Deposit";
+    static constexpr double minBalance = 10000.0;
+    static constexpr double minOpeningDeposit = 10000.0;
+    static constexpr double withdrawalFee = 0.0;
+    static constexpr double maxWithdrawal = 0.0;
+    static constexpr double maxBalance = 0.0;
+    static constexpr double interestRate = 0.075;
+    static constexpr bool allowsWithdrawal = false;
+};
+
+template <> struct ProductPolicy<PRODUCT_STUDENT> {
+    static constexpr const char* name = "Student";
+    static constexpr double minBalance = 0.0;
+    static constexpr double minOpeningDeposit = 50.0;
+    static constexpr double withdrawalFee = 0.0;
+    static constexpr double maxWithdrawal = 5000.0;
+    static constexpr double maxBalance = 200000.0;
+    static constexpr double interestRate = 0.02;
+    static constexpr bool allowsWithdrawal = true;
+};
+
+template <> struct ProductPolicy<PRODUCT_CORPORATE> {
+    static constexpr const char* name = "Corporate";
+    static constexpr double minBalance = 5000.0;
+    static constexpr double minOpeningDeposit = 10000.0;
+    static constexpr double withdrawalFee = 10.0;
+    static constexpr double maxWithdrawal = 0.0;
+    static constexpr double maxBalance = 0.0;
+    static constexpr double interestRate = 0.0;
+    static constexpr bool allowsWithdrawal = true;
+};
+
+struct ProductInfo;
+using WithdrawalRule = TxStatus (*)(const ProductInfo&, double balance, double amount);
+using DepositRule = TxStatus (*)(const ProductInfo&, double balance, double amount);
+
+struct ProductInfo {
+    char name[32];
+    double minBalance;
+    double minOpeningDeposit;
+    double withdrawalFee;
+    double maxWithdrawal;
+    double maxBalance;
+    double interestRate;
+    bool allowsWithdrawal;
+    WithdrawalRule checkWithdrawal;
+    DepositRule checkDeposit;
+};
+
+// Balances and the ledger are kept in whole paisa, so an amount with a
+// fraction of a paisa would reach the balance but not the ledger
+inline bool wholePaisa(double amount) {
+    double minor = amount * 100.0;
+    return fabs(minor - nearbyint(minor)) <= 1e-6 + fabs(minor) * 1e-15;
+}
+
+// Rules specialised at compile time for built-in products; the constexpr
+// limits fold away so each product gets only the checks it needs.
+template <ProductCode Code>
+TxStatus withdrawalRule(const ProductInfo&, double balance, double amount) {
+    using P = ProductPolicy<Code>;
+    if (amount <= 0 || !wholePaisa(amount)) return TxStatus::InvalidAmount;
+    if constexpr (!P::allowsWithdrawal) return TxStatus::WithdrawalNotAllowed;
+    if constexpr (P::maxWithdrawal > 0) {
+        if (amount > P::maxWithdrawal) return TxStatus::LimitExceeded;
     }
+    double total = amount + P::withdrawalFee;
+    if (balance - total < P::minBalance) return TxStatus::BelowMinimum;
+    if (total > balance) return TxStatus::InsufficientFunds;
+    return TxStatus::Ok;
+}
 
-    void displayAllAccounts() {
-        clearScreen();
-        cout<<"Enter Admin Password:";
-        string admin_pass;
-        cin>>admin_pass;
-        if(admin_pass=="2255"){
-            cout << "\n=== All Accounts ===" << endl;
-            if (accounts.empty()) {
-                cout << "No accounts found." << endl;
-            } else {
-                for (const auto& account : accounts) {
-                    cout << "Account Number: " << account.getAccountNumber() 
-                            << " | Holder: " << account.getAccountHolderName()
-                            << " | Type: " << account.getAccountType()
-                            << " | Balance: " << fixed << setprecision(2) << account.getBalance() << " BDT" << endl;
-                }
-            }
-            cout << "=====================\n" << endl;
-        }
-        else{
-            cout<<"\nInvalid Pass"<<endl;
-            return 0;
-         }
+template <ProductCode Code>
+TxStatus depositRule(const ProductInfo&, double balance, double amount) {
+    using P = ProductPolicy<Code>;
+    if (amount <= 0 || !wholePaisa(amount)) return TxStatus::InvalidAmount;
+    if constexpr (P::maxBalance > 0) {
+        if (balance + amount > P::maxBalance) return TxStatus::LimitExceeded;
     }
-};
+    return TxStatus::Ok;
+}
 
-void displayMenu() {
-    cout << "\n=== Banking System Menu ===" << endl;
-    cout << "1. Create New Account" << endl;
-    cout << "2. Deposit Money" << endl;
-    cout << "3. Withdraw Money" << endl;
-    cout << "4. Check Balance" << endl;
-    cout << "5. Display Account Details" << endl;
-    cout << "6. View Transaction History" << endl;
-    cout << "7. View All Accounts" << endl;
-    cout << "8. Exit" << endl;
-    cout << "==========================" << endl;
-    cout << "Enter your choice (1-8): ";
+// Table-driven rules for products loaded from configuration
+TxStatus configuredWithdrawalRule(const ProductInfo& product, double balance, double amount) {
+    if (amount <= 0 || !wholePaisa(amount)) return TxStatus::InvalidAmount;
+    if (!product.allowsWithdrawal) return TxStatus::WithdrawalNotAllowed;
+    if (product.maxWithdrawal > 0 && amount > product.maxWithdrawal) return TxStatus::LimitExceeded;
+    double total = amount + product.withdrawalFee;
+    if (balance - total < product.minBalance) return TxStatus::BelowMinimum;
+    if (total > balance) return TxStatus::InsufficientFunds;
+    return TxStatus::Ok;
 }
 
-int main() {
-    BankingSystem bank;
-    int choice;
+TxStatus configuredDepositRule(const ProductInfo& product, double balance, double amount) {
+    if (amount <= 0 || !wholePaisa(amount)) return TxStatus::InvalidAmount;
+    if (product.maxBalance > 0 && balance + amount > product.maxBalance) return TxStatus::LimitExceeded;
+    return TxStatus::Ok;
+}
 
-    cout << "Welcome to the Banking System" << endl;
+// Transfers are not charged the withdrawal fee: they are checked as a
+// withdrawal from a balance that already covers it
+inline TxStatus checkTransferOut(const ProductInfo& product, double balance, double amount) {
+    return product.checkWithdrawal(product, balance + product.withdrawalFee, amount);
+}
 
-    while (true) {
-        displayMenu();
-        
-        if (!(cin >> choice)) {
-            cin.clear();
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            cout << "Invalid input. Please enter a number between 1 and 8." << endl;
-            continue;
-        }
+template <ProductCode Code>
+ProductInfo builtinProduct() {
+    using P = ProductPolicy<Code>;
+    ProductInfo info = {};
+    snprintf(info.name, sizeof(info.name), "%s", P::name);
+    info.minBalance = P::minBalance;
+    info.minOpeningDeposit = P::minOpeningDeposit;
+    info.withdrawalFee = P::withdrawalFee;
+    info.maxWithdrawal = P::maxWithdrawal;
+    info.maxBalance = P::maxBalance;
+    info.interestRate = P::interestRate;
+    info.allowsWithdrawal = P::allowsWithdrawal;
+    info.checkWithdrawal = &withdrawalRule<Code>;
+    info.checkDeposit = &depositRule<Code>;
+    return info;
+}
 
-        switch (choice) {
-            case 1:
-                bank.createNewAccount();
-                break;
+// Registry of every product indexed by code. Names are compared only when an
+// account is opened or loaded; all per-transaction checks go through the code.
+class ProductRegistry {
+private:
+    ProductInfo products[MAX_PRODUCTS];
+    uint8_t count = 0;
+
+    ProductRegistry() {
+        products[PRODUCT_SAVINGS] = builtinProduct<PRODUCT_SAVINGS>();
+        products[PRODUCT_CURRENT] = builtinProduct<PRODUCT_CURRENT>();
+        products[PRODUCT_FIXED_DEPOSIT] = builtinProduct<PRODUCT_FIXED_DEPOSIT>();
+        products[PRODUCT_STUDENT] = builtinProduct<PRODUCT_STUDENT>();
+        products[PRODUCT_CORPORATE] = builtinProduct<PRODUCT_CORPORATE>();
+        count = BUILTIN_PRODUCT_COUNT;
+        loadConfiguredProducts();
+    }
+
+    // Each line of PRODUCT_FILE:
+    //   name|minBalance|minOpeningDeposit|withdrawalFee|maxWithdrawal|maxBalance|interestRate|allowsWithdrawal
+    void loadConfiguredProducts() {
+        ifstream inFile(PRODUCT_FILE);
+        string line;
+        while (getline(inFile, line)) {
+            if (line.empty() || line[0] == '#') continue;
+            vector<string> fields;
+            stringstream lineStream(line);
+            string field;
+            while (getline(lineStream, field, '|')) fields.push_back(field);
+            if (fields.size() != 8 || fields[0].empty() || findCode(fields[0]) >= 0) {
+                cerr << "Warning: ignoring product definition: " << line << endl;
+                continue;
+            }
+            ProductInfo info = {};
+            snprintf(info.name, sizeof(info.name), "%s", fields[0].c_str());
+            info.minBalance = atof(fields[1].c_str());
+            info.minOpeningDeposit = atof(fields[2].c_str());
+            info.withdrawalFee = atof(fields[3].c_str());
+            info.maxWithdrawal = atof(fields[4].c_str());
+            info.maxBalance = atof(fields[5].c_str());
+            info.interestRate = atof(fields[6].c_str());
+            info.allowsWithdrawal = fields[7] == "1" || fields[7] == "yes";
+            if (add(info) < 0) break;
+        }
+    }
+
+public:
+    static ProductRegistry& instance() {
+        static ProductRegistry registry;
+        return registry;
+    }
+
+    const ProductInfo& operator[](uint8_t code) const { return products[code < count ? code : 0]; }
+
+    uint8_t size() const { return count; }
+
+    int findCode(const string& name) const {
+        for (uint8_t code = 0; code < count; ++code) {
+            if (name == products[code].name) return code;
+        }
+        return -1;
+    }
+
+    int add(ProductInfo info) {
+        if (count >= MAX_PRODUCTS) {
+            cerr << "Warning: product table is full; " << info.name << " was not added." << endl;
+            return -1;
+        }
+        info.checkWithdrawal = &configuredWithdrawalRule;
+        info.checkDeposit = &configuredDepositRule;
+        products[count] = info;
+        return count++;
+    }
+
+    // Code for a product name read from a data file. A product that is no
+    // longer configured keeps working under the Current account rules.
+    uint8_t resolve(const string& name) {
+        int code = findCode(name);
+        if (code >= 0) return (uint8_t)code;
+        ProductInfo info = products[PRODUCT_CURRENT];
+        snprintf(info.name, sizeof(info.name), "%s", name.c_str());
+        cerr << "Warning: unknown account type '" << name << "'; applying Current account rules." << endl;
+        code = add(info);
+        return code >= 0 ? (uint8_t)code : (uint8_t)PRODUCT_CURRENT;
+    }
+
+    string namesList() const {
+        string names;
+        for (uint8_t code = 0; code < count; ++code) {
+            if (code > 0) names += "/";
+            names += products[code].name;
+        }
+        return names;
+    }
+};
+
+inline const ProductInfo& productInfo(uint8_t code) {
+    return ProductRegistry::instance()[code];
+}
+
+// ================= Transaction history encoding =================
+
+// Operation dictionary. An entry stores only its code; the descriptive text
+// is rebuilt from the prefix/suffix here when the history is displayed.
+enum HistoryOp : uint8_t {
+    HIST_OPENED = 0,
+    HIST_DEPOSIT = 1,
+    HIST_WITHDRAWAL = 2,
+    HIST_NOTE = 3,      // Free text after the timestamp
+    HIST_RAW_LINE = 4,  // Legacy line that could not be parsed at all
+    HIST_FEE = 5
+};
+
+struct HistoryOpInfo {
+    const char* prefix;
+    const char* suffix;
+};
+
+const HistoryOpInfo HISTORY_OPS[] = {
+    {"Account opened with initial deposit: ", " BDT"},
+    {"Deposit: +", " BDT"},
+    {"Withdrawal: -", " BDT"},
+    {"", ""},
+    {"", ""},
+    {"Withdrawal fee: -", " BDT"}
+};
+const uint8_t HISTORY_OP_COUNT = sizeof(HISTORY_OPS) / sizeof(HISTORY_OPS[0]);
+
+struct HistoryEntry {
+    time_t when = 0;
+    int64_t amountMinor = 0;  // Signed balance change in paisa
+    uint8_t op = HIST_NOTE;
+    string text;              // Only used by HIST_NOTE and HIST_RAW_LINE
+};
+
+int64_t toMinorUnits(double amount) {
+    return llround(amount * 100.0);
+}
+
+inline void putVarint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+inline uint64_t getVarint(const unsigned char*& p) {
+    uint64_t value = p[0];
+    if (value < 0x80) {
+        p += 1;
+        return value;
+    }
+    value = (value & 0x7F) | ((uint64_t)(p[1] & 0x7F) << 7);
+    if (p[1] < 0x80) {
+        p += 2;
+        return value;
+    }
+    value |= (uint64_t)(p[2] & 0x7F) << 14;
+    if (p[2] < 0x80) {
+        p += 3;
+        return value;
+    }
+    p += 3;
+    for (int shift = 21; ; shift += 7) {
+        uint64_t byte = *p++;
+        value |= (byte & 0x7F) << shift;
+        if (byte < 0x80) return value;
+    }
+}
+
+inline uint64_t zigzagEncode(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+inline int64_t zigzagDecode(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// Parses the "Sun Oct 18 09:58:44 2026" timestamps written by ctime()
+bool parseCtime(const string& text, time_t& when) {
+    static const char* MONTHS = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char weekday[4], month[4];
+    tm parts = {};
+    if (sscanf(text.c_str(), "%3s %3s %d %d:%d:%d %d", weekday, month, &parts.tm_mday,
+               &parts.tm_hour, &parts.tm_min, &parts.tm_sec, &parts.tm_year) != 7) {
+        return false;
+    }
+    const char* found = strstr(MONTHS, month);
+    if (!found || (found - MONTHS) % 3 != 0) return false;
+    parts.tm_mon = (int)(found - MONTHS) / 3;
+    parts.tm_year -= 1900;
+    parts.tm_isdst = -1;
+    when = mktime(&parts);
+    return when != (time_t)-1;
+}
+
+string formatCtime(time_t when) {
+    string dt = ctime(&when);
+    dt.erase(dt.find_last_not_of("\n") + 1); // Remove newline
+    return dt;
+}
+
+// Parses "YYYY-MM-DD", "YYYY-MM-DD HH:MM" or "YYYY-MM-DD HH:MM:SS" (a 'T'
+// may separate date and time) as local time. A bare date means the end of
+// that day, so it asks for the closing balance.
+bool parseDateTime(const string& text, time_t& when) {
+    tm parts = {};
+    int consumed = 0;
+    if (sscanf(text.c_str(), "%d-%d-%d%n", &parts.tm_year, &parts.tm_mon, &parts.tm_mday, &consumed) != 3) {
+        return false;
+    }
+    const char* rest = text.c_str() + consumed;
+    if (*rest == '\0') {
+        parts.tm_hour = 23;
+        parts.tm_min = 59;
+        parts.tm_sec = 59;
+    } else {
+        int fields = sscanf(rest + 1, "%d:%d:%d", &parts.tm_hour, &parts.tm_min, &parts.tm_sec);
+        if ((*rest != ' ' && *rest != 'T') || fields < 2) return false;
+    }
+    if (parts.tm_mon < 1 || parts.tm_mon > 12 || parts.tm_mday < 1 || parts.tm_mday > 31) return false;
+    parts.tm_year -= 1900;
+    parts.tm_mon -= 1;
+    parts.tm_isdst = -1;
+    when = mktime(&parts);
+    return when != (time_t)-1;
+}
+
+// Running balance at the first entry of a new day, so point-in-time
+// queries replay only from the nearest one instead of the whole history
+struct BalanceCheckpoint {
+    int64_t when;           // Time of the entry before it: the previous day's close
+    int64_t balanceMinor;   // Balance after that entry
+    uint32_t offset;        // Byte offset of the next entry in the block
+    uint32_t entries;       // Entries before the checkpoint
+};
+
+const uint32_t CHECKPOINT_SPACING = 32;    // Minimum entries between checkpoints
+const int64_t SECONDS_PER_DAY = 86400;
+
+// Per-account history block. Each entry is encoded as
+//   varint op | zig-zag varint time delta | zig-zag varint amount in paisa
+// followed by a length-prefixed string for note entries. Appending never
+// decodes; decoding happens only when the history is displayed or exported.
+// A closing-balance checkpoint is taken at the first day boundary after
+// every CHECKPOINT_SPACING entries.
+class CompressedHistory {
+private:
+    string block;
+    uint32_t count = 0;
+    int64_t lastTime = 0;
+    int64_t balanceMinor = 0;           // Sum of every amount appended
+    vector<BalanceCheckpoint> checkpoints;
+
+    // Decodes entries from `offset`, whose time delta is relative to
+    // `base`, until the end of the block or until fn returns false
+    template <typename Fn>
+    void decodeFrom(size_t offset, int64_t base, Fn fn) const {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(block.data()) + offset;
+        const unsigned char* end = reinterpret_cast<const unsigned char*>(block.data()) + block.size();
+        HistoryEntry entry;
+        int64_t when = base;
+        while (p < end) {
+            entry.op = (uint8_t)getVarint(p);
+            when += zigzagDecode(getVarint(p));
+            entry.when = (time_t)when;
+            entry.amountMinor = zigzagDecode(getVarint(p));
+            if (entry.op == HIST_NOTE || entry.op == HIST_RAW_LINE) {
+                size_t length = (size_t)getVarint(p);
+                entry.text.assign(reinterpret_cast<const char*>(p), length);
+                p += length;
+            }
+            if (!fn(entry)) return;
+        }
+    }
+
+    // Last checkpoint at or before `when`, or null to replay from the start
+    const BalanceCheckpoint* checkpointBefore(time_t when) const {
+        auto checkpoint = upper_bound(checkpoints.begin(), checkpoints.end(), (int64_t)when,
+                                      [](int64_t t, const BalanceCheckpoint& c) { return t < c.when; });
+        return checkpoint == checkpoints.begin() ? nullptr : &*(checkpoint - 1);
+    }
+
+    // For blocks written before checkpoints existed: re-appending every
+    // entry produces the same block with its checkpoints
+    void rebuildCheckpoints() {
+        CompressedHistory rebuilt;
+        forEach([&](const HistoryEntry& entry) {
+            rebuilt.append(entry.op, entry.when, entry.amountMinor, entry.text);
+        });
+        *this = std::move(rebuilt);
+    }
+
+public:
+    void append(uint8_t op, time_t when, int64_t amountMinor, const string& text = "") {
+        uint32_t sinceCheckpoint = count - (checkpoints.empty() ? 0 : checkpoints.back().entries);
+        if (sinceCheckpoint >= CHECKPOINT_SPACING && (int64_t)when / SECONDS_PER_DAY > lastTime / SECONDS_PER_DAY) {
+            checkpoints.push_back({lastTime, balanceMinor, (uint32_t)block.size(), count});
+        }
+        putVarint(block, op);
+        putVarint(block, zigzagEncode((int64_t)when - lastTime));
+        putVarint(block, zigzagEncode(amountMinor));
+        if (op == HIST_NOTE || op == HIST_RAW_LINE) {
+            putVarint(block, text.size());
+            block += text;
+        }
+        lastTime = (int64_t)when;
+        balanceMinor += amountMinor;
+        ++count;
+    }
+
+    // Converts one line written by older versions ("<ctime> - <description>")
+    // into a dictionary-coded entry; text that does not round-trip exactly is
+    // kept as a note so nothing is lost.
+    void appendLegacyLine(const string& line) {
+        size_t separator = line.find(" - ");
+        time_t when;
+        if (separator == string::npos || !parseCtime(line.substr(0, separator), when)) {
+            append(HIST_RAW_LINE, (time_t)lastTime, 0, line);
+            return;
+        }
+        string description = line.substr(separator + 3);
+        for (uint8_t op = HIST_OPENED; op < HISTORY_OP_COUNT; ++op) {
+            if (op == HIST_NOTE || op == HIST_RAW_LINE) continue;
+            const HistoryOpInfo& info = HISTORY_OPS[op];
+            size_t prefixLen = strlen(info.prefix);
+            if (description.compare(0, prefixLen, info.prefix) != 0) continue;
+            double amount = atof(description.c_str() + prefixLen);
+            int64_t minor = toMinorUnits(op == HIST_WITHDRAWAL || op == HIST_FEE ? -amount : amount);
+            HistoryEntry entry;
+            entry.when = when;
+            entry.amountMinor = minor;
+            entry.op = op;
+            if (describe(entry) == description) {
+                append(op, when, minor);
+                return;
+            }
+        }
+        append(HIST_NOTE, when, 0, description);
+    }
+
+    template <typename Fn>
+    void forEach(Fn fn) const {
+        decodeFrom(0, 0, [&](const HistoryEntry& entry) {
+            fn(entry);
+            return true;
+        });
+    }
+
+    // Time of the first entry (the opening deposit), or `fallback` if empty
+    time_t firstTime(time_t fallback) const {
+        decodeFrom(0, 0, [&](const HistoryEntry& entry) {
+            fallback = entry.when;
+            return false;
+        });
+        return fallback;
+    }
+
+    // Balance in paisa once every entry at or before `when` has applied:
+    // binary search to the last checkpoint before `when`, then replay the
+    // entries after it. False if the history has no entry that early.
+    bool balanceAt(time_t when, int64_t& balance) const {
+        const BalanceCheckpoint* checkpoint = checkpointBefore(when);
+        bool seen = checkpoint != nullptr;
+        balance = checkpoint ? checkpoint->balanceMinor : 0;
+        decodeFrom(checkpoint ? checkpoint->offset : 0, checkpoint ? checkpoint->when : 0,
+                   [&](const HistoryEntry& entry) {
+            if (entry.when > when) return false;
+            balance += entry.amountMinor;
+            seen = true;
+            return true;
+        });
+        return seen;
+    }
+
+    // Calls fn for the entries from `from` onwards (until it returns false),
+    // starting at the nearest checkpoint; the entries before `from` only add
+    // up `opening`. False if the history has no entry before `from`.
+    template <typename Fn>
+    bool replaySince(time_t from, int64_t& opening, Fn fn) const {
+        const BalanceCheckpoint* checkpoint = checkpointBefore(from - 1);
+        bool seen = checkpoint != nullptr;
+        opening = checkpoint ? checkpoint->balanceMinor : 0;
+        decodeFrom(checkpoint ? checkpoint->offset : 0, checkpoint ? checkpoint->when : 0,
+                   [&](const HistoryEntry& entry) {
+            if (entry.when >= from) return fn(entry);
+            opening += entry.amountMinor;
+            seen = true;
+            return true;
+        });
+        return seen;
+    }
+
+    vector<HistoryEntry> decode() const {
+        vector<HistoryEntry> entries;
+        entries.reserve(count);
+        forEach([&](const HistoryEntry& entry) { entries.push_back(entry); });
+        return entries;
+    }
+
+    static string describe(const HistoryEntry& entry) {
+        if (entry.op == HIST_NOTE || entry.op == HIST_RAW_LINE || entry.op >= HISTORY_OP_COUNT) {
+            return entry.text;
+        }
+        const HistoryOpInfo& info = HISTORY_OPS[entry.op];
+        double amount = llabs(entry.amountMinor) / 100.0;
+        return info.prefix + to_string(amount) + info.suffix;
+    }
+
+    // The line format shown to users and written by older versions
+    static string render(const HistoryEntry& entry) {
+        if (entry.op == HIST_RAW_LINE) return entry.text;
+        return formatCtime(entry.when) + " - " + describe(entry);
+    }
+
+    vector<string> renderAll() const {
+        vector<string> lines;
+        lines.reserve(count);
+        forEach([&](const HistoryEntry& entry) { lines.push_back(render(entry)); });
+        return lines;
+    }
+
+    size_t size() const { return count; }
+    size_t encodedBytes() const { return block.size(); }
+    size_t checkpointCount() const { return checkpoints.size(); }
+    size_t memoryBytes() const {
+        return sizeof(*this) + block.capacity() + checkpoints.capacity() * sizeof(BalanceCheckpoint);
+    }
+
+    void clear() {
+        block.clear();
+        count = 0;
+        lastTime = 0;
+        balanceMinor = 0;
+        checkpoints.clear();
+    }
+
+    void shrinkToFit() {
+        block.shrink_to_fit();
+        checkpoints.shrink_to_fit();
+    }
+
+    // Checkpoints follow the block, delta-coded like the entries:
+    //   H <count> <lastTime> <bytes> <balance> <checkpoints> <checkpoint bytes>
+    void write(ostream& out) const {
+        string encoded;
+        BalanceCheckpoint previous = {0, 0, 0, 0};
+        for (const auto& checkpoint : checkpoints) {
+            putVarint(encoded, zigzagEncode(checkpoint.when - previous.when));
+            putVarint(encoded, zigzagEncode(checkpoint.balanceMinor - previous.balanceMinor));
+            putVarint(encoded, checkpoint.offset - previous.offset);
+            putVarint(encoded, checkpoint.entries - previous.entries);
+            previous = checkpoint;
+        }
+        out << "H " << count << " " << lastTime << " " << block.size() << " " << balanceMinor << " "
+            << checkpoints.size() << " " << encoded.size() << "\n";
+        out.write(block.data(), (streamsize)block.size());
+        out.write(encoded.data(), (streamsize)encoded.size());
+        out << "\n";
+    }
+
+    // Reads the block written by write(); `header` is its first line.
+    // Older headers stop after the block size and get their checkpoints
+    // rebuilt here.
+    bool read(istream& in, const string& header) {
+        istringstream headerStream(header);
+        string tag;
+        size_t bytes = 0, checkpointTotal = 0, encodedBytes = 0;
+        if (!(headerStream >> tag >> count >> lastTime >> bytes) || tag != "H") return false;
+        bool hasCheckpoints = (bool)(headerStream >> balanceMinor >> checkpointTotal >> encodedBytes);
+        block.assign(bytes, '\0');
+        if (bytes > 0 && !in.read(&block[0], (streamsize)bytes)) return false;
+        if (!hasCheckpoints) {
+            if (in.get() != '\n') return false;
+            rebuildCheckpoints();
+            return true;
+        }
+        string encoded(encodedBytes, '\0');
+        if (encodedBytes > 0 && !in.read(&encoded[0], (streamsize)encodedBytes)) return false;
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(encoded.data());
+        const unsigned char* end = p + encoded.size();
+        BalanceCheckpoint checkpoint = {0, 0, 0, 0};
+        checkpoints.clear();
+        checkpoints.reserve(checkpointTotal);
+        for (size_t i = 0; i < checkpointTotal; ++i) {
+            if (p >= end) return false;
+            checkpoint.when += zigzagDecode(getVarint(p));
+            checkpoint.balanceMinor += zigzagDecode(getVarint(p));
+            checkpoint.offset += (uint32_t)getVarint(p);
+            checkpoint.entries += (uint32_t)getVarint(p);
+            checkpoints.push_back(checkpoint);
+        }
+        return in.get() == '\n';
+    }
+};
+
+// ================= Accounts =================
+
+// Stable 64-bit hash (FNV-1a with a final avalanche) so fingerprints can be
+// persisted and compared across runs
+uint64_t hashKey(const string& key) {
+    uint64_t h = 1469598103934665603ULL;
+    for (unsigned char c : key) {
+        h = (h ^ c) * 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Rarely read customer details, kept off the cache line that deposits and
+// withdrawals touch
+struct AccountProfile {
+    string accountNumber;
+    string accountHolderName;
+    string address;
+    string phoneNumber;
+    string email;
+    string password;
+    CompressedHistory history;
+};
+
+// The object itself is the hot record: exactly one cache line holding what
+// every transaction reads or writes. The profile lives in its own allocation.
+class alignas(64) BankAccount {
+private:
+    uint64_t id = 0;                 // Numeric part of the account number
+    double balance = 0.0;
+    uint64_t credentialHash = 0;     // hashKey(password)
+    uint32_t version = 0;            // Bumped on every balance change
+    uint8_t typeCode = 0;
+    unique_ptr<AccountProfile> profile;
+
+    static uint64_t numericId(const string& accNum) {
+        return accNum.size() > 4 ? strtoull(accNum.c_str() + 4, nullptr, 10) : 0;
+    }
+
+public:
+    // Constructor
+    BankAccount(string accNum = "", string name = "", string addr = "", 
+                string phone = "", string mail = "", double initialDeposit = 0.0, 
+                string type = "Savings", string pwd = "1234", time_t openedAt = time(0))
+        : id(numericId(accNum)), balance(initialDeposit), credentialHash(hashKey(pwd)),
+          typeCode(ProductRegistry::instance().resolve(type)),
+          profile(new AccountProfile{accNum, name, addr, phone, mail, pwd, CompressedHistory()}) {
+        if (initialDeposit > 0) {
+            profile->history.append(HIST_OPENED, openedAt, toMinorUnits(initialDeposit));
+        }
+    }
+
+    BankAccount(const BankAccount& other)
+        : id(other.id), balance(other.balance), credentialHash(other.credentialHash), version(other.version),
+          typeCode(other.typeCode), profile(new AccountProfile(*other.profile)) {}
+    BankAccount(BankAccount&&) = default;
+    BankAccount& operator=(const BankAccount& other) {
+        if (this != &other) *this = BankAccount(other);
+        return *this;
+    }
+    BankAccount& operator=(BankAccount&&) = default;
+
+    // Getters
+    string getAccountNumber() const { return profile->accountNumber; }
+    string getAccountHolderName() const { return profile->accountHolderName; }
+    double getBalance() const { return balance; }
+    string getAccountType() const { return productInfo(typeCode).name; }
+    uint8_t getTypeCode() const { return typeCode; }
+    uint64_t getId() const { return id; }
+    uint32_t getVersion() const { return version; }
+    uint64_t getCredentialHash() const { return credentialHash; }
+    string getAddress() const { return profile->address; }
+    string getPhoneNumber() const { return profile->phoneNumber; }
+    string getEmail() const { return profile->email; }
+    string getPassword() const { return profile->password; }
+    vector<string> getTransactionHistory() const { return profile->history.renderAll(); }
+    const CompressedHistory& getHistory() const { return profile->history; }
+
+    // Bytes held by this account, including its profile, strings and history
+    size_t memoryBytes() const {
+        auto heap = [](const string& text) { return text.capacity() > 15 ? text.capacity() + 1 : 0; };
+        const AccountProfile& p = *profile;
+        return sizeof(*this) + sizeof(AccountProfile) + heap(p.accountNumber) + heap(p.accountHolderName) +
+               heap(p.address) + heap(p.phoneNumber) + heap(p.email) + heap(p.password) +
+               p.history.memoryBytes() - sizeof(CompressedHistory);
+    }
+
+    // Account operations
+    TxStatus checkDeposit(double amount) const {
+        const ProductInfo& product = productInfo(typeCode);
+        return product.checkDeposit(product, balance, amount);
+    }
+
+    bool deposit(double amount, time_t when = time(0), ostream& out = cout) {
+        TRACE_SPAN("BankAccount::deposit");
+        PROFILE_REGION("BankAccount::deposit");
+        switch (checkDeposit(amount)) {
+            case TxStatus::Ok:
+                applyDeposit(amount, when);
+                out << "Deposit successful. New balance: " << fixed << setprecision(2) << balance << " BDT" << endl;
+                return true;
+            case TxStatus::LimitExceeded:
+                out << "Deposit failed. Maximum balance for " << getAccountType() << " account is "
+                    << productInfo(typeCode).maxBalance << " BDT" << endl;
+                return false;
+            default:
+                out << "Invalid deposit amount." << endl;
+                return false;
+        }
+    }
+
+    // Mismatches are rejected from the hot record alone
+    bool verifyPassword(const string& pwd) const {
+        return hashKey(pwd) == credentialHash && pwd == profile->password;
+    }
+
+    TxStatus checkWithdrawal(double amount, const string& pwd) const {
+        if (!verifyPassword(pwd)) return TxStatus::BadPassword;
+        const ProductInfo& product = productInfo(typeCode);
+        return product.checkWithdrawal(product, balance, amount);
+    }
+
+    double withdrawalFee() const {
+        return productInfo(typeCode).withdrawalFee;
+    }
+
+    bool withdraw(double amount, const string& pwd, time_t when = time(0), ostream& out = cout) {
+        TRACE_SPAN("BankAccount::withdraw");
+        PROFILE_REGION("BankAccount::withdraw");
+        switch (checkWithdrawal(amount, pwd)) {
+            case TxStatus::BadPassword:
+                out << "Invalid password. Withdrawal failed." << endl;
+                return false;
+            case TxStatus::InvalidAmount:
+                out << "Invalid withdrawal amount." << endl;
+                return false;
+            case TxStatus::BelowMinimum:
+                out << "Withdrawal failed. Minimum balance requirement not met." << endl;
+                out << "Minimum required balance for " << getAccountType() << " account: "
+                    << productInfo(typeCode).minBalance << " BDT" << endl;
+                return false;
+            case TxStatus::WithdrawalNotAllowed:
+                out << "Withdrawals are not allowed on " << getAccountType() << " accounts." << endl;
+                return false;
+            case TxStatus::LimitExceeded:
+                out << "Withdrawal failed. Maximum single withdrawal for " << getAccountType()
+                    << " account is " << productInfo(typeCode).maxWithdrawal << " BDT" << endl;
+                return false;
+            case TxStatus::InsufficientFunds:
+                out << "Insufficient funds." << endl;
+                return false;
+            default:
+                break;
+        }
+
+        double fee = withdrawalFee();
+        applyWithdrawal(amount, when, fee);
+        if (fee > 0) {
+            out << "Withdrawal fee charged: " << fixed << setprecision(2) << fee << " BDT" << endl;
+        }
+        out << "Withdrawal successful. New balance: " << fixed << setprecision(2) << balance << " BDT" << endl;
+        return true;
+    }
+
+    // Silent mutations used by the interactive path and by journal replay
+    void applyDeposit(double amount, time_t when) {
+        PROFILE_REGION("BankAccount::applyDeposit");
+        balance += amount;
+        ++version;
+        profile->history.append(HIST_DEPOSIT, when, toMinorUnits(amount));
+    }
+
+    void applyWithdrawal(double amount, time_t when, double fee = 0.0) {
+        PROFILE_REGION("BankAccount::applyWithdrawal");
+        balance -= amount;
+        ++version;
+        profile->history.append(HIST_WITHDRAWAL, when, -toMinorUnits(amount));
+        if (fee > 0) {
+            balance -= fee;
+            profile->history.append(HIST_FEE, when, -toMinorUnits(fee));
+        }
+    }
+
+    void displayAccountInfo(ostream& out = cout) const {
+        out << "\n=== Account Information ===" << endl;
+        out << "Account Number: " << profile->accountNumber << endl;
+        out << "Account Holder: " << profile->accountHolderName << endl;
+        out << "Address: " << profile->address << endl;
+        out << "Phone: " << profile->phoneNumber << endl;
+        out << "Email: " << profile->email << endl;
+        out << "Account Type: " << getAccountType() << endl;
+        out << "Current Balance: " << fixed << setprecision(2) << balance << " BDT" << endl;
+        out << "===========================\n" << endl;
+    }
+
+    // `history` replaces the one held here when storage keeps it elsewhere
+    void displayTransactionHistory(ostream& out = cout, const CompressedHistory* history = nullptr) const {
+        PROFILE_REGION("BankAccount::displayHistory");
+        out << "\n=== Transaction History ===" << endl;
+        out << "Account: " << profile->accountNumber << " (" << profile->accountHolderName << ")" << endl;
+        string listing;
+        (history ? *history : profile->history).forEach([&](const HistoryEntry& entry) {
+            listing += "- ";
+            listing += CompressedHistory::render(entry);
+            listing += '\n';
+        });
+        out << listing;
+        out << "===========================\n" << endl;
+    }
+
+    // Method to save account to file; without history an empty block is
+    // written, for storage that keeps the history separately
+    void saveToFile(ostream& outFile, bool withHistory = true) const {
+        const AccountProfile& p = *profile;
+        outFile << p.accountNumber << endl;
+        outFile << p.accountHolderName << endl;
+        outFile << p.address << endl;
+        outFile << p.phoneNumber << endl;
+        outFile << p.email << endl;
+        outFile << fixed << setprecision(2) << balance << endl;
+        outFile << getAccountType() << endl;
+        outFile << p.password << endl;
+        
+        // Save transaction history as its compressed block
+        if (withHistory) {
+            p.history.write(outFile);
+        } else {
+            CompressedHistory().write(outFile);
+        }
+    }
+
+    // Appends an entry read back from storage; the balance is stored separately
+    void restoreHistoryEntry(const HistoryEntry& entry) {
+        profile->history.append(entry.op, entry.when, entry.amountMinor, entry.text);
+    }
+
+    // Drops the history held in memory once storage has all of it
+    void releaseHistory() {
+        profile->history.clear();
+        profile->history.shrinkToFit();
+    }
+
+    // Method to load account from file. Returns false if the record is
+    // truncated or malformed instead of leaving half-parsed fields behind.
+    bool loadFromFile(istream& inFile) {
+        if (!profile) profile.reset(new AccountProfile());
+        AccountProfile& p = *profile;
+        getline(inFile, p.accountNumber);
+        getline(inFile, p.accountHolderName);
+        getline(inFile, p.address);
+        getline(inFile, p.phoneNumber);
+        getline(inFile, p.email);
+        inFile >> balance;
+        inFile.ignore();
+        string typeName;
+        getline(inFile, typeName);
+        typeCode = ProductRegistry::instance().resolve(typeName);
+        getline(inFile, p.password);
+        id = numericId(p.accountNumber);
+        credentialHash = hashKey(p.password);
+        version = 0;
+        
+        // Load transaction history: a compressed block, or the plain
+        // count-and-lines layout of older files which is encoded on load
+        string historyHeader;
+        getline(inFile, historyHeader);
+        if (!inFile || p.accountNumber.rfind("ACCT", 0) != 0) {
+            return false;
+        }
+        p.history.clear();
+        if (historyHeader.rfind("H ", 0) == 0) {
+            return p.history.read(inFile, historyHeader);
+        }
+        char* end = nullptr;
+        long transactionCount = strtol(historyHeader.c_str(), &end, 10);
+        if (end == historyHeader.c_str() || transactionCount < 0) {
+            return false;
+        }
+        for (long i = 0; i < transactionCount; ++i) {
+            string transaction;
+            if (!getline(inFile, transaction)) return false;
+            p.history.appendLegacyLine(transaction);
+        }
+        p.history.shrinkToFit();
+        return true;
+    }
+};
+
+static_assert(sizeof(BankAccount) == 64, "the hot account record should fill one cache line");
+
+// ================= Customer validation =================
+// The same rules back the interactive prompts and bulk import.
+
+// Branch-free so the compiler can vectorise it over long inputs
+inline bool allDigits(const string& text) {
+    unsigned char bad = 0;
+    for (unsigned char c : text) {
+        bad |= (unsigned char)(c - '0') > 9;
+    }
+    return !bad;
+}
+
+inline bool validEmail(const string& email) {
+    return email.find('@') != string::npos && email.find('.') != string::npos;
+}
+
+inline bool validPassword(const string& password) {
+    return password.length() == (size_t)MIN_PASSWORD_LENGTH && allDigits(password);
+}
+
+// Returns an empty string when the deposit is acceptable, else the reason
+string checkOpeningDeposit(const ProductInfo& product, double deposit) {
+    ostringstream reason;
+    if (!wholePaisa(deposit)) {
+        reason << "Deposit must be a whole number of paisa";
+    } else if (product.maxBalance > 0 && deposit > product.maxBalance) {
+        reason << "Maximum balance for " << product.name << " account is " << product.maxBalance << " BDT";
+    } else if (!(deposit >= product.minOpeningDeposit)) {
+        reason << "Minimum deposit for " << product.name << " account is " << product.minOpeningDeposit << " BDT";
+    }
+    return reason.str();
+}
+
+struct CustomerRecord {
+    size_t line = 0;
+    string name, address, phone, email, accountType, password;
+    double deposit = 0.0;
+    string error;   // Empty when the row passed validation
+};
+
+// Splits one CSV line; fields may be quoted with "" as an escaped quote
+vector<string> parseCsvLine(const string& line) {
+    vector<string> fields;
+    string field;
+    bool quoted = false;
+    for (size_t i = 0; i < line.size(); ++i) {
+        char c = line[i];
+        if (quoted) {
+            if (c == '"' && i + 1 < line.size() && line[i + 1] == '"') {
+                field.push_back('"');
+                ++i;
+            } else if (c == '"') {
+                quoted = false;
+            } else {
+                field.push_back(c);
+            }
+        } else if (c == '"') {
+            quoted = true;
+        } else if (c == ',') {
+            fields.push_back(field);
+            field.clear();
+        } else if (c != '\r') {
+            field.push_back(c);
+        }
+    }
+    fields.push_back(field);
+    return fields;
+}
+
+// Validates name,address,phone,email,type,deposit,password
+void validateCustomerFields(const vector<string>& fields, CustomerRecord& record) {
+    if (fields.size() != 7) {
+        record.error = "Expected 7 fields, found " + to_string(fields.size());
+        return;
+    }
+    record.name = fields[0];
+    record.address = fields[1];
+    record.phone = fields[2];
+    record.email = fields[3];
+    record.accountType = fields[4];
+    record.password = fields[6];
+
+    char* end = nullptr;
+    record.deposit = strtod(fields[5].c_str(), &end);
+    int typeCode = ProductRegistry::instance().findCode(record.accountType);
+
+    if (record.name.empty()) {
+        record.error = "Name cannot be empty";
+    } else if (record.address.empty()) {
+        record.error = "Address cannot be empty";
+    } else if (!allDigits(record.phone)) {
+        record.error = "Phone number must contain only digits";
+    } else if (!validEmail(record.email)) {
+        record.error = "Invalid email format";
+    } else if (typeCode < 0) {
+        record.error = "Invalid account type";
+    } else if (fields[5].empty() || *end != '\0') {
+        record.error = "Invalid amount";
+    } else if (!(record.error = checkOpeningDeposit(ProductRegistry::instance()[(uint8_t)typeCode], record.deposit)).empty()) {
+        // Reason already set
+    } else if (!validPassword(record.password)) {
+        record.error = "Password must be " + to_string(MIN_PASSWORD_LENGTH) + " digits";
+    }
+}
+
+// Parses and validates one import row
+void validateCustomerRow(const string& line, CustomerRecord& record) {
+    validateCustomerFields(parseCsvLine(line), record);
+}
+
+// Runs fn(begin, end) over [0, count) split across the available cores
+template <typename Fn>
+void parallelFor(size_t count, Fn fn) {
+    size_t workers = max(1u, thread::hardware_concurrency());
+    workers = min(workers, max<size_t>(1, count / 1024));
+    if (workers <= 1) {
+        fn((size_t)0, count);
+        return;
+    }
+    vector<thread> threads;
+    size_t chunk = (count + workers - 1) / workers;
+    for (size_t w = 0; w < workers; ++w) {
+        size_t begin = w * chunk;
+        size_t end = min(count, begin + chunk);
+        if (begin >= end) break;
+        threads.emplace_back([=, &fn] {
+            TRACE_SPAN("parallelFor.chunk");
+            fn(begin, end);
+        });
+    }
+    for (auto& t : threads) t.join();
+}
+
+// Runs fn(worker, index) for every index in [0, count) on `workers`
+// threads. Each worker starts with an equal share and takes from its
+// front; one that runs dry steals the back half of the largest remaining
+// share, so a run of expensive items does not leave the other cores idle.
+template <typename Fn>
+void parallelForStealing(size_t count, size_t workers, Fn fn) {
+    struct alignas(64) Share {
+        mutex lock;
+        size_t next = 0, end = 0;
+    };
+    workers = max<size_t>(1, min(workers, count));
+    vector<Share> shares(workers);
+    size_t chunk = (count + workers - 1) / workers;
+    for (size_t w = 0; w < workers; ++w) {
+        shares[w].next = min(count, w * chunk);
+        shares[w].end = min(count, shares[w].next + chunk);
+    }
+
+    auto work = [&](size_t w) {
+        TRACE_SPAN("parallelForStealing.worker");
+        Share& own = shares[w];
+        while (true) {
+            size_t index = SIZE_MAX;
+            {
+                lock_guard<mutex> guard(own.lock);
+                if (own.next < own.end) index = own.next++;
+            }
+            if (index != SIZE_MAX) {
+                fn(w, index);
+                continue;
+            }
+            size_t victim = SIZE_MAX, largest = 0;
+            for (size_t v = 0; v < workers; ++v) {
+                if (v == w) continue;
+                lock_guard<mutex> guard(shares[v].lock);
+                if (shares[v].end - shares[v].next > largest) {
+                    largest = shares[v].end - shares[v].next;
+                    victim = v;
+                }
+            }
+            if (victim == SIZE_MAX) return;
+            size_t begin, end;
+            {
+                lock_guard<mutex> guard(shares[victim].lock);
+                size_t remaining = shares[victim].end - shares[victim].next;
+                if (remaining == 0) continue;
+                end = shares[victim].end;
+                begin = end - (remaining + 1) / 2;
+                shares[victim].end = begin;
+            }
+            lock_guard<mutex> guard(own.lock);
+            own.next = begin;
+            own.end = end;
+        }
+    };
+
+    if (workers == 1) {
+        work(0);
+        return;
+    }
+    vector<thread> threads;
+    for (size_t w = 0; w < workers; ++w) threads.emplace_back(work, w);
+    for (auto& t : threads) t.join();
+}
+
+struct ImportReport {
+    size_t rows = 0;
+    size_t accepted = 0;
+    size_t rejected = 0;
+    string firstAccount, lastAccount;
+    bool committed = false;
+};
+
+// ================= Customer uniqueness indexes =================
+
+// Phone numbers compare on their local form: +880 / 880 prefixes are folded
+// into the leading 0 used inside Bangladesh.
+string normalizePhone(const string& phone) {
+    string digits;
+    for (char c : phone) {
+        if (isdigit((unsigned char)c)) digits.push_back(c);
+    }
+    if (digits.size() == 13 && digits.compare(0, 3, "880") == 0) {
+        digits = digits.substr(2);
+    }
+    return digits;
+}
+
+string normalizeEmail(const string& email) {
+    size_t begin = email.find_first_not_of(" \t");
+    size_t end = email.find_last_not_of(" \t");
+    if (begin == string::npos) return "";
+    string normalized = email.substr(begin, end - begin + 1);
+    transform(normalized.begin(), normalized.end(), normalized.begin(),
+              [](unsigned char c) { return (char)tolower(c); });
+    return normalized;
+}
+
+// Blocked Bloom filter: every key maps to one 64-byte block and sets 8 bits
+// inside it, so a lookup costs a single cache miss.
+class BlockedBloomFilter {
+private:
+    struct alignas(64) Block {
+        uint64_t words[8];
+    };
+    vector<Block> blocks;
+
+    const Block& blockFor(uint64_t h) const {
+        return blocks[(size_t)(((h >> 32) * (uint64_t)blocks.size()) >> 32)];
+    }
+
+public:
+    explicit BlockedBloomFilter(size_t expectedKeys = 0) { resize(expectedKeys); }
+
+    // About 16 bits per key keeps the false-positive rate well under 1%
+    void resize(size_t expectedKeys) {
+        size_t count = max<size_t>(64, expectedKeys * 2 / 64 + 1);
+        blocks.assign(count, Block{});
+    }
+
+    size_t blockCount() const { return blocks.size(); }
+
+    // One bit per 64-bit word of the block, chosen from a remixed hash so
+    // the bits are independent of the block selection
+    void insert(uint64_t h) {
+        Block& block = const_cast<Block&>(blockFor(h));
+        uint64_t bits = h * 0x9E3779B97F4A7C15ULL;
+        for (int i = 0; i < 8; ++i) {
+            block.words[i] |= 1ULL << ((bits >> (i * 6)) & 63);
+        }
+    }
+
+    bool mayContain(uint64_t h) const {
+        const Block& block = blockFor(h);
+        uint64_t bits = h * 0x9E3779B97F4A7C15ULL;
+        uint64_t missing = 0;
+        for (int i = 0; i < 8; ++i) {
+            missing |= ~block.words[i] & (1ULL << ((bits >> (i * 6)) & 63));
+        }
+        return missing == 0;
+    }
+
+    void write(string& out) const {
+        out.append(reinterpret_cast<const char*>(blocks.data()), blocks.size() * sizeof(Block));
+    }
+
+    bool read(const char* data, size_t count) {
+        blocks.resize(count);
+        memcpy(blocks.data(), data, count * sizeof(Block));
+        return true;
+    }
+};
+
+// Set of 64-bit fingerprints of normalised keys with a Bloom filter in
+// front. The common "definitely new" answer never touches the hash set.
+class UniquenessIndex {
+private:
+    BlockedBloomFilter bloom;
+    unordered_set<uint64_t> fingerprints;
+
+public:
+    void reset(size_t expectedKeys) {
+        bloom.resize(expectedKeys);
+        fingerprints.clear();
+        fingerprints.reserve(expectedKeys);
+    }
+
+    bool contains(uint64_t h) const {
+        return bloom.mayContain(h) && fingerprints.count(h) > 0;
+    }
+
+    void insert(uint64_t h) {
+        if (fingerprints.size() >= bloom.blockCount() * 32) {
+            // Grown past the sizing target; rebuild the filter bigger
+            bloom.resize(fingerprints.size() * 2);
+            for (uint64_t existing : fingerprints) bloom.insert(existing);
+        }
+        bloom.insert(h);
+        fingerprints.insert(h);
+    }
+
+    // The Bloom filter cannot forget a key; a stale bit only costs one
+    // extra set lookup until the next rebuild
+    void erase(uint64_t h) {
+        fingerprints.erase(h);
+    }
+
+    size_t size() const { return fingerprints.size(); }
+
+    void write(string& out) const {
+        out += to_string(bloom.blockCount()) + " " + to_string(fingerprints.size()) + "\n";
+        bloom.write(out);
+        for (uint64_t h : fingerprints) out.append(reinterpret_cast<const char*>(&h), sizeof(h));
+    }
+
+    bool read(istream& in) {
+        size_t blockCount = 0, keyCount = 0;
+        string header;
+        if (!getline(in, header)) return false;
+        istringstream headerStream(header);
+        if (!(headerStream >> blockCount >> keyCount) || blockCount == 0) return false;
+        string bloomBytes(blockCount * 64, '\0');
+        if (!in.read(&bloomBytes[0], (streamsize)bloomBytes.size())) return false;
+        bloom.read(bloomBytes.data(), blockCount);
+        fingerprints.clear();
+        fingerprints.reserve(keyCount);
+        for (size_t i = 0; i < keyCount; ++i) {
+            uint64_t h;
+            if (!in.read(reinterpret_cast<char*>(&h), sizeof(h))) return false;
+            fingerprints.insert(h);
+        }
+        return true;
+    }
+};
+
+// ================= Account number allocation =================
+
+// Hands out account numbers from blocks reserved durably in COUNTER_FILE.
+// The file holds the highest number reserved so far and is rewritten only
+// when a block runs out. Numbers inside a reserved block come from a single
+// atomic fetch-add, so concurrent onboarding threads never touch the disk or
+// a lock per account. After a crash the unissued rest of the last block is
+// skipped, never reissued.
+class AccountNumberAllocator {
+private:
+    atomic<long long> next{1001};        // Next number to hand out
+    atomic<long long> reservedEnd{1001}; // Numbers below this are durably reserved
+    mutex reserveMutex;
+    long long blockSize = ACCOUNT_NUMBER_BLOCK;
+
+    // Slow path: extend the durable reservation so it covers [.., needEnd)
+    bool reserveThrough(long long needEnd) {
+        lock_guard<mutex> lock(reserveMutex);
+        long long end = reservedEnd.load(memory_order_acquire);
+        if (end >= needEnd) return true;
+        long long newEnd = needEnd + blockSize;
+        if (!publishFileAtomically(COUNTER_FILE, to_string(newEnd - 1))) {
+            cerr << "Error reserving account numbers!" << endl;
+            return false;
+        }
+        reservedEnd.store(newEnd, memory_order_release);
+        return true;
+    }
+
+public:
+    void setBlockSize(long long size) { blockSize = max(1LL, size); }
+
+    // Reads the reservation left by the previous run. Everything up to it
+    // may have been issued, so allocation resumes after it.
+    void load() {
+        ifstream inFile(COUNTER_FILE);
+        long long stored;
+        if (inFile >> stored) observe(stored);
+    }
+
+    // Keeps allocation ahead of a number that is already in use (startup only)
+    void observe(long long number) {
+        if (number >= next.load(memory_order_relaxed)) {
+            next.store(number + 1, memory_order_relaxed);
+        }
+        if (number >= reservedEnd.load(memory_order_relaxed)) {
+            reservedEnd.store(number + 1, memory_order_relaxed);
+        }
+    }
+
+    // Returns a number that is unique across crashes, or -1 if the
+    // reservation could not be made durable.
+    long long allocate() {
+        return allocateRange(1);
+    }
+
+    // Allocates `count` consecutive numbers and returns the first one
+    long long allocateRange(long long count) {
+        long long first = next.fetch_add(count, memory_order_relaxed);
+        if (first + count <= reservedEnd.load(memory_order_acquire)) return first;
+        return reserveThrough(first + count) ? first : -1;
+    }
+
+    long long lastIssued() const {
+        return next.load(memory_order_relaxed) - 1;
+    }
+
+    // On a clean shutdown nothing past lastIssued() is in use, so the unused
+    // part of the block is handed back to keep numbering contiguous.
+    void releaseUnused() {
+        lock_guard<mutex> lock(reserveMutex);
+        long long issued = lastIssued();
+        if (publishFileAtomically(COUNTER_FILE, to_string(issued))) {
+            reservedEnd.store(issued + 1, memory_order_release);
+        }
+    }
+};
+
+// ================= Account storage =================
+
+// Handle to an account in AccountStore. The generation changes when the
+// slot is freed, so a handle to a closed account never resolves to the
+// account that later reuses its slot.
+struct AccountHandle {
+    uint32_t slot = UINT32_MAX;
+    uint32_t generation = 0;
+};
+
+// Slot map: accounts live densely in one vector, reached through a slot
+// table that stays put while the dense entries move. Closing an account is
+// O(1): its slot goes on the free list and its dense entry becomes a
+// tombstone. Tombstones are compacted later, in small steps between
+// operations, by moving the last live account into the hole; until then
+// every BankAccount pointer handed out stays valid.
+class AccountStore {
+private:
+    static const uint32_t NONE = UINT32_MAX;
+
+    struct Slot {
+        uint32_t dense;         // Position in `dense`, or next free slot when unused
+        uint32_t generation;
+    };
+
+    vector<BankAccount> dense;
+    vector<uint32_t> denseSlot;     // Owning slot per dense entry, NONE for a tombstone
+    vector<Slot> slots;
+    vector<uint32_t> tombstones;    // Dense positions awaiting compaction
+    uint32_t freeHead = NONE;
+    size_t liveCount = 0;
+
+public:
+    AccountHandle insert(BankAccount account) {
+        uint32_t slot = freeHead;
+        if (slot != NONE) {
+            freeHead = slots[slot].dense;
+        } else {
+            slot = (uint32_t)slots.size();
+            slots.push_back({0, 0});
+        }
+        slots[slot].dense = (uint32_t)dense.size();
+        dense.push_back(std::move(account));
+        denseSlot.push_back(slot);
+        ++liveCount;
+        return {slot, slots[slot].generation};
+    }
+
+    BankAccount* get(AccountHandle handle) {
+        if (handle.slot >= slots.size() || slots[handle.slot].generation != handle.generation) return nullptr;
+        return &dense[slots[handle.slot].dense];
+    }
+
+    const BankAccount* get(AccountHandle handle) const {
+        return const_cast<AccountStore*>(this)->get(handle);
+    }
+
+    bool erase(AccountHandle handle) {
+        if (!get(handle)) return false;
+        Slot& slot = slots[handle.slot];
+        denseSlot[slot.dense] = NONE;
+        tombstones.push_back(slot.dense);
+        ++slot.generation;
+        slot.dense = freeHead;
+        freeHead = handle.slot;
+        --liveCount;
+        return true;
+    }
+
+    // Removes up to `maxMoves` tombstones; returns how many remain
+    size_t compact(size_t maxMoves) {
+        size_t moves = 0;
+        while (moves < maxMoves && !tombstones.empty()) {
+            uint32_t hole = tombstones.back();
+            tombstones.pop_back();
+            while (!denseSlot.empty() && denseSlot.back() == NONE) {
+                dense.pop_back();
+                denseSlot.pop_back();
+            }
+            if (hole >= dense.size() || denseSlot[hole] != NONE) continue; // Already trimmed or reused
+            dense[hole] = std::move(dense.back());
+            denseSlot[hole] = denseSlot.back();
+            slots[denseSlot[hole]].dense = hole;
+            dense.pop_back();
+            denseSlot.pop_back();
+            ++moves;
+        }
+        if (tombstones.empty()) {
+            while (!denseSlot.empty() && denseSlot.back() == NONE) {
+                dense.pop_back();
+                denseSlot.pop_back();
+            }
+        }
+        return tombstoneCount();
+    }
+
+    size_t tombstoneCount() const { return dense.size() - liveCount; }
+    size_t size() const { return liveCount; }
+    bool empty() const { return liveCount == 0; }
+
+    void reserve(size_t count) {
+        dense.reserve(count);
+        denseSlot.reserve(count);
+        slots.reserve(count);
+    }
+
+    // Visits live accounts in storage order; stop early by returning false
+    template <typename Fn>
+    void forEach(Fn fn) const {
+        for (size_t i = 0; i < dense.size(); ++i) {
+            if (denseSlot[i] != NONE && !fn(dense[i])) return;
+        }
+    }
+};
+
+// ================= Storage engine =================
+// Key-value storage behind the checkpoints, chosen with BMS_STORAGE. Keys
+// sort bytewise. A batch of writes is applied atomically and is durable
+// once write() returns.
+
+struct StorageWrite {
+    string key;
+    string value;
+    bool remove = false;
+};
+
+class StorageEngine {
+public:
+    virtual ~StorageEngine() {}
+    virtual bool write(const vector<StorageWrite>& batch) = 0;
+    virtual bool get(const string& key, string& value) = 0;
+    // Visits the live keys starting with `prefix` in order until fn returns false
+    virtual void scan(const string& prefix, const function<bool(const string&, const string&)>& fn) = 0;
+};
+
+// Embedded log-structured merge tree. Writes go to a write-ahead log and a
+// sorted memtable; a full memtable is written out as an immutable SSTable,
+// and a background thread merges the tables once LSM_COMPACTION_TRIGGER of
+// them have piled up. An SSTable is a run of checksummed data blocks, then
+// a block index (last key of each block), a Bloom filter over its keys and
+// a fixed footer. Index and filter stay in memory and data blocks are read
+// through an LRU cache, so a lookup reads at most one block from each table
+// whose filter does not rule the key out.
+const size_t LSM_MEMTABLE_BYTES = 8 << 20;     // Memtable size that triggers a flush
+const size_t LSM_BLOCK_BYTES = 4096;            // Target data block size
+const size_t LSM_CACHE_BYTES = 64 << 20;        // Block cache; override with BMS_LSM_CACHE_MB
+const size_t LSM_COMPACTION_TRIGGER = 4;        // Tables that start a background merge
+const size_t LSM_BLOOM_BITS_PER_KEY = 10;       // About 1% false positives
+const uint32_t HISTORY_CHUNK_LIMIT = 16;        // History keys per account before a checkpoint merges them
+const string LSM_MANIFEST_MAGIC = "BMSLSM1";
+const uint64_t LSM_TABLE_MAGIC = 0x31304c5453534d42ULL; // "BMSSTL01"
+
+inline void putFixed64(string& out, uint64_t value) {
+    for (int i = 0; i < 8; ++i) out.push_back((char)(value >> (8 * i)));
+}
+
+inline uint64_t getFixed64(const char* p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; --i) value = value << 8 | (unsigned char)p[i];
+    return value;
+}
+
+// Block entry: varint key length | key | kind (1 put, 0 delete) | varint value length | value
+inline void putTableEntry(string& block, const string& key, const string& value, bool removed) {
+    putVarint(block, key.size());
+    block += key;
+    block.push_back(removed ? 0 : 1);
+    putVarint(block, removed ? 0 : value.size());
+    if (!removed) block += value;
+}
+
+// Reads the entry at `pos` of a checksum-verified block
+inline void getTableEntry(const string& block, size_t& pos, string& key, string& value, bool& removed) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(block.data()) + pos;
+    size_t keyLength = (size_t)getVarint(p);
+    key.assign(reinterpret_cast<const char*>(p), keyLength);
+    p += keyLength;
+    removed = *p++ == 0;
+    size_t valueLength = (size_t)getVarint(p);
+    value.assign(reinterpret_cast<const char*>(p), valueLength);
+    p += valueLength;
+    pos = (size_t)(p - reinterpret_cast<const unsigned char*>(block.data()));
+}
+
+class BloomFilter {
+private:
+    string bits;
+    uint8_t probes = 1;
+
+public:
+    static uint32_t hashOf(const string& key) {
+        return crc32c(key);
+    }
+
+    void build(const vector<uint32_t>& hashes) {
+        size_t bitCount = max<size_t>(64, hashes.size() * LSM_BLOOM_BITS_PER_KEY);
+        bits.assign((bitCount + 7) / 8, '\0');
+        bitCount = bits.size() * 8;
+        probes = (uint8_t)max<size_t>(1, min<size_t>(30, LSM_BLOOM_BITS_PER_KEY * 69 / 100));
+        for (uint32_t h : hashes) {
+            uint32_t delta = h >> 17 | h << 15;
+            for (uint8_t i = 0; i < probes; ++i, h += delta) {
+                bits[(h % bitCount) / 8] |= (char)(1 << (h % bitCount % 8));
+            }
+        }
+    }
+
+    bool mayContain(uint32_t h) const {
+        if (bits.empty()) return true;
+        size_t bitCount = bits.size() * 8;
+        uint32_t delta = h >> 17 | h << 15;
+        for (uint8_t i = 0; i < probes; ++i, h += delta) {
+            if (!(bits[(h % bitCount) / 8] & (1 << (h % bitCount % 8)))) return false;
+        }
+        return true;
+    }
+
+    string encode() const {
+        return string(1, (char)probes) + bits;
+    }
+
+    bool decode(const string& data) {
+        if (data.empty()) return false;
+        probes = (uint8_t)data[0];
+        bits = data.substr(1);
+        return probes >= 1;
+    }
+};
+
+// Writes one SSTable from keys added in increasing order
+class TableBuilder {
+private:
+    ofstream out;
+    string path;
+    string block, index;
+    string lastKey;
+    uint64_t offset = 0;
+    vector<uint32_t> hashes;
+    size_t entries = 0;
+
+    void writeChunk(const string& data) {
+        string framed = data;
+        uint32_t crc = crc32c(data);
+        framed.append(reinterpret_cast<const char*>(&crc), sizeof(crc));
+        out.write(framed.data(), (streamsize)framed.size());
+        offset += framed.size();
+    }
+
+    void finishBlock() {
+        if (block.empty()) return;
+        putVarint(index, lastKey.size());
+        index += lastKey;
+        putVarint(index, offset);
+        putVarint(index, block.size());
+        writeChunk(block);
+        block.clear();
+    }
+
+public:
+    explicit TableBuilder(const string& tablePath) : out(tablePath, ios::binary | ios::trunc), path(tablePath) {}
+
+    void add(const string& key, const string& value, bool removed) {
+        putTableEntry(block, key, value, removed);
+        lastKey = key;
+        hashes.push_back(BloomFilter::hashOf(key));
+        ++entries;
+        if (block.size() >= LSM_BLOCK_BYTES) finishBlock();
+    }
+
+    size_t size() const {
+        return entries;
+    }
+
+    // Index, filter and footer; the file is synced before this returns
+    bool finish() {
+        finishBlock();
+        uint64_t indexOffset = offset;
+        writeChunk(index);
+        uint64_t filterOffset = offset;
+        BloomFilter filter;
+        filter.build(hashes);
+        string encodedFilter = filter.encode();
+        writeChunk(encodedFilter);
+        string footer;
+        putFixed64(footer, indexOffset);
+        putFixed64(footer, index.size());
+        putFixed64(footer, filterOffset);
+        putFixed64(footer, encodedFilter.size());
+        putFixed64(footer, LSM_TABLE_MAGIC);
+        out.write(footer.data(), (streamsize)footer.size());
+        out.close();
+        if (out.fail()) return false;
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY);
+        bool synced = fd >= 0 && fsync(fd) == 0;
+        if (fd >= 0) ::close(fd);
+        return synced;
+#else
+        return true;
+#endif
+    }
+};
+
+// Read side of one immutable SSTable. A table replaced by compaction is
+// deleted once the last reader lets go of it.
+class SSTable {
+private:
+    struct IndexEntry {
+        string lastKey;
+        uint64_t offset;
+        uint32_t size;
+    };
+    vector<IndexEntry> index;
+    BloomFilter filter;
+    mutable ifstream file;
+    mutable mutex fileMutex;
+
+    bool readChunk(uint64_t at, size_t size, string& data) const {
+        data.assign(size + sizeof(uint32_t), '\0');
+        lock_guard<mutex> lock(fileMutex);
+        file.clear();
+        file.seekg((streamoff)at);
+        if (!file.read(&data[0], (streamsize)data.size())) return false;
+        uint32_t crc;
+        memcpy(&crc, data.data() + size, sizeof(crc));
+        data.resize(size);
+        return crc32c(data) == crc;
+    }
+
+public:
+    const uint64_t number;
+    const string path;
+    atomic<bool> obsolete{false};
+
+    SSTable(uint64_t tableNumber, const string& tablePath) : number(tableNumber), path(tablePath) {}
+
+    ~SSTable() {
+        if (file.is_open()) file.close();
+        if (obsolete) remove(path.c_str());
+    }
+
+    bool open() {
+        file.open(path, ios::binary);
+        if (!file) return false;
+        file.seekg(0, ios::end);
+        streamoff length = file.tellg();
+        char footer[40];
+        if (length < (streamoff)sizeof(footer)) return false;
+        file.seekg(length - (streamoff)sizeof(footer));
+        if (!file.read(footer, sizeof(footer)) || getFixed64(footer + 32) != LSM_TABLE_MAGIC) return false;
+        string encodedIndex, encodedFilter;
+        if (!readChunk(getFixed64(footer), (size_t)getFixed64(footer + 8), encodedIndex) ||
+            !readChunk(getFixed64(footer + 16), (size_t)getFixed64(footer + 24), encodedFilter) ||
+            !filter.decode(encodedFilter)) {
+            return false;
+        }
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(encodedIndex.data());
+        const unsigned char* end = p + encodedIndex.size();
+        while (p < end) {
+            IndexEntry entry;
+            size_t keyLength = (size_t)getVarint(p);
+            entry.lastKey.assign(reinterpret_cast<const char*>(p), keyLength);
+            p += keyLength;
+            entry.offset = getVarint(p);
+            entry.size = (uint32_t)getVarint(p);
+            index.push_back(move(entry));
+        }
+        return true;
+    }
+
+    size_t blockCount() const {
+        return index.size();
+    }
+
+    bool mayContain(uint32_t hash) const {
+        return filter.mayContain(hash);
+    }
+
+    // First block whose keys may include `key` or later ones
+    size_t findBlock(const string& key) const {
+        return (size_t)(lower_bound(index.begin(), index.end(), key,
+                                    [](const IndexEntry& entry, const string& k) { return entry.lastKey < k; }) -
+                        index.begin());
+    }
+
+    bool readBlock(size_t block, string& data) const {
+        return readChunk(index[block].offset, index[block].size, data);
+    }
+};
+
+// LRU cache of data blocks shared by every table of an engine
+class BlockCache {
+private:
+    typedef pair<uint64_t, shared_ptr<const string>> Entry;
+    size_t capacity;
+    size_t used = 0;
+    list<Entry> lru;                                // Most recently used first
+    unordered_map<uint64_t, list<Entry>::iterator> entries;
+    mutex cacheMutex;
+
+public:
+    atomic<uint64_t> hits{0}, misses{0};
+
+    explicit BlockCache(size_t bytes) : capacity(bytes) {}
+
+    static uint64_t keyOf(const SSTable& table, size_t block) {
+        return table.number << 32 | (uint64_t)block;
+    }
+
+    // A cached block, or the block read from disk (null if it is damaged)
+    shared_ptr<const string> fetch(const SSTable& table, size_t block) {
+        uint64_t key = keyOf(table, block);
+        {
+            lock_guard<mutex> lock(cacheMutex);
+            auto it = entries.find(key);
+            if (it != entries.end()) {
+                lru.splice(lru.begin(), lru, it->second);
+                ++hits;
+                return it->second->second;
+            }
+        }
+        ++misses;
+        auto data = make_shared<string>();
+        if (!table.readBlock(block, *data)) return nullptr;
+        lock_guard<mutex> lock(cacheMutex);
+        if (entries.count(key)) return data;
+        lru.emplace_front(key, data);
+        entries[key] = lru.begin();
+        used += data->size();
+        while (used > capacity && lru.size() > 1) {
+            used -= lru.back().second->size();
+            entries.erase(lru.back().first);
+            lru.pop_back();
+        }
+        return data;
+    }
+};
+
+// Walks one table in key order
+class TableIterator {
+private:
+    shared_ptr<SSTable> table;
+    BlockCache* cache;              // Null: read around the cache (compaction)
+    size_t block = 0;
+    shared_ptr<const string> data;
+    size_t pos = 0;
+
+    bool load(size_t index) {
+        for (block = index; block < table->blockCount(); ++block) {
+            if (cache) {
+                data = cache->fetch(*table, block);
+            } else {
+                auto fresh = make_shared<string>();
+                data = table->readBlock(block, *fresh) ? fresh : nullptr;
+            }
+            if (!data) {
+                // Compaction must not write a table that silently lacks the block
+                damaged = true;
+                if (!cache) return false;
+                cerr << "Warning: damaged block " << block << " in " << table->path << " was skipped." << endl;
+                continue;
+            }
+            pos = 0;
+            if (!data->empty()) return true;
+        }
+        return false;
+    }
+
+public:
+    string key, value;
+    bool removed = false;
+    bool valid = false;
+    bool damaged = false;           // A block failed its checksum
+
+    TableIterator(shared_ptr<SSTable> source, BlockCache* blockCache) : table(move(source)), cache(blockCache) {}
+
+    // Positions on the first key at or after `target`
+    void seek(const string& target) {
+        valid = load(table->findBlock(target));
+        while (valid) {
+            next();
+            if (!valid || key >= target) return;
+        }
+    }
+
+    void next() {
+        if (pos >= data->size() && !load(block + 1)) {
+            valid = false;
+            return;
+        }
+        getTableEntry(*data, pos, key, value, removed);
+        valid = true;
+    }
+};
+
+struct MemValue {
+    string value;
+    bool removed = false;
+};
+
+// Merges the memtable (if any) and tables, newest first: each key comes out
+// once, with the value of the newest source holding it
+class MergingIterator {
+private:
+    const map<string, MemValue>* memtable;
+    map<string, MemValue>::const_iterator memIt;
+    vector<TableIterator> tables;
+
+public:
+    string key, value;
+    bool removed = false;
+    bool valid = false;
+
+    MergingIterator(const map<string, MemValue>* mem, const vector<shared_ptr<SSTable>>& sources,
+                    BlockCache* cache)
+        : memtable(mem) {
+        for (const auto& table : sources) tables.emplace_back(table, cache);
+    }
+
+    bool damaged() const {
+        return any_of(tables.begin(), tables.end(), [](const TableIterator& table) { return table.damaged; });
+    }
+
+    void seek(const string& target) {
+        if (memtable) memIt = memtable->lower_bound(target);
+        for (auto& table : tables) table.seek(target);
+        next();
+    }
+
+    void next() {
+        const string* best = nullptr;
+        if (memtable && memIt != memtable->end()) {
+            best = &memIt->first;
+            value = memIt->second.value;
+            removed = memIt->second.removed;
+        }
+        for (auto& table : tables) {
+            if (table.valid && (!best || table.key < *best)) {
+                best = &table.key;
+                value = table.value;
+                removed = table.removed;
+            }
+        }
+        valid = best != nullptr;
+        if (!valid) return;
+        key = *best;
+        if (memtable && memIt != memtable->end() && memIt->first == key) ++memIt;
+        for (auto& table : tables) {
+            if (table.valid && table.key == key) table.next();
+        }
+    }
+};
+
+class LsmEngine : public StorageEngine {
+private:
+    string dir;
+    map<string, MemValue> memtable;
+    size_t memtableBytes = 0;
+    vector<shared_ptr<SSTable>> tables;     // Newest first
+    uint64_t nextTable = 1;
+    uint64_t walSeq = 0;
+    mutex tablesMutex;                      // Guards tables, nextTable and the manifest
+    BlockCache cache;
+#ifndef _WIN32
+    int walFd = -1;
+#else
+    ofstream wal;
+#endif
+    thread compactor;
+    condition_variable compactorWake;
+    bool stopping = false;
+    atomic<uint64_t> compactions{0};
+
+    string walPath() const {
+        return dir + "/wal.log";
+    }
+
+    string tablePath(uint64_t number) const {
+        return dir + "/" + to_string(number) + ".sst";
+    }
+
+    // Caller holds tablesMutex
+    bool publishManifest() {
+        string contents = LSM_MANIFEST_MAGIC + " " + to_string(nextTable) + "\n";
+        for (const auto& table : tables) contents += to_string(table->number) + "\n";
+        return publishFileAtomically(dir + "/MANIFEST", contents);
+    }
+
+    bool openWal() {
+#ifndef _WIN32
+        walFd = ::open(walPath().c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        return walFd >= 0;
+#else
+        wal.open(walPath(), ios::binary | ios::app);
+        return (bool)wal;
+#endif
+    }
+
+    void closeWal() {
+#ifndef _WIN32
+        if (walFd >= 0) ::close(walFd);
+        walFd = -1;
+#else
+        if (wal.is_open()) wal.close();
+#endif
+    }
+
+    void applyToMemtable(const StorageWrite& write) {
+        auto it = memtable.find(write.key);
+        if (it == memtable.end()) {
+            memtableBytes += write.key.size() + sizeof(MemValue) + 32;
+            it = memtable.emplace(write.key, MemValue()).first;
+        }
+        memtableBytes += write.value.size();
+        memtableBytes -= min(memtableBytes, it->second.value.size());
+        it->second.value = write.remove ? string() : write.value;
+        it->second.removed = write.remove;
+    }
+
+    static string encodeBatch(const vector<StorageWrite>& batch) {
+        string payload;
+        putVarint(payload, batch.size());
+        for (const auto& write : batch) putTableEntry(payload, write.key, write.value, write.remove);
+        return payload;
+    }
+
+    // Replays the log into the memtable; a torn tail is cut off
+    bool recoverWal() {
+        ifstream in(walPath(), ios::binary);
+        streamoff validBytes = 0;
+        uint64_t seq;
+        string payload;
+        bool torn = false;
+        while (in && in.peek() != EOF) {
+            if (!readFramedRecord(in, "L", seq, payload)) {
+                torn = true;
+                break;
+            }
+            validBytes = in.tellg();
+            walSeq = seq;
+            const unsigned char* p = reinterpret_cast<const unsigned char*>(payload.data());
+            size_t count = (size_t)getVarint(p);
+            size_t pos = (size_t)(p - reinterpret_cast<const unsigned char*>(payload.data()));
+            StorageWrite write;
+            for (size_t i = 0; i < count; ++i) {
+                getTableEntry(payload, pos, write.key, write.value, write.remove);
+                applyToMemtable(write);
+            }
+        }
+        in.close();
+#ifndef _WIN32
+        if (torn && truncate(walPath().c_str(), (off_t)validBytes) != 0) return false;
+#else
+        (void)torn;
+#endif
+        return true;
+    }
+
+    // Writes the memtable out as the newest table and starts a fresh log
+    bool flushMemtable() {
+        TRACE_SPAN("lsm.flush");
+        uint64_t number;
+        {
+            lock_guard<mutex> lock(tablesMutex);
+            number = nextTable++;
+        }
+        TableBuilder builder(tablePath(number));
+        for (const auto& entry : memtable) builder.add(entry.first, entry.second.value, entry.second.removed);
+        auto table = make_shared<SSTable>(number, tablePath(number));
+        if (!builder.finish() || !table->open()) return false;
+        {
+            lock_guard<mutex> lock(tablesMutex);
+            tables.insert(tables.begin(), table);
+            if (!publishManifest()) {
+                tables.erase(tables.begin());
+                return false;
+            }
+        }
+        closeWal();
+        if (!publishFileAtomically(walPath(), "") || !openWal()) return false;
+        memtable.clear();
+        memtableBytes = 0;
+        compactorWake.notify_one();
+        return true;
+    }
+
+    // Background thread: merges every table into one when enough have
+    // piled up. The merged table is the oldest, so deletes can be dropped.
+    void runCompactor() {
+        unique_lock<mutex> lock(tablesMutex);
+        while (true) {
+            compactorWake.wait(lock, [&] { return stopping || tables.size() >= LSM_COMPACTION_TRIGGER; });
+            if (stopping) return;
+            vector<shared_ptr<SSTable>> inputs = tables;
+            uint64_t number = nextTable++;
+            lock.unlock();
+
+            MergingIterator merged(nullptr, inputs, nullptr);
+            TableBuilder builder(tablePath(number));
+            for (merged.seek(""); merged.valid; merged.next()) {
+                if (!merged.removed) builder.add(merged.key, merged.value, false);
+            }
+            auto table = make_shared<SSTable>(number, tablePath(number));
+            bool damaged = merged.damaged();
+            bool built = !damaged && builder.finish() && table->open();
+
+            lock.lock();
+            if (!built) {
+                if (damaged) {
+                    cerr << "Warning: storage compaction stopped at a damaged block; its tables are kept." << endl;
+                } else {
+                    cerr << "Warning: storage compaction failed; will retry after the next flush." << endl;
+                }
+                table->obsolete = true;
+                compactorWake.wait(lock, [&] { return stopping || tables.size() > inputs.size(); });
+                continue;
+            }
+            // Tables flushed meanwhile are newer and stay in front
+            tables.resize(tables.size() - inputs.size());
+            tables.push_back(table);
+            if (!publishManifest()) {
+                tables.pop_back();
+                tables.insert(tables.end(), inputs.begin(), inputs.end());
+                table->obsolete = true;
+                continue;
+            }
+            for (auto& input : inputs) input->obsolete = true;
+            ++compactions;
+        }
+    }
+
+public:
+    explicit LsmEngine(const string& directory, size_t cacheBytes = LSM_CACHE_BYTES)
+        : dir(directory), cache(cacheBytes) {}
+
+    ~LsmEngine() {
+        {
+            lock_guard<mutex> lock(tablesMutex);
+            stopping = true;
+        }
+        compactorWake.notify_all();
+        if (compactor.joinable()) compactor.join();
+        closeWal();
+    }
+
+    // Loads the manifest and tables, replays the log and starts compaction
+    bool open() {
+#ifndef _WIN32
+        mkdir(dir.c_str(), 0755);
+#else
+        _mkdir(dir.c_str());
+#endif
+        ifstream manifest(dir + "/MANIFEST");
+        string magic;
+        if (manifest >> magic) {
+            if (magic != LSM_MANIFEST_MAGIC || !(manifest >> nextTable)) return false;
+            uint64_t number;
+            while (manifest >> number) {
+                auto table = make_shared<SSTable>(number, tablePath(number));
+                if (!table->open()) {
+                    cerr << "Cannot open storage table " << tablePath(number) << endl;
+                    return false;
+                }
+                tables.push_back(table);
+            }
+        }
+        if (!recoverWal() || !openWal()) return false;
+        compactor = thread([this] { runCompactor(); });
+        return true;
+    }
+
+    bool write(const vector<StorageWrite>& batch) override {
+        TRACE_SPAN("lsm.write");
+        string record = frameRecord("L", ++walSeq, encodeBatch(batch));
+#ifndef _WIN32
+        if (walFd < 0 || !writeAll(walFd, record) || fdatasync(walFd) != 0) return false;
+#else
+        wal << record;
+        wal.flush();
+        if (!wal) return false;
+#endif
+        for (const auto& write : batch) applyToMemtable(write);
+        if (memtableBytes >= LSM_MEMTABLE_BYTES && !flushMemtable()) {
+            cerr << "Warning: could not flush the storage memtable; it stays in the log." << endl;
+        }
+        return true;
+    }
+
+    bool get(const string& key, string& value) override {
+        auto it = memtable.find(key);
+        if (it != memtable.end()) {
+            value = it->second.value;
+            return !it->second.removed;
+        }
+        vector<shared_ptr<SSTable>> sources;
+        {
+            lock_guard<mutex> lock(tablesMutex);
+            sources = tables;
+        }
+        uint32_t hash = BloomFilter::hashOf(key);
+        string found;
+        bool removed;
+        for (const auto& table : sources) {
+            if (!table->mayContain(hash)) continue;
+            size_t block = table->findBlock(key);
+            if (block >= table->blockCount()) continue;
+            shared_ptr<const string> data = cache.fetch(*table, block);
+            if (!data) continue;
+            for (size_t pos = 0; pos < data->size();) {
+                getTableEntry(*data, pos, found, value, removed);
+                if (found == key) return !removed;
+                if (found > key) break;
+            }
+        }
+        return false;
+    }
+
+    void scan(const string& prefix, const function<bool(const string&, const string&)>& fn) override {
+        vector<shared_ptr<SSTable>> sources;
+        {
+            lock_guard<mutex> lock(tablesMutex);
+            sources = tables;
+        }
+        MergingIterator it(&memtable, sources, &cache);
+        for (it.seek(prefix); it.valid && it.key.compare(0, prefix.size(), prefix) == 0; it.next()) {
+            if (!it.removed && !fn(it.key, it.value)) return;
+        }
+    }
+
+    // For the benchmark: tables on disk, merges done, block cache hit rate
+    string describe() {
+        lock_guard<mutex> lock(tablesMutex);
+        uint64_t hits = cache.hits, misses = cache.misses;
+        ostringstream out;
+        out << tables.size() << " table(s), " << compactions << " compaction(s), memtable "
+            << memtableBytes / 1024 << " KiB, block cache hit rate " << fixed << setprecision(1)
+            << (hits + misses ? 100.0 * hits / (hits + misses) : 0.0) << "%";
+        return out.str();
+    }
+};
+
+// ================= Aggregates =================
+// Live totals for the admin view, kept up to date on every balance change
+// so reading them never walks the accounts. Writers add to the shard owned
+// by their thread (one cache line per counter group, relaxed atomics), and a
+// snapshot sums the shards, so a reporting thread can read at any time.
+
+struct AggregateSnapshot {
+    int64_t heldMinor[MAX_PRODUCTS] = {};      // Deposits held per product, in paisa
+    int64_t accounts[MAX_PRODUCTS] = {};
+    int64_t belowMinimum = 0;
+    int64_t inflowMinor = 0;                   // Cash in today (deposits, opening deposits)
+    int64_t outflowMinor = 0;                  // Cash out today (withdrawals, fees, closures)
+    long day = 0;                              // Local date as YYYYMMDD
+};
+
+// Local calendar date of `when` as YYYYMMDD; caches the current day's bounds
+long localDay(time_t when) {
+    thread_local time_t dayStart = 1, dayEnd = 0;
+    thread_local long cachedDay = 0;
+    if (when < dayStart || when >= dayEnd) {
+        tm local;
+#ifdef _WIN32
+        localtime_s(&local, &when);
+#else
+        localtime_r(&when, &local);
+#endif
+        cachedDay = (local.tm_year + 1900) * 10000L + (local.tm_mon + 1) * 100L + local.tm_mday;
+        local.tm_hour = local.tm_min = local.tm_sec = 0;
+        local.tm_isdst = -1;
+        dayStart = mktime(&local);
+        local.tm_mday += 1;
+        dayEnd = mktime(&local);
+    }
+    return cachedDay;
+}
+
+class BankAggregates {
+private:
+    static const size_t SHARDS = 16;
+
+    struct alignas(64) Shard {
+        atomic<int64_t> heldMinor[MAX_PRODUCTS];
+        atomic<int64_t> accounts[MAX_PRODUCTS];
+        atomic<int64_t> belowMinimum{0};
+        atomic<long> day{0};
+        atomic<int64_t> inflowMinor{0};
+        atomic<int64_t> outflowMinor{0};
+
+        Shard() {
+            for (auto& v : heldMinor) v.store(0, memory_order_relaxed);
+            for (auto& v : accounts) v.store(0, memory_order_relaxed);
+        }
+    };
+
+    Shard shards[SHARDS];
+
+    Shard& local() {
+        static atomic<size_t> nextShard{0};
+        thread_local size_t shard = nextShard.fetch_add(1, memory_order_relaxed) % SHARDS;
+        return shards[shard];
+    }
+
+    static bool belowMinimum(uint8_t type, int64_t balanceMinor) {
+        return balanceMinor < toMinorUnits(productInfo(type).minBalance);
+    }
+
+    void addFlow(Shard& shard, time_t when, int64_t inMinor, int64_t outMinor) {
+        long day = localDay(when);
+        long shardDay = shard.day.load(memory_order_relaxed);
+        if (day < shardDay) return;        // Replayed from an earlier day
+        if (day > shardDay) {
+            shard.inflowMinor.store(0, memory_order_relaxed);
+            shard.outflowMinor.store(0, memory_order_relaxed);
+            shard.day.store(day, memory_order_relaxed);
+        }
+        shard.inflowMinor.fetch_add(inMinor, memory_order_relaxed);
+        shard.outflowMinor.fetch_add(outMinor, memory_order_relaxed);
+    }
+
+public:
+    void accountOpened(uint8_t type, double balance, time_t when, bool countInflow) {
+        Shard& shard = local();
+        int64_t minor = toMinorUnits(balance);
+        shard.heldMinor[type].fetch_add(minor, memory_order_relaxed);
+        shard.accounts[type].fetch_add(1, memory_order_relaxed);
+        if (belowMinimum(type, minor)) shard.belowMinimum.fetch_add(1, memory_order_relaxed);
+        if (countInflow) addFlow(shard, when, minor, 0);
+    }
+
+    void accountClosed(uint8_t type, double balance, time_t when) {
+        Shard& shard = local();
+        int64_t minor = toMinorUnits(balance);
+        shard.heldMinor[type].fetch_sub(minor, memory_order_relaxed);
+        shard.accounts[type].fetch_sub(1, memory_order_relaxed);
+        if (belowMinimum(type, minor)) shard.belowMinimum.fetch_sub(1, memory_order_relaxed);
+        addFlow(shard, when, 0, minor);
+    }
+
+    // `external` is false for transfers, which move money between accounts
+    // without it entering or leaving the bank
+    void balanceChanged(uint8_t type, double before, double after, time_t when, bool external = true) {
+        Shard& shard = local();
+        int64_t beforeMinor = toMinorUnits(before), afterMinor = toMinorUnits(after);
+        int64_t delta = afterMinor - beforeMinor;
+        shard.heldMinor[type].fetch_add(delta, memory_order_relaxed);
+        int64_t belowChange = (int64_t)belowMinimum(type, afterMinor) - (int64_t)belowMinimum(type, beforeMinor);
+        if (belowChange != 0) shard.belowMinimum.fetch_add(belowChange, memory_order_relaxed);
+        if (external) addFlow(shard, when, max<int64_t>(delta, 0), max<int64_t>(-delta, 0));
+    }
+
+    // Today's flows as saved with a checkpoint
+    void seedFlows(long day, int64_t inMinor, int64_t outMinor) {
+        if (day != localDay(time(0))) return;
+        addFlow(local(), time(0), inMinor, outMinor);
+    }
+
+    AggregateSnapshot snapshot() const {
+        AggregateSnapshot result;
+        result.day = localDay(time(0));
+        for (const auto& shard : shards) {
+            for (uint8_t type = 0; type < MAX_PRODUCTS; ++type) {
+                result.heldMinor[type] += shard.heldMinor[type].load(memory_order_relaxed);
+                result.accounts[type] += shard.accounts[type].load(memory_order_relaxed);
+            }
+            result.belowMinimum += shard.belowMinimum.load(memory_order_relaxed);
+            if (shard.day.load(memory_order_relaxed) == result.day) {
+                result.inflowMinor += shard.inflowMinor.load(memory_order_relaxed);
+                result.outflowMinor += shard.outflowMinor.load(memory_order_relaxed);
+            }
+        }
+        return result;
+    }
+};
+
+// Dashboard text for a snapshot, one line per product in use
+string renderAggregates(const AggregateSnapshot& stats) {
+    ostringstream out;
+    out << fixed << setprecision(2);
+    int64_t totalHeld = 0, totalAccounts = 0;
+    const ProductRegistry& products = ProductRegistry::instance();
+    for (uint8_t type = 0; type < products.size(); ++type) {
+        if (stats.accounts[type] == 0) continue;
+        out << left << setw(16) << products[type].name << right << setw(10) << stats.accounts[type]
+            << " accounts " << setw(18) << stats.heldMinor[type] / 100.0 << " BDT\n";
+        totalHeld += stats.heldMinor[type];
+        totalAccounts += stats.accounts[type];
+    }
+    out << left << setw(16) << "Total" << right << setw(10) << totalAccounts << " accounts " << setw(18)
+        << totalHeld / 100.0 << " BDT\n";
+    out << "Below minimum balance: " << stats.belowMinimum << "\n";
+    out << "Today (" << stats.day << "): inflow " << stats.inflowMinor / 100.0 << " BDT, outflow "
+        << stats.outflowMinor / 100.0 << " BDT\n";
+    return out.str();
+}
+
+// ================= General ledger =================
+// Double-entry view of every balance change. Each opening deposit,
+// deposit, withdrawal, fee, transfer and closing payout posts one entry
+// whose legs sum to zero: debits positive, credits negative, in paisa.
+// Customer accounts are what the bank owes, so their ledger balance is the
+// account balance negated; the other side is cash (LEDGER_CASH), fees
+// earned (LEDGER_FEE_INCOME) or, for cross-shard transfers awaiting the
+// coordinator, LEDGER_CLEARING.
+//
+// Entries are stored column by column and only ever appended. The balance
+// of each ledger account is a materialised view updated as entries post,
+// so validation is a sequential pass over a few flat arrays. A period runs
+// from one checkpoint to the next: once its entries are durable in the
+// checkpoint, closing the period carries the balances forward as the next
+// one's opening balances and empties the columns.
+
+enum LedgerAccount : uint32_t {
+    LEDGER_CASH = 0,
+    LEDGER_FEE_INCOME = 1,
+    LEDGER_CLEARING = 2,
+    LEDGER_INTERNAL_ACCOUNTS = 3  // Customer accounts follow
+};
+
+const char* const LEDGER_ACCOUNT_NAMES[LEDGER_INTERNAL_ACCOUNTS] = {"Cash", "Fee income", "Shard clearing"};
+
+enum LedgerEntryKind : uint8_t {
+    LEDGER_OPENED = 0,
+    LEDGER_DEPOSIT = 1,
+    LEDGER_WITHDRAWAL = 2,
+    LEDGER_FEE = 3,
+    LEDGER_TRANSFER = 4,
+    LEDGER_CLOSED = 5,
+    LEDGER_HELD = 6,      // Cross-shard leg prepared
+    LEDGER_RELEASED = 7   // Cross-shard leg decided
+};
+
+struct LedgerCheck {
+    size_t entries = 0;
+    size_t legs = 0;
+    size_t bytesScanned = 0;
+    size_t unbalancedEntries = 0;   // Legs not summing to zero
+    size_t viewMismatches = 0;      // Ledger balances that are not opening + postings
+    size_t accountMismatches = 0;   // Customer balances that disagree with the ledger
+    int64_t trialBalanceMinor = 0;  // Sum of every ledger balance: zero when the books balance
+    int64_t internalMinor[LEDGER_INTERNAL_ACCOUNTS] = {};
+    int64_t customersMinor = 0;     // Sum of the customer accounts' ledger balances
+    double seconds = 0.0;
+
+    bool clean() const {
+        return unbalancedEntries == 0 && viewMismatches == 0 && accountMismatches == 0 && trialBalanceMinor == 0;
+    }
+};
+
+class GeneralLedger {
+private:
+    // Entry columns; entry i owns legs [legStart[i], legStart[i + 1])
+    vector<int64_t> entryWhen;
+    vector<uint8_t> entryKind;
+    vector<uint32_t> legStart{0};
+    // Leg columns
+    vector<uint32_t> legAccount;
+    vector<int64_t> legAmount;
+    // Per ledger account: balance now, and when the period opened
+    vector<int64_t> balances;
+    vector<int64_t> opening;
+    unordered_map<uint64_t, uint32_t> customerAccounts; // Account id -> ledger account
+
+public:
+    GeneralLedger() : balances(LEDGER_INTERNAL_ACCOUNTS), opening(LEDGER_INTERNAL_ACCOUNTS) {}
+
+    uint32_t accountFor(uint64_t customerId) {
+        auto inserted = customerAccounts.emplace(customerId, (uint32_t)balances.size());
+        if (inserted.second) {
+            balances.push_back(0);
+            opening.push_back(0);
+        }
+        return inserted.first->second;
+    }
+
+    // A balance the period starts with, e.g. loaded from a checkpoint
+    void bringForward(uint32_t debitAccount, uint32_t creditAccount, int64_t amountMinor) {
+        opening[debitAccount] += amountMinor;
+        opening[creditAccount] -= amountMinor;
+        balances[debitAccount] += amountMinor;
+        balances[creditAccount] -= amountMinor;
+    }
+
+    void post(LedgerEntryKind kind, time_t when, uint32_t debitAccount, uint32_t creditAccount, int64_t amountMinor) {
+        if (amountMinor == 0) return;
+        entryWhen.push_back(when);
+        entryKind.push_back(kind);
+        legAccount.push_back(debitAccount);
+        legAmount.push_back(amountMinor);
+        legAccount.push_back(creditAccount);
+        legAmount.push_back(-amountMinor);
+        legStart.push_back((uint32_t)legAccount.size());
+        balances[debitAccount] += amountMinor;
+        balances[creditAccount] -= amountMinor;
+    }
+
+    int64_t balance(uint32_t account) const { return balances[account]; }
+    size_t entryCount() const { return entryKind.size(); }
+
+    // Bytes of the period's columns
+    size_t columnBytes() const {
+        return entryWhen.size() * sizeof(int64_t) + entryKind.size() + legStart.size() * sizeof(uint32_t) +
+               legAccount.size() * sizeof(uint32_t) + legAmount.size() * sizeof(int64_t);
+    }
+
+    // Re-adds every leg of the period to the opening balances, in parallel
+    // over ranges of entries, and compares the result with the view
+    LedgerCheck validate() const {
+        TRACE_SPAN("GeneralLedger::validate");
+        LedgerCheck check;
+        auto start = chrono::steady_clock::now();
+        check.entries = entryKind.size();
+        check.legs = legAccount.size();
+        check.bytesScanned = columnBytes();
+        vector<int64_t> posted(balances.size(), 0);
+        mutex merge;
+        parallelFor(check.entries, [&](size_t begin, size_t end) {
+            vector<int64_t> local(balances.size(), 0);
+            size_t unbalanced = 0;
+            for (size_t e = begin; e < end; ++e) {
+                int64_t sum = 0;
+                for (uint32_t l = legStart[e]; l < legStart[e + 1]; ++l) {
+                    sum += legAmount[l];
+                    local[legAccount[l]] += legAmount[l];
+                }
+                unbalanced += sum != 0;
+            }
+            lock_guard<mutex> guard(merge);
+            check.unbalancedEntries += unbalanced;
+            for (size_t a = 0; a < local.size(); ++a) posted[a] += local[a];
+        });
+        for (size_t a = 0; a < balances.size(); ++a) {
+            check.viewMismatches += opening[a] + posted[a] != balances[a];
+            check.trialBalanceMinor += balances[a];
+            if (a < LEDGER_INTERNAL_ACCOUNTS) {
+                check.internalMinor[a] = balances[a];
+            } else {
+                check.customersMinor += balances[a];
+            }
+        }
+        check.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return check;
+    }
+
+    void closePeriod() {
+        opening = balances;
+        entryWhen.clear();
+        entryKind.clear();
+        legStart.assign(1, 0);
+        legAccount.clear();
+        legAmount.clear();
+    }
+};
+
+// Trial balance and validation result, one line each
+string renderLedgerCheck(const LedgerCheck& check) {
+    ostringstream out;
+    out << fixed << setprecision(2);
+    auto line = [&](const string& name, int64_t minor) {
+        out << left << setw(18) << name << right << setw(18) << llabs(minor) / 100.0
+            << (minor > 0 ? " Dr" : minor < 0 ? " Cr" : "") << "\n";
+    };
+    for (uint32_t a = 0; a < LEDGER_INTERNAL_ACCOUNTS; ++a) line(LEDGER_ACCOUNT_NAMES[a], check.internalMinor[a]);
+    line("Customer deposits", check.customersMinor);
+    if (check.trialBalanceMinor == 0) {
+        out << "Trial balance agrees\n";
+    } else {
+        out << "Trial balance is off by " << check.trialBalanceMinor / 100.0 << " BDT\n";
+    }
+    out << "Period: " << check.entries << " entries, " << check.legs << " legs, validated in " << setprecision(3)
+        << check.seconds * 1000 << " ms\n";
+    out << "Unbalanced entries: " << check.unbalancedEntries << ", ledger balances off: " << check.viewMismatches
+        << ", accounts off: " << check.accountMismatches << "\n";
+    return out.str();
+}
+
+// ================= Velocity rules =================
+// Per-account velocity and spike checks on money leaving an account
+// (withdrawals and outgoing transfers). Rules are read from RULES_FILE and
+// each one is bound to a predicate function when loaded. An account's
+// sliding-window state fits in one cache line, so screening costs one hash
+// lookup plus a comparison per rule. Without a rules file the engine is off.
+
+const uint8_t VELOCITY_RING = 8;                            // Recent withdrawal times kept per account
+const int64_t VELOCITY_SEED_WINDOW = 7 * SECONDS_PER_DAY;   // History read when an account is first screened
+const uint16_t SPIKE_MIN_SAMPLES = 5;                       // Withdrawals before the spike rule applies
+const float SPIKE_WEIGHT = 0.1f;                            // Weight of the newest amount in the average
+
+// One slot of the open-addressing table below: a single cache line
+struct alignas(64) VelocityState {
+    uint64_t id = 0;                        // Owning account; 0 for a free slot
+    uint32_t recent[VELOCITY_RING] = {};    // Times of the latest withdrawals; `head` is the oldest
+    int64_t dayMinor = 0;                   // Withdrawn on `day`, in paisa
+    int32_t day = 0;                        // YYYYMMDD
+    float averageMinor = 0.0f;              // Rolling average withdrawal
+    uint16_t samples = 0;
+    uint8_t head = 0;
+};
+static_assert(sizeof(VelocityState) == 64, "VelocityState should fill exactly one cache line");
+
+enum class RuleAction : uint8_t { Allow, Flag, Block };
+
+// What a rule predicate sees: the account's state before this withdrawal
+struct VelocityCheck {
+    const VelocityState& state;
+    int64_t amountMinor;
+    time_t now;
+    int32_t day;
+};
+
+struct VelocityRule {
+    char name[32];
+    bool (*triggers)(const VelocityCheck& check, double limit);
+    double limit;
+    RuleAction action;
+    int productCode;        // -1 for every product
+};
+
+// More than `limit` withdrawals within an hour, counting this one: the
+// limit-th most recent earlier withdrawal is less than an hour old
+bool hourlyCountRule(const VelocityCheck& check, double limit) {
+    uint8_t back = (uint8_t)limit;
+    if (back == 0) return true;
+    uint32_t when = check.state.recent[(check.state.head + VELOCITY_RING - back) % VELOCITY_RING];
+    return when != 0 && check.now - (time_t)when < 3600;
+}
+
+bool dailyAmountRule(const VelocityCheck& check, double limit) {
+    int64_t today = check.state.day == check.day ? check.state.dayMinor : 0;
+    return (double)(today + check.amountMinor) > limit * 100.0;
+}
+
+bool singleAmountRule(const VelocityCheck& check, double limit) {
+    return (double)check.amountMinor > limit * 100.0;
+}
+
+bool spikeRule(const VelocityCheck& check, double limit) {
+    return check.state.samples >= SPIKE_MIN_SAMPLES && check.amountMinor > limit * check.state.averageMinor;
+}
+
+struct VelocityMetric {
+    const char* name;
+    bool (*triggers)(const VelocityCheck& check, double limit);
+};
+
+const VelocityMetric VELOCITY_METRICS[] = {
+    {"hourly_count", &hourlyCountRule},
+    {"daily_amount", &dailyAmountRule},
+    {"single_amount", &singleAmountRule},
+    {"spike_ratio", &spikeRule}
+};
+
+struct RuleVerdict {
+    RuleAction action = RuleAction::Allow;
+    const VelocityRule* rule = nullptr;
+};
+
+// Withdrawals a batch has accepted but not yet journaled, noted on copies
+// of the accounts' windows so later operations in the batch see them
+struct VelocityPending {
+    unordered_map<uint64_t, VelocityState> states;
+};
+
+class VelocityRules {
+private:
+    vector<VelocityRule> rules;
+    vector<VelocityState> slots;    // Linear probing on the account id, at most half full
+    size_t used = 0;
+    ofstream alertLog;
+    uint64_t flagged = 0, blocked = 0;
+
+    static void note(VelocityState& state, int64_t amountMinor, time_t when) {
+        state.recent[state.head] = (uint32_t)when;
+        state.head = (uint8_t)((state.head + 1) % VELOCITY_RING);
+        int32_t day = (int32_t)localDay(when);
+        if (state.day != day) {
+            state.day = day;
+            state.dayMinor = 0;
+        }
+        state.dayMinor += amountMinor;
+        state.averageMinor = state.samples == 0
+                                 ? (float)amountMinor
+                                 : state.averageMinor + SPIKE_WEIGHT * ((float)amountMinor - state.averageMinor);
+        if (state.samples < UINT16_MAX) ++state.samples;
+    }
+
+    // Windows survive restarts by being rebuilt from the account's recent
+    // history the first time it is screened
+    VelocityState* find(uint64_t id) {
+        if (slots.empty()) return nullptr;
+        size_t mask = slots.size() - 1;
+        for (size_t i = (size_t)(id * 0x9E3779B97F4A7C15ULL >> 20) & mask; ; i = (i + 1) & mask) {
+            if (slots[i].id == id) return &slots[i];
+            if (slots[i].id == 0) return nullptr;
+        }
+    }
+
+    VelocityState& insert(uint64_t id) {
+        if ((used + 1) * 2 > slots.size()) {
+            vector<VelocityState> old(max<size_t>(1024, slots.size() * 2));
+            old.swap(slots);
+            used = 0;
+            for (const auto& state : old) {
+                if (state.id != 0) insert(state.id) = state;
+            }
+        }
+        size_t mask = slots.size() - 1;
+        size_t i = (size_t)(id * 0x9E3779B97F4A7C15ULL >> 20) & mask;
+        while (slots[i].id != 0) i = (i + 1) & mask;
+        slots[i].id = id;
+        ++used;
+        return slots[i];
+    }
+
+    VelocityState& start(const BankAccount& account, const CompressedHistory& history, time_t now) {
+        VelocityState& state = insert(account.getId());
+        int64_t before = 0;
+        history.replaySince(now - VELOCITY_SEED_WINDOW, before, [&](const HistoryEntry& entry) {
+            if (entry.op == HIST_WITHDRAWAL) note(state, -entry.amountMinor, entry.when);
+            return true;
+        });
+        return state;
+    }
+
+    VelocityState& stateFor(const BankAccount& account, time_t now) {
+        if (VelocityState* found = find(account.getId())) return *found;
+        return start(account, account.getHistory(), now);
+    }
+
+public:
+    bool tracks(uint64_t id) { return find(id) != nullptr; }
+
+    // Starts an account's windows from a history kept outside the account
+    void seed(const BankAccount& account, const CompressedHistory& history, time_t now) {
+        if (!find(account.getId())) start(account, history, now);
+    }
+
+    // Each line of RULES_FILE:
+    //   name|metric|limit|block or flag[|product]
+    // metric is hourly_count (withdrawals per hour, at most VELOCITY_RING),
+    // daily_amount (BDT per calendar day), single_amount (BDT) or
+    // spike_ratio (multiple of the account's rolling average withdrawal)
+    void load(const string& path = RULES_FILE) {
+        ifstream inFile(path);
+        string line;
+        while (getline(inFile, line)) {
+            if (line.empty() || line[0] == '#') continue;
+            if (!addRule(line)) cerr << "Warning: ignoring velocity rule: " << line << endl;
+        }
+    }
+
+    bool addRule(const string& line) {
+        vector<string> fields;
+        stringstream lineStream(line);
+        string field;
+        while (getline(lineStream, field, '|')) fields.push_back(field);
+        if (fields.size() < 4 || fields.size() > 5 || fields[0].empty()) return false;
+        VelocityRule rule = {};
+        snprintf(rule.name, sizeof(rule.name), "%s", fields[0].c_str());
+        for (const auto& metric : VELOCITY_METRICS) {
+            if (fields[1] == metric.name) rule.triggers = metric.triggers;
+        }
+        char* end = nullptr;
+        rule.limit = strtod(fields[2].c_str(), &end);
+        if (!rule.triggers || end == fields[2].c_str() || rule.limit < 0) return false;
+        if (rule.triggers == &hourlyCountRule && rule.limit > VELOCITY_RING) return false;
+        if (fields[3] == "block") rule.action = RuleAction::Block;
+        else if (fields[3] == "flag") rule.action = RuleAction::Flag;
+        else return false;
+        rule.productCode = fields.size() == 5 ? ProductRegistry::instance().findCode(fields[4]) : -1;
+        if (fields.size() == 5 && rule.productCode < 0) return false;
+        rules.push_back(rule);
+        return true;
+    }
+
+    bool enabled() const { return !rules.empty(); }
+
+    // The strongest action any rule asks for; changes no state. With
+    // `pending`, the account's window includes what the batch holds.
+    RuleVerdict screen(const BankAccount& account, int64_t amountMinor, time_t now,
+                       VelocityPending* pending = nullptr) {
+        RuleVerdict verdict;
+        if (rules.empty()) return verdict;
+        const VelocityState& state =
+            pending ? pending->states.try_emplace(account.getId(), stateFor(account, now)).first->second
+                    : stateFor(account, now);
+        VelocityCheck check{state, amountMinor, now, (int32_t)localDay(now)};
+        for (const auto& rule : rules) {
+            if (rule.action <= verdict.action) continue;
+            if (rule.productCode >= 0 && rule.productCode != account.getTypeCode()) continue;
+            if (!rule.triggers(check, rule.limit)) continue;
+            verdict.action = rule.action;
+            verdict.rule = &rule;
+            if (verdict.action == RuleAction::Block) break;
+        }
+        return verdict;
+    }
+
+    // Counts a withdrawal that was screened and went ahead
+    void record(const BankAccount& account, int64_t amountMinor, time_t now) {
+        if (VelocityState* state = find(account.getId())) note(*state, amountMinor, now);
+    }
+
+    // Counts a screened withdrawal in the batch's copy only; record() it
+    // once the batch is durable
+    void hold(const BankAccount& account, int64_t amountMinor, time_t now, VelocityPending& pending) {
+        auto it = pending.states.find(account.getId());
+        if (it != pending.states.end()) note(it->second, amountMinor, now);
+    }
+
+    void alert(const RuleVerdict& verdict, const string& accNum, double amount, time_t now) {
+        bool block = verdict.action == RuleAction::Block;
+        ++(block ? blocked : flagged);
+        if (!alertLog.is_open()) alertLog.open(ALERT_LOG, ios::app);
+        alertLog << formatCtime(now) << " - " << (block ? "BLOCK " : "FLAG ") << verdict.rule->name << " " << accNum
+                 << " " << fixed << setprecision(2) << amount << " BDT" << endl;
+    }
+
+    uint64_t flaggedCount() const { return flagged; }
+    uint64_t blockedCount() const { return blocked; }
+};
+
+// ================= Batched operations =================
+
+enum class BatchOpType { Deposit, Withdraw, Transfer, Balance };
+
+struct BatchOperation {
+    BatchOpType type = BatchOpType::Balance;
+    string account;         // Source for transfers
+    string target;          // Transfers only
+    double amount = 0.0;
+    string password;        // Withdrawals and transfers
+    bool preauthorized = false; // Standing orders: the password was checked when scheduled
+};
+
+struct BatchResult {
+    TxStatus status = TxStatus::NotFound;
+    double balance = 0.0;   // Of `account` once the operation has run
+};
+
+// Parses one batch line, in the daemon protocol's words:
+//   DEPOSIT <account> <amount>
+//   WITHDRAW <account> <amount> <password>
+//   TRANSFER <from> <to> <amount> <password>
+//   BALANCE <account>
+bool parseBatchLine(const string& line, BatchOperation& op) {
+    istringstream in(line);
+    string verb;
+    in >> verb;
+    if (verb == "DEPOSIT") {
+        op.type = BatchOpType::Deposit;
+        return (bool)(in >> op.account >> op.amount);
+    }
+    if (verb == "WITHDRAW") {
+        op.type = BatchOpType::Withdraw;
+        return (bool)(in >> op.account >> op.amount >> op.password);
+    }
+    if (verb == "TRANSFER") {
+        op.type = BatchOpType::Transfer;
+        return (bool)(in >> op.account >> op.target >> op.amount >> op.password);
+    }
+    if (verb == "BALANCE") {
+        op.type = BatchOpType::Balance;
+        return (bool)(in >> op.account);
+    }
+    return false;
+}
+
+// ================= Cross-shard transfer legs =================
+// One shard's half of a transfer between shards, prepared and waiting for
+// the coordinator's decision: 'D' debits the source, 'C' credits the target.
+// Written as "<transfer id> <D|C> <account> <amount>".
+struct PreparedLeg {
+    string id;
+    char side = 'D';
+    string account;
+    double amount = 0.0;
+};
+
+string formatLeg(const PreparedLeg& leg) {
+    return leg.id + " " + leg.side + " " + leg.account + " " + formatAmount(leg.amount);
+}
+
+bool parseLeg(istream& in, PreparedLeg& leg) {
+    return (bool)(in >> leg.id >> leg.side >> leg.account >> leg.amount) && (leg.side == 'D' || leg.side == 'C');
+}
+
+// ================= Standing orders =================
+// Recurring transfers between accounts ("rent on the 1st"). Orders are
+// filed by due time in a hierarchical timing wheel: six levels of 64 slots
+// at 1 s resolution, level L covering 64^(L+1) seconds. Scheduling and
+// cancelling link or unlink one node. Advancing the clock moves a slot one
+// level down only when the wheel reaches that slot's start, and jumps over
+// empty slots and levels, so catching up after a long downtime costs a few
+// steps per pending order rather than one per elapsed second.
+
+const int WHEEL_LEVELS = 6;
+const int WHEEL_BITS = 6;
+const uint32_t WHEEL_SLOTS = 1u << WHEEL_BITS;
+const uint32_t NO_ORDER = UINT32_MAX;
+const size_t ORDER_BATCH_SIZE = 4096;   // Due orders executed per batch
+
+struct StandingOrder {
+    uint64_t id = 0;                // 0 marks a free pool entry
+    string from, to;
+    double amount = 0.0;
+    int64_t due = 0;                // Next execution, seconds since the epoch
+    int32_t remaining = -1;         // Executions left; -1 runs until cancelled
+    uint16_t every = 1;
+    char unit = 'm';                // 'd' for days, 'm' for months
+    uint8_t anchorDay = 1;          // Monthly orders keep this day, clamped to short months
+    uint32_t prev = NO_ORDER, next = NO_ORDER;
+    uint8_t level = 0, slot = 0;    // Wheel bucket holding the order
+};
+
+// "7d" or "1m"
+bool parseOrderInterval(const string& text, uint16_t& every, char& unit) {
+    char* end = nullptr;
+    long count = strtol(text.c_str(), &end, 10);
+    if (end == text.c_str() || count < 1 || count > 1000 || (*end != 'd' && *end != 'm') || end[1] != '\0') {
+        return false;
+    }
+    every = (uint16_t)count;
+    unit = *end;
+    return true;
+}
+
+// First execution: a bare date means the start of that day
+bool parseOrderStart(const string& text, time_t& when) {
+    return parseDateTime(text.find_first_of(" T") == string::npos ? text + " 00:00" : text, when);
+}
+
+// Journal and snapshot form:
+// "<id> <from> <to> <amount> <due> <every><unit> <anchor day> <remaining>"
+string formatOrder(const StandingOrder& order) {
+    return to_string(order.id) + " " + order.from + " " + order.to + " " + formatAmount(order.amount) + " " +
+           to_string(order.due) + " " + to_string(order.every) + order.unit + " " + to_string(order.anchorDay) +
+           " " + to_string(order.remaining);
+}
+
+bool parseOrder(istream& in, StandingOrder& order) {
+    string interval;
+    int anchor = 0;
+    long long due = 0;
+    if (!(in >> order.id >> order.from >> order.to >> order.amount >> due >> interval >> anchor >>
+          order.remaining)) {
+        return false;
+    }
+    order.due = due;
+    order.anchorDay = (uint8_t)anchor;
+    return order.id != 0 && anchor >= 1 && anchor <= 31 && parseOrderInterval(interval, order.every, order.unit);
+}
+
+// The execution after `order.due`, at the same local time of day. Most
+// orders share a handful of due times (midnight on the 1st, on Fridays),
+// so results are memoized per thread instead of going through the C
+// library's time zone code for every order.
+int64_t nextOccurrence(const StandingOrder& order) {
+    struct Memo {
+        int64_t due = -1;
+        uint32_t key = 0;
+        int64_t next = 0;
+    };
+    thread_local Memo memo[256];
+    uint32_t key = (uint32_t)order.every << 16 | (uint32_t)(uint8_t)order.unit << 8 | order.anchorDay;
+    Memo& entry = memo[((uint64_t)order.due * 0x9E3779B97F4A7C15ULL ^ key) >> 56];
+    if (entry.due == order.due && entry.key == key) return entry.next;
+
+    time_t due = (time_t)order.due;
+    tm local = {};
+#ifdef _WIN32
+    localtime_s(&local, &due);
+#else
+    localtime_r(&due, &local);
+#endif
+    if (order.unit == 'd') {
+        local.tm_mday += order.every;
+    } else {
+        local.tm_mon += order.every;
+        tm monthEnd = local;
+        monthEnd.tm_mon += 1;
+        monthEnd.tm_mday = 0;
+        monthEnd.tm_isdst = -1;
+        mktime(&monthEnd);
+        local.tm_mday = min<int>(order.anchorDay, monthEnd.tm_mday);
+    }
+    local.tm_isdst = -1;
+    entry.due = order.due;
+    entry.key = key;
+    entry.next = (int64_t)mktime(&local);
+    return entry.next;
+}
+
+class OrderScheduler {
+private:
+    vector<StandingOrder> orders;       // Pool; freed entries are reused
+    vector<uint32_t> freeEntries;
+    unordered_map<uint64_t, uint32_t> byId;
+    // Level WHEEL_LEVELS has a single list: orders already due
+    uint32_t heads[WHEEL_LEVELS + 1][WHEEL_SLOTS];
+    uint64_t occupied[WHEEL_LEVELS] = {};
+    int64_t now;
+    uint64_t nextId = 1;
+
+    static int shiftOf(int level) {
+        return WHEEL_BITS * level;
+    }
+
+    // Files an order in the lowest level whose span, aligned like the
+    // clock, still contains its due time
+    void link(uint32_t index) {
+        StandingOrder& order = orders[index];
+        int level = WHEEL_LEVELS;
+        uint32_t slot = 0;
+        if (order.due > now) {
+            level = 0;
+            while (level < WHEEL_LEVELS - 1 && (order.due >> shiftOf(level + 1)) != (now >> shiftOf(level + 1))) {
+                ++level;
+            }
+            slot = (uint32_t)(order.due >> shiftOf(level)) & (WHEEL_SLOTS - 1);
+            occupied[level] |= 1ULL << slot;
+        }
+        order.level = (uint8_t)level;
+        order.slot = (uint8_t)slot;
+        order.prev = NO_ORDER;
+        order.next = heads[level][slot];
+        if (order.next != NO_ORDER) orders[order.next].prev = index;
+        heads[level][slot] = index;
+    }
+
+    void unlink(uint32_t index) {
+        StandingOrder& order = orders[index];
+        if (order.prev != NO_ORDER) {
+            orders[order.prev].next = order.next;
+        } else {
+            heads[order.level][order.slot] = order.next;
+            if (order.next == NO_ORDER && order.level < WHEEL_LEVELS) occupied[order.level] &= ~(1ULL << order.slot);
+        }
+        if (order.next != NO_ORDER) orders[order.next].prev = order.prev;
+    }
+
+    // Re-files every order of a slot the clock has just reached
+    void cascade(int level, uint32_t slot) {
+        uint32_t index = heads[level][slot];
+        heads[level][slot] = NO_ORDER;
+        occupied[level] &= ~(1ULL << slot);
+        while (index != NO_ORDER) {
+            uint32_t next = orders[index].next;
+            link(index);
+            index = next;
+        }
+    }
+
+    // Moves the clock forward to `until`, stopping only where a slot has
+    // orders: the next occupied level-0 slot, otherwise the start of the
+    // next slot of the lowest non-empty level
+    void advance(int64_t until) {
+        while (now < until) {
+            int lowest = 0;
+            while (lowest < WHEEL_LEVELS && occupied[lowest] == 0) ++lowest;
+            if (lowest == WHEEL_LEVELS) {
+                now = until;
+                return;
+            }
+            int64_t target;
+            uint32_t position = (uint32_t)now & (WHEEL_SLOTS - 1);
+            uint64_t ahead = position == WHEEL_SLOTS - 1 ? 0 : occupied[0] & (~0ULL << (position + 1));
+            if (lowest == 0 && ahead) {
+                target = (now & ~(int64_t)(WHEEL_SLOTS - 1)) + __builtin_ctzll(ahead);
+            } else {
+                int64_t span = 1LL << shiftOf(max(lowest, 1));
+                target = (now / span + 1) * span;
+            }
+            if (target > until) {
+                now = until;
+                return;
+            }
+            now = target;
+            for (int level = WHEEL_LEVELS - 1; level >= 1; --level) {
+                if (now & ((1LL << shiftOf(level)) - 1)) continue;
+                uint32_t slot = (uint32_t)(now >> shiftOf(level)) & (WHEEL_SLOTS - 1);
+                if (occupied[level] >> slot & 1) cascade(level, slot);
+            }
+            uint32_t slot = (uint32_t)now & (WHEEL_SLOTS - 1);
+            if (occupied[0] >> slot & 1) cascade(0, slot);
+        }
+    }
+
+public:
+    OrderScheduler() : now((int64_t)time(0)) {
+        for (auto& level : heads) fill(begin(level), end(level), NO_ORDER);
+    }
+
+    size_t size() const {
+        return byId.size();
+    }
+
+    uint64_t nextOrderId() const {
+        return nextId;
+    }
+
+    // New orders get ids from `first` on; a shard keeps its ids apart this way
+    void startIdsAt(uint64_t first) {
+        nextId = max(nextId, first);
+    }
+
+    // Files an order; one without an id gets the next free one
+    uint64_t add(StandingOrder order) {
+        if (order.id == 0) order.id = nextId;
+        nextId = max(nextId, order.id + 1);
+        uint32_t index;
+        if (!freeEntries.empty()) {
+            index = freeEntries.back();
+            freeEntries.pop_back();
+            orders[index] = order;
+        } else {
+            index = (uint32_t)orders.size();
+            orders.push_back(order);
+        }
+        byId[order.id] = index;
+        link(index);
+        return order.id;
+    }
+
+    const StandingOrder* find(uint64_t id) const {
+        auto it = byId.find(id);
+        return it == byId.end() ? nullptr : &orders[it->second];
+    }
+
+    bool cancel(uint64_t id) {
+        auto it = byId.find(id);
+        if (it == byId.end()) return false;
+        unlink(it->second);
+        orders[it->second] = StandingOrder();
+        freeEntries.push_back(it->second);
+        byId.erase(it);
+        return true;
+    }
+
+    // Moves an order to its next execution; none left cancels it
+    bool reschedule(uint64_t id, int64_t due, int32_t remaining) {
+        if (remaining == 0) return cancel(id);
+        auto it = byId.find(id);
+        if (it == byId.end()) return false;
+        unlink(it->second);
+        orders[it->second].due = due;
+        orders[it->second].remaining = remaining;
+        link(it->second);
+        return true;
+    }
+
+    // Advances the clock and copies up to `limit` orders that are due into
+    // `due`. They stay due until rescheduled or cancelled, so a batch that
+    // fails to execute is simply picked up again.
+    void takeDue(int64_t until, size_t limit, vector<StandingOrder>& due) {
+        advance(until);
+        due.clear();
+        for (uint32_t index = heads[WHEEL_LEVELS][0]; index != NO_ORDER && due.size() < limit;
+             index = orders[index].next) {
+            due.push_back(orders[index]);
+        }
+    }
+
+    template<typename Fn>
+    void forEach(Fn fn) const {
+        for (const auto& entry : byId) fn(orders[entry.second]);
+    }
+};
+
+// ================= Paged listing =================
+// Keyset pagination over sorted views of the accounts: a page resumes
+// strictly after the last key it returned, so a cursor stays valid while
+// accounts are opened, closed or change balance between pages.
+
+enum class ListOrder { Number, Name, Balance };
+
+struct ListQuery {
+    ListOrder order = ListOrder::Number;
+    size_t pageSize = 50;
+    string cursor;                  // From the previous page; empty for the first
+    int typeCode = -1;              // Only this product, -1 for all
+    double minBalance = -numeric_limits<double>::infinity();
+    double maxBalance = numeric_limits<double>::infinity();
+};
+
+struct ListPage {
+    vector<const BankAccount*> accounts;    // Valid until the next change to the bank
+    string nextCursor;                      // Empty once the listing is exhausted
+};
+
+// Resume position decoded from a cursor token
+struct ListCursor {
+    uint64_t id = 0;
+    int64_t balanceMinor = 0;
+    string name;
+};
+
+bool parseListOrder(const string& word, ListOrder& order) {
+    if (word == "number") order = ListOrder::Number;
+    else if (word == "name") order = ListOrder::Name;
+    else if (word == "balance") order = ListOrder::Balance;
+    else return false;
+    return true;
+}
+
+// Cursor tokens: N<id>, A<id>:<holder name in hex>, B<balance in paisa>:<id>
+string encodeListCursor(ListOrder order, const BankAccount& last) {
+    switch (order) {
+    case ListOrder::Number:
+        return "N" + to_string(last.getId());
+    case ListOrder::Name: {
+        static const char digits[] = "0123456789abcdef";
+        string token = "A" + to_string(last.getId()) + ":";
+        for (unsigned char c : last.getAccountHolderName()) {
+            token += digits[c >> 4];
+            token += digits[c & 15];
+        }
+        return token;
+    }
+    case ListOrder::Balance:
+        return "B" + to_string(toMinorUnits(last.getBalance())) + ":" + to_string(last.getId());
+    }
+    return "";
+}
+
+bool decodeListCursor(ListOrder order, const string& token, ListCursor& cursor) {
+    const char tag = order == ListOrder::Number ? 'N' : order == ListOrder::Name ? 'A' : 'B';
+    if (token.size() < 2 || token[0] != tag) return false;
+    const char* p = token.c_str() + 1;
+    char* end = nullptr;
+    if (order == ListOrder::Balance) {
+        cursor.balanceMinor = strtoll(p, &end, 10);
+        if (end == p || *end != ':') return false;
+        p = end + 1;
+    }
+    cursor.id = strtoull(p, &end, 10);
+    if (end == p) return false;
+    if (order != ListOrder::Name) return *end == '\0';
+    if (*end++ != ':') return false;
+    auto nibble = [](char c) {
+        return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+    };
+    cursor.name.clear();
+    for (; end[0] && end[1]; end += 2) {
+        int hi = nibble(end[0]), lo = nibble(end[1]);
+        if (hi < 0 || lo < 0) return false;
+        cursor.name += (char)(hi << 4 | lo);
+    }
+    return *end == '\0';
+}
+
+// Appends one admin listing line, newline included
+void appendAccountLine(string& out, const BankAccount& account) {
+    char balance[32];
+    snprintf(balance, sizeof(balance), "%.2f", account.getBalance());
+    out += "Account Number: ";
+    out += account.getAccountNumber();
+    out += " | Holder: ";
+    out += account.getAccountHolderName();
+    out += " | Type: ";
+    out += account.getAccountType();
+    out += " | Balance: ";
+    out += balance;
+    out += " BDT\n";
+}
+
+// ================= Point-in-time balances =================
+// "What was the balance at T" is answered from each account's history: the
+// closing-balance checkpoints kept by CompressedHistory bound the replay to
+// the entries since the nearest one. Closed accounts are no longer held, so
+// they do not appear.
+
+struct AsOfBalance {
+    const BankAccount* account;
+    int64_t balanceMinor = 0;
+    bool existed = false;       // Opened at or before the requested time
+};
+
+// Report for balancesAsOf(), built in one buffer
+string renderAsOfReport(const vector<AsOfBalance>& rows, time_t when) {
+    string out = "=== Balances as of " + formatCtime(when) + " ===\n";
+    int64_t heldMinor[MAX_PRODUCTS] = {};
+    size_t held[MAX_PRODUCTS] = {};
+    char line[256];
+    for (const auto& row : rows) {
+        if (!row.existed) continue;
+        uint8_t type = row.account->getTypeCode();
+        heldMinor[type] += row.balanceMinor;
+        ++held[type];
+        snprintf(line, sizeof(line), "%-12s %-30s %-10s %14.2f BDT\n", row.account->getAccountNumber().c_str(),
+                 row.account->getAccountHolderName().c_str(), row.account->getAccountType().c_str(),
+                 row.balanceMinor / 100.0);
+        out += line;
+    }
+    int64_t totalMinor = 0;
+    size_t total = 0;
+    out += "=== Totals ===\n";
+    for (size_t type = 0; type < MAX_PRODUCTS; ++type) {
+        if (held[type] == 0) continue;
+        snprintf(line, sizeof(line), "%-16s%10zu accounts %18.2f BDT\n", productInfo((uint8_t)type).name,
+                 held[type], heldMinor[type] / 100.0);
+        out += line;
+        totalMinor += heldMinor[type];
+        total += held[type];
+    }
+    snprintf(line, sizeof(line), "%-16s%10zu accounts %18.2f BDT\n", "Total", total, totalMinor / 100.0);
+    out += line;
+    return out;
+}
+
+// ================= Monthly statements =================
+// One statement per account for a calendar month: opening balance, every
+// entry in the period with its running balance, totals and the closing
+// balance. Accounts are rendered in parallel on a work-stealing pool and
+// each worker appends to its own buffered shard file, so workers never
+// share a writer.
+
+struct StatementPeriod {
+    time_t start = 0;       // First second of the month, local time
+    time_t end = 0;         // First second of the next month
+    string label;           // "YYYY-MM"
+};
+
+bool parseStatementMonth(const string& text, StatementPeriod& period) {
+    tm parts = {};
+    int consumed = 0;
+    if (sscanf(text.c_str(), "%d-%d%n", &parts.tm_year, &parts.tm_mon, &consumed) != 2 ||
+        consumed != (int)text.size() || parts.tm_mon < 1 || parts.tm_mon > 12) {
+        return false;
+    }
+    parts.tm_year -= 1900;
+    parts.tm_mon -= 1;
+    parts.tm_mday = 1;
+    parts.tm_isdst = -1;
+    tm next = parts;
+    period.start = mktime(&parts);
+    next.tm_mon += 1;
+    period.end = mktime(&next);
+    period.label = text;
+    return period.start != (time_t)-1 && period.end != (time_t)-1;
+}
+
+// Appends "YYYY-MM-DD HH:MM:SS" in local time. The date and the start of
+// the day are cached per thread, so most entries cost no libc time
+// conversion.
+void appendLocalTime(string& out, time_t when) {
+    thread_local time_t dayStart = 1, dayEnd = 0;
+    thread_local char date[16];
+    if (when < dayStart || when >= dayEnd) {
+        tm local;
+#ifdef _WIN32
+        localtime_s(&local, &when);
+#else
+        localtime_r(&when, &local);
+#endif
+        snprintf(date, sizeof(date), "%04u-%02u-%02u", (unsigned)(local.tm_year + 1900) % 10000,
+                 (unsigned)(local.tm_mon + 1) % 100, (unsigned)local.tm_mday % 100);
+        long secondsIntoDay = local.tm_hour * 3600L + local.tm_min * 60L + local.tm_sec;
+        local.tm_hour = local.tm_min = local.tm_sec = 0;
+        local.tm_isdst = -1;
+        dayStart = mktime(&local);
+        local.tm_mday += 1;
+        dayEnd = mktime(&local);
+        if (dayEnd - dayStart != SECONDS_PER_DAY) {
+            // Clock change today: no shortcut, and the wall time comes from libc
+            dayStart = when - secondsIntoDay;
+            dayEnd = dayStart;
+            when = dayStart + secondsIntoDay;
+        }
+    }
+    unsigned seconds = (unsigned)(when - dayStart) % (unsigned)SECONDS_PER_DAY;
+    char clock[9] = {
+        (char)('0' + seconds / 36000), (char)('0' + seconds / 3600 % 10), ':',
+        (char)('0' + seconds / 600 % 6), (char)('0' + seconds / 60 % 10), ':',
+        (char)('0' + seconds % 60 / 10), (char)('0' + seconds % 10), '\0'
+    };
+    out.append(date, 10);
+    out += ' ';
+    out.append(clock, 8);
+}
+
+// Appends an amount in paisa as fixed point, right-aligned to `width`,
+// without a round trip through double and printf
+void appendAmount(string& out, int64_t minor, int width, bool plusSign = false) {
+    char digits[32];
+    int n = 0;
+    uint64_t value = minor < 0 ? 0 - (uint64_t)minor : (uint64_t)minor;
+    digits[n++] = (char)('0' + value % 10);
+    value /= 10;
+    digits[n++] = (char)('0' + value % 10);
+    value /= 10;
+    digits[n++] = '.';
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    if (minor < 0) digits[n++] = '-';
+    else if (plusSign) digits[n++] = '+';
+    if (width > n) out.append((size_t)(width - n), ' ');
+    while (n > 0) out += digits[--n];
+}
+
+const char* const STATEMENT_LABELS[] = {
+    "Account opened", "Deposit", "Withdrawal", "", "", "Withdrawal fee"
+};
+
+// Appends the statement of one account for `period`. False (and nothing
+// appended) if the account had not been opened by the end of the period.
+bool renderStatement(string& out, const BankAccount& account, const CompressedHistory& history,
+                     const StatementPeriod& period) {
+    int64_t opening = 0, balance = 0, creditsMinor = 0, debitsMinor = 0, feesMinor = 0;
+    size_t credits = 0, debits = 0;
+    bool started = false;
+
+    auto header = [&] {
+        out += "STATEMENT " + account.getAccountNumber() + " " + period.label + "\n";
+        out += "Holder: " + account.getAccountHolderName() + " | Type: " + account.getAccountType() + "\n";
+        out += "Address: " + account.getAddress() + "\n";
+        out += "Period: ";
+        appendLocalTime(out, period.start);
+        out.resize(out.size() - 9);
+        out += " to ";
+        appendLocalTime(out, period.end - 1);
+        out.resize(out.size() - 9);
+        out += "\nOpening balance: ";
+        appendAmount(out, opening, 0);
+        out += " BDT\n";
+        balance = opening;
+        started = true;
+    };
+
+    bool openedBefore = history.replaySince(period.start, opening, [&](const HistoryEntry& entry) {
+        if (entry.when >= period.end) return false;
+        if (!started) header();
+        out += "  ";
+        appendLocalTime(out, entry.when);
+        out += "  ";
+        if (entry.op == HIST_NOTE || entry.op == HIST_RAW_LINE || entry.op >= HISTORY_OP_COUNT) {
+            out += entry.text;
+            out += '\n';
+            return true;
+        }
+        balance += entry.amountMinor;
+        if (entry.op == HIST_FEE) {
+            feesMinor -= entry.amountMinor;
+        } else if (entry.amountMinor >= 0) {
+            creditsMinor += entry.amountMinor;
+            ++credits;
+        } else {
+            debitsMinor -= entry.amountMinor;
+            ++debits;
+        }
+        const char* label = STATEMENT_LABELS[entry.op];
+        size_t labelLength = strlen(label);
+        out.append(label, labelLength);
+        out.append(labelLength < 16 ? 16 - labelLength : 0, ' ');
+        appendAmount(out, entry.amountMinor, 15, true);
+        appendAmount(out, balance, 15);
+        out += '\n';
+        return true;
+    });
+    if (!started) {
+        if (!openedBefore) return false;
+        header();
+        out += "  No transactions in this period\n";
+    }
+    out += "Credits: " + to_string(credits) + " totalling ";
+    appendAmount(out, creditsMinor, 0);
+    out += " BDT | Debits: " + to_string(debits) + " totalling ";
+    appendAmount(out, debitsMinor, 0);
+    out += " BDT | Fees: ";
+    appendAmount(out, feesMinor, 0);
+    out += " BDT\nClosing balance: ";
+    appendAmount(out, balance, 0);
+    out += " BDT\n\n";
+    return true;
+}
+
+struct StatementReport {
+    size_t statements = 0;
+    size_t shards = 0;
+    uint64_t bytes = 0;
+    double seconds = 0.0;
+    bool ok = true;
+};
+
+const size_t STATEMENT_FLUSH_BYTES = 1 << 20;
+
+// Writes the statements of `accounts` to <prefix>-<worker>.txt, one shard
+// per worker, each buffered and written in 1 MiB blocks. `withHistory`
+// calls its second argument with the account's whole history.
+template <typename WithHistory>
+StatementReport writeStatements(const vector<const BankAccount*>& accounts, const StatementPeriod& period,
+                                const string& prefix, size_t workers, WithHistory withHistory) {
+    TRACE_SPAN("writeStatements");
+    struct alignas(64) Shard {
+        ofstream file;
+        string buffer;
+        size_t statements = 0;
+        uint64_t bytes = 0;
+    };
+    auto start = chrono::steady_clock::now();
+    workers = max<size_t>(1, min(workers, accounts.size()));
+    vector<Shard> shards(workers);
+    StatementReport report;
+    for (size_t w = 0; w < workers; ++w) {
+        shards[w].file.open(prefix + "-" + to_string(w) + ".txt", ios::binary | ios::trunc);
+        shards[w].buffer.reserve(STATEMENT_FLUSH_BYTES + 64 * 1024);
+        if (!shards[w].file) report.ok = false;
+    }
+    if (!report.ok) return report;
+
+    parallelForStealing(accounts.size(), workers, [&](size_t worker, size_t index) {
+        Shard& shard = shards[worker];
+        bool rendered = withHistory(*accounts[index], [&](const CompressedHistory& history) {
+            return renderStatement(shard.buffer, *accounts[index], history, period);
+        });
+        if (!rendered) return;
+        ++shard.statements;
+        if (shard.buffer.size() >= STATEMENT_FLUSH_BYTES) {
+            shard.file.write(shard.buffer.data(), (streamsize)shard.buffer.size());
+            shard.bytes += shard.buffer.size();
+            shard.buffer.clear();
+        }
+    });
+
+    for (auto& shard : shards) {
+        shard.file.write(shard.buffer.data(), (streamsize)shard.buffer.size());
+        shard.bytes += shard.buffer.size();
+        shard.file.close();
+        report.ok = report.ok && !shard.file.fail();
+        report.statements += shard.statements;
+        report.bytes += shard.bytes;
+    }
+    report.shards = workers;
+    report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return report;
+}
+
+// One standing order as listed to its customer:
+// "<id> <from> -> <to> <amount> BDT every <interval>, next <time>, <n> left"
+void appendOrderLine(string& out, const StandingOrder& order) {
+    out += to_string(order.id) + " " + order.from + " -> " + order.to + " ";
+    appendAmount(out, toMinorUnits(order.amount), 0);
+    out += " BDT every " + to_string(order.every) + order.unit + ", next ";
+    appendLocalTime(out, (time_t)order.due);
+    out += order.remaining < 0 ? string(", until cancelled") : ", " + to_string(order.remaining) + " left";
+    out += '\n';
+}
+
+// ================= End-of-day reconciliation =================
+// Every account's balance is recomputed twice and compared with the stored
+// one: from its own history, and from the operations in TRANSACTION_LOG.
+// The history side is summed here, in parallel over the accounts; the log
+// is tallied by runReconciliation().
+
+struct ReconciledAccount {
+    const BankAccount* account;
+    int64_t historyMinor = 0;   // Sum of every history entry
+    int64_t openingMinor = 0;   // Opening deposit recorded in the history
+    int64_t feesMinor = 0;      // Fees charged; the log does not show them
+    int64_t inDoubtMinor = 0;   // Prepared cross-shard debits, not logged until decided
+    bool legacyLines = false;   // History holds old lines whose amounts are unknown
+};
+
+// ================= Teller sessions =================
+// The interactive flows are coroutines that suspend whenever they need input
+// that has not arrived yet, so one thread multiplexes any number of teller
+// and ATM sessions. Reads follow cin's rules (tokens skip whitespace, numbers
+// stop at the first character that cannot continue them, getline and hidden
+// input run to the newline) so prompts and validation behave exactly as on
+// the console. Sessions share one formatting stream and keep only its flags;
+// an idle session is its frame, its TellerIO and nothing else.
+
+// Bytes currently held by session coroutine frames
+size_t tellerFrameBytes = 0;
+
+// Lazily started coroutine returning nothing. Awaiting one runs it and
+// resumes the awaiting coroutine when it finishes.
+class SessionTask {
+public:
+    struct promise_type {
+        coroutine_handle<> continuation;
+        exception_ptr error;
+
+        static void* operator new(size_t size) {
+            tellerFrameBytes += size;
+            return ::operator new(size);
+        }
+        static void operator delete(void* frame, size_t size) {
+            tellerFrameBytes -= size;
+            ::operator delete(frame);
+        }
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            coroutine_handle<> await_suspend(coroutine_handle<promise_type> done) noexcept {
+                coroutine_handle<> next = done.promise().continuation;
+                return next ? next : noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+
+        SessionTask get_return_object() {
+            return SessionTask(coroutine_handle<promise_type>::from_promise(*this));
+        }
+        suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { error = current_exception(); }
+    };
+
+    SessionTask() = default;
+    SessionTask(SessionTask&& other) noexcept : handle(exchange(other.handle, {})) {}
+    SessionTask& operator=(SessionTask&& other) noexcept {
+        if (this != &other) {
+            if (handle) handle.destroy();
+            handle = exchange(other.handle, {});
+        }
+        return *this;
+    }
+    ~SessionTask() {
+        if (handle) handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    coroutine_handle<> await_suspend(coroutine_handle<> caller) noexcept {
+        handle.promise().continuation = caller;
+        return handle;
+    }
+    void await_resume() const {
+        if (handle.promise().error) rethrow_exception(handle.promise().error);
+    }
+
+    // Top-level use: start once, then check whether it has run to the end
+    void start() { handle.resume(); }
+    bool done() const { return !handle || handle.done(); }
+    void rethrowIfFailed() const {
+        if (handle && handle.done()) await_resume();
+    }
+
+private:
+    coroutine_handle<promise_type> handle;
+
+    explicit SessionTask(coroutine_handle<promise_type> h) : handle(h) {}
+};
+
+class TellerIO {
+public:
+    enum class ReadKind : uint8_t { Token, Number, Integer, Unsigned, Line, Hidden, IgnoreChar, IgnoreLine, GetChar };
+
+    // co_await yields true when the read succeeded, like testing cin after it
+    struct Read {
+        TellerIO& io;
+        void* target;
+        ReadKind kind;
+        bool ok = false;
+
+        bool await_ready() { return io.attempt(*this); }
+        void await_suspend(coroutine_handle<> session) {
+            io.waiting = session;
+            io.pending = this;
+        }
+        bool await_resume() const { return ok; }
+    };
+
+    // Written by the running session; formatting flags stick per session
+    ostream& out;
+
+    explicit TellerIO(bool onConsole = false) : out(sharedStream()), console(onConsole) {}
+    TellerIO(const TellerIO&) = delete;
+    TellerIO& operator=(const TellerIO&) = delete;
+
+    Read read(string& word) { return {*this, &word, ReadKind::Token}; }
+    Read read(double& value) { return {*this, &value, ReadKind::Number}; }
+    Read read(int& value) { return {*this, &value, ReadKind::Integer}; }
+    Read read(uint64_t& value) { return {*this, &value, ReadKind::Unsigned}; }
+    Read readLine(string& text) { return {*this, &text, ReadKind::Line}; }
+    Read readHidden(string& text) { return {*this, &text, ReadKind::Hidden}; }
+    Read ignore() { return {*this, nullptr, ReadKind::IgnoreChar}; }
+    Read ignoreLine() { return {*this, nullptr, ReadKind::IgnoreLine}; }
+    Read get() { return {*this, nullptr, ReadKind::GetChar}; }
+
+    // Runs the session until its first read that has to wait
+    void begin(SessionTask& session) {
+        attach();
+        session.start();
+        detach();
+    }
+
+    // New input from the terminal or connection; carriage returns are dropped
+    void feed(const char* data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            if (data[i] != '\r') input += data[i];
+        }
+        resumeIfReady();
+    }
+
+    // No more input; a session still waiting after this has ended
+    void close() {
+        closed = true;
+        resumeIfReady();
+    }
+
+    // Resumes a session that awaited something other than input, such as a
+    // reply from another process, and runs it until it waits again
+    void resume(coroutine_handle<> awaiting) {
+        attach();
+        awaiting.resume();
+        runReady();
+        detach();
+    }
+
+    bool waitingForInput() const { return pending != nullptr; }
+    bool hasOutput() const { return !output.empty(); }
+    bool hasEnded(const SessionTask& session) const { return session.done() || (closed && pending); }
+
+    string takeOutput() {
+        string text;
+        text.swap(output);
+        return text;
+    }
+
+    void clearScreen() {
+        if (!console) {
+            out << "\033[H\033[2J";
+            return;
+        }
+        // The console keeps the original behaviour of shelling out
+        detach();
+        cout << takeOutput() << flush;
+        #ifdef _WIN32
+            system("cls");
+        #else
+            system("clear");
+        #endif
+    }
+
+    size_t memoryBytes() const {
+        auto heap = [](const string& text) { return text.capacity() > 15 ? text.capacity() + 1 : 0; };
+        return sizeof(*this) + heap(input) + heap(output);
+    }
+
+private:
+    string input;
+    string output;
+    size_t pos = 0;
+    coroutine_handle<> waiting;
+    Read* pending = nullptr;
+    ios_base::fmtflags flags = ios_base::dec | ios_base::skipws;
+    int precision = 6;
+    bool closed = false;
+    bool console;
+
+    static ostringstream& sharedStream() {
+        static thread_local ostringstream stream;
+        return stream;
+    }
+
+    void attach() {
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+    // Moves what the session wrote into its own output
+    void detach() {
+        ostringstream& stream = sharedStream();
+        flags = stream.flags();
+        precision = (int)stream.precision();
+        output += stream.str();
+        stream.str("");
+    }
+
+    void resumeIfReady() {
+        attach();
+        runReady();
+        detach();
+    }
+
+    void runReady() {
+        while (pending && attempt(*pending)) {
+            coroutine_handle<> session = waiting;
+            pending = nullptr;
+            waiting = {};
+            session.resume();
+        }
+    }
+
+    // Completes the read if the buffered input decides it; consumed input is
+    // released so an idle session holds no buffer
+    bool attempt(Read& r) {
+        bool done = complete(r);
+        if (done && pos == input.size()) {
+            string().swap(input);
+            pos = 0;
+        }
+        return done;
+    }
+
+    bool complete(Read& r) {
+        const size_t end = input.size();
+        switch (r.kind) {
+            case ReadKind::Token:
+            case ReadKind::Number:
+            case ReadKind::Integer:
+            case ReadKind::Unsigned: {
+                size_t start = pos;
+                while (start < end && isspace((unsigned char)input[start])) ++start;
+                size_t stop = start;
+                while (stop < end && !isspace((unsigned char)input[stop])) ++stop;
+                // The word may still be arriving; at end of input nothing is left
+                if ((stop == end && !closed) || start == stop) return false;
+                pos = start;
+                if (r.kind == ReadKind::Token) {
+                    static_cast<string*>(r.target)->assign(input, start, stop - start);
+                    pos = stop;
+                    r.ok = true;
+                    return true;
+                }
+                r.ok = parseNumber(r, input.substr(start, stop - start));
+                return true;
+            }
+            case ReadKind::Line:
+            case ReadKind::Hidden: {
+                size_t newline = input.find('\n', pos);
+                if (newline == string::npos) return false;
+                string& text = *static_cast<string*>(r.target);
+                text.clear();
+                if (r.kind == ReadKind::Line) {
+                    text.assign(input, pos, newline - pos);
+                } else {
+                    for (size_t i = pos; i < newline; ++i) {
+                        if (input[i] == '\b') { // Handle backspace
+                            if (!text.empty()) {
+                                text.pop_back();
+                                out << "\b \b";
+                            }
+                        } else {
+                            text.push_back(input[i]);
+                            out << '*';
+                        }
+                    }
+                }
+                pos = newline + 1;
+                r.ok = true;
+                return true;
+            }
+            case ReadKind::IgnoreLine: {
+                size_t newline = input.find('\n', pos);
+                if (newline == string::npos) return false;
+                pos = newline + 1;
+                r.ok = true;
+                return true;
+            }
+            case ReadKind::IgnoreChar:
+            case ReadKind::GetChar:
+                if (pos == end) return false;
+                ++pos;
+                r.ok = true;
+                return true;
+        }
+        return false;
+    }
+
+    // Takes the longest numeric prefix of word, as operator>> would, and
+    // leaves the rest for the next read
+    bool parseNumber(Read& r, const string& word) {
+        size_t i = 0, digits = 0;
+        if (r.kind != ReadKind::Unsigned && (word[i] == '+' || word[i] == '-')) ++i;
+        while (i < word.size() && isdigit((unsigned char)word[i])) ++i, ++digits;
+        if (r.kind == ReadKind::Number) {
+            if (i < word.size() && word[i] == '.') {
+                ++i;
+                while (i < word.size() && isdigit((unsigned char)word[i])) ++i, ++digits;
+            }
+            if (digits > 0 && i < word.size() && (word[i] == 'e' || word[i] == 'E')) {
+                size_t exponent = i + 1;
+                if (exponent < word.size() && (word[exponent] == '+' || word[exponent] == '-')) ++exponent;
+                if (exponent < word.size() && isdigit((unsigned char)word[exponent])) {
+                    i = exponent;
+                    while (i < word.size() && isdigit((unsigned char)word[i])) ++i;
+                }
+            }
+        }
+        if (digits == 0) return false;
+        pos += i;
+        string number = word.substr(0, i);
+        errno = 0;
+        switch (r.kind) {
+            case ReadKind::Number:
+                *static_cast<double*>(r.target) = strtod(number.c_str(), nullptr);
+                return errno == 0;
+            case ReadKind::Integer: {
+                long long value = strtoll(number.c_str(), nullptr, 10);
+                if (errno != 0 || value < INT_MIN || value > INT_MAX) return false;
+                *static_cast<int*>(r.target) = (int)value;
+                return true;
+            }
+            default:
+                *static_cast<uint64_t*>(r.target) = strtoull(number.c_str(), nullptr, 10);
+                return errno == 0;
+        }
+    }
+};
+
+class BankingSystem {
+private:
+    AccountStore accounts;
+    unordered_map<string, AccountHandle> accountIndex; // Account number -> slot in accounts
+    UniquenessIndex phoneIndex;                 // Normalised phone numbers in use
+    UniquenessIndex emailIndex;                 // Normalised email addresses in use
+    AccountNumberAllocator numberAllocator; // Starting from ACCT1001
+    TransactionJournal journal;
+    uint64_t lastSeq = 0;               // Sequence number of the last durable mutation
+    size_t recordsSinceCheckpoint = 0;  // Journal records recovery would have to replay
+    long recoveryBoundMs = DEFAULT_RECOVERY_BOUND_MS;
+    long replayCostNs = DEFAULT_REPLAY_COST_NS;
+    BankAggregates aggregates;
+    GeneralLedger ledger;               // Double-entry postings since the last checkpoint
+    VelocityRules velocity;
+    OrderScheduler orders;
+    // Checkpoint storage engine; null writes full snapshots to ACCOUNT_FILE.
+    // With an engine a checkpoint stores only what changed since the last
+    // one, tracked here.
+    unique_ptr<StorageEngine> engine;
+    struct StoredHistory {
+        uint32_t entries = 0;   // History entries already stored
+        uint32_t chunks = 0;    // Keys they are spread over
+    };
+    unordered_set<string> dirtyAccounts;
+    unordered_set<uint64_t> dirtyOrders;
+    // Cross-shard transfer legs awaiting the coordinator, by transfer id
+    map<string, PreparedLeg> preparedLegs;
+    unordered_set<string> dirtyLegs;
+    long shardIndex = 0; // BMS_SHARD: this process's shard in a sharded deployment
+    unordered_map<string, StoredHistory> storedHistory;
+    bool storeEverything = false;       // First checkpoint after moving from ACCOUNT_FILE
+    thread statsDumper;
+    mutex statsMutex;
+    condition_variable statsWake;
+    bool statsStop = false;
+    // Sorted views for paged listing, built on first use and from then on
+    // kept current by addAccount(), removeAccount() and every balance change
+    bool orderingsBuilt = false;
+    map<uint64_t, AccountHandle> byNumber;
+    map<pair<string, uint64_t>, AccountHandle> byName;
+    map<pair<int64_t, uint64_t>, AccountHandle> byBalance;
+
+    string generateAccountNumber() {
+        long long number = numberAllocator.allocate();
+        return number < 0 ? "" : "ACCT" + to_string(number);
+    }
+
+    void loadAccountCounter() {
+        numberAllocator.load();
+        // A shard numbers its accounts inside its own range
+        if (shardIndex > 0) numberAllocator.observe(1000 + shardIndex * SHARD_ACCOUNT_RANGE);
+    }
+
+    void saveAccountCounter() {
+        numberAllocator.releaseUnused();
+    }
+
+    // Keeps the counter ahead of every account number seen while loading
+    void noteAccountNumber(const string& accNum) {
+        const char* digits = accNum.c_str() + 4; // Skip "ACCT"
+        char* end = nullptr;
+        long num = strtol(digits, &end, 10);
+        if (end != digits && *end == '\0' && num > 0) {
+            numberAllocator.observe(num);
+        }
+    }
+
+    BankAccount* findAccount(const string& accNum) {
+        TRACE_SPAN("findAccount");
+        PROFILE_REGION("findAccount");
+        auto it = accountIndex.find(accNum);
+        return it == accountIndex.end() ? nullptr : accounts.get(it->second);
+    }
+
+    // `opened` is false while loading a snapshot: the balance is already
+    // held, not a new deposit. An opening is dated from the account's own
+    // history, so replaying it from the journal keeps its original day.
+    void addAccount(const BankAccount& account, bool opened = false) {
+        time_t when = account.getHistory().firstTime(time(0));
+        aggregates.accountOpened(account.getTypeCode(), account.getBalance(), when, opened);
+        uint32_t ledgerAccount = ledger.accountFor(account.getId());
+        if (opened) {
+            ledger.post(LEDGER_OPENED, when, LEDGER_CASH, ledgerAccount, toMinorUnits(account.getBalance()));
+        } else {
+            ledger.bringForward(LEDGER_CASH, ledgerAccount, toMinorUnits(account.getBalance()));
+        }
+        AccountHandle handle = accounts.insert(account);
+        accountIndex[account.getAccountNumber()] = handle;
+        if (orderingsBuilt) indexOrderings(account, handle);
+        if (engine && opened) dirtyAccounts.insert(account.getAccountNumber());
+    }
+
+    void indexOrderings(const BankAccount& account, AccountHandle handle) {
+        byNumber.emplace(account.getId(), handle);
+        byName.emplace(make_pair(account.getAccountHolderName(), account.getId()), handle);
+        byBalance.emplace(make_pair(toMinorUnits(account.getBalance()), account.getId()), handle);
+    }
+
+    void unindexOrderings(const BankAccount& account) {
+        byNumber.erase(account.getId());
+        byName.erase(make_pair(account.getAccountHolderName(), account.getId()));
+        byBalance.erase(make_pair(toMinorUnits(account.getBalance()), account.getId()));
+    }
+
+    void buildOrderings() {
+        TRACE_SPAN("buildOrderings");
+        for (const auto& entry : accountIndex) {
+            indexOrderings(*accounts.get(entry.second), entry.second);
+        }
+        orderingsBuilt = true;
+    }
+
+    // Every balance change ends here so the aggregates, the balance
+    // ordering and the next incremental checkpoint stay exact
+    void balanceMoved(const BankAccount& account, double before, time_t when, bool external = true) {
+        aggregates.balanceChanged(account.getTypeCode(), before, account.getBalance(), when, external);
+        if (engine) dirtyAccounts.insert(account.getAccountNumber());
+        if (!orderingsBuilt) return;
+        int64_t from = toMinorUnits(before), to = toMinorUnits(account.getBalance());
+        if (from == to) return;
+        auto node = byBalance.extract(make_pair(from, account.getId()));
+        if (node.empty()) return;
+        node.key().first = to;
+        byBalance.insert(std::move(node));
+    }
+
+    // Ledger entries for a deposit or withdrawal already applied to
+    // `account`; `counterpart` is where the money came from or went
+    void ledgerCredit(const BankAccount& account, double amount, time_t when, uint32_t counterpart = LEDGER_CASH) {
+        ledger.post(LEDGER_DEPOSIT, when, counterpart, ledger.accountFor(account.getId()), toMinorUnits(amount));
+    }
+
+    void ledgerDebit(const BankAccount& account, double amount, time_t when, double fee = 0.0,
+                   uint32_t counterpart = LEDGER_CASH) {
+        uint32_t ledgerAccount = ledger.accountFor(account.getId());
+        ledger.post(LEDGER_WITHDRAWAL, when, ledgerAccount, counterpart, toMinorUnits(amount));
+        if (fee > 0) ledger.post(LEDGER_FEE, when, ledgerAccount, LEDGER_FEE_INCOME, toMinorUnits(fee));
+    }
+
+    // Money only enters or leaves the bank through cash
+    void credit(BankAccount& account, double amount, time_t when, uint32_t counterpart = LEDGER_CASH) {
+        double before = account.getBalance();
+        account.applyDeposit(amount, when);
+        balanceMoved(account, before, when, counterpart == LEDGER_CASH);
+        ledgerCredit(account, amount, when, counterpart);
+    }
+
+    void debit(BankAccount& account, double amount, time_t when, double fee = 0.0, uint32_t counterpart = LEDGER_CASH) {
+        double before = account.getBalance();
+        account.applyWithdrawal(amount, when, fee);
+        balanceMoved(account, before, when, counterpart == LEDGER_CASH);
+        ledgerDebit(account, amount, when, fee, counterpart);
+    }
+
+    // One entry debiting `source` and crediting `target`
+    void transfer(BankAccount& source, BankAccount& target, double amount, time_t when) {
+        double sourceBefore = source.getBalance(), targetBefore = target.getBalance();
+        source.applyWithdrawal(amount, when);
+        target.applyDeposit(amount, when);
+        balanceMoved(source, sourceBefore, when, false);
+        balanceMoved(target, targetBefore, when, false);
+        ledger.post(LEDGER_TRANSFER, when, ledger.accountFor(source.getId()), ledger.accountFor(target.getId()),
+                    toMinorUnits(amount));
+    }
+
+    // A prepared debit leaves the source at once, so the money cannot be
+    // spent twice while the coordinator decides; a credit waits for commit
+    void applyPreparedLeg(const PreparedLeg& leg, time_t when) {
+        if (leg.side == 'D') debit(*findAccount(leg.account), leg.amount, when, 0.0, LEDGER_CLEARING);
+        preparedLegs[leg.id] = leg;
+        if (engine) dirtyLegs.insert(leg.id);
+    }
+
+    // A leg loaded with a checkpoint: a prepared debit has already left the
+    // account, so the period opens with it held in clearing
+    void restorePreparedLeg(const PreparedLeg& leg) {
+        preparedLegs[leg.id] = leg;
+        if (leg.side == 'D') ledger.bringForward(LEDGER_CASH, LEDGER_CLEARING, toMinorUnits(leg.amount));
+    }
+
+    void applyLegDecision(const string& id, bool commit, time_t when) {
+        auto it = preparedLegs.find(id);
+        if (it == preparedLegs.end()) return;
+        const PreparedLeg& leg = it->second;
+        // Commit pays the credit; abort returns the debit
+        if (commit == (leg.side == 'C')) {
+            if (BankAccount* account = findAccount(leg.account)) credit(*account, leg.amount, when, LEDGER_CLEARING);
+        }
+        preparedLegs.erase(it);
+        if (engine) dirtyLegs.insert(id);
+    }
+
+    bool hasLegInDoubt(const string& accNum) const {
+        for (const auto& entry : preparedLegs) {
+            if (entry.second.account == accNum) return true;
+        }
+        return false;
+    }
+
+    // Velocity screening for money leaving `account`. Flagged and blocked
+    // operations are written to the alert log; only a block stops one.
+    bool passesVelocityRules(const BankAccount& account, double amount, time_t now, string* rule = nullptr,
+                             VelocityPending* pending = nullptr) {
+        if (engine && velocity.enabled() && !velocity.tracks(account.getId())) {
+            withHistory(account, [&](const CompressedHistory& history) { velocity.seed(account, history, now); });
+        }
+        RuleVerdict verdict = velocity.screen(account, toMinorUnits(amount), now, pending);
+        if (verdict.action == RuleAction::Allow) return true;
+        velocity.alert(verdict, account.getAccountNumber(), amount, now);
+        if (verdict.action == RuleAction::Flag) return true;
+        if (rule) *rule = verdict.rule->name;
+        return false;
+    }
+
+    // O(1): drops the index entries and tombstones the stored account;
+    // `when` is the closing time given to the aggregates and the ledger
+    bool removeAccount(const string& accNum, time_t when = time(0)) {
+        auto it = accountIndex.find(accNum);
+        if (it == accountIndex.end()) return false;
+        const BankAccount* account = accounts.get(it->second);
+        unregisterCustomer(account->getPhoneNumber(), account->getEmail());
+        aggregates.accountClosed(account->getTypeCode(), account->getBalance(), when);
+        ledger.post(LEDGER_CLOSED, when, ledger.accountFor(account->getId()), LEDGER_CASH,
+                    toMinorUnits(account->getBalance()));
+        if (orderingsBuilt) unindexOrderings(*account);
+        if (engine) dirtyAccounts.insert(accNum);
+        accounts.erase(it->second);
+        accountIndex.erase(it);
+        return true;
+    }
+
+    bool phoneInUse(const string& phone) const {
+        string normalizedPhone = normalizePhone(phone);
+        return !normalizedPhone.empty() && phoneIndex.contains(hashKey(normalizedPhone));
+    }
+
+    bool emailInUse(const string& email) const {
+        return emailIndex.contains(hashKey(normalizeEmail(email)));
+    }
+
+    // Empty when no existing customer uses this phone number or email
+    string duplicateReason(const string& phone, const string& email) const {
+        if (phoneInUse(phone)) return "An account with this phone number already exists";
+        if (emailInUse(email)) return "An account with this email already exists";
+        return "";
+    }
+
+    void registerCustomer(const string& phone, const string& email) {
+        string normalizedPhone = normalizePhone(phone);
+        if (!normalizedPhone.empty()) phoneIndex.insert(hashKey(normalizedPhone));
+        emailIndex.insert(hashKey(normalizeEmail(email)));
+    }
+
+    void unregisterCustomer(const string& phone, const string& email) {
+        string normalizedPhone = normalizePhone(phone);
+        if (!normalizedPhone.empty()) phoneIndex.erase(hashKey(normalizedPhone));
+        emailIndex.erase(hashKey(normalizeEmail(email)));
+    }
+
+    void rebuildUniqueIndexes() {
+        phoneIndex.reset(accounts.size() + 1024);
+        emailIndex.reset(accounts.size() + 1024);
+        accounts.forEach([&](const BankAccount& account) {
+            registerCustomer(account.getPhoneNumber(), account.getEmail());
+            return true;
+        });
+    }
+
+    // The indexes are saved with each checkpoint and tagged with its
+    // sequence number; they are reused only if they match the snapshot.
+    void saveUniqueIndexes() {
+        string body;
+        phoneIndex.write(body);
+        emailIndex.write(body);
+        string contents = UNIQUE_INDEX_MAGIC + " " + to_string(lastSeq) + " " + toHex32(crc32c(body)) + "\n" + body;
+        if (!publishFileAtomically(UNIQUE_INDEX_FILE, contents)) {
+            cerr << "Warning: could not save customer uniqueness indexes." << endl;
+        }
+    }
+
+    // Today's flows cannot be rebuilt from the snapshot, so each checkpoint
+    // records them, tagged like the uniqueness indexes
+    void saveStats() {
+        AggregateSnapshot stats = aggregates.snapshot();
+        string contents = STATS_MAGIC + " " + to_string(lastSeq) + " " + to_string(stats.day) + " " +
+                          to_string(stats.inflowMinor) + " " + to_string(stats.outflowMinor) + "\n";
+        if (!publishFileAtomically(STATS_FILE, contents)) {
+            cerr << "Warning: could not save daily totals." << endl;
+        }
+    }
+
+    void loadStats(uint64_t snapshotSeq) {
+        ifstream inFile(STATS_FILE);
+        string magic;
+        uint64_t seq = 0;
+        long day = 0;
+        long long inMinor = 0, outMinor = 0;
+        if (inFile >> magic >> seq >> day >> inMinor >> outMinor && magic == STATS_MAGIC && seq == snapshotSeq) {
+            aggregates.seedFlows(day, inMinor, outMinor);
+        }
+    }
+
+    // Appends a dashboard dump to STATS_LOG every `seconds` until stopped;
+    // reads only the aggregates, which are safe to read from any thread
+    void runStatsDumper(long seconds) {
+        unique_lock<mutex> lock(statsMutex);
+        while (!statsWake.wait_for(lock, chrono::seconds(seconds), [&] { return statsStop; })) {
+            ofstream logFile(STATS_LOG, ios::app);
+            time_t now = time(0);
+            logFile << ctime(&now) << renderAggregates(aggregates.snapshot()) << "\n";
+        }
+    }
+
+    bool loadUniqueIndexes(uint64_t snapshotSeq) {
+        ifstream inFile(UNIQUE_INDEX_FILE, ios::binary);
+        string header;
+        if (!inFile || !getline(inFile, header)) return false;
+        istringstream headerStream(header);
+        string magic, crcHex;
+        uint64_t seq = 0;
+        if (!(headerStream >> magic >> seq >> crcHex) || magic != UNIQUE_INDEX_MAGIC || seq != snapshotSeq) {
+            return false;
+        }
+        string body((istreambuf_iterator<char>(inFile)), istreambuf_iterator<char>());
+        if (toHex32(crc32c(body)) != crcHex) return false;
+        istringstream bodyStream(body);
+        return phoneIndex.read(bodyStream) && emailIndex.read(bodyStream);
+    }
+
+    // Loads the last published snapshot and returns the journal sequence it
+    // covers. Both the checksummed snapshot format and the plain format
+    // written by older versions are accepted; a damaged record stops the
+    // load at the last good account instead of mis-parsing the rest.
+    uint64_t loadAccounts() {
+        TRACE_SPAN("loadAccounts");
+        PROFILE_REGION("loadAccounts");
+        uint64_t storedSeq = 0;
+        if (engine) {
+            if (loadFromEngine(storedSeq)) return storedSeq;
+            storeEverything = true; // Moving from ACCOUNT_FILE, if there is one
+        }
+        ifstream inFile(ACCOUNT_FILE, ios::binary);
+        if (!inFile) return 0;
+
+        string header;
+        getline(inFile, header);
+        if (header.rfind(SNAPSHOT_MAGIC, 0) != 0) {
+            inFile.clear();
+            inFile.seekg(0);
+            while (inFile.peek() != EOF) {
+                BankAccount account;
+                if (!account.loadFromFile(inFile)) {
+                    cerr << "Warning: ignoring damaged account record after " << accounts.size()
+                         << " accounts in " << ACCOUNT_FILE << endl;
+                    break;
+                }
+                addAccount(account);
+                noteAccountNumber(account.getAccountNumber());
+            }
+            return 0;
+        }
+
+        istringstream headerStream(header.substr(SNAPSHOT_MAGIC.size()));
+        uint64_t snapshotSeq = 0;
+        long long storedCounter = 0;
+        size_t count = 0;
+        headerStream >> snapshotSeq >> storedCounter >> count;
+        if (storedCounter > 0) numberAllocator.observe(storedCounter);
+
+        for (size_t i = 0; i < count; ++i) {
+            uint64_t recordSeq;
+            string payload;
+            BankAccount account;
+            istringstream record;
+            if (readFramedRecord(inFile, "A", recordSeq, payload)) {
+                record.str(payload);
+            }
+            if (payload.empty() || !account.loadFromFile(record)) {
+                cerr << "Warning: snapshot record " << i + 1 << " of " << count
+                     << " failed its checksum; later records were not loaded." << endl;
+                return snapshotSeq;
+            }
+            addAccount(account);
+            noteAccountNumber(account.getAccountNumber());
+        }
+
+        // Standing orders follow the accounts; older snapshots have none
+        string line;
+        size_t orderCount = 0;
+        if (!getline(inFile, line) || line.rfind("END ", 0) != 0 || !getline(inFile, line) ||
+            sscanf(line.c_str(), "ORDERS %zu", &orderCount) != 1) {
+            return snapshotSeq;
+        }
+        for (size_t i = 0; i < orderCount; ++i) {
+            uint64_t recordSeq;
+            string payload;
+            StandingOrder order;
+            istringstream record;
+            if (readFramedRecord(inFile, "O", recordSeq, payload)) {
+                record.str(payload);
+            }
+            if (payload.empty() || !parseOrder(record, order)) {
+                cerr << "Warning: standing order " << i + 1 << " of " << orderCount
+                     << " failed its checksum; later orders were not loaded." << endl;
+                break;
+            }
+            orders.add(order);
+        }
+
+        // Then cross-shard transfer legs in doubt, in snapshots that have them
+        size_t legCount = 0;
+        if (!getline(inFile, line) || sscanf(line.c_str(), "PREPARED %zu", &legCount) != 1) {
+            return snapshotSeq;
+        }
+        for (size_t i = 0; i < legCount; ++i) {
+            uint64_t recordSeq;
+            string payload;
+            PreparedLeg leg;
+            istringstream record;
+            if (readFramedRecord(inFile, "P", recordSeq, payload)) {
+                record.str(payload);
+            }
+            if (payload.empty() || !parseLeg(record, leg)) {
+                cerr << "Warning: prepared transfer " << i + 1 << " of " << legCount
+                     << " failed its checksum; later ones were not loaded." << endl;
+                return snapshotSeq;
+            }
+            restorePreparedLeg(leg);
+        }
+
+        // Fees earned, which no account balance shows
+        long long feesMinor = 0;
+        if (getline(inFile, line) && sscanf(line.c_str(), "LEDGER %lld", &feesMinor) == 1) {
+            ledger.bringForward(LEDGER_CASH, LEDGER_FEE_INCOME, feesMinor);
+        }
+        return snapshotSeq;
+    }
+
+    // Checkpoint: publishes a checksummed snapshot of every account with an
+    // atomic rename, or the changes since the last checkpoint to the storage
+    // engine, then resets the journal to a checkpoint marker.
+    bool saveAccounts() {
+        TRACE_SPAN("saveAccounts");
+        PROFILE_REGION("saveAccounts");
+        bool stored;
+        if (engine) {
+            stored = checkpointToEngine();
+        } else {
+            ostringstream snapshot;
+            snapshot << SNAPSHOT_MAGIC << " " << lastSeq << " " << numberAllocator.lastIssued() << " "
+                     << accounts.size() << "\n";
+            accounts.forEach([&](const BankAccount& account) {
+                ostringstream record;
+                account.saveToFile(record);
+                snapshot << frameRecord("A", lastSeq, record.str());
+                return true;
+            });
+            snapshot << "END " << accounts.size() << "\n";
+            snapshot << "ORDERS " << orders.size() << "\n";
+            orders.forEach([&](const StandingOrder& order) {
+                snapshot << frameRecord("O", lastSeq, formatOrder(order));
+            });
+            snapshot << "PREPARED " << preparedLegs.size() << "\n";
+            for (const auto& entry : preparedLegs) snapshot << frameRecord("P", lastSeq, formatLeg(entry.second));
+            snapshot << "LEDGER " << -ledger.balance(LEDGER_FEE_INCOME) << "\n";
+            stored = publishFileAtomically(ACCOUNT_FILE, snapshot.str());
+        }
+
+        if (stored && journal.resetToCheckpoint(lastSeq)) {
+            recordsSinceCheckpoint = 0;
+            closeLedgerPeriod();
+            saveUniqueIndexes();
+            saveStats();
+            return true;
+        }
+        cerr << "Error saving accounts to file!" << endl;
+        return false;
+    }
+
+    // The checkpoint holds the period's entries now; the books are checked
+    // before they are carried forward
+    void closeLedgerPeriod() {
+        LedgerCheck check = ledger.validate();
+        if (!check.clean()) {
+            cerr << "Warning: the ledger does not balance at this checkpoint:\n" << renderLedgerCheck(check);
+        }
+        ledger.closePeriod();
+    }
+
+    // Storage engine keys:
+    //   M                          "<journal seq> <last issued account number>"
+    //   A<account>                 account record with an empty history
+    //   H<account>/<first entry>   history entries from that index on, as a
+    //                              compressed block (hex index, so keys sort)
+    //   O<order id>                standing order, as in the journal
+    //   P<transfer id>             cross-shard transfer leg in doubt
+    //   L                          fees earned, in paisa
+    static string historyKey(const string& accNum, uint32_t first) {
+        return "H" + accNum + "/" + toHex32(first);
+    }
+
+    static string orderKey(uint64_t id) {
+        return "O" + toHex32((uint32_t)(id >> 32)) + toHex32((uint32_t)id);
+    }
+
+    // Writes the accounts and orders changed since the last checkpoint, and
+    // the history appended since, as one atomic batch
+    bool checkpointToEngine() {
+        if (storeEverything) {
+            accounts.forEach([&](const BankAccount& account) {
+                dirtyAccounts.insert(account.getAccountNumber());
+                return true;
+            });
+            orders.forEach([&](const StandingOrder& order) { dirtyOrders.insert(order.id); });
+            for (const auto& entry : preparedLegs) dirtyLegs.insert(entry.first);
+        }
+        vector<StorageWrite> batch;
+        vector<pair<string, StoredHistory>> stored;
+        auto removeHistory = [&](const string& accNum) {
+            engine->scan("H" + accNum + "/", [&](const string& key, const string&) {
+                batch.push_back({key, "", true});
+                return true;
+            });
+        };
+        for (const string& accNum : dirtyAccounts) {
+            const BankAccount* account = findAccount(accNum);
+            if (!account) {
+                batch.push_back({"A" + accNum, "", true});
+                removeHistory(accNum);
+                stored.emplace_back(accNum, StoredHistory{0, 0});
+                continue;
+            }
+            ostringstream record;
+            account->saveToFile(record, false);
+            batch.push_back({"A" + accNum, record.str(), false});
+
+            // The account holds only the entries not yet stored
+            StoredHistory history = storedHistory.count(accNum) ? storedHistory[accNum] : StoredHistory();
+            if (account->getHistory().size() == 0) continue;
+            ostringstream encoded;
+            if (history.chunks >= HISTORY_CHUNK_LIMIT) {
+                withHistory(*account, [&](const CompressedHistory& whole) { whole.write(encoded); });
+                removeHistory(accNum);
+                history = StoredHistory();
+            } else {
+                account->getHistory().write(encoded);
+            }
+            batch.push_back({historyKey(accNum, history.entries), encoded.str(), false});
+            stored.emplace_back(accNum, StoredHistory{history.entries + (uint32_t)account->getHistory().size(),
+                                                      history.chunks + 1});
+        }
+        for (uint64_t id : dirtyOrders) {
+            const StandingOrder* order = orders.find(id);
+            batch.push_back({orderKey(id), order ? formatOrder(*order) : "", !order});
+        }
+        for (const string& id : dirtyLegs) {
+            auto it = preparedLegs.find(id);
+            bool resolved = it == preparedLegs.end();
+            batch.push_back({"P" + id, resolved ? "" : formatLeg(it->second), resolved});
+        }
+        batch.push_back({"L", to_string(-ledger.balance(LEDGER_FEE_INCOME)), false});
+        batch.push_back({"M", to_string(lastSeq) + " " + to_string(numberAllocator.lastIssued()), false});
+        if (!engine->write(batch)) return false;
+
+        for (const auto& entry : stored) {
+            if (entry.second.chunks == 0) {
+                storedHistory.erase(entry.first);
+            } else {
+                storedHistory[entry.first] = entry.second;
+                findAccount(entry.first)->releaseHistory();
+            }
+        }
+        dirtyAccounts.clear();
+        dirtyOrders.clear();
+        dirtyLegs.clear();
+        storeEverything = false;
+        return true;
+    }
+
+    // Loads the last checkpoint from the storage engine; false if it holds none
+    bool loadFromEngine(uint64_t& snapshotSeq) {
+        TRACE_SPAN("loadFromEngine");
+        string meta;
+        if (!engine->get("M", meta)) return false;
+        long long storedCounter = 0;
+        istringstream(meta) >> snapshotSeq >> storedCounter;
+        if (storedCounter > 0) numberAllocator.observe(storedCounter);
+
+        size_t damaged = 0;
+        engine->scan("A", [&](const string&, const string& value) {
+            istringstream record(value);
+            BankAccount account;
+            if (!account.loadFromFile(record)) {
+                ++damaged;
+                return true;
+            }
+            addAccount(account);
+            noteAccountNumber(account.getAccountNumber());
+            return true;
+        });
+        // Histories stay in the engine (see withHistory); only their sizes
+        // are noted here
+        string current;
+        BankAccount* account = nullptr;
+        engine->scan("H", [&](const string& key, const string& value) {
+            string accNum = key.substr(1, key.rfind('/') - 1);
+            if (accNum != current) {
+                current = accNum;
+                account = findAccount(accNum);
+            }
+            istringstream in(value);
+            string header;
+            CompressedHistory chunk;
+            if (!account || !getline(in, header) || !chunk.read(in, header)) {
+                ++damaged;
+                return true;
+            }
+            StoredHistory& history = storedHistory[accNum];
+            history.entries += (uint32_t)chunk.size();
+            ++history.chunks;
+            return true;
+        });
+        engine->scan("O", [&](const string&, const string& value) {
+            istringstream record(value);
+            StandingOrder order;
+            if (parseOrder(record, order)) {
+                orders.add(order);
+            } else {
+                ++damaged;
+            }
+            return true;
+        });
+        engine->scan("P", [&](const string&, const string& value) {
+            istringstream record(value);
+            PreparedLeg leg;
+            if (parseLeg(record, leg)) {
+                restorePreparedLeg(leg);
+            } else {
+                ++damaged;
+            }
+            return true;
+        });
+        if (damaged > 0) {
+            cerr << "Warning: " << damaged << " damaged record(s) in " << LSM_DIR << " were not loaded." << endl;
+        }
+        string fees;
+        if (engine->get("L", fees)) ledger.bringForward(LEDGER_CASH, LEDGER_FEE_INCOME, atoll(fees.c_str()));
+        return true;
+    }
+
+    // Re-applies one journal payload on top of the loaded snapshot
+    bool applyJournalRecord(const string& payload) {
+        if (payload.size() < 2) return false;
+        istringstream in(payload.substr(2));
+        switch (payload[0]) {
+            case 'C': {
+                BankAccount account;
+                if (!account.loadFromFile(in)) return false;
+                if (!findAccount(account.getAccountNumber())) {
+                    addAccount(account, true);
+                    registerCustomer(account.getPhoneNumber(), account.getEmail());
+                }
+                noteAccountNumber(account.getAccountNumber());
+                return true;
+            }
+            case 'D':
+            case 'W': {
+                string accNum;
+                double amount;
+                long long when;
+                double fee = 0.0;
+                if (!(in >> accNum >> amount >> when)) return false;
+                in >> fee; // Absent in records written before withdrawal fees
+                BankAccount* account = findAccount(accNum);
+                if (!account) return false;
+                if (payload[0] == 'D') {
+                    credit(*account, amount, (time_t)when);
+                } else {
+                    debit(*account, amount, (time_t)when, fee);
+                }
+                return true;
+            }
+            case 'T': {
+                string from, to;
+                double amount;
+                long long when;
+                if (!(in >> from >> to >> amount >> when)) return false;
+                BankAccount* source = findAccount(from);
+                BankAccount* target = findAccount(to);
+                if (!source || !target) return false;
+                transfer(*source, *target, amount, (time_t)when);
+                return true;
+            }
+            case 'B': {
+                // One line per operation of an executeBatch() call, then
+                // any standing-order updates committed with it
+                string line;
+                while (getline(in, line)) {
+                    if (!applyJournalRecord(line)) return false;
+                }
+                return true;
+            }
+            case 'X': {
+                string accNum;
+                double payout = 0.0;
+                long long when = 0;
+                if (!(in >> accNum)) return false;
+                if (!(in >> payout >> when)) when = (long long)time(0);
+                return removeAccount(accNum, (time_t)when);
+            }
+            case 'S': {
+                StandingOrder order;
+                if (!parseOrder(in, order)) return false;
+                if (!orders.find(order.id)) orders.add(order);
+                if (engine) dirtyOrders.insert(order.id);
+                return true;
+            }
+            case 'Z': {
+                uint64_t id;
+                if (!(in >> id)) return false;
+                if (engine) dirtyOrders.insert(id);
+                return orders.cancel(id);
+            }
+            case 'N': {
+                // Standing order executed: next due time and executions left
+                uint64_t id;
+                long long due;
+                int32_t remaining;
+                if (!(in >> id >> due >> remaining)) return false;
+                if (engine) dirtyOrders.insert(id);
+                return orders.reschedule(id, due, remaining);
+            }
+            case 'P': {
+                // Cross-shard transfer leg prepared: "<leg> <time>"
+                PreparedLeg leg;
+                long long when;
+                if (!parseLeg(in, leg) || !(in >> when)) return false;
+                if (preparedLegs.count(leg.id)) return true;
+                if (!findAccount(leg.account)) return false;
+                applyPreparedLeg(leg, (time_t)when);
+                return true;
+            }
+            case 'Q': {
+                // Coordinator's decision on a leg: "<transfer id> <C|A> <time>"
+                string id;
+                char decision;
+                long long when;
+                if (!(in >> id >> decision >> when)) return false;
+                applyLegDecision(id, decision == 'C', (time_t)when);
+                return true;
+            }
+            case 'K':
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Startup recovery: last snapshot plus the journal tail after it. A torn
+    // or corrupted tail record marks the end of the consistent state and is
+    // cut off so new records are appended after the last good one.
+    void recover() {
+        TRACE_SPAN("recover");
+        auto start = chrono::steady_clock::now();
+        lastSeq = loadAccounts();
+        if (!loadUniqueIndexes(lastSeq)) {
+            rebuildUniqueIndexes();
+        }
+        loadStats(lastSeq);
+        auto snapshotLoaded = chrono::steady_clock::now();
+
+        size_t replayed = 0;
+        bool tornTail = false;
+        streamoff validBytes = 0;
+        ifstream inFile(JOURNAL_FILE, ios::binary);
+        if (inFile) {
+            uint64_t seq;
+            string payload;
+            while (inFile.peek() != EOF) {
+                if (!readFramedRecord(inFile, "J", seq, payload)) {
+                    tornTail = true;
+                    break;
+                }
+                validBytes = inFile.tellg();
+                if (seq <= lastSeq) continue; // Already covered by the snapshot
+                if (!applyJournalRecord(payload)) {
+                    cerr << "Warning: journal record " << seq << " could not be applied." << endl;
+                }
+                lastSeq = seq;
+                ++replayed;
+            }
+            inFile.close();
+        }
+        if (tornTail) {
+            TransactionJournal::truncateTo(validBytes);
+        }
+
+        auto end = chrono::steady_clock::now();
+        long long replayNs = chrono::duration_cast<chrono::nanoseconds>(end - snapshotLoaded).count();
+        if (replayed > 0) {
+            replayCostNs = max<long long>(replayCostNs, replayNs / (long long)replayed);
+            cout << "Recovered " << replayed << " journal record(s)"
+                 << (tornTail ? " (discarded a torn tail record)" : "") << " in "
+                 << chrono::duration_cast<chrono::milliseconds>(end - start).count() << " ms" << endl;
+        } else if (tornTail) {
+            cout << "Discarded a torn journal record left by an interrupted write." << endl;
+        }
+        recordsSinceCheckpoint = replayed;
+
+        if (!journal.open()) {
+            cerr << "Error opening transaction journal!" << endl;
+        }
+        checkpointIfDue();
+    }
+
+    // Longest journal tail whose replay still fits in the recovery bound
+    size_t maxTailRecords() const {
+        long long budget = (long long)recoveryBoundMs * 1000000LL / max(1L, replayCostNs);
+        return (size_t)max(1LL, budget);
+    }
+
+    // Runs between operations, so compaction never moves an account a
+    // caller still holds a pointer to
+    void checkpointIfDue() {
+        if (recordsSinceCheckpoint >= maxTailRecords()) {
+            saveAccounts();
+        }
+        accounts.compact(COMPACTION_STEP);
+    }
+
+    bool journalMutation(const string& payload) {
+        TRACE_SPAN("journalMutation");
+        PROFILE_REGION("journalMutation");
+        if (!journal.append(lastSeq + 1, payload)) {
+            cerr << "Error writing transaction journal!" << endl;
+            return false;
+        }
+        ++lastSeq;
+        ++recordsSinceCheckpoint;
+        return true;
+    }
+
+    void logTransaction(const string& message) {
+        logTransactions(vector<string>(1, message));
+    }
+
+    // Several messages under one timestamp, with one open of the log
+    void logTransactions(const vector<string>& messages) {
+        TRACE_SPAN("logTransaction");
+        PROFILE_REGION("logTransaction");
+        if (messages.empty()) return;
+        ofstream logFile(TRANSACTION_LOG, ios::app);
+        if (logFile) {
+            time_t now = time(0);
+            string entry = ctime(&now);
+            for (const auto& message : messages) {
+                entry += " - ";
+                entry += message;
+                entry += '\n';
+            }
+            logFile << entry << "\n";
+            logFile.close();
+        }
+    }
+
+public:
+    BankingSystem() {
+        if (const char* bound = getenv("BMS_RECOVERY_BOUND_MS")) {
+            recoveryBoundMs = max(1L, atol(bound));
+        }
+        if (const char* crashAfter = getenv("BMS_CRASH_AFTER")) {
+            crashCountdown = atol(crashAfter);
+        }
+        if (const char* storage = getenv("BMS_STORAGE")) {
+            // "lsm" moves the checkpoints from ACCOUNT_FILE into LSM_DIR for good
+            if (string(storage) == "lsm") {
+                const char* cacheMb = getenv("BMS_LSM_CACHE_MB");
+                size_t cacheBytes = cacheMb ? (size_t)max(1L, atol(cacheMb)) << 20 : LSM_CACHE_BYTES;
+                unique_ptr<LsmEngine> lsm(new LsmEngine(LSM_DIR, cacheBytes));
+                if (!lsm->open()) {
+                    cerr << "Error opening the storage engine in " << LSM_DIR << "!" << endl;
+                    exit(1);
+                }
+                engine = move(lsm);
+            } else if (string(storage) != "snapshot") {
+                cerr << "Unknown BMS_STORAGE " << storage << "; using " << ACCOUNT_FILE << "." << endl;
+            }
+        }
+        if (const char* shard = getenv("BMS_SHARD")) {
+            shardIndex = max(0L, atol(shard));
+        }
+        loadAccountCounter();
+        recover();
+        if (shardIndex > 0) orders.startIdsAt((uint64_t)shardIndex << 40);
+        velocity.load();
+        if (const char* interval = getenv("BMS_STATS_INTERVAL")) {
+            long seconds = atol(interval);
+            if (seconds > 0) statsDumper = thread([this, seconds] { runStatsDumper(seconds); });
+        }
+    }
+
+    ~BankingSystem() {
+        if (statsDumper.joinable()) {
+            {
+                lock_guard<mutex> lock(statsMutex);
+                statsStop = true;
+            }
+            statsWake.notify_all();
+            statsDumper.join();
+        }
+        saveAccounts();
+        saveAccountCounter();
+    }
+
+    // Instant totals; O(products), independent of the number of accounts
+    AggregateSnapshot aggregateSnapshot() const {
+        return aggregates.snapshot();
+    }
+
+    // Validates the current ledger period and checks every account's
+    // balance against its ledger account
+    LedgerCheck checkLedger() {
+        LedgerCheck check = ledger.validate();
+        accounts.forEach([&](const BankAccount& account) {
+            int64_t owed = -ledger.balance(ledger.accountFor(account.getId()));
+            check.accountMismatches += owed != toMinorUnits(account.getBalance());
+            return true;
+        });
+        return check;
+    }
+
+    // Non-interactive operations used by tools and test harnesses. Each one is
+    // journaled durably before it returns, so an acknowledged operation
+    // survives a crash.
+    string openAccount(const string& name, const string& address, const string& phone,
+                       const string& email, double initialDeposit, const string& accountType,
+                       const string& password, TxStatus* status = nullptr) {
+        TRACE_SPAN("openAccount");
+        PROFILE_REGION("openAccount");
+        if (status) *status = TxStatus::StorageError;
+        if (!duplicateReason(phone, email).empty()) {
+            if (status) *status = TxStatus::DuplicateCustomer;
+            return "";
+        }
+        string accNum = generateAccountNumber();
+        if (accNum.empty()) {
+            return "";
+        }
+        BankAccount account(accNum, name, address, phone, email, initialDeposit, accountType, password);
+        ostringstream record;
+        account.saveToFile(record);
+        if (!journalMutation("C\n" + record.str())) {
+            return "";
+        }
+        addAccount(account, true);
+        registerCustomer(phone, email);
+        ostringstream details;
+        details << fixed << setprecision(2) << " (" << account.getAccountType() << ", initial deposit "
+                << initialDeposit << " BDT)";
+        logTransaction("Account created: " + accNum + " for " + name + details.str());
+        checkpointIfDue();
+        if (status) *status = TxStatus::Ok;
+        return accNum;
+    }
+
+    TxStatus postDeposit(const string& accNum, double amount) {
+        TRACE_SPAN("postDeposit");
+        PROFILE_REGION("postDeposit");
+        BankAccount* account = findAccount(accNum);
+        if (!account) return TxStatus::NotFound;
+        TxStatus status = account->checkDeposit(amount);
+        if (status != TxStatus::Ok) return status;
+        time_t now = time(0);
+        if (!journalMutation(movementRecord('D', accNum, amount, now))) return TxStatus::StorageError;
+        credit(*account, amount, now);
+        logTransaction("Deposit to " + accNum + ": " + to_string(amount) + " BDT");
+        checkpointIfDue();
+        return TxStatus::Ok;
+    }
+
+    TxStatus postWithdrawal(const string& accNum, double amount, const string& password) {
+        TRACE_SPAN("postWithdrawal");
+        PROFILE_REGION("postWithdrawal");
+        BankAccount* account = findAccount(accNum);
+        if (!account) return TxStatus::NotFound;
+        TxStatus status = account->checkWithdrawal(amount, password);
+        if (status != TxStatus::Ok) return status;
+        time_t now = time(0);
+        if (!passesVelocityRules(*account, amount, now)) return TxStatus::RuleBlocked;
+        double fee = account->withdrawalFee();
+        if (!journalMutation(movementRecord('W', accNum, amount, now, fee))) return TxStatus::StorageError;
+        debit(*account, amount, now, fee);
+        velocity.record(*account, toMinorUnits(amount), now);
+        logTransaction("Withdrawal from " + accNum + ": " + to_string(amount) + " BDT");
+        checkpointIfDue();
+        return TxStatus::Ok;
+    }
+
+    // Pays out the whole balance and removes the account. The number is
+    // never issued again; the customer's phone and email become free.
+    TxStatus closeAccount(const string& accNum, const string& password, double* payout = nullptr) {
+        BankAccount* account = findAccount(accNum);
+        if (!account) return TxStatus::NotFound;
+        if (!account->verifyPassword(password)) return TxStatus::BadPassword;
+        if (hasLegInDoubt(accNum)) return TxStatus::InDoubt;
+        double balance = account->getBalance();
+        time_t now = time(0);
+        if (!journalMutation("X " + accNum + " " + formatAmount(balance) + " " + to_string((long long)now))) {
+            return TxStatus::StorageError;
+        }
+        removeAccount(accNum, now);
+        ostringstream message;
+        message << "Account closed: " << accNum << ", paid out " << fixed << setprecision(2) << balance << " BDT";
+        logTransaction(message.str());
+        checkpointIfDue();
+        if (payout) *payout = balance;
+        return TxStatus::Ok;
+    }
+
+    const BankAccount* lookupAccount(const string& accNum) {
+        return findAccount(accNum);
+    }
+
+    // Calls fn with the account's whole history and returns what it does.
+    // With a storage engine the account holds only the entries appended
+    // since its last checkpoint; the rest is read back from the engine for
+    // this call and dropped again afterwards, so histories never all sit
+    // in memory. Safe from several threads while nothing is written.
+    template <typename Fn>
+    auto withHistory(const BankAccount& account, Fn&& fn) const -> decltype(fn(declval<const CompressedHistory&>())) {
+        auto stored = storedHistory.find(account.getAccountNumber());
+        if (!engine || stored == storedHistory.end() || stored->second.entries == 0) return fn(account.getHistory());
+        CompressedHistory whole;
+        auto appendEntry = [&](const HistoryEntry& entry) {
+            whole.append(entry.op, entry.when, entry.amountMinor, entry.text);
+        };
+        engine->scan("H" + account.getAccountNumber() + "/", [&](const string&, const string& value) {
+            istringstream in(value);
+            string header;
+            CompressedHistory chunk;
+            if (getline(in, header) && chunk.read(in, header)) chunk.forEach(appendEntry);
+            return true;
+        });
+        account.getHistory().forEach(appendEntry);
+        return fn(static_cast<const CompressedHistory&>(whole));
+    }
+
+    // One shard's half of a cross-shard transfer (see Sharded deployment).
+    // The leg is checked like the matching half of a local transfer and
+    // journaled before the answer; `balance` receives the account's balance.
+    TxStatus prepareTransferLeg(const PreparedLeg& leg, const string& password, double* balance = nullptr) {
+        TRACE_SPAN("prepareTransferLeg");
+        if (preparedLegs.count(leg.id)) return TxStatus::InvalidAmount;
+        BankAccount* account = findAccount(leg.account);
+        if (!account) return TxStatus::NotFound;
+        time_t now = time(0);
+        TxStatus status = leg.side == 'D' ? account->checkWithdrawal(leg.amount, password)
+                                          : account->checkDeposit(leg.amount);
+        if (status == TxStatus::Ok && leg.side == 'D' && !passesVelocityRules(*account, leg.amount, now)) {
+            status = TxStatus::RuleBlocked;
+        }
+        if (status != TxStatus::Ok) return status;
+        if (!journalMutation("P " + formatLeg(leg) + " " + to_string((long long)now))) return TxStatus::StorageError;
+        applyPreparedLeg(leg, now);
+        if (leg.side == 'D') velocity.record(*account, toMinorUnits(leg.amount), now);
+        if (balance) *balance = account->getBalance();
+        checkpointIfDue();
+        return TxStatus::Ok;
+    }
+
+    // Applies the coordinator's decision. A leg that is not (or no longer)
+    // prepared here is already resolved, so repeating a decision is harmless.
+    TxStatus resolveTransferLeg(const string& id, bool commit) {
+        TRACE_SPAN("resolveTransferLeg");
+        auto it = preparedLegs.find(id);
+        if (it == preparedLegs.end()) return TxStatus::Ok;
+        PreparedLeg leg = it->second;
+        time_t now = time(0);
+        if (!journalMutation("Q " + id + (commit ? " C " : " A ") + to_string((long long)now))) {
+            return TxStatus::StorageError;
+        }
+        applyLegDecision(id, commit, now);
+        logTransaction(string(commit ? "Cross-shard transfer " : "Cross-shard transfer aborted, ") +
+                       (leg.side == 'D' ? "from " : "to ") + leg.account + ": " + to_string(leg.amount) +
+                       " BDT (transfer " + id + ")");
+        checkpointIfDue();
+        return TxStatus::Ok;
+    }
+
+    // Balance of one account at `when`; false if the account is unknown or
+    // had not been opened by then
+    bool balanceAsOf(const string& accNum, time_t when, double& balance) {
+        TRACE_SPAN("balanceAsOf");
+        const BankAccount* account = findAccount(accNum);
+        int64_t minor = 0;
+        if (!account) return false;
+        if (!withHistory(*account, [&](const CompressedHistory& history) { return history.balanceAt(when, minor); })) {
+            return false;
+        }
+        balance = minor / 100.0;
+        return true;
+    }
+
+    // Monthly statements for every account, sharded per worker
+    StatementReport generateStatements(const StatementPeriod& period, const string& prefix, size_t workers) const {
+        TRACE_SPAN("generateStatements");
+        vector<const BankAccount*> all;
+        all.reserve(accounts.size());
+        accounts.forEach([&](const BankAccount& account) {
+            all.push_back(&account);
+            return true;
+        });
+        sort(all.begin(), all.end(), [](const BankAccount* a, const BankAccount* b) { return a->getId() < b->getId(); });
+        return writeStatements(all, period, prefix, workers, [this](const BankAccount& account, auto&& fn) {
+            return withHistory(account, fn);
+        });
+    }
+
+    // Every account's balance at `when`, in account-number order. Accounts
+    // are independent, so they are split across the cores.
+    vector<AsOfBalance> balancesAsOf(time_t when) const {
+        TRACE_SPAN("balancesAsOf");
+        PROFILE_REGION("balancesAsOf");
+        vector<AsOfBalance> rows;
+        rows.reserve(accounts.size());
+        accounts.forEach([&](const BankAccount& account) {
+            rows.push_back({&account});
+            return true;
+        });
+        sort(rows.begin(), rows.end(), [](const AsOfBalance& a, const AsOfBalance& b) {
+            return a.account->getId() < b.account->getId();
+        });
+        parallelFor(rows.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                rows[i].existed = withHistory(*rows[i].account, [&](const CompressedHistory& history) {
+                    return history.balanceAt(when, rows[i].balanceMinor);
+                });
+            }
+        });
+        return rows;
+    }
+
+    // Each account's history summed for reconciliation, in account-number
+    // order, split across `workers` threads
+    vector<ReconciledAccount> reconcileHistories(size_t workers) const {
+        TRACE_SPAN("reconcileHistories");
+        vector<ReconciledAccount> rows;
+        rows.reserve(accounts.size());
+        accounts.forEach([&](const BankAccount& account) {
+            rows.push_back({&account});
+            return true;
+        });
+        sort(rows.begin(), rows.end(), [](const ReconciledAccount& a, const ReconciledAccount& b) {
+            return a.account->getId() < b.account->getId();
+        });
+        for (const auto& entry : preparedLegs) {
+            const PreparedLeg& leg = entry.second;
+            uint64_t id = strtoull(leg.account.c_str() + 4, nullptr, 10);
+            auto row = lower_bound(rows.begin(), rows.end(), id, [](const ReconciledAccount& r, uint64_t key) {
+                return r.account->getId() < key;
+            });
+            if (leg.side == 'D' && row != rows.end() && row->account->getId() == id) {
+                row->inDoubtMinor += toMinorUnits(leg.amount);
+            }
+        }
+        size_t perPart = max<size_t>(1, rows.size() / (workers * 8));
+        parallelForStealing((rows.size() + perPart - 1) / perPart, workers, [&](size_t, size_t part) {
+            for (size_t i = part * perPart; i < min(rows.size(), (part + 1) * perPart); ++i) {
+                ReconciledAccount& row = rows[i];
+                withHistory(*row.account, [&](const CompressedHistory& history) {
+                    history.forEach([&](const HistoryEntry& entry) {
+                        row.historyMinor += entry.amountMinor;
+                        if (entry.op == HIST_OPENED) row.openingMinor += entry.amountMinor;
+                        if (entry.op == HIST_FEE) row.feesMinor += entry.amountMinor;
+                        if (entry.op == HIST_RAW_LINE) row.legacyLines = true;
+                    });
+                });
+            }
+        });
+        return rows;
+    }
+
+    // Runs a batch with one journal record, one log entry and one durability
+    // point. Operations run in submitted order, since a transfer changes
+    // what later operations on either of its accounts may do; the accounts
+    // a few operations ahead are prefetched. Every operation gets its own
+    // result, and a rejected one does not stop the rest. `trailer` lines
+    // are further journal records committed in the same record, whatever
+    // the outcome.
+    vector<BatchResult> executeBatch(const vector<BatchOperation>& ops, const vector<string>& trailer = {}) {
+        TRACE_SPAN("executeBatch");
+        PROFILE_REGION("executeBatch");
+        vector<BatchResult> results(ops.size());
+        vector<BankAccount*> primary(ops.size()), secondary(ops.size(), nullptr);
+        for (size_t i = 0; i < ops.size(); ++i) {
+            primary[i] = findAccount(ops[i].account);
+            if (ops[i].type == BatchOpType::Transfer) secondary[i] = findAccount(ops[i].target);
+        }
+
+        // Validate against running balances first: the journal record must
+        // exist before any account changes
+        unordered_map<const BankAccount*, double> running;
+        running.reserve(ops.size() * 2);
+        auto balanceOf = [&](BankAccount* account) -> double& {
+            auto it = running.find(account);
+            return it != running.end() ? it->second : running.emplace(account, account->getBalance()).first->second;
+        };
+        time_t now = time(0);
+        string record = "B";
+        vector<uint32_t> accepted;
+        VelocityPending pending; // Velocity windows are recorded only once the batch is durable
+        vector<string> messages;
+        for (uint32_t i = 0; i < ops.size(); ++i) {
+            if (i + 4 < ops.size()) {
+                if (primary[i + 4]) __builtin_prefetch(primary[i + 4]);
+                if (secondary[i + 4]) __builtin_prefetch(secondary[i + 4]);
+            }
+            const BatchOperation& op = ops[i];
+            BatchResult& result = results[i];
+            BankAccount* account = primary[i];
+            if (!account || (op.type == BatchOpType::Transfer && !secondary[i])) {
+                result.status = TxStatus::NotFound;
+                continue;
+            }
+            double& balance = balanceOf(account);
+            const ProductInfo& product = productInfo(account->getTypeCode());
+            switch (op.type) {
+                case BatchOpType::Balance:
+                    result.status = TxStatus::Ok;
+                    break;
+                case BatchOpType::Deposit:
+                    result.status = product.checkDeposit(product, balance, op.amount);
+                    if (result.status != TxStatus::Ok) break;
+                    balance += op.amount;
+                    record += "\n" + movementRecord('D', op.account, op.amount, now);
+                    messages.push_back("Deposit to " + op.account + ": " + to_string(op.amount) + " BDT");
+                    break;
+                case BatchOpType::Withdraw:
+                    result.status = account->verifyPassword(op.password)
+                                        ? product.checkWithdrawal(product, balance, op.amount) : TxStatus::BadPassword;
+                    if (result.status != TxStatus::Ok) break;
+                    if (!passesVelocityRules(*account, op.amount, now, nullptr, &pending)) {
+                        result.status = TxStatus::RuleBlocked;
+                        break;
+                    }
+                    velocity.hold(*account, toMinorUnits(op.amount), now, pending);
+                    balance -= op.amount + product.withdrawalFee;
+                    record += "\n" + movementRecord('W', op.account, op.amount, now, product.withdrawalFee);
+                    messages.push_back("Withdrawal from " + op.account + ": " + to_string(op.amount) + " BDT");
+                    break;
+                case BatchOpType::Transfer: {
+                    if (secondary[i] == account) {
+                        result.status = TxStatus::InvalidAmount;
+                        break;
+                    }
+                    result.status = op.preauthorized || account->verifyPassword(op.password)
+                                        ? checkTransferOut(product, balance, op.amount) : TxStatus::BadPassword;
+                    if (result.status != TxStatus::Ok) break;
+                    double& targetBalance = balanceOf(secondary[i]);
+                    const ProductInfo& targetProduct = productInfo(secondary[i]->getTypeCode());
+                    result.status = targetProduct.checkDeposit(targetProduct, targetBalance, op.amount);
+                    if (result.status != TxStatus::Ok) break;
+                    if (!passesVelocityRules(*account, op.amount, now, nullptr, &pending)) {
+                        result.status = TxStatus::RuleBlocked;
+                        break;
+                    }
+                    velocity.hold(*account, toMinorUnits(op.amount), now, pending);
+                    balance -= op.amount;
+                    targetBalance += op.amount;
+                    record += "\nT " + op.account + " " + op.target + " " + formatAmount(op.amount) + " " +
+                              to_string((long long)now);
+                    messages.push_back("Transfer from " + op.account + " to " + op.target + ": " +
+                                       to_string(op.amount) + " BDT");
+                    break;
+                }
+            }
+            result.balance = balance;
+            if (result.status == TxStatus::Ok && op.type != BatchOpType::Balance) accepted.push_back(i);
+        }
+        if (accepted.empty() && trailer.empty()) return results;
+        for (const string& line : trailer) record += "\n" + line;
+
+        if (!journalMutation(record)) {
+            for (uint32_t i : accepted) {
+                results[i].status = TxStatus::StorageError;
+                results[i].balance = primary[i]->getBalance();
+            }
+            return results;
+        }
+        recordsSinceCheckpoint += accepted.size() + trailer.size() - 1; // Replay cost is per operation
+        for (uint32_t i : accepted) {
+            const BatchOperation& op = ops[i];
+            switch (op.type) {
+                case BatchOpType::Deposit:
+                    credit(*primary[i], op.amount, now);
+                    break;
+                case BatchOpType::Withdraw:
+                    debit(*primary[i], op.amount, now, productInfo(primary[i]->getTypeCode()).withdrawalFee);
+                    velocity.record(*primary[i], toMinorUnits(op.amount), now);
+                    break;
+                default:
+                    transfer(*primary[i], *secondary[i], op.amount, now);
+                    velocity.record(*primary[i], toMinorUnits(op.amount), now);
+            }
+        }
+        for (const string& line : trailer) applyJournalRecord(line);
+        logTransactions(messages);
+        checkpointIfDue();
+        return results;
+    }
+
+    // Journal payload for a deposit ('D') or withdrawal ('W')
+    static string movementRecord(char type, const string& accNum, double amount, time_t when, double fee = 0.0) {
+        string record = string(1, type) + " " + accNum + " " + formatAmount(amount) + " " + to_string((long long)when);
+        if (fee > 0) record += " " + formatAmount(fee);
+        return record;
+    }
+
+    // Makes durable, and applies here, a D/W/X payload that another process
+    // has validated against its view of the balance. Deposits and
+    // withdrawals are checked again against the product rules here, where
+    // the balance is authoritative, and withdrawals are screened by the
+    // velocity rules, whose windows are kept here.
+    TxStatus applyMutation(const string& payload) {
+        if (payload.size() < 2) return TxStatus::StorageError;
+        istringstream in(payload.substr(2));
+        string accNum;
+        double amount = 0.0;
+        long long when = 0;
+        in >> accNum >> amount >> when;
+        BankAccount* target = findAccount(accNum);
+        if (!target) return TxStatus::NotFound;
+        if (payload[0] == 'D' || payload[0] == 'W') {
+            const ProductInfo& product = productInfo(target->getTypeCode());
+            TxStatus status = payload[0] == 'D' ? product.checkDeposit(product, target->getBalance(), amount)
+                                                : product.checkWithdrawal(product, target->getBalance(), amount);
+            if (status != TxStatus::Ok) return status;
+        }
+        BankAccount* account = payload[0] == 'W' ? target : nullptr;
+        if (account && !passesVelocityRules(*account, amount, (time_t)when)) return TxStatus::RuleBlocked;
+        if (!journalMutation(payload) || !applyJournalRecord(payload)) return TxStatus::StorageError;
+        if (account) velocity.record(*account, toMinorUnits(amount), (time_t)when);
+        if (payload[0] == 'D') {
+            logTransaction("Deposit to " + accNum + ": " + to_string(amount) + " BDT");
+        } else if (payload[0] == 'W') {
+            logTransaction("Withdrawal from " + accNum + ": " + to_string(amount) + " BDT");
+        } else {
+            ostringstream message;
+            message << "Account closed: " << accNum << ", paid out " << fixed << setprecision(2) << amount << " BDT";
+            logTransaction(message.str());
+        }
+        checkpointIfDue();
+        return TxStatus::Ok;
+    }
+
+    // Sets up a standing order paid from `from`, first executed at `first`,
+    // then every `every` days ('d') or months ('m'); `times` executions, or
+    // 0 until cancelled. Each execution is an ordinary transfer and is
+    // checked against the product and velocity rules when it runs.
+    TxStatus scheduleOrder(const string& from, const string& to, double amount, const string& password,
+                           time_t first, uint16_t every, char unit, int times, uint64_t* id = nullptr) {
+        BankAccount* source = findAccount(from);
+        if (!source || !findAccount(to)) return TxStatus::NotFound;
+        if (!source->verifyPassword(password)) return TxStatus::BadPassword;
+        if (from == to || !(amount > 0) || times < 0 || every < 1 || (unit != 'd' && unit != 'm')) {
+            return TxStatus::InvalidAmount;
+        }
+        StandingOrder order;
+        tm local = {};
+#ifdef _WIN32
+        localtime_s(&local, &first);
+#else
+        localtime_r(&first, &local);
+#endif
+        order.id = orders.nextOrderId();
+        order.from = from;
+        order.to = to;
+        order.amount = amount;
+        order.due = first;
+        order.every = every;
+        order.unit = unit;
+        order.anchorDay = (uint8_t)local.tm_mday;
+        order.remaining = times > 0 ? times : -1;
+        if (!journalMutation("S " + formatOrder(order))) return TxStatus::StorageError;
+        orders.add(order);
+        if (engine) dirtyOrders.insert(order.id);
+        if (id) *id = order.id;
+        logTransaction("Standing order " + to_string(order.id) + " set up from " + from + " to " + to + ": " +
+                       to_string(amount) + " BDT every " + to_string(every) + unit);
+        checkpointIfDue();
+        return TxStatus::Ok;
+    }
+
+    // Only the paying account's password can cancel an order
+    TxStatus cancelOrder(uint64_t id, const string& password) {
+        const StandingOrder* order = orders.find(id);
+        const BankAccount* source = order ? findAccount(order->from) : nullptr;
+        if (!source) return TxStatus::NotFound;
+        if (!source->verifyPassword(password)) return TxStatus::BadPassword;
+        if (!journalMutation("Z " + to_string(id))) return TxStatus::StorageError;
+        orders.cancel(id);
+        if (engine) dirtyOrders.insert(id);
+        logTransaction("Standing order " + to_string(id) + " cancelled");
+        checkpointIfDue();
+        return TxStatus::Ok;
+    }
+
+    // Orders paying from or into an account, soonest first
+    vector<StandingOrder> ordersFor(const string& accNum) const {
+        vector<StandingOrder> found;
+        orders.forEach([&](const StandingOrder& order) {
+            if (order.from == accNum || order.to == accNum) found.push_back(order);
+        });
+        sort(found.begin(), found.end(),
+             [](const StandingOrder& a, const StandingOrder& b) { return a.due < b.due; });
+        return found;
+    }
+
+    // Executes every standing order due by `now`, ORDER_BATCH_SIZE at a
+    // time through executeBatch(). Each batch's journal record also moves
+    // its orders on to their next execution, so a crash can neither repeat
+    // nor skip a payment. Occurrences missed while the bank was down come
+    // due again one round after another until the orders are caught up; a
+    // payment that is refused is skipped, not retried.
+    size_t runDueOrders(time_t now) {
+        size_t executed = 0;
+        vector<StandingOrder> due;
+        while (true) {
+            orders.takeDue(now, ORDER_BATCH_SIZE, due);
+            if (due.empty()) return executed;
+            vector<BatchOperation> ops;
+            vector<const StandingOrder*> paying;
+            vector<string> trailer, messages;
+            for (const StandingOrder& order : due) {
+                int32_t remaining = order.remaining < 0 ? -1 : order.remaining - 1;
+                if (!findAccount(order.from) || !findAccount(order.to)) {
+                    remaining = 0;
+                    messages.push_back("Standing order " + to_string(order.id) + " cancelled: account closed");
+                } else {
+                    BatchOperation op;
+                    op.type = BatchOpType::Transfer;
+                    op.account = order.from;
+                    op.target = order.to;
+                    op.amount = order.amount;
+                    op.preauthorized = true;
+                    ops.push_back(op);
+                    paying.push_back(&order);
+                }
+                trailer.push_back("N " + to_string(order.id) + " " + to_string(nextOccurrence(order)) + " " +
+                                  to_string(remaining));
+            }
+            vector<BatchResult> results = executeBatch(ops, trailer);
+            const StandingOrder* first = orders.find(due.front().id);
+            if (first && first->due == due.front().due) {
+                return executed; // Not journaled: the orders stay due for the next attempt
+            }
+            for (size_t i = 0; i < results.size(); ++i) {
+                if (results[i].status == TxStatus::Ok) {
+                    ++executed;
+                } else {
+                    messages.push_back("Standing order " + to_string(paying[i]->id) + " from " + paying[i]->from +
+                                       " to " + paying[i]->to + " failed: " + txStatusName(results[i].status));
+                }
+            }
+            logTransactions(messages);
+        }
+    }
+
+    vector<string> accountNumbers() const {
+        vector<string> numbers;
+        numbers.reserve(accounts.size());
+        accounts.forEach([&](const BankAccount& account) {
+            numbers.push_back(account.getAccountNumber());
+            return true;
+        });
+        return numbers;
+    }
+
+    size_t accountCount() const {
+        return accounts.size();
+    }
+
+    // One "Account Number: ... | Balance: ..." line per account, as printed
+    // by displayAllAccounts(), for accounts [offset, offset + limit)
+    vector<string> listAccounts(size_t offset, size_t limit) const {
+        PROFILE_REGION("listAccounts");
+        vector<string> lines;
+        string line;
+        size_t position = 0;
+        accounts.forEach([&](const BankAccount& account) {
+            if (position++ < offset) return true;
+            if (lines.size() >= limit) return false;
+            line.clear();
+            appendAccountLine(line, account);
+            line.pop_back();
+            lines.push_back(line);
+            return true;
+        });
+        return lines;
+    }
+
+    // One page of accounts in the requested order, filtered by product and
+    // balance range. Served from the sorted views, so a page costs
+    // O(log n + page) plus whatever the filters skip. False when the cursor
+    // does not belong to this order.
+    bool listPage(const ListQuery& query, ListPage& page) {
+        TRACE_SPAN("listPage");
+        PROFILE_REGION("listPage");
+        page.accounts.clear();
+        page.nextCursor.clear();
+        ListCursor cursor;
+        bool resume = !query.cursor.empty();
+        if (resume && !decodeListCursor(query.order, query.cursor, cursor)) return false;
+        if (!orderingsBuilt) buildOrderings();
+
+        size_t pageSize = max<size_t>(1, query.pageSize);
+        int64_t minMinor = isfinite(query.minBalance) ? toMinorUnits(query.minBalance) : INT64_MIN;
+        int64_t maxMinor = isfinite(query.maxBalance) ? toMinorUnits(query.maxBalance) : INT64_MAX;
+        // An empty range matches nothing, and would put the balance seek
+        // past the end of its range
+        if (minMinor > maxMinor) return true;
+        auto scan = [&](auto it, auto end) {
+            for (; it != end && page.accounts.size() < pageSize; ++it) {
+                const BankAccount* account = accounts.get(it->second);
+                if (query.typeCode >= 0 && account->getTypeCode() != query.typeCode) continue;
+                int64_t minor = toMinorUnits(account->getBalance());
+                if (minor < minMinor || minor > maxMinor) continue;
+                page.accounts.push_back(account);
+            }
+        };
+
+        switch (query.order) {
+        case ListOrder::Number:
+            scan(resume ? byNumber.upper_bound(cursor.id) : byNumber.begin(), byNumber.end());
+            break;
+        case ListOrder::Name:
+            scan(resume ? byName.upper_bound(make_pair(cursor.name, cursor.id)) : byName.begin(), byName.end());
+            break;
+        case ListOrder::Balance: {
+            // The balance range is a key range here: seek to it instead of filtering
+            if (resume && cursor.balanceMinor > maxMinor) break;
+            pair<int64_t, uint64_t> from(minMinor, 0);
+            auto it = byBalance.lower_bound(from);
+            if (resume && make_pair(cursor.balanceMinor, cursor.id) >= from) {
+                it = byBalance.upper_bound(make_pair(cursor.balanceMinor, cursor.id));
+            }
+            scan(it, maxMinor == INT64_MAX ? byBalance.end() : byBalance.upper_bound(make_pair(maxMinor, UINT64_MAX)));
+            break;
+        }
+        }
+        if (page.accounts.size() == pageSize) {
+            page.nextCursor = encodeListCursor(query.order, *page.accounts.back());
+        }
+        return true;
+    }
+
+    size_t recoveryTailLimit() const {
+        return maxTailRecords();
+    }
+
+    // Numbers for accounts built outside openAccount(); -1 on failure
+    long long reserveAccountNumbers(long long count) {
+        return numberAllocator.allocateRange(count);
+    }
+
+    // Appends fully built accounts, extends every index in one pass and makes
+    // them durable with a single checkpoint
+    bool commitNewAccounts(vector<BankAccount>& staged) {
+        accounts.reserve(accounts.size() + staged.size());
+        accountIndex.reserve(accounts.size() + staged.size());
+        for (auto& account : staged) {
+            registerCustomer(account.getPhoneNumber(), account.getEmail());
+            time_t when = account.getHistory().firstTime(time(0));
+            aggregates.accountOpened(account.getTypeCode(), account.getBalance(), when, true);
+            ledger.post(LEDGER_OPENED, when, LEDGER_CASH, ledger.accountFor(account.getId()),
+                        toMinorUnits(account.getBalance()));
+            string accNum = account.getAccountNumber();
+            AccountHandle handle = accounts.insert(std::move(account));
+            accountIndex.emplace(accNum, handle);
+            if (orderingsBuilt) indexOrderings(*accounts.get(handle), handle);
+            if (engine) dirtyAccounts.insert(accNum);
+        }
+        staged.clear();
+        return saveAccounts();
+    }
+
+    // Bulk onboarding. Rows are parsed and validated in parallel with the
+    // same rules as the interactive prompts, account numbers are allocated
+    // as one range, the index is extended in one pass and the whole batch
+    // becomes durable with a single checkpoint. Rejected rows go to
+    // `rejectPath` with the reason.
+    ImportReport importAccounts(const string& path, const string& rejectPath) {
+        TRACE_SPAN("importAccounts");
+        ImportReport report;
+        ifstream inFile(path, ios::binary);
+        if (!inFile) {
+            cerr << "Cannot open import file " << path << endl;
+            return report;
+        }
+        string contents((istreambuf_iterator<char>(inFile)), istreambuf_iterator<char>());
+
+        vector<pair<size_t, size_t>> lines; // Offset and length of each data row
+        size_t lineNumber = 0;
+        vector<size_t> lineNumbers;
+        for (size_t pos = 0; pos < contents.size();) {
+            size_t end = contents.find('\n', pos);
+            if (end == string::npos) end = contents.size();
+            ++lineNumber;
+            bool header = lineNumber == 1 && contents.compare(pos, 4, "name") == 0;
+            if (end > pos && !header) {
+                lines.emplace_back(pos, end - pos);
+                lineNumbers.push_back(lineNumber);
+            }
+            pos = end + 1;
+        }
+        report.rows = lines.size();
+
+        vector<CustomerRecord> records(lines.size());
+        parallelFor(lines.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                records[i].line = lineNumbers[i];
+                validateCustomerRow(contents.substr(lines[i].first, lines[i].second), records[i]);
+            }
+        });
+
+        // Customers already on file, or repeated earlier in the same file
+        unordered_set<uint64_t> batchPhones, batchEmails;
+        for (auto& record : records) {
+            if (!record.error.empty()) continue;
+            record.error = duplicateReason(record.phone, record.email);
+            if (!record.error.empty()) continue;
+            string phone = normalizePhone(record.phone);
+            if (!phone.empty() && !batchPhones.insert(hashKey(phone)).second) {
+                record.error = "Phone number repeats an earlier row";
+            } else if (!batchEmails.insert(hashKey(normalizeEmail(record.email))).second) {
+                record.error = "Email repeats an earlier row";
+            }
+        }
+
+        vector<size_t> accepted;
+        accepted.reserve(records.size());
+        ofstream rejectFile;
+        for (size_t i = 0; i < records.size(); ++i) {
+            if (records[i].error.empty()) {
+                accepted.push_back(i);
+                continue;
+            }
+            if (!rejectFile.is_open()) {
+                rejectFile.open(rejectPath, ios::trunc);
+                rejectFile << "line,reason,row\n";
+            }
+            rejectFile << records[i].line << ",\"" << records[i].error << "\","
+                       << contents.substr(lines[i].first, lines[i].second) << "\n";
+        }
+        report.rejected = records.size() - accepted.size();
+        if (accepted.empty()) return report;
+
+        long long first = numberAllocator.allocateRange((long long)accepted.size());
+        if (first < 0) return report;
+
+        vector<BankAccount> staged(accepted.size());
+        parallelFor(accepted.size(), [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; ++k) {
+                const CustomerRecord& r = records[accepted[k]];
+                staged[k] = BankAccount("ACCT" + to_string(first + (long long)k), r.name, r.address, r.phone,
+                                        r.email, r.deposit, r.accountType, r.password);
+            }
+        });
+
+        report.accepted = accepted.size();
+        report.firstAccount = staged.front().getAccountNumber();
+        report.lastAccount = staged.back().getAccountNumber();
+        report.committed = commitNewAccounts(staged);
+        logTransaction("Bulk import from " + path + ": " + to_string(report.accepted) + " accounts created (" +
+                       report.firstAccount + " to " + report.lastAccount + ")");
+        return report;
+    }
+
+    SessionTask createNewAccount(TellerIO& io) {
+        string name, address, phone, email, accountType, password;
+        double initialDeposit;
+
+        io.clearScreen();
+        io.out << "\n=== Create New Account ===" << endl;
+
+        co_await io.ignoreLine();
+
+        // Name validation
+        while (true) {
+            io.out << "Enter full name: ";
+            co_await io.readLine(name);
+            if (!name.empty()) break;
+            io.out << "Name cannot be empty. Please try again." << endl;
+        }
+
+        // Address validation
+        while (true) {
+            io.out << "Enter address: ";
+            co_await io.readLine(address);
+            if (!address.empty()) break;
+            io.out << "Address cannot be empty. Please try again." << endl;
+        }
+
+        // Phone validation
+        while (true) {
+            io.out << "Enter phone number: ";
+            co_await io.readLine(phone);
+            if (!allDigits(phone)) {
+                io.out << "Phone number must contain only digits. Please try again." << endl;
+            } else if (phoneInUse(phone)) {
+                io.out << "An account with this phone number already exists. Please try again." << endl;
+            } else {
+                break;
+            }
+        }
+
+        // Email validation (simple check)
+        while (true) {
+            io.out << "Enter email: ";
+            co_await io.readLine(email);
+            if (!validEmail(email)) {
+                io.out << "Invalid email format. Please try again." << endl;
+            } else if (emailInUse(email)) {
+                io.out << "An account with this email already exists. Please try again." << endl;
+            } else {
+                break;
+            }
+        }
+
+        // Account type validation
+        const ProductRegistry& products = ProductRegistry::instance();
+        int typeCode;
+        while (true) {
+            io.out << "Enter account type (" << products.namesList() << "): ";
+            co_await io.readLine(accountType);
+            typeCode = products.findCode(accountType);
+            if (typeCode >= 0) {
+                break;
+            }
+            io.out << "Invalid account type. Please enter one of: " << products.namesList() << "." << endl;
+        }
+
+        // Initial deposit validation
+        const ProductInfo& product = products[(uint8_t)typeCode];
+        double minDeposit = product.minOpeningDeposit;
+        while (true) {
+            io.out << "Enter initial deposit amount (minimum " << minDeposit << " BDT): ";
+            if (co_await io.read(initialDeposit)) {
+                string reason = checkOpeningDeposit(product, initialDeposit);
+                if (reason.empty()) {
+                    co_await io.ignore();
+                    break;
+                }
+                io.out << reason << endl;
+            } else {
+                io.out << "Invalid amount. Please enter a numeric value." << endl;
+                co_await io.ignoreLine();
+            }
+        }
+
+        // Password validation
+        io.out << "Set a " << MIN_PASSWORD_LENGTH << "-digit password for withdrawals: ";
+        co_await io.readHidden(password);
+        while (!validPassword(password)) {
+            io.out << "\nPassword must be " << MIN_PASSWORD_LENGTH << " digits. Please try again: ";
+            co_await io.readHidden(password);
+        }
+
+        string accNum = openAccount(name, address, phone, email, initialDeposit, accountType, password);
+        if (accNum.empty()) {
+            io.out << "\n\nAccount could not be created. Please try again later." << endl;
+            co_return;
+        }
+
+        string successMsg = "Account created: " + accNum + " for " + name;
+        io.out << "\n\n" << successMsg << endl;
+
+        io.out << "\n=== Account Created Successfully ===" << endl;
+        io.out << "Account Number: " << accNum << endl;
+        io.out << "Account Holder: " << name << endl;
+        io.out << "Account Type: " << accountType << endl;
+        io.out << "Initial Balance: " << fixed << setprecision(2) << initialDeposit << " BDT" << endl;
+        io.out << "==================================\n" << endl;
+    }
+
+    SessionTask depositMoney(TellerIO& io) {
+        TRACE_SPAN("depositMoney");
+        string accNum;
+        double amount;
+
+        io.clearScreen();
+        io.out << "\n=== Deposit Money ===" << endl;
+        io.out << "Enter account number: ";
+        co_await io.read(accNum);
+
+        BankAccount* account = findAccount(accNum);
+        if (account) {
+            io.out << "Account holder: " << account->getAccountHolderName() << endl;
+            io.out << "Current balance: " << fixed << setprecision(2) << account->getBalance() << " BDT" << endl;
+            
+            while (true) {
+                io.out << "Enter deposit amount: ";
+                if (co_await io.read(amount)) {
+                    // Other sessions may have changed the accounts while this one waited
+                    account = findAccount(accNum);
+                    if (!account) {
+                        io.out << "Account not found." << endl;
+                        break;
+                    }
+                    time_t now = time(0);
+                    if (account->checkDeposit(amount) == TxStatus::Ok &&
+                        !journalMutation(movementRecord('D', accNum, amount, now))) {
+                        io.out << "Deposit failed. The transaction could not be recorded." << endl;
+                        break;
+                    }
+                    double before = account->getBalance();
+                    if (account->deposit(amount, now, io.out)) {
+                        balanceMoved(*account, before, now);
+                        ledgerCredit(*account, amount, now);
+                        logTransaction("Deposit to " + accNum + ": " + to_string(amount) + " BDT");
+                        checkpointIfDue();
+                    }
+                    break;
+                } else {
+                    io.out << "Invalid amount. Please enter a numeric value." << endl;
+                    co_await io.ignoreLine();
+                }
+            }
+        } else {
+            io.out << "Account not found." << endl;
+        }
+    }
+
+    SessionTask withdrawMoney(TellerIO& io) {
+        TRACE_SPAN("withdrawMoney");
+        string accNum, password;
+        double amount;
+
+        io.clearScreen();
+        io.out << "\n=== Withdraw Money ===" << endl;
+        io.out << "Enter account number: ";
+        co_await io.read(accNum);
+
+        BankAccount* account = findAccount(accNum);
+        if (account) {
+            io.out << "Account holder: " << account->getAccountHolderName() << endl;
+            io.out << "Current balance: " << fixed << setprecision(2) << account->getBalance() << " BDT" << endl;
+            
+            io.out << "Enter your " << MIN_PASSWORD_LENGTH << "-digit password: ";
+            co_await io.ignore();
+            co_await io.readHidden(password);
+            io.out << endl;
+
+            while (true) {
+                io.out << "Enter withdrawal amount: ";
+                if (co_await io.read(amount)) {
+                    // Other sessions may have changed the accounts while this one waited
+                    account = findAccount(accNum);
+                    if (!account) {
+                        io.out << "Account not found." << endl;
+                        break;
+                    }
+                    time_t now = time(0);
+                    bool allowed = account->checkWithdrawal(amount, password) == TxStatus::Ok;
+                    string rule;
+                    if (allowed && !passesVelocityRules(*account, amount, now, &rule)) {
+                        io.out << "Withdrawal blocked by the " << rule << " rule. Please contact the bank." << endl;
+                        break;
+                    }
+                    if (allowed && !journalMutation(movementRecord('W', accNum, amount, now, account->withdrawalFee()))) {
+                        io.out << "Withdrawal failed. The transaction could not be recorded." << endl;
+                        break;
+                    }
+                    double before = account->getBalance();
+                    double fee = account->withdrawalFee();
+                    if (account->withdraw(amount, password, now, io.out)) {
+                        balanceMoved(*account, before, now);
+                        ledgerDebit(*account, amount, now, fee);
+                        velocity.record(*account, toMinorUnits(amount), now);
+                        logTransaction("Withdrawal from " + accNum + ": " + to_string(amount) + " BDT");
+                        checkpointIfDue();
+                    }
+                    break;
+                } else {
+                    io.out << "Invalid amount. Please enter a numeric value." << endl;
+                    co_await io.ignoreLine();
+                }
+            }
+        } else {
+            io.out << "Account not found." << endl;
+        }
+    }
+
+    SessionTask transferMoney(TellerIO& io) {
+        BatchOperation transfer;
+        transfer.type = BatchOpType::Transfer;
+
+        io.clearScreen();
+        io.out << "\n=== Transfer Money ===" << endl;
+        io.out << "Enter source account number: ";
+        co_await io.read(transfer.account);
+
+        BankAccount* account = findAccount(transfer.account);
+        if (!account) {
+            io.out << "Account not found." << endl;
+            co_return;
+        }
+        io.out << "Account holder: " << account->getAccountHolderName() << endl;
+        io.out << "Current balance: " << fixed << setprecision(2) << account->getBalance() << " BDT" << endl;
+
+        io.out << "Enter your " << MIN_PASSWORD_LENGTH << "-digit password: ";
+        co_await io.ignore();
+        co_await io.readHidden(transfer.password);
+        io.out << endl;
+
+        io.out << "Enter destination account number: ";
+        co_await io.read(transfer.target);
+        io.out << "Enter transfer amount: ";
+        while (!(co_await io.read(transfer.amount))) {
+            io.out << "Invalid amount. Please enter a numeric value: ";
+            co_await io.ignoreLine();
+        }
+
+        BatchResult result = executeBatch(vector<BatchOperation>(1, transfer))[0];
+        switch (result.status) {
+            case TxStatus::Ok:
+                io.out << "Transfer successful. New balance: " << fixed << setprecision(2) << result.balance
+                        << " BDT" << endl;
+                break;
+            case TxStatus::NotFound:
+                io.out << "Destination account not found." << endl;
+                break;
+            case TxStatus::BadPassword:
+                io.out << "Invalid password. Transfer failed." << endl;
+                break;
+            case TxStatus::InsufficientFunds:
+                io.out << "Insufficient funds." << endl;
+                break;
+            case TxStatus::BelowMinimum:
+                io.out << "Transfer failed. Minimum balance requirement not met." << endl;
+                break;
+            case TxStatus::StorageError:
+                io.out << "Transfer failed. The transaction could not be recorded." << endl;
+                break;
+            case TxStatus::RuleBlocked:
+                io.out << "Transfer blocked by a security rule. Please contact the bank." << endl;
+                break;
+            default:
+                io.out << "Transfer failed: " << txStatusName(result.status) << endl;
+        }
+    }
+
+    SessionTask standingOrdersMenu(TellerIO& io) {
+        string accNum, password;
+        int choice;
+
+        io.clearScreen();
+        io.out << "\n=== Standing Orders ===" << endl;
+        io.out << "Enter account number: ";
+        co_await io.read(accNum);
+
+        if (!findAccount(accNum)) {
+            io.out << "Account not found." << endl;
+            co_return;
+        }
+        vector<StandingOrder> found = ordersFor(accNum);
+        if (found.empty()) {
+            io.out << "No standing orders for this account." << endl;
+        } else {
+            string lines;
+            for (const StandingOrder& order : found) appendOrderLine(lines, order);
+            io.out << lines;
+        }
+
+        io.out << "\n1. New standing order\n2. Cancel a standing order\n3. Back\nEnter your choice: ";
+        if (!(co_await io.read(choice)) || choice < 1 || choice > 2) {
+            co_return;
+        }
+
+        io.out << "Enter your " << MIN_PASSWORD_LENGTH << "-digit password: ";
+        co_await io.ignore();
+        co_await io.readHidden(password);
+        io.out << endl;
+
+        TxStatus status;
+        if (choice == 1) {
+            string target, date, interval;
+            double amount;
+            int times;
+            time_t first;
+            uint16_t every;
+            char unit;
+            io.out << "Enter destination account number: ";
+            co_await io.read(target);
+            io.out << "Enter amount: ";
+            while (!(co_await io.read(amount))) {
+                io.out << "Invalid amount. Please enter a numeric value: ";
+                co_await io.ignoreLine();
+            }
+            io.out << "Enter first payment date (YYYY-MM-DD): ";
+            while (co_await io.read(date) && !parseOrderStart(date, first)) {
+                io.out << "Invalid date. Please use YYYY-MM-DD: ";
+            }
+            io.out << "Repeat every (e.g. 7d for 7 days, 1m for monthly): ";
+            while (co_await io.read(interval) && !parseOrderInterval(interval, every, unit)) {
+                io.out << "Invalid interval. Please enter a number followed by d or m: ";
+            }
+            io.out << "Number of payments (0 until cancelled): ";
+            while (!(co_await io.read(times)) || times < 0) {
+                io.out << "Please enter 0 or a positive number: ";
+                co_await io.ignoreLine();
+            }
+
+            uint64_t id = 0;
+            status = scheduleOrder(accNum, target, amount, password, first, every, unit, times, &id);
+            if (status == TxStatus::Ok) {
+                io.out << "Standing order " << id << " set up." << endl;
+                co_return;
+            }
+        } else {
+            uint64_t id;
+            io.out << "Enter standing order number: ";
+            if (!(co_await io.read(id))) {
+                io.out << "Standing order not found." << endl;
+                co_return;
+            }
+            status = cancelOrder(id, password);
+            if (status == TxStatus::Ok) {
+                io.out << "Standing order " << id << " cancelled." << endl;
+                co_return;
+            }
+        }
+        switch (status) {
+            case TxStatus::NotFound:
+                io.out << (choice == 1 ? "Destination account not found." : "Standing order not found.") << endl;
+                break;
+            case TxStatus::BadPassword:
+                io.out << "Invalid password." << endl;
+                break;
+            case TxStatus::InvalidAmount:
+                io.out << "Invalid amount or destination." << endl;
+                break;
+            default:
+                io.out << "The standing order could not be recorded. Please try again later." << endl;
+        }
+    }
+
+    SessionTask closeAccountMenu(TellerIO& io) {
+        string accNum, password, confirm;
+
+        io.clearScreen();
+        io.out << "\n=== Close Account ===" << endl;
+        io.out << "Enter account number: ";
+        co_await io.read(accNum);
+
+        BankAccount* account = findAccount(accNum);
+        if (!account) {
+            io.out << "Account not found." << endl;
+            co_return;
+        }
+        io.out << "Account holder: " << account->getAccountHolderName() << endl;
+        io.out << "Current balance: " << fixed << setprecision(2) << account->getBalance() << " BDT" << endl;
+
+        io.out << "Enter your " << MIN_PASSWORD_LENGTH << "-digit password: ";
+        co_await io.ignore();
+        co_await io.readHidden(password);
+        io.out << endl;
+
+        io.out << "Close this account and pay out the full balance? (y/n): ";
+        co_await io.read(confirm);
+        if (confirm != "y" && confirm != "Y") {
+            io.out << "Account was not closed." << endl;
+            co_return;
+        }
+
+        double payout = 0.0;
+        switch (closeAccount(accNum, password, &payout)) {
+            case TxStatus::Ok:
+                io.out << "Account " << accNum << " closed. Paid out " << fixed << setprecision(2) << payout
+                        << " BDT." << endl;
+                break;
+            case TxStatus::BadPassword:
+                io.out << "Invalid password. Account was not closed." << endl;
+                break;
+            default:
+                io.out << "Account could not be closed. Please try again later." << endl;
+        }
+    }
+
+    SessionTask checkBalance(TellerIO& io) {
+        string accNum;
+
+        io.clearScreen();
+        io.out << "\n=== Check Balance ===" << endl;
+        io.out << "Enter account number: ";
+        co_await io.read(accNum);
+
+        BankAccount* account = findAccount(accNum);
+        if (account) {
+            io.out << "Account holder: " << account->getAccountHolderName() << endl;
+            io.out << "Account type: " << account->getAccountType() << endl;
+            io.out << "Current balance: " << fixed << setprecision(2) << account->getBalance() << " BDT" << endl;
+        } else {
+            io.out << "Account not found." << endl;
+        }
+    }
+
+    SessionTask displayAccountDetails(TellerIO& io) {
+        string accNum;
+
+        io.clearScreen();
+        io.out << "\n=== Account Details ===" << endl;
+        io.out << "Enter account number: ";
+        co_await io.read(accNum);
+
+        BankAccount* account = findAccount(accNum);
+        if (account) {
+            account->displayAccountInfo(io.out);
+        } else {
+            io.out << "Account not found." << endl;
+        }
+    }
+
+    SessionTask viewTransactionHistory(TellerIO& io) {
+        string accNum;
+
+        io.clearScreen();
+        io.out << "\n=== Transaction History ===" << endl;
+        io.out << "Enter account number: ";
+        co_await io.read(accNum);
+
+        BankAccount* account = findAccount(accNum);
+        if (account) {
+            withHistory(*account, [&](const CompressedHistory& history) {
+                account->displayTransactionHistory(io.out, &history);
+            });
+        } else {
+            io.out << "Account not found." << endl;
+        }
+    }
+
+    SessionTask displayAllAccounts(TellerIO& io) {
+        TRACE_SPAN("displayAllAccounts");
+        PROFILE_REGION("displayAllAccounts");
+        io.clearScreen();
+        io.out<<"Enter Admin Password:";
+        string admin_pass;
+        co_await io.read(admin_pass);
+        if(admin_pass=="2255"){
+            ListQuery query;
+            int order = 1;
+            io.out << "Sort by (1) Account number (2) Holder name (3) Balance: ";
+            if (!(co_await io.read(order)) || order < 1 || order > 3) {
+                co_await io.ignoreLine();
+                order = 1;
+            }
+            query.order = (ListOrder)(order - 1);
+
+            string type;
+            io.out << "Account type (\"all\" for every type): ";
+            co_await io.read(type);
+            if (type != "all") {
+                query.typeCode = ProductRegistry::instance().findCode(type);
+                if (query.typeCode < 0) io.out << "Unknown account type, showing every type." << endl;
+            }
+
+            const char* boundPrompts[] = {"Minimum balance (0 for none): ", "Maximum balance (0 for none): "};
+            double* limits[] = {&query.minBalance, &query.maxBalance};
+            for (int i = 0; i < 2; ++i) {
+                double bound;
+                io.out << boundPrompts[i];
+                if (co_await io.read(bound)) {
+                    if (bound > 0) *limits[i] = bound;
+                } else {
+                    co_await io.ignoreLine();
+                }
+            }
+
+            // Each page is built in one buffer and written in a single call
+            string out;
+            out.reserve(query.pageSize * 128);
+            out = "\n=== All Accounts ===\n";
+            ListPage page;
+            size_t shown = 0;
+            while (listPage(query, page)) {
+                for (const BankAccount* account : page.accounts) appendAccountLine(out, *account);
+                shown += page.accounts.size();
+                if (shown == 0) out += "No accounts found.\n";
+                io.out << out;
+                out.clear();
+                if (page.nextCursor.empty()) break;
+                io.out << "-- " << shown << " shown. n for the next page, q to stop: " << flush;
+                string reply;
+                if (!(co_await io.read(reply)) || reply == "q" || reply == "Q") break;
+                query.cursor = page.nextCursor;
+            }
+            io.out << "\n=== Totals ===\n" << renderAggregates(aggregates.snapshot()) << "=====================\n" << endl;
+        }
+        else{
+            io.out<<"\nInvalid Pass"<<endl;
+            co_return;
+         }
+    }
+};
+
+void displayMenu(ostream& out) {
+    out << "\n=== Banking System Menu ===" << endl;
+    out << "1. Create New Account" << endl;
+    out << "2. Deposit Money" << endl;
+    out << "3. Withdraw Money" << endl;
+    out << "4. Check Balance" << endl;
+    out << "5. Display Account Details" << endl;
+    out << "6. View Transaction History" << endl;
+    out << "7. View All Accounts" << endl;
+    out << "8. Close Account" << endl;
+    out << "9. Transfer Money" << endl;
+    out << "10. Standing Orders" << endl;
+    out << "11. Exit" << endl;
+    out << "==========================" << endl;
+    out << "Enter your choice (1-11): ";
+}
+
+// One teller at the menu, from the welcome line until they choose Exit or
+// their input ends
+SessionTask tellerSession(BankingSystem& bank, TellerIO& io) {
+    int choice;
+
+    io.out << "Welcome to the Banking System" << endl;
+
+    while (true) {
+        bank.runDueOrders(time(0));
+        displayMenu(io.out);
+
+        if (!(co_await io.read(choice))) {
+            co_await io.ignoreLine();
+            io.out << "Invalid input. Please enter a number between 1 and 11." << endl;
+            continue;
+        }
+
+        switch (choice) {
+            case 1:
+                co_await bank.createNewAccount(io);
+                break;
+            case 2:
+                co_await bank.depositMoney(io);
+                break;
+            case 3:
+                co_await bank.withdrawMoney(io);
+                break;
+            case 4:
+                co_await bank.checkBalance(io);
+                break;
+            case 5:
+                co_await bank.displayAccountDetails(io);
+                break;
+            case 6:
+                co_await bank.viewTransactionHistory(io);
+                break;
+            case 7:
+                co_await bank.displayAllAccounts(io);
+                break;
+            case 8:
+                co_await bank.closeAccountMenu(io);
+                break;
+            case 9:
+                co_await bank.transferMoney(io);
+                break;
+            case 10:
+                co_await bank.standingOrdersMenu(io);
+                break;
+            case 11:
+                io.out << "Thank you for using our Banking System. Goodbye!" << endl;
+                co_return;
+            default:
+                io.out << "Invalid choice. Please enter a number between 1 and 11." << endl;
+        }
+
+        io.out << "\nPress Enter to continue...";
+        co_await io.ignore();
+        co_await io.get();
+    }
+}
+
+// The console is a single session fed one line of stdin at a time
+int runConsoleSession() {
+    BankingSystem bank;
+    TellerIO io(true);
+    SessionTask session = tellerSession(bank, io);
+    io.begin(session);
+    string line;
+    while (true) {
+        cout << io.takeOutput() << flush;
+        if (io.hasEnded(session)) break;
+        if (getline(cin, line)) {
+            line += '\n';
+            io.feed(line.data(), line.size());
+        } else {
+            io.close();
+        }
+    }
+    session.rethrowIfFailed();
+    return 0;
+}
+
+// ================= Crash-injection test harness =================
+// Each iteration forks a worker that runs random operations in a scratch
+// directory and is killed at a random crash point (possibly mid-write). The
+// parent records which operations were acknowledged, runs recovery, and
+// checks that every acknowledged operation survived and nothing else did.
+#ifndef _WIN32
+int runCrashTest(int iterations, unsigned seed) {
+    char dirTemplate[] = "/tmp/bms-crash-XXXXXX";
+    if (!mkdtemp(dirTemplate) || chdir(dirTemplate) != 0) {
+        cerr << "Could not create scratch directory for crash test." << endl;
+        return 1;
+    }
+
+    mt19937 rng(seed);
+    map<string, double> expected;
+    int crashes = 0, failures = 0;
+    long long worstRecoveryMs = 0;
+    long boundMs = DEFAULT_RECOVERY_BOUND_MS;
+    if (const char* bound = getenv("BMS_RECOVERY_BOUND_MS")) boundMs = max(1L, atol(bound));
+
+    for (int iter = 0; iter < iterations; ++iter) {
+        int fds[2];
+        if (pipe(fds) != 0) return 1;
+        unsigned workerSeed = rng();
+        long countdown = (long)(rng() % 400);
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            ::close(fds[0]);
+            if (!freopen("/dev/null", "w", stdout)) _exit(2);
+            srand(workerSeed);
+            crashCountdown = countdown;
+            FILE* acks = fdopen(fds[1], "w");
+            setvbuf(acks, nullptr, _IONBF, 0);
+            {
+                BankingSystem bank;
+                mt19937 workerRng(workerSeed);
+                for (int op = 0; op < 200; ++op) {
+                    vector<string> numbers = bank.accountNumbers();
+                    unsigned kind = numbers.empty() ? 0 : workerRng() % 10;
+                    if (kind == 0) {
+                        double deposit = 500 + workerRng() % 1000;
+                        fprintf(acks, "I C - %.2f\n", deposit);
+                        string tag = to_string(iter) + "-" + to_string(op);
+                        string accNum = bank.openAccount("Crash Test", "Scratch", "017" + to_string(workerSeed % 100000) + to_string(op),
+                                                         "crash" + tag + "@test.local", deposit, "Current", "1234");
+                        fprintf(acks, "A %s\n", accNum.empty() ? "-" : accNum.c_str());
+                    } else {
+                        string accNum = numbers[workerRng() % numbers.size()];
+                        double amount = 1 + workerRng() % 300;
+                        char type = kind < 6 ? 'D' : 'W';
+                        fprintf(acks, "I %c %s %.2f\n", type, accNum.c_str(), amount);
+                        TxStatus status = type == 'D' ? bank.postDeposit(accNum, amount)
+                                                      : bank.postWithdrawal(accNum, amount, "1234");
+                        fprintf(acks, "A %d\n", (int)status);
+                    }
+                }
+            }
+            _exit(0);
+        }
+
+        ::close(fds[1]);
+        string output;
+        char buf[4096];
+        ssize_t n;
+        while ((n = ::read(fds[0], buf, sizeof(buf))) > 0) output.append(buf, (size_t)n);
+        ::close(fds[0]);
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if (WIFSIGNALED(status)) ++crashes;
+
+        // Fold acknowledged operations into the model; remember the one in flight
+        istringstream lines(output);
+        string line, inflightAcc;
+        char inflightType = 0;
+        double inflightAmount = 0;
+        while (getline(lines, line)) {
+            istringstream fields(line);
+            string tag;
+            fields >> tag;
+            if (tag == "I") {
+                fields >> inflightType >> inflightAcc >> inflightAmount;
+            } else if (tag == "A" && inflightType != 0) {
+                string result;
+                fields >> result;
+                if (inflightType == 'C' && result != "-") {
+                    if (expected.count(result)) {
+                        cerr << "Iteration " << iter << ": account number " << result << " was issued twice" << endl;
+                        ++failures;
+                    }
+                    expected[result] = inflightAmount;
+                } else if (inflightType != 'C' && result == to_string((int)TxStatus::Ok)) {
+                    expected[inflightAcc] += inflightType == 'D' ? inflightAmount : -inflightAmount;
+                }
+                inflightType = 0;
+            }
+        }
+
+        streambuf* savedOut = cout.rdbuf(nullptr);
+        auto start = chrono::steady_clock::now();
+        BankingSystem bank;
+        long long recoveryMs = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+        cout.rdbuf(savedOut);
+        cout.clear();
+        worstRecoveryMs = max(worstRecoveryMs, recoveryMs);
+
+        for (const string& accNum : bank.accountNumbers()) {
+            const BankAccount* account = bank.lookupAccount(accNum);
+            auto it = expected.find(accNum);
+            if (it == expected.end()) {
+                if (inflightType == 'C' && fabs(account->getBalance() - inflightAmount) < 0.005) {
+                    expected[accNum] = inflightAmount; // Journaled but not acknowledged
+                    continue;
+                }
+                cerr << "Iteration " << iter << ": unexpected account " << accNum << endl;
+                ++failures;
+                continue;
+            }
+            double want = it->second;
+            double got = account->getBalance();
+            if (fabs(got - want) < 0.005) continue;
+            double delta = inflightType == 'D' ? inflightAmount : -inflightAmount;
+            if ((inflightType == 'D' || inflightType == 'W') && inflightAcc == accNum &&
+                fabs(got - (want + delta)) < 0.005) {
+                it->second = got;
+                continue;
+            }
+            cerr << "Iteration " << iter << ": " << accNum << " balance " << fixed << setprecision(2)
+                 << got << " BDT, expected " << want << " BDT" << endl;
+            ++failures;
+        }
+        for (const auto& entry : expected) {
+            if (!bank.lookupAccount(entry.first)) {
+                cerr << "Iteration " << iter << ": acknowledged account " << entry.first << " was lost" << endl;
+                ++failures;
+            }
+        }
+    }
+
+    cout << "Crash test: " << iterations << " iterations, " << crashes << " crashes, "
+         << expected.size() << " accounts, worst recovery " << worstRecoveryMs
+         << " ms (bound " << boundMs << " ms), " << failures << " failures" << endl;
+    cout << "Scratch directory: " << dirTemplate << endl;
+    return failures == 0 ? 0 : 1;
+}
+#endif
+
+// ================= History encoding benchmark =================
+// Compares the compressed history block with the old one-string-per-entry
+// representation (size on disk and in memory) and measures decode speed.
+int runHistoryBenchmark(size_t accountCount, size_t entriesPerAccount) {
+    mt19937 rng(12345);
+    vector<CompressedHistory> histories(accountCount);
+    size_t legacyDiskBytes = 0, legacyMemoryBytes = 0, totalEntries = 0;
+    time_t start = time(0) - (time_t)entriesPerAccount * 3600;
+
+    for (auto& history : histories) {
+        time_t when = start;
+        history.append(HIST_OPENED, when, toMinorUnits(500 + rng() % 5000));
+        for (size_t i = 1; i < entriesPerAccount; ++i) {
+            when += 60 + rng() % 7200;
+            double amount = (1 + rng() % 200000) / 100.0;
+            if (rng() % 3 == 0) {
+                history.append(HIST_WITHDRAWAL, when, -toMinorUnits(amount));
+            } else {
+                history.append(HIST_DEPOSIT, when, toMinorUnits(amount));
+            }
+        }
+        history.shrinkToFit();
+        history.forEach([&](const HistoryEntry& entry) {
+            string line = CompressedHistory::render(entry);
+            legacyDiskBytes += line.size() + 1;
+            legacyMemoryBytes += sizeof(string) + (line.size() > 15 ? line.size() + 1 : 0);
+            ++totalEntries;
+        });
+    }
+
+    size_t encodedBytes = 0, memoryBytes = 0;
+    for (const auto& history : histories) {
+        encodedBytes += history.encodedBytes();
+        memoryBytes += history.memoryBytes();
+    }
+
+    int64_t checksum = 0;
+    size_t passes = 0;
+    auto begin = chrono::steady_clock::now();
+    chrono::duration<double> elapsed(0);
+    while (elapsed.count() < 1.0) {
+        for (const auto& history : histories) {
+            history.forEach([&](const HistoryEntry& entry) { checksum += entry.amountMinor + entry.op; });
+        }
+        ++passes;
+        elapsed = chrono::steady_clock::now() - begin;
+    }
+
+    double decodedMB = (double)encodedBytes * passes / 1e6;
+    cout << fixed << setprecision(2);
+    cout << "Entries: " << totalEntries << " in " << accountCount << " accounts" << endl;
+    cout << "On disk:   legacy " << legacyDiskBytes / 1e6 << " MB, compressed " << encodedBytes / 1e6
+         << " MB (" << (double)legacyDiskBytes / encodedBytes << "x smaller)" << endl;
+    cout << "In memory: legacy " << legacyMemoryBytes / 1e6 << " MB, compressed " << memoryBytes / 1e6
+         << " MB (" << (double)legacyMemoryBytes / memoryBytes << "x smaller)" << endl;
+    cout << "Decode: " << decodedMB / elapsed.count() << " MB/s of encoded history, "
+         << totalEntries * passes / elapsed.count() / 1e6 << " M entries/s (checksum " << checksum % 1000 << ")" << endl;
+    return 0;
+}
+
+// ================= Daemon =================
+// Line protocol over a Unix socket, one request per line:
+//   CREATE name|address|phone|email|type|deposit|password  -> OK <account>
+//   DEPOSIT <account> <amount>                              -> OK <balance>
+//   WITHDRAW <account> <amount> <password>                  -> OK <balance>
+//   CLOSE <account> <password>                              -> OK <amount paid out>
+//   BALANCE <account>                                       -> OK <balance>
+//   HISTORY <account>                                       -> OK <n>, then n lines
+//   LIST <offset> <limit>                                   -> OK <n>, then n lines
+//   PAGE <number|name|balance> <size> [<cursor>|-] [type=<T>] [min=<x>] [max=<x>]
+//                                                           -> OK <n> <next cursor|->, then n lines
+//   ASOF <account> <YYYY-MM-DD[ HH:MM[:SS]]>                -> OK <balance at that time>
+//   SCHEDULE <from> <to> <amount> <password> <YYYY-MM-DD> <Nd|Nm> [<times>]
+//                                                           -> OK <order id>
+//   CANCEL <order id> <password>                            -> OK
+//   ORDERS <account>                                        -> OK <n>, then n lines
+//   STATS                                                   -> OK <n>, then n lines of totals
+//   LEDGER                                                  -> OK <n>, then the trial balance and
+//                                                              ledger validation in n lines
+//   BATCH <n>, then n DEPOSIT/WITHDRAW/TRANSFER/BALANCE lines -> OK <n>, then one
+//                                                              OK <balance> or ERR line each
+//   PREPARE <transfer id> DEBIT <account> <amount> <password> -> OK <balance>
+//   PREPARE <transfer id> CREDIT <account> <amount>          -> OK <balance>
+//   COMMIT <transfer id> / ABORT <transfer id>               -> OK
+//     (the two phases of a cross-shard transfer, sent by the shard router)
+//   QUIT
+// Failures answer "ERR <reason>".
+string formatBalance(double balance) {
+    ostringstream out;
+    out << fixed << setprecision(2) << balance;
+    return out.str();
+}
+
+// Executes the lines following "BATCH <n>" as one batch
+string handleBatch(BankingSystem& bank, const vector<string>& lines) {
+    vector<BatchOperation> ops(lines.size());
+    vector<bool> parsed(lines.size());
+    vector<BatchOperation> valid;
+    for (size_t i = 0; i < lines.size(); ++i) {
+        parsed[i] = parseBatchLine(lines[i], ops[i]);
+        if (parsed[i]) valid.push_back(ops[i]);
+    }
+    vector<BatchResult> results = bank.executeBatch(valid);
+    string response = "OK " + to_string(lines.size()) + "\n";
+    for (size_t i = 0, next = 0; i < lines.size(); ++i) {
+        if (!parsed[i]) {
+            response += "ERR BAD_REQUEST\n";
+            continue;
+        }
+        const BatchResult& result = results[next++];
+        response += result.status == TxStatus::Ok ? "OK " + formatBalance(result.balance) + "\n"
+                                                  : string("ERR ") + txStatusName(result.status) + "\n";
+    }
+    return response;
+}
+
+// Runs a file of batch lines (see parseBatchLine), `batchSize` lines per
+// batch, printing one OK/ERR line per operation in input order
+int runBatchFile(const string& path, size_t batchSize) {
+    ifstream inFile(path);
+    if (!inFile) {
+        cerr << "Cannot open batch file " << path << endl;
+        return 1;
+    }
+    BankingSystem bank;
+    vector<string> lines;
+    size_t operations = 0, rejected = 0, batches = 0;
+    auto start = chrono::steady_clock::now();
+    auto runPending = [&] {
+        if (lines.empty()) return;
+        string response = handleBatch(bank, lines);
+        response.erase(0, response.find('\n') + 1);
+        for (size_t pos = 0; pos < response.size(); pos = response.find('\n', pos) + 1) {
+            rejected += response.compare(pos, 3, "ERR") == 0;
+        }
+        cout << response;
+        operations += lines.size();
+        ++batches;
+        lines.clear();
+    };
+    string line;
+    while (getline(inFile, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        lines.push_back(line);
+        if (lines.size() >= batchSize) runPending();
+    }
+    runPending();
+    cerr << operations << " operations in " << batches << " batches, " << rejected << " rejected, " << fixed
+         << setprecision(2) << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s" << endl;
+    return 0;
+}
+
+#ifndef _WIN32
+volatile sig_atomic_t stopRequested = 0;
+
+void requestStop(int) {
+    stopRequested = 1;
+}
+
+string handleRequest(BankingSystem& bank, const string& line) {
+    TRACE_SPAN("handleRequest");
+    istringstream in(line);
+    string command;
+    in >> command;
+
+    if (command == "CREATE") {
+        string rest;
+        getline(in >> ws, rest);
+        vector<string> fields;
+        stringstream restStream(rest);
+        string field;
+        while (getline(restStream, field, '|')) fields.push_back(field);
+        CustomerRecord record;
+        validateCustomerFields(fields, record);
+        if (!record.error.empty()) return "ERR " + record.error + "\n";
+        TxStatus status;
+        string accNum = bank.openAccount(record.name, record.address, record.phone, record.email,
+                                         record.deposit, record.accountType, record.password, &status);
+        return accNum.empty() ? string("ERR ") + txStatusName(status) + "\n" : "OK " + accNum + "\n";
+    }
+
+    if (command == "DEPOSIT" || command == "WITHDRAW") {
+        string accNum, password;
+        double amount;
+        if (!(in >> accNum >> amount)) return "ERR BAD_REQUEST\n";
+        TxStatus status;
+        if (command == "DEPOSIT") {
+            status = bank.postDeposit(accNum, amount);
+        } else {
+            in >> password;
+            status = bank.postWithdrawal(accNum, amount, password);
+        }
+        if (status != TxStatus::Ok) return string("ERR ") + txStatusName(status) + "\n";
+        return "OK " + formatBalance(bank.lookupAccount(accNum)->getBalance()) + "\n";
+    }
+
+    if (command == "CLOSE") {
+        string accNum, password;
+        if (!(in >> accNum >> password)) return "ERR BAD_REQUEST\n";
+        double payout = 0.0;
+        TxStatus status = bank.closeAccount(accNum, password, &payout);
+        if (status != TxStatus::Ok) return string("ERR ") + txStatusName(status) + "\n";
+        return "OK " + formatBalance(payout) + "\n";
+    }
+
+    if (command == "BALANCE" || command == "HISTORY") {
+        string accNum;
+        in >> accNum;
+        const BankAccount* account = bank.lookupAccount(accNum);
+        if (!account) return "ERR NOT_FOUND\n";
+        if (command == "BALANCE") return "OK " + formatBalance(account->getBalance()) + "\n";
+        return bank.withHistory(*account, [](const CompressedHistory& history) {
+            string response = "OK " + to_string(history.size()) + "\n";
+            history.forEach([&](const HistoryEntry& entry) {
+                response += CompressedHistory::render(entry);
+                response += '\n';
+            });
+            return response;
+        });
+    }
+
+    if (command == "ASOF") {
+        string accNum, moment;
+        in >> accNum;
+        getline(in >> ws, moment);
+        time_t when;
+        if (accNum.empty() || !parseDateTime(moment, when)) return "ERR BAD_REQUEST\n";
+        if (!bank.lookupAccount(accNum)) return "ERR NOT_FOUND\n";
+        double balance = 0.0;
+        if (!bank.balanceAsOf(accNum, when, balance)) return "ERR NOT_OPEN\n";
+        return "OK " + formatBalance(balance) + "\n";
+    }
+
+    if (command == "SCHEDULE") {
+        string from, to, password, date, interval;
+        double amount;
+        int times = 0;
+        if (!(in >> from >> to >> amount >> password >> date >> interval)) return "ERR BAD_REQUEST\n";
+        in >> times;
+        time_t first;
+        uint16_t every;
+        char unit;
+        if (!parseOrderStart(date, first) || !parseOrderInterval(interval, every, unit)) return "ERR BAD_REQUEST\n";
+        uint64_t id = 0;
+        TxStatus status = bank.scheduleOrder(from, to, amount, password, first, every, unit, times, &id);
+        if (status != TxStatus::Ok) return string("ERR ") + txStatusName(status) + "\n";
+        return "OK " + to_string(id) + "\n";
+    }
+
+    if (command == "CANCEL") {
+        uint64_t id;
+        string password;
+        if (!(in >> id >> password)) return "ERR BAD_REQUEST\n";
+        TxStatus status = bank.cancelOrder(id, password);
+        return status == TxStatus::Ok ? "OK\n" : string("ERR ") + txStatusName(status) + "\n";
+    }
+
+    if (command == "ORDERS") {
+        string accNum;
+        in >> accNum;
+        if (!bank.lookupAccount(accNum)) return "ERR NOT_FOUND\n";
+        vector<StandingOrder> found = bank.ordersFor(accNum);
+        string response = "OK " + to_string(found.size()) + "\n";
+        for (const StandingOrder& order : found) appendOrderLine(response, order);
+        return response;
+    }
+
+    if (command == "PREPARE") {
+        PreparedLeg leg;
+        string side, password;
+        if (!(in >> leg.id >> side >> leg.account >> leg.amount) || (side != "DEBIT" && side != "CREDIT")) {
+            return "ERR BAD_REQUEST\n";
+        }
+        leg.side = side[0];
+        in >> password;
+        double balance = 0.0;
+        TxStatus status = bank.prepareTransferLeg(leg, password, &balance);
+        if (status != TxStatus::Ok) return string("ERR ") + txStatusName(status) + "\n";
+        return "OK " + formatBalance(balance) + "\n";
+    }
+
+    if (command == "COMMIT" || command == "ABORT") {
+        string id;
+        if (!(in >> id)) return "ERR BAD_REQUEST\n";
+        TxStatus status = bank.resolveTransferLeg(id, command == "COMMIT");
+        return status == TxStatus::Ok ? "OK\n" : string("ERR ") + txStatusName(status) + "\n";
+    }
+
+    if (command == "STATS") {
+        string text = renderAggregates(bank.aggregateSnapshot());
+        return "OK " + to_string(count(text.begin(), text.end(), '\n')) + "\n" + text;
+    }
+
+    if (command == "LEDGER") {
+        string text = renderLedgerCheck(bank.checkLedger());
+        return "OK " + to_string(count(text.begin(), text.end(), '\n')) + "\n" + text;
+    }
+
+    if (command == "LIST") {
+        size_t offset = 0, limit = 100;
+        in >> offset >> limit;
+        vector<string> lines = bank.listAccounts(offset, limit);
+        string response = "OK " + to_string(lines.size()) + "\n";
+        for (const auto& entry : lines) {
+            response += entry;
+            response += '\n';
+        }
+        return response;
+    }
+
+    if (command == "PAGE") {
+        ListQuery query;
+        string order, cursor, option;
+        if (!(in >> order >> query.pageSize) || !parseListOrder(order, query.order)) return "ERR BAD_REQUEST\n";
+        if (in >> cursor && cursor != "-") query.cursor = cursor;
+        while (in >> option) {
+            if (option.compare(0, 5, "type=") == 0) {
+                query.typeCode = ProductRegistry::instance().findCode(option.substr(5));
+                if (query.typeCode < 0) return "ERR UNKNOWN_TYPE\n";
+            } else if (option.compare(0, 4, "min=") == 0) {
+                query.minBalance = strtod(option.c_str() + 4, nullptr);
+            } else if (option.compare(0, 4, "max=") == 0) {
+                query.maxBalance = strtod(option.c_str() + 4, nullptr);
+            } else {
+                return "ERR BAD_REQUEST\n";
+            }
+        }
+        ListPage page;
+        if (!bank.listPage(query, page)) return "ERR BAD_CURSOR\n";
+        string response = "OK " + to_string(page.accounts.size()) + " " +
+                          (page.nextCursor.empty() ? "-" : page.nextCursor) + "\n";
+        for (const BankAccount* account : page.accounts) appendAccountLine(response, *account);
+        return response;
+    }
+
+    return "ERR UNKNOWN_COMMAND\n";
+}
+
+// Listening Unix socket for the servers below, or -1 after reporting why not
+int listenOnSocket(const string& socketPath) {
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socketPath.c_str());
+    unlink(socketPath.c_str());
+    if (listenFd < 0 || ::bind(listenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, 1024) != 0) {
+        cerr << "Cannot listen on " << socketPath << ": " << strerror(errno) << endl;
+        if (listenFd >= 0) ::close(listenFd);
+        return -1;
+    }
+    return listenFd;
+}
+
+int runDaemon(const string& socketPath) {
+    BankingSystem bank;
+
+    int listenFd = listenOnSocket(socketPath);
+    if (listenFd < 0) return 1;
+    signal(SIGINT, requestStop);
+    signal(SIGTERM, requestStop);
+    signal(SIGPIPE, SIG_IGN);
+    cout << "Serving " << bank.accountCount() << " accounts on " << socketPath << endl;
+
+    struct Client {
+        int fd;
+        string input;
+    };
+    vector<Client> clients;
+    while (!stopRequested) {
+        bank.runDueOrders(time(0));
+        vector<pollfd> fds;
+        fds.push_back({listenFd, POLLIN, 0});
+        for (const auto& client : clients) fds.push_back({client.fd, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), 200) <= 0) continue;
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd >= 0) clients.push_back({fd, ""});
+        }
+        for (size_t i = 1; i < fds.size(); ++i) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            Client& client = clients[i - 1];
+            char buf[65536];
+            ssize_t n = ::read(client.fd, buf, sizeof(buf));
+            bool closed = n <= 0;
+            if (n > 0) client.input.append(buf, (size_t)n);
+
+            size_t start = 0, newline;
+            string output;
+            while ((newline = client.input.find('\n', start)) != string::npos) {
+                string request = client.input.substr(start, newline - start);
+                if (request == "QUIT") {
+                    closed = true;
+                    break;
+                }
+                if (request.compare(0, 6, "BATCH ") == 0) {
+                    // Wait until every line of the batch has arrived
+                    size_t count = strtoul(request.c_str() + 6, nullptr, 10);
+                    vector<string> lines;
+                    size_t cursor = newline + 1, end;
+                    while (lines.size() < count && (end = client.input.find('\n', cursor)) != string::npos) {
+                        lines.push_back(client.input.substr(cursor, end - cursor));
+                        cursor = end + 1;
+                    }
+                    if (lines.size() < count) break;
+                    output += handleBatch(bank, lines);
+                    start = cursor;
+                    continue;
+                }
+                start = newline + 1;
+                output += handleRequest(bank, request);
+            }
+            client.input.erase(0, start);
+            size_t written = 0;
+            while (written < output.size()) {
+                ssize_t w = ::write(client.fd, output.data() + written, output.size() - written);
+                if (w <= 0) {
+                    closed = true;
+                    break;
+                }
+                written += (size_t)w;
+            }
+            if (closed) {
+                ::close(client.fd);
+                client.fd = -1;
+            }
+        }
+        clients.erase(remove_if(clients.begin(), clients.end(), [](const Client& c) { return c.fd < 0; }),
+                      clients.end());
+    }
+
+    for (const auto& client : clients) ::close(client.fd);
+    ::close(listenFd);
+    unlink(socketPath.c_str());
+    cout << "Daemon stopped; checkpointing." << endl;
+    return 0;
+}
+
+// A client connection served by a session coroutine. The socket is
+// non-blocking, so a client that stops reading holds back only its own output.
+struct SessionConnection {
+    int fd;
+    TellerIO io;
+    SessionTask session;
+    string unsent;
+    bool hungUp = false; // Client gone; the session may still be finishing a request
+
+    explicit SessionConnection(int socketFd) : fd(socketFd) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    pollfd pollEntry() const {
+        return {hungUp ? -1 : fd, (short)(POLLIN | (unsent.empty() ? 0 : POLLOUT)), 0};
+    }
+
+    // Sends what the session wrote; false once the connection is unusable
+    bool flush() {
+        unsent += io.takeOutput();
+        size_t written = 0;
+        while (written < unsent.size()) {
+            ssize_t w = ::write(fd, unsent.data() + written, unsent.size() - written);
+            if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (w <= 0) return false;
+            written += (size_t)w;
+        }
+        unsent.erase(0, written);
+        if (unsent.empty()) string().swap(unsent);
+        return true;
+    }
+
+    void hangUp() {
+        hungUp = true;
+        string().swap(unsent);
+        io.close();
+    }
+
+    // Handles poll results and output from a resumed session; false once
+    // the session has ended
+    bool service(short revents) {
+        if (!hungUp && (revents & (POLLIN | POLLHUP | POLLERR))) {
+            char buf[4096];
+            ssize_t n = ::read(fd, buf, sizeof(buf));
+            if (n > 0) {
+                io.feed(buf, (size_t)n);
+            } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                hangUp();
+            }
+        }
+        if (hungUp) {
+            io.takeOutput();
+        } else if (!flush()) {
+            hangUp();
+        }
+        return !io.hasEnded(session);
+    }
+};
+
+// Accepts one waiting client and starts `session` for it
+template <class StartSession>
+void acceptSession(int listenFd, vector<unique_ptr<SessionConnection>>& connections, StartSession start) {
+    int fd = accept(listenFd, nullptr, nullptr);
+    if (fd < 0) return;
+    unique_ptr<SessionConnection> connection(new SessionConnection(fd));
+    connection->session = start(connection->io);
+    connection->io.begin(connection->session);
+    if (connection->flush()) {
+        connections.push_back(move(connection));
+    } else {
+        ::close(fd);
+    }
+}
+
+// Services the connections whose poll entries start at fds[first], then
+// drops the ones that ended. A session that failed is logged and closes
+// only its own connection.
+void serviceSessions(vector<unique_ptr<SessionConnection>>& connections, const vector<pollfd>& fds, size_t first) {
+    for (size_t i = 0; i < connections.size(); ++i) {
+        SessionConnection& connection = *connections[i];
+        // Connections accepted after the poll have no entry yet. Output can
+        // also come from a session resumed by something other than its socket.
+        short revents = first + i < fds.size() ? fds[first + i].revents : 0;
+        if (!revents && !connection.io.hasOutput() && !connection.hungUp) continue;
+        if (!connection.service(revents)) {
+            try {
+                connection.session.rethrowIfFailed();
+            } catch (const exception& e) {
+                cerr << "Session on connection " << connection.fd << " failed: " << e.what() << endl;
+            } catch (...) {
+                cerr << "Session on connection " << connection.fd << " failed." << endl;
+            }
+            ::close(connection.fd);
+            connection.fd = -1;
+        }
+    }
+    connections.erase(remove_if(connections.begin(), connections.end(),
+                                [](const unique_ptr<SessionConnection>& c) { return c->fd < 0; }),
+                      connections.end());
+}
+
+// Interactive teller sessions over a Unix socket, one coroutine per
+// connection on this one thread
+int runTellers(const string& socketPath) {
+    BankingSystem bank;
+
+    int listenFd = listenOnSocket(socketPath);
+    if (listenFd < 0) return 1;
+    signal(SIGINT, requestStop);
+    signal(SIGTERM, requestStop);
+    signal(SIGPIPE, SIG_IGN);
+    cout << "Serving teller sessions for " << bank.accountCount() << " accounts on " << socketPath << endl;
+
+    vector<unique_ptr<SessionConnection>> tellers;
+    vector<pollfd> fds;
+    while (!stopRequested) {
+        bank.runDueOrders(time(0));
+        fds.clear();
+        fds.push_back({listenFd, POLLIN, 0});
+        for (const auto& teller : tellers) fds.push_back(teller->pollEntry());
+        if (poll(fds.data(), fds.size(), 200) <= 0) continue;
+
+        if (fds[0].revents & POLLIN) {
+            acceptSession(listenFd, tellers, [&](TellerIO& io) { return tellerSession(bank, io); });
+        }
+        serviceSessions(tellers, fds, 1);
+    }
+
+    for (const auto& teller : tellers) ::close(teller->fd);
+    ::close(listenFd);
+    unlink(socketPath.c_str());
+    cout << "Teller service stopped; checkpointing." << endl;
+    return 0;
+}
+
+// Number of lines after the status line in the answer to `request`
+size_t responseBodyLines(const string& request, const string& status) {
+    bool multiLine = request.compare(0, 7, "HISTORY") == 0 || request.compare(0, 4, "LIST") == 0 ||
+                     request.compare(0, 4, "PAGE") == 0 || request.compare(0, 5, "BATCH") == 0 ||
+                     request.compare(0, 5, "STATS") == 0 || request.compare(0, 6, "ORDERS") == 0 ||
+                     request.compare(0, 6, "LEDGER") == 0;
+    return multiLine && status.compare(0, 3, "OK ") == 0 ? strtoul(status.c_str() + 3, nullptr, 10) : 0;
+}
+
+// Blocking client used by the tools that drive a running daemon
+class DaemonClient {
+private:
+    int fd = -1;
+    string buffer;
+
+    bool readLine(string& line) {
+        size_t newline;
+        while ((newline = buffer.find('\n')) == string::npos) {
+            char buf[65536];
+            ssize_t n = ::read(fd, buf, sizeof(buf));
+            if (n <= 0) return false;
+            buffer.append(buf, (size_t)n);
+        }
+        line = buffer.substr(0, newline);
+        buffer.erase(0, newline + 1);
+        return true;
+    }
+
+public:
+    ~DaemonClient() {
+        if (fd >= 0) ::close(fd);
+    }
+
+    bool connectTo(const string& socketPath) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socketPath.c_str());
+        return fd >= 0 && connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0;
+    }
+
+    // Sends one request; `body` receives the extra lines of HISTORY/LIST/BATCH/ORDERS
+    bool request(const string& line, string& status, vector<string>* body = nullptr) {
+        string message = line + "\n";
+        if (::write(fd, message.data(), message.size()) != (ssize_t)message.size()) return false;
+        if (!readLine(status)) return false;
+        size_t count = responseBodyLines(line, status);
+        string entry;
+        for (size_t i = 0; i < count; ++i) {
+            if (!readLine(entry)) return false;
+            if (body) body->push_back(entry);
+        }
+        return true;
+    }
+};
+
+// ================= Sharded deployment =================
+// `shards N [socket]` runs N daemons, each in its own directory
+// (SHARD_DIR_PREFIX<i>) with its own journal and checkpoints, behind a
+// router that speaks the daemon protocol on the public socket. Shard i
+// numbers new accounts from ACCT<1001 + i * SHARD_ACCOUNT_RANGE> and its
+// standing orders from i << 40, so the router finds the shard of an account
+// or order from the number alone. CREATE goes to the shard picked by a hash
+// of the phone number, which keeps phone numbers unique across the bank;
+// e-mail addresses are unique per shard only.
+//
+// A transfer between shards is a two-phase commit run by the router: it
+// logs the transfer durably in COORDINATOR_LOG, has the source shard
+// prepare the debit and the target shard prepare the credit, logs a commit
+// durably if both agreed, sends the decision to both and logs the end. On
+// start the router settles whatever its log left open: committed transfers
+// are committed again and the rest aborted. A shard that stops takes the
+// deployment down with it; the next start settles its transfers.
+//
+// The router runs on one thread. Each client connection is a session
+// coroutine, and the connection to each shard is pipelined, so requests
+// for different shards are served in parallel.
+
+string shardSocketPath(const string& socketPath, size_t shard) {
+    return socketPath + "." + to_string(shard);
+}
+
+// Pipelined connection from the router to one shard. The shard answers in
+// request order, so each complete answer belongs to the oldest open call.
+class ShardLink {
+public:
+    struct Call {
+        ShardLink& link;
+        TellerIO& io;
+        string request;
+        string& response;
+        coroutine_handle<> waiter;
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(coroutine_handle<> caller) {
+            if (link.broken()) {
+                response = "ERR SHARD_UNAVAILABLE\n";
+                return false;
+            }
+            waiter = caller;
+            link.send(this);
+            return true;
+        }
+        void await_resume() const noexcept {}
+    };
+
+    ~ShardLink() {
+        if (fd >= 0) ::close(fd);
+    }
+
+    // Waits up to `patience` for the shard to accept connections
+    bool connectTo(const string& socketPath, chrono::milliseconds patience) {
+        auto deadline = chrono::steady_clock::now() + patience;
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socketPath.c_str());
+        while (true) {
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd >= 0 && connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0) break;
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+            if (chrono::steady_clock::now() > deadline) return false;
+            this_thread::sleep_for(chrono::milliseconds(20));
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        return true;
+    }
+
+    // co_await sends `request` (one line, or a BATCH with its lines) and
+    // resumes with the complete answer in `response`
+    Call call(TellerIO& io, const string& request, string& response) {
+        return {*this, io, request, response, {}};
+    }
+
+    bool broken() const { return fd < 0; }
+
+    pollfd pollEntry() const {
+        return {fd, (short)(POLLIN | (outbox.empty() ? 0 : POLLOUT)), 0};
+    }
+
+    void service(short revents) {
+        if (revents & POLLOUT) flush();
+        if (!(revents & (POLLIN | POLLHUP | POLLERR))) return;
+        char buf[65536];
+        ssize_t n = ::read(fd, buf, sizeof(buf));
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) {
+            fail();
+            return;
+        }
+        inbox.append(buf, (size_t)n);
+        string response;
+        while (!calls.empty() && takeResponse(calls.front()->request, response)) {
+            Call* done = calls.front();
+            calls.pop_front();
+            done->response.swap(response);
+            done->io.resume(done->waiter);
+        }
+    }
+
+    // The shard is gone: every open call is answered with an error
+    void fail() {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        while (!calls.empty()) {
+            Call* done = calls.front();
+            calls.pop_front();
+            done->response = "ERR SHARD_UNAVAILABLE\n";
+            done->io.resume(done->waiter);
+        }
+    }
+
+private:
+    int fd = -1;
+    deque<Call*> calls;
+    string inbox;
+    string outbox;
+    size_t inboxStart = 0;
+
+    void send(Call* call) {
+        calls.push_back(call);
+        outbox += call->request;
+        outbox += '\n';
+        flush();
+    }
+
+    void flush() {
+        size_t written = 0;
+        while (written < outbox.size()) {
+            ssize_t w = ::write(fd, outbox.data() + written, outbox.size() - written);
+            if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (w <= 0) break; // Reported by the next read
+            written += (size_t)w;
+        }
+        outbox.erase(0, written);
+    }
+
+    // Cuts the answer to `request` off the inbox once all of it has arrived
+    bool takeResponse(const string& request, string& response) {
+        size_t newline = inbox.find('\n', inboxStart);
+        if (newline == string::npos) return false;
+        size_t end = newline + 1;
+        size_t body = responseBodyLines(request, inbox.substr(inboxStart, newline - inboxStart));
+        for (size_t i = 0; i < body; ++i) {
+            newline = inbox.find('\n', end);
+            if (newline == string::npos) return false;
+            end = newline + 1;
+        }
+        response.assign(inbox, inboxStart, end - inboxStart);
+        inboxStart = end;
+        if (inboxStart == inbox.size() || inboxStart > 65536) {
+            inbox.erase(0, inboxStart);
+            inboxStart = 0;
+        }
+        return true;
+    }
+};
+
+// Durable record of the transfers the router coordinates:
+//   B <id> <source shard> <target shard> <from> <to> <amount>   begun
+//   C <id>                                                      committed
+//   E <id>                                                      both shards told
+// An abort is not logged: a transfer begun and never committed is aborted.
+class CoordinatorLog {
+public:
+    struct OpenTransfer {
+        uint64_t id;
+        size_t source, target;
+        bool committed;
+    };
+
+    ~CoordinatorLog() {
+        if (fd >= 0) ::close(fd);
+    }
+
+    // Transfers the previous run left unfinished; `highestId` receives the
+    // largest transfer id it used
+    vector<OpenTransfer> unfinished(uint64_t& highestId) const {
+        map<uint64_t, OpenTransfer> open;
+        ifstream in(COORDINATOR_LOG, ios::binary);
+        uint64_t seq;
+        string payload;
+        while (in && in.peek() != EOF && readFramedRecord(in, "R", seq, payload)) {
+            istringstream fields(payload);
+            char type;
+            uint64_t id;
+            if (!(fields >> type >> id)) break;
+            highestId = max(highestId, id);
+            if (type == 'B') {
+                OpenTransfer transfer{id, 0, 0, false};
+                fields >> transfer.source >> transfer.target;
+                open[id] = transfer;
+            } else if (type == 'C' && open.count(id)) {
+                open[id].committed = true;
+            } else if (type == 'E') {
+                open.erase(id);
+            }
+        }
+        vector<OpenTransfer> result;
+        for (const auto& entry : open) result.push_back(entry.second);
+        return result;
+    }
+
+    // Starts an empty log once everything in the old one is settled
+    bool reset() {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        bytes = 0;
+        if (!publishFileAtomically(COORDINATOR_LOG, "")) return false;
+        fd = ::open(COORDINATOR_LOG.c_str(), O_WRONLY | O_APPEND);
+        return fd >= 0;
+    }
+
+    bool append(const string& payload, bool durable) {
+        string record = frameRecord("R", ++seq, payload);
+        bytes += record.size();
+        return fd >= 0 && writeAll(fd, record) && (!durable || fdatasync(fd) == 0);
+    }
+
+    size_t size() const { return bytes; }
+
+private:
+    int fd = -1;
+    uint64_t seq = 0;
+    size_t bytes = 0;
+};
+
+const size_t COORDINATOR_LOG_LIMIT = 64 << 20; // Log size that triggers a reset when every transfer is settled
+const int SHARD_DECISION_ATTEMPTS = 5;          // Sends of a COMMIT/ABORT before the shard counts as failed
+
+class ShardRouter {
+public:
+    vector<unique_ptr<ShardLink>> links;
+
+    explicit ShardRouter(size_t shards) {
+        for (size_t i = 0; i < shards; ++i) links.emplace_back(new ShardLink);
+    }
+
+    // A shard that would not take a decision counts as broken: the deployment
+    // stops, and the next start settles the transfer from the log
+    bool anyLinkBroken() const {
+        if (decisionUndelivered) return true;
+        for (const auto& link : links) {
+            if (link->broken()) return true;
+        }
+        return false;
+    }
+
+    // Settles the transfers left open in COORDINATOR_LOG, over blocking
+    // connections, and starts a fresh log
+    bool settleTransfers(const string& socketPath) {
+        uint64_t highestId = 0;
+        vector<CoordinatorLog::OpenTransfer> open = log.unfinished(highestId);
+        if (!open.empty()) {
+            vector<DaemonClient> shards(links.size());
+            for (size_t i = 0; i < links.size(); ++i) {
+                if (!shards[i].connectTo(shardSocketPath(socketPath, i))) return false;
+            }
+            for (const auto& transfer : open) {
+                string decision = (transfer.committed ? "COMMIT " : "ABORT ") + to_string(transfer.id);
+                for (size_t shard : {transfer.source, transfer.target}) {
+                    string status;
+                    if (shard >= shards.size() || !shards[shard].request(decision, status) || status != "OK") {
+                        cerr << "Could not settle transfer " << transfer.id << " on shard " << shard << endl;
+                        return false;
+                    }
+                }
+            }
+            cout << "Settled " << open.size() << " cross-shard transfer(s) left open by the last run" << endl;
+        }
+        // Ids stay unique across restarts even after the log is emptied
+        nextTransferId = max(highestId + 1, (uint64_t)time(0) << 20);
+        return log.reset();
+    }
+
+    size_t shardOf(const string& accNum) const {
+        if (accNum.compare(0, 4, "ACCT") != 0) return 0;
+        long long shard = (atoll(accNum.c_str() + 4) - 1001) / SHARD_ACCOUNT_RANGE;
+        return shard < 0 || shard >= (long long)links.size() ? 0 : (size_t)shard;
+    }
+
+    // Answers one request line other than BATCH
+    SessionTask route(TellerIO& io, const string& request, string& response) {
+        istringstream in(request);
+        string command, key;
+        in >> command >> key;
+        size_t shard = shardOf(key);
+        if (command == "CREATE") {
+            // Fields: name|address|phone|...
+            size_t first = request.find('|'), second = request.find('|', first + 1);
+            string phone = second == string::npos ? "" : request.substr(second + 1, request.find('|', second + 1) - second - 1);
+            shard = hashKey(phone) % links.size();
+        } else if (command == "SCHEDULE") {
+            string target;
+            in >> target;
+            if (shardOf(target) != shard) {
+                response = "ERR CROSS_SHARD\n";
+                co_return;
+            }
+        } else if (command == "CANCEL") {
+            uint64_t id = strtoull(key.c_str(), nullptr, 10);
+            shard = (id >> 40) < links.size() ? (size_t)(id >> 40) : 0;
+        } else if (command == "STATS" || command == "LEDGER" || command == "LIST") {
+            co_await gather(io, request, response);
+            co_return;
+        } else if (command == "PAGE") {
+            co_await page(io, request, response);
+            co_return;
+        } else if (command == "PREPARE" || command == "COMMIT" || command == "ABORT") {
+            response = "ERR UNKNOWN_COMMAND\n";
+            co_return;
+        }
+        co_await links[shard]->call(io, request, response);
+    }
+
+    // Single-shard operations go to their shards as one sub-batch each;
+    // transfers between shards then commit one by one
+    SessionTask batch(TellerIO& io, const vector<string>& lines, string& response) {
+        vector<string> results(lines.size());
+        vector<vector<size_t>> perShard(links.size());
+        vector<BatchOperation> ops(lines.size());
+        vector<size_t> crossShard;
+        for (size_t i = 0; i < lines.size(); ++i) {
+            if (!parseBatchLine(lines[i], ops[i])) {
+                results[i] = "ERR BAD_REQUEST";
+                continue;
+            }
+            size_t shard = shardOf(ops[i].account);
+            if (ops[i].type == BatchOpType::Transfer && shardOf(ops[i].target) != shard) {
+                crossShard.push_back(i);
+            } else {
+                perShard[shard].push_back(i);
+            }
+        }
+        for (size_t shard = 0; shard < links.size(); ++shard) {
+            if (perShard[shard].empty()) continue;
+            string request = "BATCH " + to_string(perShard[shard].size());
+            for (size_t i : perShard[shard]) request += "\n" + lines[i];
+            string reply;
+            co_await links[shard]->call(io, request, reply);
+            istringstream answers(reply);
+            string status, answer;
+            getline(answers, status);
+            for (size_t i : perShard[shard]) {
+                results[i] = status.compare(0, 3, "OK ") == 0 && getline(answers, answer) ? answer : status;
+            }
+        }
+        for (size_t i : crossShard) co_await transfer(io, ops[i], results[i]);
+        response = "OK " + to_string(lines.size()) + "\n";
+        for (const string& result : results) response += result + "\n";
+    }
+
+private:
+    CoordinatorLog log;
+    uint64_t nextTransferId = 1;
+    size_t unsettledTransfers = 0;  // Begun and not yet given their E record
+    bool decisionUndelivered = false;
+
+    // Sends a decision until the shard acknowledges it; repeats are harmless
+    // (see resolveTransferLeg). False if it never did.
+    SessionTask deliver(TellerIO& io, size_t shard, const string& decision, bool& acknowledged) {
+        acknowledged = false;
+        for (int attempt = 0; attempt < SHARD_DECISION_ATTEMPTS && !acknowledged; ++attempt) {
+            string ack;
+            co_await links[shard]->call(io, decision, ack);
+            acknowledged = ack == "OK\n";
+            if (!acknowledged) cerr << "Shard " << shard << " answered " << decision << " with " << ack;
+        }
+    }
+
+    // Two-phase commit of one transfer; `result` is its batch answer line
+    SessionTask transfer(TellerIO& io, const BatchOperation& op, string& result) {
+        size_t source = shardOf(op.account), target = shardOf(op.target);
+        string id = to_string(nextTransferId++);
+        string amount = formatAmount(op.amount);
+        if (!log.append("B " + id + " " + to_string(source) + " " + to_string(target) + " " + op.account + " " +
+                        op.target + " " + amount, true)) {
+            result = "ERR STORAGE_ERROR";
+            co_return;
+        }
+        ++unsettledTransfers;
+        string debit, credit;
+        string prepare = "PREPARE " + id + " DEBIT " + op.account + " " + amount + " " + op.password;
+        co_await links[source]->call(io, prepare, debit);
+        bool commit = debit.compare(0, 3, "OK ") == 0;
+        if (commit) {
+            prepare = "PREPARE " + id + " CREDIT " + op.target + " " + amount;
+            co_await links[target]->call(io, prepare, credit);
+            commit = credit.compare(0, 3, "OK ") == 0;
+        }
+        // Only a commit must be durable before anyone hears of it
+        if (commit && !log.append("C " + id, true)) {
+            commit = false;
+            credit = "ERR STORAGE_ERROR\n";
+        }
+        // The E record, and with it a log reset, waits for both shards to
+        // acknowledge; otherwise the next start settles the transfer
+        string decision = (commit ? "COMMIT " : "ABORT ") + id;
+        bool sourceAcked = false, targetAcked = false;
+        co_await deliver(io, source, decision, sourceAcked);
+        co_await deliver(io, target, decision, targetAcked);
+        if (sourceAcked && targetAcked && log.append("E " + id, false)) {
+            --unsettledTransfers;
+            if (unsettledTransfers == 0 && log.size() > COORDINATOR_LOG_LIMIT) log.reset();
+        } else {
+            cerr << "Transfer " << id << " is not settled on both shards." << endl;
+            decisionUndelivered = true;
+        }
+
+        result = commit || debit.compare(0, 3, "OK ") != 0 ? debit : credit;
+        result.pop_back();
+    }
+
+    // STATS, LEDGER and LIST over every shard, in shard order
+    SessionTask gather(TellerIO& io, const string& request, string& response) {
+        bool report = request.compare(0, 4, "LIST") != 0;
+        size_t offset = 0, limit = 100;
+        if (!report) istringstream(request.substr(4)) >> offset >> limit;
+        vector<string> lines;
+        for (size_t shard = 0; shard < links.size(); ++shard) {
+            if (!report && lines.size() >= offset + limit) break;
+            string part = report ? request : "LIST 0 " + to_string(offset + limit - lines.size()), reply;
+            co_await links[shard]->call(io, part, reply);
+            if (reply.compare(0, 3, "OK ") != 0) {
+                response = reply;
+                co_return;
+            }
+            istringstream answers(reply);
+            string line;
+            getline(answers, line);
+            if (report) lines.push_back("Shard " + to_string(shard));
+            while (getline(answers, line)) lines.push_back(line);
+        }
+        size_t first = report ? 0 : min(offset, lines.size());
+        size_t last = report ? lines.size() : min(offset + limit, lines.size());
+        response = "OK " + to_string(last - first) + "\n";
+        for (size_t i = first; i < last; ++i) response += lines[i] + "\n";
+    }
+
+    // PAGE walks the shards in turn, so its order holds within each shard;
+    // the router's cursor is "<shard>/<that shard's cursor>"
+    SessionTask page(TellerIO& io, const string& request, string& response) {
+        istringstream in(request);
+        string command, order, cursor, option, options;
+        size_t size = 0;
+        in >> command >> order >> size;
+        if (!(in >> cursor)) cursor = "-";
+        while (in >> option) options += " " + option;
+        size_t shard = 0;
+        string inner = "-";
+        if (cursor != "-") {
+            size_t slash = cursor.find('/');
+            shard = strtoul(cursor.c_str(), nullptr, 10);
+            if (slash == string::npos || shard >= links.size()) {
+                response = "ERR BAD_CURSOR\n";
+                co_return;
+            }
+            inner = cursor.substr(slash + 1);
+        }
+        size = max<size_t>(1, size);
+        string lines;
+        size_t count = 0;
+        while (shard < links.size() && count < size) {
+            string part = "PAGE " + order + " " + to_string(size - count) + " " + inner + options, reply;
+            co_await links[shard]->call(io, part, reply);
+            istringstream answers(reply);
+            string status, ok, next, line;
+            getline(answers, status);
+            size_t n = 0;
+            if (!(istringstream(status) >> ok >> n >> next) || ok != "OK") {
+                response = reply;
+                co_return;
+            }
+            while (getline(answers, line)) lines += line + "\n";
+            count += n;
+            if (next == "-") {
+                ++shard;
+                inner = "-";
+            } else {
+                inner = next;
+            }
+        }
+        string nextCursor = shard < links.size() ? to_string(shard) + "/" + inner : "-";
+        response = "OK " + to_string(count) + " " + nextCursor + "\n" + lines;
+    }
+};
+
+// One router client: request lines in, answers out, in order
+SessionTask routerSession(ShardRouter& router, TellerIO& io) {
+    string line, response;
+    while (co_await io.readLine(line)) {
+        if (line == "QUIT") co_return;
+        if (line.compare(0, 6, "BATCH ") == 0) {
+            // Grows as the lines arrive, so a bogus count costs nothing up front
+            size_t count = strtoul(line.c_str() + 6, nullptr, 10);
+            vector<string> lines;
+            string entry;
+            while (lines.size() < count) {
+                if (!co_await io.readLine(entry)) co_return;
+                lines.push_back(entry);
+            }
+            co_await router.batch(io, lines, response);
+        } else {
+            co_await router.route(io, line, response);
+        }
+        io.out << response;
+    }
+}
+
+int runShards(size_t count, const string& socketPath) {
+    // Shards read the deployment's product and rule files through links
+    vector<pid_t> children;
+    for (size_t i = 0; i < count; ++i) {
+        string dir = SHARD_DIR_PREFIX + to_string(i);
+        mkdir(dir.c_str(), 0755);
+        for (const string& shared : {PRODUCT_FILE, RULES_FILE}) {
+            if (access(shared.c_str(), F_OK) == 0) symlink(("../" + shared).c_str(), (dir + "/" + shared).c_str());
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (chdir(dir.c_str()) != 0) _exit(1);
+            setenv("BMS_SHARD", to_string(i).c_str(), 1);
+            _exit(runDaemon(shardSocketPath(socketPath, i)));
+        }
+        if (pid > 0) children.push_back(pid);
+    }
+    auto stopShards = [&] {
+        for (pid_t child : children) kill(child, SIGTERM);
+        for (pid_t child : children) waitpid(child, nullptr, 0);
+    };
+
+    ShardRouter router(count);
+    for (size_t i = 0; i < count; ++i) {
+        if (children.size() != count || !router.links[i]->connectTo(shardSocketPath(socketPath, i), chrono::seconds(60))) {
+            cerr << "Shard " << i << " did not start." << endl;
+            stopShards();
+            return 1;
+        }
+    }
+    int listenFd = router.settleTransfers(socketPath) ? listenOnSocket(socketPath) : -1;
+    if (listenFd < 0) {
+        cerr << "Could not start the router." << endl;
+        stopShards();
+        return 1;
+    }
+    signal(SIGINT, requestStop);
+    signal(SIGTERM, requestStop);
+    signal(SIGPIPE, SIG_IGN);
+    cout << "Routing for " << count << " shards on " << socketPath << endl;
+
+    vector<unique_ptr<SessionConnection>> clients;
+    vector<pollfd> fds;
+    int exitCode = 0;
+    while (!stopRequested) {
+        if (router.anyLinkBroken() || waitpid(-1, nullptr, WNOHANG) > 0) {
+            cerr << "A shard stopped; stopping the deployment." << endl;
+            exitCode = 1;
+            break;
+        }
+        fds.clear();
+        fds.push_back({listenFd, POLLIN, 0});
+        for (const auto& link : router.links) fds.push_back(link->pollEntry());
+        for (const auto& client : clients) fds.push_back(client->pollEntry());
+        if (poll(fds.data(), fds.size(), 200) <= 0) continue;
+
+        if (fds[0].revents & POLLIN) {
+            acceptSession(listenFd, clients, [&](TellerIO& io) { return routerSession(router, io); });
+        }
+        for (size_t i = 0; i < count; ++i) router.links[i]->service(fds[1 + i].revents);
+        serviceSessions(clients, fds, 1 + count);
+    }
+
+    // Sessions go before the links their open calls point into
+    for (const auto& client : clients) ::close(client->fd);
+    clients.clear();
+    ::close(listenFd);
+    unlink(socketPath.c_str());
+    stopShards();
+    cout << "Sharded deployment stopped." << endl;
+    return exitCode;
+}
+
+// Starts deployments of 1, 2, 4 ... shards in a scratch directory and
+// drives each through its router with the same number of client processes
+int runShardBenchmark(size_t maxShards, double seconds, size_t clients) {
+    char dirTemplate[] = "/tmp/bms-shards-XXXXXX";
+    if (!mkdtemp(dirTemplate)) {
+        cerr << "Could not create scratch directory for the benchmark." << endl;
+        return 1;
+    }
+    string base = dirTemplate;
+    const size_t accountsPerShard = 256;
+    double baseline = 0;
+    cout << "Shards  Ops/s      Speedup  Cross-shard transfers/s" << endl;
+    for (size_t shards = 1; shards <= maxShards; shards *= 2) {
+        string dir = base + "/" + to_string(shards);
+        string socketPath = dir + "/router.sock";
+        mkdir(dir.c_str(), 0755);
+        pid_t deployment = fork();
+        if (deployment == 0) {
+            if (chdir(dir.c_str()) != 0 || !freopen("/dev/null", "w", stdout)) _exit(1);
+            _exit(runShards(shards, socketPath));
+        }
+
+        DaemonClient setup;
+        auto deadline = chrono::steady_clock::now() + chrono::seconds(60);
+        while (!setup.connectTo(socketPath)) {
+            if (chrono::steady_clock::now() > deadline) {
+                cerr << "The deployment with " << shards << " shards did not start." << endl;
+                kill(deployment, SIGTERM);
+                waitpid(deployment, nullptr, 0);
+                return 1;
+            }
+            setup = DaemonClient();
+            this_thread::sleep_for(chrono::milliseconds(50));
+        }
+        vector<string> numbers;
+        string status;
+        for (size_t i = 0; i < accountsPerShard * shards; ++i) {
+            string phone = "019" + to_string(10000000 + i);
+            setup.request("CREATE Bench Customer|Scratch|" + phone + "|bench" + to_string(i) +
+                          "@test.local|Current|100000|1234", status);
+            if (status.compare(0, 3, "OK ") == 0) numbers.push_back(status.substr(3));
+        }
+        if (numbers.size() < 2) {
+            cerr << "Could not open benchmark accounts: " << status << endl;
+            kill(deployment, SIGTERM);
+            waitpid(deployment, nullptr, 0);
+            return 1;
+        }
+
+        // Each client reports "<operations> <cross-shard transfers>" when done
+        int fds[2];
+        if (pipe(fds) != 0) return 1;
+        for (size_t c = 0; c < clients; ++c) {
+            if (fork() == 0) {
+                ::close(fds[0]);
+                DaemonClient client;
+                if (!client.connectTo(socketPath)) _exit(1);
+                mt19937 rng((unsigned)(c * 7919 + shards));
+                size_t operations = 0, transfers = 0;
+                auto end = chrono::steady_clock::now() + chrono::duration<double>(seconds);
+                while (chrono::steady_clock::now() < end) {
+                    const string& account = numbers[rng() % numbers.size()];
+                    unsigned kind = rng() % 100;
+                    string reply;
+                    if (kind < 45) {
+                        client.request("DEPOSIT " + account + " 10", reply);
+                    } else if (kind < 80) {
+                        client.request("WITHDRAW " + account + " 5 1234", reply);
+                    } else if (kind < 95) {
+                        client.request("BALANCE " + account, reply);
+                    } else {
+                        const string& target = numbers[rng() % numbers.size()];
+                        client.request("BATCH 1\nTRANSFER " + account + " " + target + " 1 1234", reply);
+                        transfers += shards > 1 && (atoll(account.c_str() + 4) - 1001) / SHARD_ACCOUNT_RANGE !=
+                                                   (atoll(target.c_str() + 4) - 1001) / SHARD_ACCOUNT_RANGE;
+                    }
+                    ++operations;
+                }
+                string report = to_string(operations) + " " + to_string(transfers) + "\n";
+                _exit(writeAll(fds[1], report) ? 0 : 1);
+            }
+        }
+        ::close(fds[1]);
+        string reports;
+        char buf[4096];
+        ssize_t n;
+        while ((n = ::read(fds[0], buf, sizeof(buf))) > 0) reports.append(buf, (size_t)n);
+        ::close(fds[0]);
+        for (size_t c = 0; c < clients; ++c) wait(nullptr);
+        size_t operations = 0, transfers = 0, a, b;
+        istringstream parsed(reports);
+        while (parsed >> a >> b) {
+            operations += a;
+            transfers += b;
+        }
+
+        kill(deployment, SIGTERM);
+        waitpid(deployment, nullptr, 0);
+        double rate = operations / seconds;
+        if (shards == 1) baseline = rate;
+        cout << left << setw(8) << shards << setw(11) << fixed << setprecision(0) << rate << setw(9)
+             << setprecision(2) << rate / max(baseline, 1e-9) << setprecision(0) << transfers / seconds << right
+             << endl;
+    }
+    cout << "Scratch data left in " << base << endl;
+    return 0;
+}
+#endif
+
+// ================= Shared-memory account store =================
+// One owner process (`BMS shm-owner`) keeps the journal, snapshots and
+// history, and publishes every account's hot fields into a named POSIX
+// shared-memory segment. Teller processes (`BMS shm-teller`) map the same
+// segment: balance reads are plain seqlock reads with no IPC, and deposits,
+// withdrawals and closures are validated and applied in place under a
+// process-shared robust mutex, then queued on a shared ring. The owner
+// drains the ring in order, journals each record and marks it done; a
+// teller acknowledges only once its record is durable. New accounts need
+// a number and a profile, so tellers queue them for the owner to open.
+// Other tellers can see an applied change a moment before it is durable;
+// if the owner dies first, the change was never acknowledged and is gone
+// after restart. Tellers run in the owner's directory so they load the
+// same product rules.
+//
+// Everything inside the segment is addressed by offsets from its base, so
+// each process may map it at a different address.
+#ifndef _WIN32
+const uint64_t SHM_MAGIC = 0x3148534d534d42ULL;    // "BMSMSH1"
+const uint32_t SHM_RING_SIZE = 1024;
+const size_t SHM_PAYLOAD_BYTES = 480;
+const unsigned SHM_READ_SPINS = 1u << 20;          // odd-version reads before suspecting a dead writer
+const auto SHM_ENQUEUE_WAIT = chrono::seconds(10); // longest a teller waits for a free ring slot
+const auto SHM_RECLAIM_AFTER = chrono::seconds(2); // answered slots the teller never collected
+
+struct SharedAccount {
+    atomic<uint32_t> version;       // Seqlock: odd while a writer is updating
+    uint8_t typeCode;
+    uint8_t closed;
+    uint64_t id;
+    atomic<double> balance;
+    uint64_t credentialHash;
+    char accountNumber[24];
+    char holder[64];
+};
+
+enum SharedRingState : uint32_t { RING_FREE = 0, RING_READY = 1, RING_DONE = 2 };
+
+struct SharedRingEntry {
+    atomic<uint32_t> state;
+    int32_t status;                 // TxStatus once done
+    uint64_t seq;
+    char payload[SHM_PAYLOAD_BYTES];
+    char result[96];                // Account number, or why a CREATE was refused
+};
+
+struct SharedHeader {
+    uint64_t magic;
+    uint32_t capacity;              // Account records
+    uint32_t indexSize;             // Power of two, at least 2 * capacity
+    uint64_t recordsOffset;
+    uint64_t indexOffset;
+    uint64_t ringOffset;
+    uint64_t totalBytes;
+    atomic<uint32_t> recordCount;
+    atomic<int32_t> ownerPid;
+    atomic<uint64_t> nextSeq;       // Next ring sequence, assigned under `lock`
+    atomic<uint64_t> processedSeq;  // Ring entries below this are durable
+    pthread_mutex_t lock;           // Serialises mutations across processes
+};
+
+static_assert(atomic<double>::is_always_lock_free && atomic<uint64_t>::is_always_lock_free,
+              "shared-memory atomics must not depend on per-process locks");
+
+// A mapped segment plus offset-based accessors
+class SharedSegment {
+private:
+    string name;
+    char* base = nullptr;
+    size_t mappedBytes = 0;
+    bool owner = false;
+
+    static uint64_t mix(uint64_t id) {
+        id ^= id >> 33;
+        id *= 0xff51afd7ed558ccdULL;
+        id ^= id >> 33;
+        return id;
+    }
+
+public:
+    ~SharedSegment() {
+        if (base) munmap(base, mappedBytes);
+        if (owner) shm_unlink(name.c_str());
+    }
+
+    SharedHeader* header() const { return reinterpret_cast<SharedHeader*>(base); }
+    SharedAccount* records() const { return reinterpret_cast<SharedAccount*>(base + header()->recordsOffset); }
+    atomic<uint32_t>* index() const { return reinterpret_cast<atomic<uint32_t>*>(base + header()->indexOffset); }
+    SharedRingEntry* ring() const { return reinterpret_cast<SharedRingEntry*>(base + header()->ringOffset); }
+
+    bool create(const string& segmentName, uint32_t capacity) {
+        name = segmentName;
+        uint32_t indexSize = 1;
+        while (indexSize < capacity * 2) indexSize <<= 1;
+        size_t recordsOffset = (sizeof(SharedHeader) + 63) & ~(size_t)63;
+        size_t indexOffset = recordsOffset + sizeof(SharedAccount) * capacity;
+        size_t ringOffset = (indexOffset + sizeof(uint32_t) * indexSize + 63) & ~(size_t)63;
+        mappedBytes = ringOffset + sizeof(SharedRingEntry) * SHM_RING_SIZE;
+
+        shm_unlink(name.c_str()); // A stale segment from a crashed owner
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0) return false;
+        if (ftruncate(fd, (off_t)mappedBytes) != 0) {
+            ::close(fd);
+            return false;
+        }
+        void* mapped = mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) return false;
+        base = static_cast<char*>(mapped);
+        owner = true;
+
+        // ftruncate zero-fills, which is the empty state of every atomic here
+        SharedHeader* h = header();
+        h->capacity = capacity;
+        h->indexSize = indexSize;
+        h->recordsOffset = recordsOffset;
+        h->indexOffset = indexOffset;
+        h->ringOffset = ringOffset;
+        h->totalBytes = mappedBytes;
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&h->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        h->ownerPid.store((int32_t)getpid());
+        atomic_thread_fence(memory_order_release);
+        h->magic = SHM_MAGIC; // Published last: attachers wait for it
+        return true;
+    }
+
+    bool attach(const string& segmentName) {
+        name = segmentName;
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(SharedHeader)) {
+            ::close(fd);
+            return false;
+        }
+        mappedBytes = (size_t)info.st_size;
+        void* mapped = mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) return false;
+        base = static_cast<char*>(mapped);
+        return header()->magic == SHM_MAGIC && header()->totalBytes == mappedBytes;
+    }
+
+    bool ownerAlive() const {
+        int32_t pid = header()->ownerPid.load();
+        return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+    }
+
+    void lock() {
+        if (pthread_mutex_lock(&header()->lock) == EOWNERDEAD) {
+            // A teller died holding the lock; unfinish any half-written record
+            SharedAccount* all = records();
+            for (uint32_t i = 0; i < header()->recordCount.load(); ++i) {
+                uint32_t v = all[i].version.load();
+                if (v & 1) all[i].version.store(v + 1);
+            }
+            pthread_mutex_consistent(&header()->lock);
+        }
+    }
+
+    void unlock() { pthread_mutex_unlock(&header()->lock); }
+
+    // Lock-free for readers: an index slot is published after its record
+    SharedAccount* find(const string& accNum) const {
+        if (accNum.size() <= 4 || accNum.compare(0, 4, "ACCT") != 0) return nullptr;
+        uint64_t id = strtoull(accNum.c_str() + 4, nullptr, 10);
+        uint32_t mask = header()->indexSize - 1;
+        for (uint32_t probe = (uint32_t)mix(id) & mask;; probe = (probe + 1) & mask) {
+            uint32_t slot = index()[probe].load(memory_order_acquire);
+            if (slot == 0) return nullptr;
+            SharedAccount& record = records()[slot - 1];
+            if (record.id == id && accNum == record.accountNumber) return &record;
+        }
+    }
+
+    // Owner only, under lock
+    bool insert(const BankAccount& account) {
+        SharedHeader* h = header();
+        uint32_t count = h->recordCount.load();
+        if (count >= h->capacity) return false;
+        SharedAccount& record = records()[count];
+        record.id = account.getId();
+        record.typeCode = account.getTypeCode();
+        record.closed = 0;
+        record.credentialHash = account.getCredentialHash();
+        record.balance.store(account.getBalance());
+        snprintf(record.accountNumber, sizeof(record.accountNumber), "%s", account.getAccountNumber().c_str());
+        snprintf(record.holder, sizeof(record.holder), "%s", account.getAccountHolderName().c_str());
+        uint32_t mask = h->indexSize - 1;
+        uint32_t probe = (uint32_t)mix(record.id) & mask;
+        while (index()[probe].load(memory_order_relaxed) != 0) probe = (probe + 1) & mask;
+        index()[probe].store(count + 1, memory_order_release);
+        h->recordCount.store(count + 1, memory_order_release);
+        return true;
+    }
+};
+
+// Seqlock read of a balance; never blocks on writers in other processes.
+// `settled` is false if the record stayed half-written for SHM_READ_SPINS
+// tries, as it does when its writer died mid-update.
+bool readSharedBalance(const SharedAccount& record, double& balance, bool& settled) {
+    for (unsigned spins = 0; spins < SHM_READ_SPINS; ++spins) {
+        uint32_t before = record.version.load(memory_order_acquire);
+        if (before & 1) continue;
+        balance = record.balance.load(memory_order_relaxed);
+        bool closed = record.closed != 0;
+        atomic_thread_fence(memory_order_acquire);
+        if (record.version.load(memory_order_relaxed) == before) {
+            settled = true;
+            return !closed;
+        }
+    }
+    settled = false;
+    return false;
+}
+
+// Seqlock write; the caller holds the lock
+template <typename Fn>
+void writeSharedRecord(SharedAccount& record, Fn write) {
+    record.version.fetch_add(1, memory_order_acq_rel);
+    write();
+    record.version.fetch_add(1, memory_order_release);
+}
+
+// Takes a failed D/W/X payload's change back out of its record, for a
+// teller that is no longer there to do it; the caller holds the lock
+void undoSharedPayload(SharedSegment& segment, const string& payload) {
+    istringstream in(payload.substr(2));
+    string accNum;
+    double amount = 0.0, fee = 0.0;
+    long long when = 0;
+    in >> accNum >> amount >> when >> fee;
+    SharedAccount* record = segment.find(accNum);
+    if (!record) return;
+    writeSharedRecord(*record, [&] {
+        if (payload[0] == 'D') record->balance.store(record->balance.load() - amount);
+        else if (payload[0] == 'W') record->balance.store(record->balance.load() + amount + fee);
+        else if (payload[0] == 'X') record->closed = 0;
+    });
+}
+
+// The three calls a SharedTeller makes to a mutation's change function
+enum class SharedStep { Check, Apply, Undo };
+
+class SharedTeller {
+private:
+    SharedSegment& segment;
+
+    // Queues a payload; the caller holds the lock. Returns the ring sequence.
+    bool enqueue(const string& payload, uint64_t& seq) {
+        SharedHeader* h = segment.header();
+        seq = h->nextSeq.load();
+        SharedRingEntry& entry = segment.ring()[seq % SHM_RING_SIZE];
+        if (entry.state.load(memory_order_acquire) != RING_FREE || payload.size() >= SHM_PAYLOAD_BYTES) {
+            return false;
+        }
+        entry.seq = seq;
+        memcpy(entry.payload, payload.c_str(), payload.size() + 1);
+        entry.state.store(RING_READY, memory_order_release);
+        h->nextSeq.store(seq + 1);
+        return true;
+    }
+
+    // Waits for the owner to make the entry durable, then frees it. If the
+    // owner reclaimed the slot first (see runSharedOwner), the answer is lost
+    // and `reclaimed` is set; the owner has then undone a failed change.
+    TxStatus await(uint64_t seq, string* result = nullptr, bool* reclaimed = nullptr) {
+        SharedRingEntry& entry = segment.ring()[seq % SHM_RING_SIZE];
+        for (unsigned spins = 0;; ++spins) {
+            uint32_t state = entry.state.load(memory_order_acquire);
+            if (state == RING_DONE) break;
+            if (state == RING_FREE || entry.seq != seq) {
+                if (reclaimed) *reclaimed = true;
+                return TxStatus::StorageError;
+            }
+            if (spins < 1000) {
+                this_thread::yield();
+            } else {
+                this_thread::sleep_for(chrono::microseconds(50));
+                if (spins % 20000 == 0 && !segment.ownerAlive()) return TxStatus::StorageError;
+            }
+        }
+        TxStatus status = (TxStatus)entry.status;
+        if (result) *result = entry.result;
+        uint32_t done = RING_DONE;
+        if (entry.seq != seq || !entry.state.compare_exchange_strong(done, RING_FREE, memory_order_acq_rel)) {
+            if (reclaimed) *reclaimed = true;
+            return TxStatus::StorageError;
+        }
+        return status;
+    }
+
+    // Applies `change` to a record under the lock and queues its journal
+    // payload; waits up to SHM_ENQUEUE_WAIT for the ring to drain if it is
+    // full. If the owner then fails to make it durable, the change is taken
+    // back out of the record, leaving any later tellers' changes in place.
+    template <typename Fn>
+    TxStatus mutate(const string& accNum, Fn change) {
+        SharedAccount* record = segment.find(accNum);
+        if (!record) return TxStatus::NotFound;
+        uint64_t seq = 0;
+        string payload;
+        auto deadline = chrono::steady_clock::now() + SHM_ENQUEUE_WAIT;
+        while (true) {
+            segment.lock();
+            if (record->closed) {
+                segment.unlock();
+                return TxStatus::NotFound;
+            }
+            TxStatus status = change(*record, payload, SharedStep::Check);
+            if (status != TxStatus::Ok) {
+                segment.unlock();
+                return status;
+            }
+            if (enqueue(payload, seq)) {
+                writeSharedRecord(*record, [&] { change(*record, payload, SharedStep::Apply); });
+                segment.unlock();
+                break;
+            }
+            segment.unlock();
+            if (chrono::steady_clock::now() > deadline) return TxStatus::StorageError;
+            this_thread::sleep_for(chrono::microseconds(100));
+        }
+        bool reclaimed = false;
+        TxStatus status = await(seq, nullptr, &reclaimed);
+        if (status != TxStatus::Ok && !reclaimed) {
+            segment.lock();
+            writeSharedRecord(*record, [&] { change(*record, payload, SharedStep::Undo); });
+            segment.unlock();
+        }
+        return status;
+    }
+
+public:
+    explicit SharedTeller(SharedSegment& s) : segment(s) {}
+
+    bool balance(const string& accNum, double& balance) const {
+        const SharedAccount* record = segment.find(accNum);
+        if (!record) return false;
+        bool settled = false;
+        bool open = readSharedBalance(*record, balance, settled);
+        if (!settled) {
+            // Taking the lock repairs a record left half-written by a dead
+            // writer (see SharedSegment::lock)
+            segment.lock();
+            segment.unlock();
+            open = readSharedBalance(*record, balance, settled);
+        }
+        return settled && open;
+    }
+
+    TxStatus deposit(const string& accNum, double amount) {
+        return mutate(accNum, [&](SharedAccount& record, string& payload, SharedStep step) {
+            if (step != SharedStep::Check) {
+                record.balance.store(record.balance.load() + (step == SharedStep::Apply ? amount : -amount));
+                return TxStatus::Ok;
+            }
+            const ProductInfo& product = productInfo(record.typeCode);
+            TxStatus status = product.checkDeposit(product, record.balance.load(), amount);
+            payload = BankingSystem::movementRecord('D', accNum, amount, time(0));
+            return status;
+        });
+    }
+
+    TxStatus withdraw(const string& accNum, double amount, const string& password) {
+        return mutate(accNum, [&](SharedAccount& record, string& payload, SharedStep step) {
+            const ProductInfo& product = productInfo(record.typeCode);
+            if (step != SharedStep::Check) {
+                double taken = amount + product.withdrawalFee;
+                record.balance.store(record.balance.load() + (step == SharedStep::Apply ? -taken : taken));
+                return TxStatus::Ok;
+            }
+            if (hashKey(password) != record.credentialHash) return TxStatus::BadPassword;
+            TxStatus status = product.checkWithdrawal(product, record.balance.load(), amount);
+            payload = BankingSystem::movementRecord('W', accNum, amount, time(0), product.withdrawalFee);
+            return status;
+        });
+    }
+
+    TxStatus close(const string& accNum, const string& password, double& payout) {
+        return mutate(accNum, [&](SharedAccount& record, string& payload, SharedStep step) {
+            if (step != SharedStep::Check) {
+                record.closed = step == SharedStep::Apply;
+                return TxStatus::Ok;
+            }
+            if (hashKey(password) != record.credentialHash) return TxStatus::BadPassword;
+            payout = record.balance.load();
+            payload = "X " + accNum + " " + formatAmount(payout) + " " + to_string((long long)time(0));
+            return TxStatus::Ok;
+        });
+    }
+
+    // "name|address|phone|email|type|deposit|password", opened by the owner.
+    // On failure `detail` may hold the validation message.
+    string open(const string& fields, TxStatus& status, string& detail) {
+        uint64_t seq = 0;
+        auto deadline = chrono::steady_clock::now() + SHM_ENQUEUE_WAIT;
+        while (true) {
+            segment.lock();
+            bool queued = enqueue("N " + fields, seq);
+            segment.unlock();
+            if (queued) break;
+            if (fields.size() + 2 >= SHM_PAYLOAD_BYTES || chrono::steady_clock::now() > deadline) {
+                status = TxStatus::StorageError;
+                return "";
+            }
+            this_thread::sleep_for(chrono::microseconds(100));
+        }
+        status = await(seq, &detail);
+        return status == TxStatus::Ok ? detail : "";
+    }
+};
+
+// Teller requests use the daemon protocol, minus HISTORY and LIST which
+// need the cold profile kept by the owner
+string handleSharedRequest(SharedTeller& teller, const string& line) {
+    istringstream in(line);
+    string command, accNum, password;
+    double amount = 0.0;
+    in >> command;
+    TxStatus status;
+    if (command == "CREATE") {
+        string rest;
+        getline(in >> ws, rest);
+        string detail;
+        string accNum = teller.open(rest, status, detail);
+        if (!accNum.empty()) return "OK " + accNum + "\n";
+        return "ERR " + (detail.empty() ? string(txStatusName(status)) : detail) + "\n";
+    }
+    if (command == "BALANCE") {
+        in >> accNum;
+        double balance;
+        return teller.balance(accNum, balance) ? "OK " + formatBalance(balance) + "\n" : "ERR NOT_FOUND\n";
+    }
+    if (command == "DEPOSIT" || command == "WITHDRAW") {
+        if (!(in >> accNum >> amount)) return "ERR BAD_REQUEST\n";
+        in >> password;
+        status = command == "DEPOSIT" ? teller.deposit(accNum, amount) : teller.withdraw(accNum, amount, password);
+    } else if (command == "CLOSE") {
+        if (!(in >> accNum >> password)) return "ERR BAD_REQUEST\n";
+        status = teller.close(accNum, password, amount);
+        if (status == TxStatus::Ok) return "OK " + formatBalance(amount) + "\n";
+    } else {
+        return "ERR UNSUPPORTED\n";
+    }
+    if (status != TxStatus::Ok) return string("ERR ") + txStatusName(status) + "\n";
+    double balance = 0.0;
+    teller.balance(accNum, balance);
+    return "OK " + formatBalance(balance) + "\n";
+}
+
+// Publishes the recovered accounts, then makes teller mutations durable in
+// ring order until stopped
+int runSharedOwner(const string& name, uint32_t extraCapacity) {
+    BankingSystem bank;
+    SharedSegment segment;
+    vector<string> numbers = bank.accountNumbers();
+    if (!segment.create(name, (uint32_t)numbers.size() + extraCapacity)) {
+        cerr << "Cannot create shared memory segment " << name << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    for (const auto& accNum : numbers) {
+        segment.insert(*bank.lookupAccount(accNum));
+    }
+    signal(SIGINT, requestStop);
+    signal(SIGTERM, requestStop);
+    cout << "Sharing " << numbers.size() << " accounts in " << name << " (room for "
+         << segment.header()->capacity << ")" << endl;
+
+    // Answered slots in answer order. One its teller has not freed after
+    // SHM_RECLAIM_AFTER is taken back, so a dead teller cannot fill the ring;
+    // a failed change it left in its record is undone here.
+    SharedHeader* h = segment.header();
+    deque<pair<uint64_t, chrono::steady_clock::time_point>> answered;
+    unsigned idle = 0;
+    while (!stopRequested) {
+        auto now = chrono::steady_clock::now();
+        while (!answered.empty() && now - answered.front().second > SHM_RECLAIM_AFTER) {
+            SharedRingEntry& slot = segment.ring()[answered.front().first % SHM_RING_SIZE];
+            // Read before the slot is freed; another teller may reuse it at once
+            string payload = slot.payload;
+            TxStatus status = (TxStatus)slot.status;
+            uint32_t done = RING_DONE;
+            if (slot.seq == answered.front().first &&
+                slot.state.compare_exchange_strong(done, RING_FREE, memory_order_acq_rel)) {
+                cerr << "Reclaimed ring slot " << answered.front().first << " from a teller that never collected it."
+                     << endl;
+                if (status != TxStatus::Ok && payload.compare(0, 2, "N ") != 0) {
+                    segment.lock();
+                    undoSharedPayload(segment, payload);
+                    segment.unlock();
+                }
+            }
+            answered.pop_front();
+        }
+        uint64_t seq = h->processedSeq.load();
+        SharedRingEntry& entry = segment.ring()[seq % SHM_RING_SIZE];
+        if (entry.state.load(memory_order_acquire) != RING_READY || entry.seq != seq) {
+            if (++idle > 1000) this_thread::sleep_for(chrono::microseconds(100));
+            else this_thread::yield();
+            continue;
+        }
+        idle = 0;
+        string payload = entry.payload;
+        TxStatus status = TxStatus::StorageError;
+        entry.result[0] = '\0';
+        if (payload.compare(0, 2, "N ") == 0) {
+            vector<string> fields;
+            stringstream restStream(payload.substr(2));
+            string field;
+            while (getline(restStream, field, '|')) fields.push_back(field);
+            CustomerRecord record;
+            validateCustomerFields(fields, record);
+            if (!record.error.empty()) {
+                status = TxStatus::InvalidAmount;
+                snprintf(entry.result, sizeof(entry.result), "%s", record.error.c_str());
+            } else {
+                string accNum = bank.openAccount(record.name, record.address, record.phone, record.email,
+                                                 record.deposit, record.accountType, record.password, &status);
+                segment.lock();
+                bool published = !accNum.empty() && segment.insert(*bank.lookupAccount(accNum));
+                segment.unlock();
+                if (!accNum.empty() && !published) cerr << "Shared segment full; " << accNum << " not shared." << endl;
+                snprintf(entry.result, sizeof(entry.result), "%s", accNum.c_str());
+            }
+        } else {
+            status = bank.applyMutation(payload);
+        }
+        entry.status = (int32_t)status;
+        entry.state.store(RING_DONE, memory_order_release);
+        h->processedSeq.store(seq + 1);
+        answered.emplace_back(seq, chrono::steady_clock::now());
+    }
+    h->ownerPid.store(0);
+    cout << "Owner stopped after " << h->processedSeq.load() << " shared operations." << endl;
+    return 0;
+}
+
+// Answers protocol lines from stdin against the shared segment
+int runSharedTeller(const string& name) {
+    SharedSegment segment;
+    if (!segment.attach(name) || !segment.ownerAlive()) {
+        cerr << "No running shm-owner for " << name << endl;
+        return 1;
+    }
+    SharedTeller teller(segment);
+    string line;
+    while (getline(cin, line)) {
+        if (line == "QUIT") break;
+        if (line.empty()) continue;
+        cout << handleSharedRequest(teller, line) << flush;
+    }
+    return 0;
+}
+#endif
+
+// ================= Load generator =================
+
+// Reads "--name value" pairs following the command words
+map<string, string> parseOptions(int argc, char* argv[], int first) {
+    map<string, string> options;
+    for (int i = first; i < argc; ++i) {
+        string key = argv[i];
+        if (key.rfind("--", 0) != 0) continue;
+        options[key.substr(2)] = (i + 1 < argc && string(argv[i + 1]).rfind("--", 0) != 0) ? argv[++i] : "1";
+    }
+    return options;
+}
+
+string optionOr(const map<string, string>& options, const string& key, const string& fallback) {
+    auto it = options.find(key);
+    return it == options.end() ? fallback : it->second;
+}
+
+// Draws ranks 0..n-1 with probability proportional to 1 / (rank + 1)^s
+class ZipfSampler {
+private:
+    vector<double> cdf;
+
+public:
+    ZipfSampler(size_t n, double s) : cdf(max<size_t>(1, n)) {
+        double sum = 0;
+        for (size_t i = 0; i < cdf.size(); ++i) {
+            sum += 1.0 / pow((double)(i + 1), s);
+            cdf[i] = sum;
+        }
+        for (auto& value : cdf) value /= sum;
+    }
+
+    size_t sample(mt19937_64& rng) const {
+        double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+        return (size_t)(lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+    }
+};
+
+// Synthetic customers with `historyDepth` past transactions each. Phone
+// numbers and emails are derived from the account number so they are unique.
+vector<BankAccount> buildSyntheticAccounts(long long firstNumber, size_t count, size_t historyDepth, unsigned seed) {
+    vector<BankAccount> accounts(count);
+    time_t now = time(0);
+    parallelFor(count, [&](size_t begin, size_t end) {
+        mt19937_64 rng(seed + begin);
+        for (size_t i = begin; i < end; ++i) {
+            long long number = firstNumber + (long long)i;
+            bool savings = rng() % 2 == 0;
+            double deposit = (savings ? 1000 : 5000) + (double)(rng() % 100000) / 10;
+            char phone[16];
+            snprintf(phone, sizeof(phone), "01%09lld", number % 1000000000LL);
+            time_t when = now - (time_t)historyDepth * 3600;
+            BankAccount account("ACCT" + to_string(number), "Customer " + to_string(number),
+                                "House " + to_string(number % 997) + ", Road " + to_string(number % 31) + ", Dhaka",
+                                phone, "customer" + to_string(number) + "@example.com", deposit,
+                                savings ? "Savings" : "Current", "1234", when);
+            for (size_t h = 0; h < historyDepth; ++h) {
+                when += 1 + (time_t)(rng() % 3600);
+                double amount = 1 + (double)(rng() % 50000) / 100;
+                if (rng() % 3 == 0 && account.getBalance() - amount > 500) {
+                    account.applyWithdrawal(amount, when);
+                } else {
+                    account.applyDeposit(amount, when);
+                }
+            }
+            accounts[i] = std::move(account);
+        }
+    });
+    return accounts;
+}
+
+// Measures the account layout: memory per account and the cost of the
+// per-transaction fields when accounts are touched in random order.
+int runAccountBenchmark(size_t accountCount, size_t operations) {
+    vector<BankAccount> accounts = buildSyntheticAccounts(1001, accountCount, 4, 7);
+    size_t memoryBytes = 0;
+    for (const auto& account : accounts) {
+        memoryBytes += account.memoryBytes();
+    }
+
+    mt19937 rng(99);
+    vector<uint32_t> order(operations);
+    for (auto& index : order) index = rng() % accountCount;
+    time_t now = time(0);
+
+    auto bestOf = [](int rounds, auto&& body) {
+        double best = 1e30;
+        for (int r = 0; r < rounds; ++r) {
+            auto begin = chrono::steady_clock::now();
+            body();
+            best = min(best, chrono::duration<double>(chrono::steady_clock::now() - begin).count());
+        }
+        return best;
+    };
+
+    size_t accepted = 0;
+    double checkSeconds = bestOf(3, [&] {
+        for (uint32_t index : order) accepted += accounts[index].checkDeposit(25.0) == TxStatus::Ok;
+    });
+    double depositSeconds = bestOf(1, [&] {
+        for (uint32_t index : order) {
+            BankAccount& account = accounts[index];
+            if (account.checkDeposit(25.0) == TxStatus::Ok) account.applyDeposit(25.0, now);
+        }
+    });
+    double total = 0;
+    double scanSeconds = bestOf(5, [&] {
+        for (const auto& account : accounts) total += account.getBalance();
+    });
+
+    cout << fixed << setprecision(2);
+    cout << "Accounts: " << accountCount << ", sizeof(BankAccount) " << sizeof(BankAccount) << " bytes, "
+         << (double)memoryBytes / accountCount << " bytes per account in total" << endl;
+    cout << "Deposit checks:  " << operations / checkSeconds / 1e6 << " M/s (random accounts)" << endl;
+    cout << "Deposits:        " << operations / depositSeconds / 1e6 << " M/s (check, credit and history)" << endl;
+    cout << "Balance scan:    " << accountCount / scanSeconds / 1e6 << " M accounts/s (checksum "
+         << (long long)(total + accepted) % 1000 << ")" << endl;
+    return 0;
+}
+
+// Measures what velocity screening adds to a withdrawal: the product
+// check alone against the check plus screen() and record(), on random
+// accounts whose windows are already built
+int runVelocityBenchmark(size_t accountCount, size_t operations) {
+    vector<BankAccount> accounts = buildSyntheticAccounts(1001, accountCount, 4, 7);
+    VelocityRules rules;
+    for (const char* rule : {"hourly|hourly_count|5|block", "daily|daily_amount|200000|block",
+                             "large|single_amount|500000|block", "spike|spike_ratio|10|flag"}) {
+        rules.addRule(rule);
+    }
+
+    mt19937 rng(99);
+    vector<uint32_t> order(operations);
+    vector<int64_t> amounts(operations);
+    for (size_t i = 0; i < operations; ++i) {
+        order[i] = rng() % accountCount;
+        amounts[i] = toMinorUnits(1 + rng() % 5000);
+    }
+    time_t now = time(0);
+    for (const auto& account : accounts) rules.screen(account, 0, now); // Build every window once
+
+    auto timed = [](auto&& body) {
+        auto begin = chrono::steady_clock::now();
+        body();
+        return chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    };
+    size_t allowed = 0, flagged = 0, blocked = 0;
+    double checkSeconds = timed([&] {
+        for (size_t i = 0; i < operations; ++i) {
+            const BankAccount& account = accounts[order[i]];
+            const ProductInfo& product = productInfo(account.getTypeCode());
+            allowed += product.checkWithdrawal(product, account.getBalance(), amounts[i] / 100.0) == TxStatus::Ok;
+        }
+    });
+    vector<long long> samples;
+    samples.reserve(operations / 16 + 1);
+    double screenSeconds = timed([&] {
+        for (size_t i = 0; i < operations; ++i) {
+            const BankAccount& account = accounts[order[i]];
+            const ProductInfo& product = productInfo(account.getTypeCode());
+            time_t when = now + (time_t)(i / 64);
+            bool sample = i % 16 == 0;
+            auto begin = sample ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
+            if (product.checkWithdrawal(product, account.getBalance(), amounts[i] / 100.0) == TxStatus::Ok) {
+                RuleVerdict verdict = rules.screen(account, amounts[i], when);
+                if (verdict.action == RuleAction::Block) {
+                    ++blocked;
+                } else {
+                    flagged += verdict.action == RuleAction::Flag;
+                    rules.record(account, amounts[i], when);
+                }
+            }
+            if (sample) {
+                samples.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin).count());
+            }
+        }
+    });
+    sort(samples.begin(), samples.end());
+    auto percentile = [&](double p) { return samples.empty() ? 0LL : samples[(size_t)(p * (samples.size() - 1))]; };
+
+    cout << fixed << setprecision(1);
+    cout << "Accounts: " << accountCount << ", operations: " << operations << ", sizeof(VelocityState) "
+         << sizeof(VelocityState) << " bytes" << endl;
+    cout << "Product check only:    " << checkSeconds * 1e9 / operations << " ns/op" << endl;
+    cout << "Check + velocity rules: " << screenSeconds * 1e9 / operations << " ns/op (added "
+         << (screenSeconds - checkSeconds) * 1e9 / operations << " ns/op)" << endl;
+    cout << "Per operation (timer included): p50 " << percentile(0.5) << " ns, p99 " << percentile(0.99)
+         << " ns, p99.9 " << percentile(0.999) << " ns" << endl;
+    cout << "Verdicts: " << blocked << " blocked, " << flagged << " flagged (of " << allowed << " allowed by product rules)"
+         << endl;
+    return 0;
+}
+
+// Schedules `count` standing orders due at the start of the next `days`
+// days and cancels a tenth of them, then runs the wheel hour by hour
+// through the period, rescheduling every order it fires, and once more
+// after a simulated outage of the same length
+int runOrderBenchmark(size_t count, long days) {
+    OrderScheduler scheduler;
+    mt19937 rng(45);
+    time_t start = time(0);
+    string tomorrow;
+    appendLocalTime(tomorrow, start + SECONDS_PER_DAY);
+    time_t firstDay;
+    parseOrderStart(tomorrow.substr(0, 10), firstDay);
+    auto timed = [](auto&& body) {
+        auto begin = chrono::steady_clock::now();
+        body();
+        return chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    };
+    double scheduleSeconds = timed([&] {
+        for (size_t i = 0; i < count; ++i) {
+            StandingOrder order;
+            order.from = "1000000001";
+            order.to = "1000000002";
+            order.amount = 100;
+            order.due = firstDay + (int64_t)(rng() % (uint32_t)days) * SECONDS_PER_DAY; // Start of a day
+            order.every = i % 4 == 0 ? 7 : 1;
+            order.unit = i % 4 == 0 ? 'd' : 'm';
+            order.anchorDay = 1;
+            scheduler.add(order);
+        }
+    });
+    size_t cancels = count / 10;
+    double cancelSeconds = timed([&] {
+        for (size_t i = 0; i < cancels; ++i) scheduler.cancel(1 + rng() % count);
+    });
+
+    auto runUntil = [&](time_t from, time_t until, bool hourly) {
+        size_t fired = 0;
+        vector<StandingOrder> due;
+        for (time_t now = hourly ? from + 3600 : until; now <= until; now += 3600) {
+            while (scheduler.takeDue(now, ORDER_BATCH_SIZE, due), !due.empty()) {
+                for (const StandingOrder& order : due) scheduler.reschedule(order.id, nextOccurrence(order), -1);
+                fired += due.size();
+            }
+        }
+        return fired;
+    };
+    size_t fired = 0, caughtUp = 0;
+    time_t end = start + days * SECONDS_PER_DAY;
+    double runSeconds = timed([&] { fired = runUntil(start, end, true); });
+    double catchUpSeconds = timed([&] { caughtUp = runUntil(end, end + days * SECONDS_PER_DAY, false); });
+
+    cout << fixed << setprecision(1);
+    cout << "Orders: " << count << " over " << days << " days, sizeof(StandingOrder) " << sizeof(StandingOrder)
+         << " bytes" << endl;
+    cout << "Schedule: " << scheduleSeconds * 1e9 / max<size_t>(1, count) << " ns/order" << endl;
+    cout << "Cancel:   " << cancelSeconds * 1e9 / max<size_t>(1, cancels) << " ns/order" << endl;
+    cout << "Hourly run: " << fired << " executions in " << setprecision(3) << runSeconds << " s ("
+         << setprecision(0) << fired / max(runSeconds, 1e-9) << "/s)" << endl;
+    cout << "Catch-up after " << days << " days down: " << caughtUp << " executions in " << setprecision(3)
+         << catchUpSeconds << " s (" << setprecision(0) << caughtUp / max(catchUpSeconds, 1e-9) << "/s)" << endl;
+    return 0;
+}
+
+// Posts `entries` random deposits, withdrawals, fees and transfers over
+// `accountCount` ledger accounts, then measures how fast validate() scans
+// the columns
+int runLedgerBenchmark(size_t accountCount, size_t entries) {
+    GeneralLedger ledger;
+    mt19937 rng(31);
+    vector<uint32_t> ledgerAccounts(accountCount);
+    for (size_t i = 0; i < accountCount; ++i) {
+        ledgerAccounts[i] = ledger.accountFor(1001 + i);
+        ledger.bringForward(LEDGER_CASH, ledgerAccounts[i], 1000000);
+    }
+    auto timed = [](auto&& body) {
+        auto begin = chrono::steady_clock::now();
+        body();
+        return chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    };
+    time_t when = time(0);
+    double postSeconds = timed([&] {
+        for (size_t e = 0; e < entries; ++e) {
+            uint32_t account = ledgerAccounts[rng() % accountCount];
+            int64_t amount = 100 + rng() % 50000;
+            switch (rng() % 8) {
+                case 0:
+                case 1:
+                case 2:
+                    ledger.post(LEDGER_DEPOSIT, when, LEDGER_CASH, account, amount);
+                    break;
+                case 3:
+                case 4:
+                    ledger.post(LEDGER_WITHDRAWAL, when, account, LEDGER_CASH, amount);
+                    break;
+                case 5:
+                    ledger.post(LEDGER_FEE, when, account, LEDGER_FEE_INCOME, 2000);
+                    break;
+                default:
+                    ledger.post(LEDGER_TRANSFER, when, account, ledgerAccounts[rng() % accountCount], amount);
+            }
+            when += e % 16 == 0;
+        }
+    });
+    LedgerCheck check;
+    double best = 1e30;
+    for (int round = 0; round < 5; ++round) {
+        check = ledger.validate();
+        best = min(best, check.seconds);
+    }
+
+    cout << fixed << setprecision(1);
+    cout << "Ledger: " << accountCount << " accounts, " << check.entries << " entries, " << check.legs << " legs, "
+         << check.bytesScanned / 1e6 << " MB of columns" << endl;
+    cout << "Post:     " << setprecision(2) << entries / max(postSeconds, 1e-9) / 1e6 << " M entries/s" << endl;
+    cout << "Validate: " << setprecision(3) << best * 1000 << " ms, " << setprecision(2)
+         << check.bytesScanned / max(best, 1e-9) / 1e9 << " GB/s, " << check.entries / max(best, 1e-9) / 1e6
+         << " M entries/s on " << max(1u, thread::hardware_concurrency()) << " cores" << endl;
+    cout << "Books " << (check.clean() ? "balance" : "do not balance") << endl;
+    return check.clean() ? 0 : 1;
+}
+
+// Opens idle teller sessions in-process to measure what each one holds, then
+// drives every session through a balance check to measure switching cost
+int runTellerBenchmark(size_t sessions, size_t rounds) {
+    BankingSystem bank;
+    vector<string> numbers = bank.accountNumbers();
+    string request = "4\n" + (numbers.empty() ? string("ACCT0") : numbers.front()) + "\n\n";
+
+    struct BenchTeller {
+        TellerIO io;
+        SessionTask session;
+    };
+    vector<unique_ptr<BenchTeller>> tellers;
+    tellers.reserve(sessions);
+    size_t framesBefore = tellerFrameBytes;
+    for (size_t i = 0; i < sessions; ++i) {
+        unique_ptr<BenchTeller> teller(new BenchTeller);
+        teller->session = tellerSession(bank, teller->io);
+        teller->io.begin(teller->session);
+        teller->io.takeOutput();
+        tellers.push_back(move(teller));
+    }
+    size_t frameBytes = tellerFrameBytes - framesBefore;
+    size_t ioBytes = 0;
+    for (const auto& teller : tellers) ioBytes += teller->io.memoryBytes() + sizeof(SessionTask);
+
+    size_t interactions = 0, outputBytes = 0;
+    auto begin = chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; ++round) {
+        for (auto& teller : tellers) {
+            teller->io.feed(request.data(), request.size());
+            outputBytes += teller->io.takeOutput().size();
+            ++interactions;
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    bool allWaiting = all_of(tellers.begin(), tellers.end(), [](const unique_ptr<BenchTeller>& t) {
+        return t->io.waitingForInput();
+    });
+
+    cout << fixed << setprecision(0);
+    cout << "Sessions: " << sessions << ", idle cost " << (frameBytes + ioBytes) / max<size_t>(1, sessions)
+         << " bytes each (coroutine frames " << frameBytes / max<size_t>(1, sessions) << ", session state "
+         << ioBytes / max<size_t>(1, sessions) << ")" << endl;
+    cout << "Balance checks: " << interactions << " in " << setprecision(3) << seconds << " s ("
+         << setprecision(0) << interactions / max(seconds, 1e-9) << "/s, " << setprecision(2)
+         << seconds * 1e9 / max<size_t>(1, interactions) << " ns each, " << outputBytes / max<size_t>(1, interactions)
+         << " bytes of output)" << endl;
+    cout << "Every session back at the menu: " << (allWaiting ? "yes" : "NO") << endl;
+    return allWaiting ? 0 : 1;
+}
+
+// The plain layout written by older versions: fields, count, history lines
+void writeLegacyDataset(const vector<BankAccount>& accounts, long long lastNumber) {
+    ofstream outFile(ACCOUNT_FILE, ios::trunc);
+    for (const auto& account : accounts) {
+        outFile << account.getAccountNumber() << "\n" << account.getAccountHolderName() << "\n"
+                << account.getAddress() << "\n" << account.getPhoneNumber() << "\n" << account.getEmail() << "\n"
+                << fixed << setprecision(2) << account.getBalance() << "\n" << account.getAccountType() << "\n"
+                << account.getPassword() << "\n";
+        vector<string> lines = account.getTransactionHistory();
+        outFile << lines.size() << "\n";
+        for (const auto& line : lines) outFile << line << "\n";
+    }
+    ofstream counterFile(COUNTER_FILE, ios::trunc);
+    counterFile << lastNumber;
+}
+
+struct WorkloadMix {
+    double weights[6] = {2, 30, 20, 35, 8, 5}; // create, deposit, withdraw, balance, history, list
+};
+const char* WORKLOAD_OPS[6] = {"create", "deposit", "withdraw", "balance", "history", "list"};
+
+// Parses "create:2,deposit:30,withdraw:20,balance:35,history:8,list:5"
+WorkloadMix parseMix(const string& text) {
+    WorkloadMix mix;
+    if (text.empty()) return mix;
+    fill(begin(mix.weights), end(mix.weights), 0.0);
+    stringstream items(text);
+    string item;
+    while (getline(items, item, ',')) {
+        size_t colon = item.find(':');
+        for (int op = 0; op < 6; ++op) {
+            if (item.compare(0, colon, WORKLOAD_OPS[op]) == 0 && colon != string::npos) {
+                mix.weights[op] = atof(item.c_str() + colon + 1);
+            }
+        }
+    }
+    return mix;
+}
+
+// Executes one workload operation either in-process or through the daemon
+class WorkloadTarget {
+public:
+    virtual ~WorkloadTarget() {}
+    virtual bool execute(int op, const string& accNum, double amount, const string& createTag) = 0;
+};
+
+class InProcessTarget : public WorkloadTarget {
+private:
+    BankingSystem& bank;
+
+public:
+    explicit InProcessTarget(BankingSystem& b) : bank(b) {}
+
+    bool execute(int op, const string& accNum, double amount, const string& createTag) override {
+        switch (op) {
+            case 0:
+                return !bank.openAccount("Load " + createTag, "Generated", "", "load" + createTag + "@example.com",
+                                         1000 + amount, "Savings", "1234").empty();
+            case 1:
+                return bank.postDeposit(accNum, amount) == TxStatus::Ok;
             case 2:
-                bank.depositMoney();
-                break;
-            case 3:
-                bank.withdrawMoney();
-                break;
-            case 4:
-                bank.checkBalance();
-                break;
-            case 5:
-                bank.displayAccountDetails();
+                return bank.postWithdrawal(accNum, amount, "1234") == TxStatus::Ok;
+            case 3: {
+                const BankAccount* account = bank.lookupAccount(accNum);
+                return account && account->getBalance() >= 0;
+            }
+            case 4: {
+                const BankAccount* account = bank.lookupAccount(accNum);
+                return account && bank.withHistory(*account, [](const CompressedHistory& history) {
+                    return !history.renderAll().empty();
+                });
+            }
+            default:
+                return !bank.listAccounts((size_t)amount % max<size_t>(1, bank.accountCount()), 100).empty();
+        }
+    }
+};
+
+#ifndef _WIN32
+class DaemonTarget : public WorkloadTarget {
+private:
+    DaemonClient& client;
+    size_t accountCount;
+
+public:
+    DaemonTarget(DaemonClient& c, size_t count) : client(c), accountCount(max<size_t>(1, count)) {}
+
+    bool execute(int op, const string& accNum, double amount, const string& createTag) override {
+        string request;
+        switch (op) {
+            case 0:
+                request = "CREATE Load " + createTag + "|Generated||load" + createTag + "@example.com|Savings|" +
+                          formatAmount(1000 + amount) + "|1234";
                 break;
-            case 6:
-                bank.viewTransactionHistory();
+            case 1: request = "DEPOSIT " + accNum + " " + formatAmount(amount); break;
+            case 2: request = "WITHDRAW " + accNum + " " + formatAmount(amount) + " 1234"; break;
+            case 3: request = "BALANCE " + accNum; break;
+            case 4: request = "HISTORY " + accNum; break;
+            default: request = "LIST " + to_string((size_t)amount % accountCount) + " 100"; break;
+        }
+        string status;
+        return client.request(request, status) && status.compare(0, 2, "OK") == 0;
+    }
+};
+#endif
+
+void printLatencyLine(const string& label, vector<long long>& latencies) {
+    if (latencies.empty()) return;
+    sort(latencies.begin(), latencies.end());
+    auto pct = [&](double p) {
+        return latencies[min(latencies.size() - 1, (size_t)(p * (double)latencies.size()))] / 1000.0;
+    };
+    cout << "  " << left << setw(9) << label << right << setw(9) << latencies.size() << fixed << setprecision(1)
+         << setw(11) << pct(0.50) << setw(11) << pct(0.90) << setw(11) << pct(0.99) << setw(11) << pct(0.999)
+         << setw(12) << latencies.back() / 1000.0 << endl;
+}
+
+// Open loop: operation i is due at start + i / rate regardless of how long
+// earlier ones took, and its latency is measured from that due time, so a
+// stalled server shows up as queueing delay instead of being hidden.
+int driveWorkload(WorkloadTarget& target, const vector<string>& accountNumbers, const map<string, string>& options) {
+    double rate = atof(optionOr(options, "rate", "1000").c_str());
+    double duration = atof(optionOr(options, "duration", "10").c_str());
+    double zipf = atof(optionOr(options, "zipf", "0.99").c_str());
+    WorkloadMix mix = parseMix(optionOr(options, "mix", ""));
+    size_t total = (size_t)max(1.0, rate * duration);
+    if (accountNumbers.empty()) {
+        cerr << "No accounts to drive." << endl;
+        return 1;
+    }
+
+    ZipfSampler sampler(accountNumbers.size(), zipf);
+    mt19937_64 rng(atoll(optionOr(options, "seed", "42").c_str()));
+    discrete_distribution<int> pickOp(begin(mix.weights), end(mix.weights));
+    // Hot ranks are spread over the account space instead of the first numbers
+    vector<size_t> rankToAccount(accountNumbers.size());
+    for (size_t i = 0; i < rankToAccount.size(); ++i) rankToAccount[i] = i;
+    shuffle(rankToAccount.begin(), rankToAccount.end(), rng);
+
+    vector<vector<long long>> latencies(6);
+    size_t errors = 0;
+    string runTag = to_string((long long)time(0)) + "-" + to_string(rng() % 100000);
+    auto interval = chrono::nanoseconds((long long)(1e9 / rate));
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < total; ++i) {
+        auto due = start + interval * (long long)i;
+        this_thread::sleep_until(due);
+        int op = pickOp(rng);
+        const string& accNum = accountNumbers[rankToAccount[sampler.sample(rng)]];
+        double amount = 1 + (double)(rng() % 20000) / 100;
+        if (!target.execute(op, accNum, amount, runTag + "-" + to_string(i))) ++errors;
+        latencies[op].push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - due).count());
+    }
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "Operations: " << total << " in " << fixed << setprecision(2) << elapsed << " s, target "
+         << rate << " ops/s, achieved " << total / elapsed << " ops/s, " << errors << " rejected" << endl;
+    cout << "Latency (us)    count        p50        p90        p99      p99.9         max" << endl;
+    vector<long long> all;
+    for (int op = 0; op < 6; ++op) {
+        all.insert(all.end(), latencies[op].begin(), latencies[op].end());
+        printLatencyLine(WORKLOAD_OPS[op], latencies[op]);
+    }
+    printLatencyLine("all", all);
+    return 0;
+}
+
+// Appends what the log would hold had `accounts` been bulk-imported and then
+// operated on: the import line, then each account's later deposits and
+// withdrawals under its own timestamp
+void writeSyntheticLog(const vector<BankAccount>& accounts) {
+    if (accounts.empty()) return;
+    ofstream logFile(TRANSACTION_LOG, ios::app | ios::binary);
+    time_t now = time(0);
+    logFile << ctime(&now) << " - Bulk import from synthetic: " << accounts.size() << " accounts created ("
+            << accounts.front().getAccountNumber() << " to " << accounts.back().getAccountNumber() << ")\n\n";
+    string entry;
+    char line[96];
+    for (const auto& account : accounts) {
+        entry.clear();
+        account.getHistory().forEach([&](const HistoryEntry& item) {
+            if (item.op != HIST_DEPOSIT && item.op != HIST_WITHDRAWAL) return;
+            if (entry.empty()) entry = ctime(&item.when);
+            snprintf(line, sizeof(line), " - %s %s: %.6f BDT\n",
+                     item.op == HIST_DEPOSIT ? "Deposit to" : "Withdrawal from", account.getAccountNumber().c_str(),
+                     llabs(item.amountMinor) / 100.0);
+            entry += line;
+        });
+        if (!entry.empty()) logFile << entry << "\n";
+    }
+}
+
+// loadgen build: writes a synthetic dataset into the current directory
+// loadgen run:   drives a workload in-process (scratch copy) or via --socket
+int runLoadgen(int argc, char* argv[]) {
+    string mode = argc > 2 ? argv[2] : "";
+    map<string, string> options = parseOptions(argc, argv, 3);
+    size_t accountTotal = strtoul(optionOr(options, "accounts", "10000").c_str(), nullptr, 10);
+    size_t historyDepth = strtoul(optionOr(options, "history", "20").c_str(), nullptr, 10);
+    unsigned seed = (unsigned)strtoul(optionOr(options, "seed", "42").c_str(), nullptr, 10);
+
+    if (mode == "build") {
+        if (options.count("dir") && chdir(options["dir"].c_str()) != 0) {
+            cerr << "Cannot enter " << options["dir"] << endl;
+            return 1;
+        }
+        auto start = chrono::steady_clock::now();
+        if (optionOr(options, "format", "snapshot") == "legacy") {
+            vector<BankAccount> accounts = buildSyntheticAccounts(1001, accountTotal, historyDepth, seed);
+            if (options.count("log")) writeSyntheticLog(accounts);
+            writeLegacyDataset(accounts, 1000 + (long long)accountTotal);
+        } else {
+            BankingSystem bank;
+            long long first = bank.reserveAccountNumbers((long long)accountTotal);
+            if (first < 0) return 1;
+            vector<BankAccount> accounts = buildSyntheticAccounts(first, accountTotal, historyDepth, seed);
+            if (options.count("log")) writeSyntheticLog(accounts);
+            if (!bank.commitNewAccounts(accounts)) return 1;
+        }
+        cout << "Built " << accountTotal << " accounts with " << historyDepth << " history entries each in "
+             << fixed << setprecision(2) << chrono::duration<double>(chrono::steady_clock::now() - start).count()
+             << " s" << endl;
+        return 0;
+    }
+
+    if (mode == "run") {
+#ifndef _WIN32
+        if (options.count("socket")) {
+            DaemonClient client;
+            if (!client.connectTo(options["socket"])) {
+                cerr << "Cannot connect to " << options["socket"] << endl;
+                return 1;
+            }
+            string status;
+            vector<string> lines;
+            client.request("LIST 0 " + to_string(accountTotal), status, &lines);
+            vector<string> numbers;
+            for (const auto& line : lines) {
+                size_t begin = line.find("ACCT");
+                numbers.push_back(line.substr(begin, line.find(' ', begin) - begin));
+            }
+            DaemonTarget target(client, numbers.size());
+            return driveWorkload(target, numbers, options);
+        }
+        char dirTemplate[] = "/tmp/bms-load-XXXXXX";
+        if (!mkdtemp(dirTemplate) || chdir(dirTemplate) != 0) return 1;
+        cout << "Scratch directory: " << dirTemplate << endl;
+#endif
+        BankingSystem bank;
+        long long first = bank.reserveAccountNumbers((long long)accountTotal);
+        vector<BankAccount> accounts = buildSyntheticAccounts(first, accountTotal, historyDepth, seed);
+        if (first < 0 || !bank.commitNewAccounts(accounts)) return 1;
+        InProcessTarget target(bank);
+        return driveWorkload(target, bank.accountNumbers(), options);
+    }
+
+    cerr << "Usage: " << argv[0] << " loadgen build [--accounts N] [--history D] [--format snapshot|legacy] [--dir path]" << endl;
+    cerr << "                 [--log]" << endl;
+    cerr << "       " << argv[0] << " loadgen run [--accounts N] [--history D] [--rate ops/s] [--duration s]" << endl;
+    cerr << "                 [--zipf s] [--mix create:2,deposit:30,...] [--socket path]" << endl;
+    return 2;
+}
+
+// ================= Transaction log replay =================
+
+struct LoggedOperation {
+    time_t when = 0;
+    char type = 0;              // 'C' create, 'D' deposit, 'W' withdrawal, 'T' transfer, 'X' close,
+                                // 'B' bulk import range
+    string account;             // Account number as logged ('B': first of the range)
+    string lastAccount;         // 'B': last of the range, 'T': destination
+    string name;
+    string accountType;         // Empty when the log line predates the details
+    double amount = 0.0;        // Deposit, withdrawal or initial deposit
+};
+
+// Parses the message part of one TRANSACTION_LOG entry
+bool parseLogMessage(const string& message, LoggedOperation& op) {
+    static const string CREATED = "Account created: ";
+    static const string DEPOSIT = "Deposit to ";
+    static const string WITHDRAWAL = "Withdrawal from ";
+    static const string BULK = "Bulk import from ";
+    static const string CLOSED = "Account closed: ";
+    static const string TRANSFER = "Transfer from ";
+
+    if (message.compare(0, CREATED.size(), CREATED) == 0) {
+        size_t forPos = message.find(" for ", CREATED.size());
+        if (forPos == string::npos) return false;
+        op.type = 'C';
+        op.account = message.substr(CREATED.size(), forPos - CREATED.size());
+        op.name = message.substr(forPos + 5);
+        // Newer lines end with " (<type>, initial deposit <amount> BDT)"
+        size_t details = op.name.rfind(" (");
+        size_t marker = op.name.find(", initial deposit ", details == string::npos ? 0 : details);
+        if (details != string::npos && marker != string::npos && op.name.back() == ')') {
+            op.accountType = op.name.substr(details + 2, marker - details - 2);
+            op.amount = atof(op.name.c_str() + marker + 18);
+            op.name.erase(details);
+        }
+        return true;
+    }
+    if (message.compare(0, DEPOSIT.size(), DEPOSIT) == 0 || message.compare(0, WITHDRAWAL.size(), WITHDRAWAL) == 0) {
+        bool deposit = message[0] == 'D';
+        size_t begin = deposit ? DEPOSIT.size() : WITHDRAWAL.size();
+        size_t colon = message.find(": ", begin);
+        if (colon == string::npos) return false;
+        op.type = deposit ? 'D' : 'W';
+        op.account = message.substr(begin, colon - begin);
+        op.amount = atof(message.c_str() + colon + 2);
+        return true;
+    }
+    if (message.compare(0, TRANSFER.size(), TRANSFER) == 0) {
+        size_t to = message.find(" to ", TRANSFER.size());
+        size_t colon = message.find(": ", to == string::npos ? 0 : to);
+        if (to == string::npos || colon == string::npos) return false;
+        op.type = 'T';
+        op.account = message.substr(TRANSFER.size(), to - TRANSFER.size());
+        op.lastAccount = message.substr(to + 4, colon - to - 4);
+        op.amount = atof(message.c_str() + colon + 2);
+        return true;
+    }
+    if (message.compare(0, CLOSED.size(), CLOSED) == 0) {
+        size_t comma = message.find(',', CLOSED.size());
+        if (comma == string::npos) return false;
+        op.type = 'X';
+        op.account = message.substr(CLOSED.size(), comma - CLOSED.size());
+        return true;
+    }
+    if (message.compare(0, BULK.size(), BULK) == 0) {
+        size_t open = message.rfind(" (");
+        size_t to = message.find(" to ", open == string::npos ? 0 : open);
+        if (open == string::npos || to == string::npos) return false;
+        op.type = 'B';
+        op.account = message.substr(open + 2, to - open - 2);
+        op.lastAccount = message.substr(to + 4, message.size() - to - 5);
+        return true;
+    }
+    return false;
+}
+
+// Streams TRANSACTION_LOG entries: "<ctime>\n - <message>\n\n"
+vector<LoggedOperation> readTransactionLog(const string& path, size_t& unparsed) {
+    vector<LoggedOperation> ops;
+    ifstream inFile(path);
+    string line;
+    time_t when = 0;
+    unparsed = 0;
+    while (getline(inFile, line)) {
+        if (line.empty()) continue;
+        if (line.compare(0, 3, " - ") == 0) {
+            LoggedOperation op;
+            op.when = when;
+            if (parseLogMessage(line.substr(3), op)) {
+                ops.push_back(op);
+            } else {
+                ++unparsed;
+            }
+        } else if (!parseCtime(line, when)) {
+            ++unparsed;
+        }
+    }
+    return ops;
+}
+
+bool copyFile(const string& from, const string& to) {
+    ifstream in(from, ios::binary);
+    if (!in) return false;
+    ofstream out(to, ios::binary | ios::trunc);
+    out << in.rdbuf();
+    return (bool)out;
+}
+
+struct ReferenceAccount {
+    double balance = 0.0;
+    double openingDeposit = 0.0;
+    string accountType, name, address, phone, email;
+};
+
+// Replays TRANSACTION_LOG against a fresh BankingSystem in a scratch
+// directory, then compares the resulting balances with the snapshot (plus
+// journal tail) the log came from.
+int runReplay(int argc, char* argv[]) {
+#ifndef _WIN32
+    map<string, string> options = parseOptions(argc, argv, 2);
+    string dataDir = optionOr(options, "data", ".");
+    string logPath = optionOr(options, "log", dataDir + "/" + TRANSACTION_LOG);
+    bool paced = optionOr(options, "pace", "max") == "recorded";
+    double speed = max(0.001, atof(optionOr(options, "speed", "1").c_str()));
+
+    size_t unparsed = 0;
+    auto parseStart = chrono::steady_clock::now();
+    vector<LoggedOperation> ops = readTransactionLog(logPath, unparsed);
+    double parseSeconds = chrono::duration<double>(chrono::steady_clock::now() - parseStart).count();
+    if (ops.empty()) {
+        cerr << "No replayable operations in " << logPath << endl;
+        return 1;
+    }
+
+    char referenceDir[] = "/tmp/bms-replay-ref-XXXXXX";
+    char replayDir[] = "/tmp/bms-replay-XXXXXX";
+    if (!mkdtemp(referenceDir) || !mkdtemp(replayDir)) return 1;
+    for (const string& file : {ACCOUNT_FILE, JOURNAL_FILE, COUNTER_FILE, PRODUCT_FILE}) {
+        copyFile(dataDir + "/" + file, string(referenceDir) + "/" + file);
+    }
+    copyFile(dataDir + "/" + PRODUCT_FILE, string(replayDir) + "/" + PRODUCT_FILE);
+
+    // Reference state: recovered from copies so the source is never written
+    map<string, ReferenceAccount> reference;
+    if (chdir(referenceDir) != 0) return 1;
+    {
+        streambuf* savedOut = cout.rdbuf(nullptr);
+        BankingSystem source;
+        cout.rdbuf(savedOut);
+        cout.clear();
+        for (const string& accNum : source.accountNumbers()) {
+            const BankAccount* account = source.lookupAccount(accNum);
+            ReferenceAccount& ref = reference[accNum];
+            ref.balance = account->getBalance();
+            ref.accountType = account->getAccountType();
+            ref.name = account->getAccountHolderName();
+            ref.address = account->getAddress();
+            ref.phone = account->getPhoneNumber();
+            ref.email = account->getEmail();
+            source.withHistory(*account, [&](const CompressedHistory& history) {
+                history.forEach([&](const HistoryEntry& entry) {
+                    if (entry.op == HIST_OPENED && ref.openingDeposit == 0) ref.openingDeposit = entry.amountMinor / 100.0;
+                });
+            });
+        }
+    }
+
+    if (chdir(replayDir) != 0) return 1;
+    BankingSystem bank;
+    map<string, string> renumbered; // Logged account number -> replayed one
+    size_t counts[6] = {0, 0, 0, 0, 0, 0}, failed = 0, skipped = 0, replayedOps = 0;
+    const string REPLAY_PASSWORD = "0000";
+
+    auto openLogged = [&](const string& logged, const LoggedOperation* op) {
+        auto ref = reference.find(logged);
+        string type = op && !op->accountType.empty() ? op->accountType
+                      : ref != reference.end() ? ref->second.accountType : "Savings";
+        double deposit = op && op->amount > 0 ? op->amount
+                         : ref != reference.end() ? ref->second.openingDeposit : 0.0;
+        if (deposit <= 0) deposit = productInfo((uint8_t)max(0, ProductRegistry::instance().findCode(type))).minOpeningDeposit;
+        bool known = ref != reference.end();
+        string accNum = bank.openAccount(known ? ref->second.name : (op ? op->name : logged),
+                                         known ? ref->second.address : "Replayed",
+                                         known ? ref->second.phone : "",
+                                         known ? ref->second.email : "replay-" + logged + "@example.com",
+                                         deposit, type, REPLAY_PASSWORD);
+        if (accNum.empty()) ++failed;
+        else renumbered[logged] = accNum;
+    };
+
+    auto replayStart = chrono::steady_clock::now();
+    time_t firstWhen = ops.front().when;
+    for (const auto& op : ops) {
+        if (paced) {
+            auto due = replayStart + chrono::duration<double>((double)(op.when - firstWhen) / speed);
+            this_thread::sleep_until(due);
+        }
+        switch (op.type) {
+            case 'C':
+                openLogged(op.account, &op);
+                ++counts[0];
                 break;
-            case 7:
-                bank.displayAllAccounts();
+            case 'B': {
+                long long first = atoll(op.account.c_str() + 4), last = atoll(op.lastAccount.c_str() + 4);
+                // Numbers missing from the snapshot were closed later; they get
+                // placeholder accounts so the closure replays too
+                for (long long n = first; n <= last; ++n) {
+                    openLogged("ACCT" + to_string(n), nullptr);
+                }
+                ++counts[3];
                 break;
-            case 8:
-                cout << "Thank you for using our Banking System. Goodbye!" << endl;
+            }
+            default: {
+                auto it = renumbered.find(op.account);
+                if (it == renumbered.end()) {
+                    ++skipped; // Account was opened before the log begins
+                    continue;
+                }
+                if (op.type == 'T') {
+                    auto target = renumbered.find(op.lastAccount);
+                    BatchOperation transfer;
+                    transfer.type = BatchOpType::Transfer;
+                    transfer.account = it->second;
+                    transfer.target = target == renumbered.end() ? op.lastAccount : target->second;
+                    transfer.amount = op.amount;
+                    transfer.password = REPLAY_PASSWORD;
+                    if (bank.executeBatch(vector<BatchOperation>(1, transfer))[0].status != TxStatus::Ok) ++failed;
+                    ++counts[5];
+                    break;
+                }
+                if (op.type == 'X') {
+                    if (bank.closeAccount(it->second, REPLAY_PASSWORD) != TxStatus::Ok) ++failed;
+                    renumbered.erase(it);
+                    ++counts[4];
+                    break;
+                }
+                TxStatus status = op.type == 'D' ? bank.postDeposit(it->second, op.amount)
+                                                 : bank.postWithdrawal(it->second, op.amount, REPLAY_PASSWORD);
+                if (status != TxStatus::Ok) ++failed;
+                ++counts[op.type == 'D' ? 1 : 2];
+            }
+        }
+        ++replayedOps;
+    }
+    double replaySeconds = chrono::duration<double>(chrono::steady_clock::now() - replayStart).count();
+
+    size_t matched = 0, mismatched = 0;
+    for (const auto& entry : renumbered) {
+        auto ref = reference.find(entry.first);
+        if (ref == reference.end()) continue;
+        double replayed = bank.lookupAccount(entry.second)->getBalance();
+        if (fabs(replayed - ref->second.balance) < 0.005) {
+            ++matched;
+        } else {
+            ++mismatched;
+            if (mismatched <= 10) {
+                cout << "Mismatch " << entry.first << ": snapshot " << fixed << setprecision(2) << ref->second.balance
+                     << " BDT, replayed " << replayed << " BDT" << endl;
+            }
+        }
+    }
+
+    cout << fixed << setprecision(2);
+    cout << "Parsed " << ops.size() << " operations (" << unparsed << " unparsed lines) in " << parseSeconds << " s" << endl;
+    cout << "Replayed " << replayedOps << " operations: " << counts[0] << " creates, " << counts[3] << " bulk imports, "
+         << counts[1] << " deposits, " << counts[2] << " withdrawals, " << counts[5] << " transfers, " << counts[4] << " closures, "
+         << failed << " failed, "
+         << skipped << " skipped (account opened before the log)" << endl;
+    cout << "Replay time " << replaySeconds << " s, " << replayedOps / max(replaySeconds, 1e-9) << " ops/s"
+         << (paced ? " (recorded pacing)" : "") << endl;
+    cout << "Verified " << matched << " balances against the snapshot, " << mismatched << " mismatches, "
+         << reference.size() - matched - mismatched << " snapshot accounts not covered by the log" << endl;
+    cout << "Replay directory: " << replayDir << endl;
+    return mismatched == 0 && failed == 0 ? 0 : 1;
+#else
+    (void)argc;
+    (void)argv;
+    cerr << "replay requires a POSIX system." << endl;
+    return 2;
+#endif
+}
+
+// What TRANSACTION_LOG says about one account
+struct LoggedBalance {
+    int64_t movedMinor = 0;     // Deposits and incoming transfers less withdrawals and outgoing ones
+    int64_t openingMinor = 0;   // Initial deposit from the "Account created" line
+    bool created = false;       // The log covers the account from its opening
+    bool openingLogged = false; // The create line carried the initial deposit
+    bool closed = false;
+};
+
+struct LogTally {
+    unordered_map<uint64_t, LoggedBalance> accounts;    // By account id
+    vector<pair<uint64_t, uint64_t>> imported;           // Bulk-imported id ranges
+    size_t operations = 0;
+    size_t unparsed = 0;
+
+    void add(const LogTally& other) {
+        for (const auto& entry : other.accounts) {
+            LoggedBalance& mine = accounts[entry.first];
+            mine.movedMinor += entry.second.movedMinor;
+            if (entry.second.openingLogged) mine.openingMinor = entry.second.openingMinor;
+            mine.created |= entry.second.created;
+            mine.openingLogged |= entry.second.openingLogged;
+            mine.closed |= entry.second.closed;
+        }
+        imported.insert(imported.end(), other.imported.begin(), other.imported.end());
+        operations += other.operations;
+        unparsed += other.unparsed;
+    }
+};
+
+inline uint64_t loggedAccountId(const string& accNum) {
+    return accNum.size() > 4 ? strtoull(accNum.c_str() + 4, nullptr, 10) : 0;
+}
+
+// Adds one " - <message>" line of the log to `tally`. Timestamps do not
+// matter for the totals, so lines are independent and a reader can start
+// anywhere.
+void tallyLogMessage(const string& message, LogTally& tally) {
+    static const string CROSS_SHARD = "Cross-shard transfer ";
+    LoggedOperation op;
+    if (message.compare(0, CROSS_SHARD.size(), CROSS_SHARD) == 0) {
+        // A decided leg; an aborted one left the balance as it was
+        bool from = message.compare(CROSS_SHARD.size(), 5, "from ") == 0;
+        bool to = message.compare(CROSS_SHARD.size(), 3, "to ") == 0;
+        size_t begin = CROSS_SHARD.size() + (from ? 5 : 3), colon = message.find(": ", begin);
+        if ((from || to) && colon != string::npos) {
+            int64_t amount = toMinorUnits(atof(message.c_str() + colon + 2));
+            tally.accounts[loggedAccountId(message.substr(begin, colon - begin))].movedMinor += from ? -amount : amount;
+        }
+        ++tally.operations;
+        return;
+    }
+    if (!parseLogMessage(message, op)) {
+        // Standing-order bookkeeping and the like move no money
+        if (message.compare(0, 15, "Standing order ") != 0) ++tally.unparsed;
+        return;
+    }
+    ++tally.operations;
+    int64_t amount = toMinorUnits(op.amount);
+    switch (op.type) {
+        case 'C': {
+            LoggedBalance& account = tally.accounts[loggedAccountId(op.account)];
+            account.created = true;
+            account.openingLogged = !op.accountType.empty();
+            account.openingMinor = amount;
+            break;
+        }
+        case 'D':
+            tally.accounts[loggedAccountId(op.account)].movedMinor += amount;
+            break;
+        case 'W':
+            tally.accounts[loggedAccountId(op.account)].movedMinor -= amount;
+            break;
+        case 'T':
+            tally.accounts[loggedAccountId(op.account)].movedMinor -= amount;
+            tally.accounts[loggedAccountId(op.lastAccount)].movedMinor += amount;
+            break;
+        case 'X':
+            tally.accounts[loggedAccountId(op.account)].closed = true;
+            break;
+        case 'B':
+            tally.imported.emplace_back(loggedAccountId(op.account), loggedAccountId(op.lastAccount));
+            break;
+    }
+}
+
+const size_t RECONCILE_READ_BYTES = 1 << 20; // Block size of each log reader
+
+// Tallies the log in byte ranges, each streamed by its own reader; a range
+// owns the lines that start inside it
+LogTally tallyTransactionLog(const string& path, size_t workers, uint64_t& bytes) {
+    LogTally total;
+    bytes = 0;
+    {
+        ifstream probe(path, ios::binary | ios::ate);
+        if (!probe) return total;
+        bytes = (uint64_t)probe.tellg();
+    }
+    size_t parts = max<size_t>(1, min<size_t>(workers * 8, bytes / RECONCILE_READ_BYTES + 1));
+    vector<LogTally> tallies(max<size_t>(1, min(workers, parts)));
+    parallelForStealing(parts, tallies.size(), [&](size_t worker, size_t part) {
+        uint64_t begin = bytes * part / parts, end = bytes * (part + 1) / parts;
+        // Reading from the byte before `begin` and dropping everything up to
+        // the first newline leaves the line in progress to the previous
+        // range, while a line starting exactly at `begin` stays in this one
+        uint64_t lineStart = begin > 0 ? begin - 1 : 0;
+        bool skipping = begin > 0;
+        ifstream in(path, ios::binary);
+        in.seekg((streamoff)lineStart);
+        vector<char> block(RECONCILE_READ_BYTES);
+        string line;
+        while (lineStart < end && in) {
+            in.read(block.data(), (streamsize)block.size());
+            size_t got = (size_t)in.gcount();
+            if (got == 0) break;
+            size_t from = 0;
+            for (size_t newline; from < got && (newline = (size_t)((const char*)memchr(block.data() + from, '\n',
+                                                                            got - from) - block.data())) < got;) {
+                line.append(block.data() + from, newline - from);
+                if (skipping) {
+                    skipping = false;
+                } else if (line.compare(0, 3, " - ") == 0) {
+                    tallyLogMessage(line.substr(3), tallies[worker]);
+                }
+                lineStart += line.size() + 1;
+                line.clear();
+                from = newline + 1;
+                if (lineStart >= end) break;
+            }
+            if (lineStart >= end) break;
+            line.append(block.data() + from, got - from);
+        }
+        if (!skipping && lineStart < end && line.compare(0, 3, " - ") == 0) tallyLogMessage(line.substr(3), tallies[worker]);
+    });
+    for (const LogTally& tally : tallies) total.add(tally);
+    return total;
+}
+
+// Recomputes every account's balance from its history and from the log,
+// compares both with the stored balance and the per-type totals with the
+// live aggregates and the ledger, and writes each discrepancy to `--out`
+int runReconciliation(int argc, char* argv[]) {
+    map<string, string> options = parseOptions(argc, argv, 2);
+    string logPath = optionOr(options, "log", TRANSACTION_LOG);
+    string outPath = optionOr(options, "out", "reconciliation.csv");
+    size_t workers = max<size_t>(1, strtoul(optionOr(options, "workers", to_string(max(1u, thread::hardware_concurrency())))
+                                                 .c_str(), nullptr, 10));
+
+    auto start = chrono::steady_clock::now();
+    auto seconds = [&] { return chrono::duration<double>(chrono::steady_clock::now() - start).count(); };
+    BankingSystem bank;
+    double loadSeconds = seconds();
+
+    // The log is read while the histories are summed
+    LogTally logged;
+    uint64_t logBytes = 0;
+    thread logReader([&] { logged = tallyTransactionLog(logPath, workers, logBytes); });
+    vector<ReconciledAccount> rows = bank.reconcileHistories(workers);
+    logReader.join();
+    if (!ifstream(logPath)) cerr << "Cannot read " << logPath << "; only the histories are checked" << endl;
+    for (const auto& range : logged.imported) {
+        for (uint64_t id = range.first; id <= range.second; ++id) logged.accounts[id].created = true;
+    }
+    double tallySeconds = seconds() - loadSeconds;
+
+    struct TypeTotals {
+        size_t accounts = 0, covered = 0;
+        int64_t balanceMinor = 0, historyMinor = 0, coveredBalanceMinor = 0, loggedMinor = 0;
+    };
+    TypeTotals totals[MAX_PRODUCTS];
+    size_t historyAgree = 0, historyOff = 0, legacy = 0, logAgree = 0, logOff = 0, uncovered = 0;
+    ofstream out(outPath, ios::trunc);
+    out << "account,type,issue,balance,history,log\n";
+    size_t discrepancies = 0;
+    vector<string> firstFew; // Shown on the console after the totals
+    auto report = [&](const string& accNum, const string& type, const string& issue, int64_t balance,
+                      const string& history, const string& log) {
+        out << accNum << "," << type << "," << issue << "," << formatBalance(balance / 100.0) << "," << history << ","
+            << log << "\n";
+        if (++discrepancies <= 10) {
+            firstFew.push_back((accNum.empty() ? type : accNum + (type.empty() ? "" : " (" + type + ")")) + ": " + issue);
+        }
+    };
+
+    for (const ReconciledAccount& row : rows) {
+        const BankAccount& account = *row.account;
+        int64_t balance = toMinorUnits(account.getBalance());
+        TypeTotals& type = totals[account.getTypeCode()];
+        ++type.accounts;
+        type.balanceMinor += balance;
+        type.historyMinor += row.historyMinor;
+        string history = formatBalance(row.historyMinor / 100.0), log;
+
+        auto found = logged.accounts.find(account.getId());
+        bool covered = found != logged.accounts.end() && found->second.created;
+        if (covered) {
+            const LoggedBalance& entry = found->second;
+            int64_t opening = entry.openingLogged ? entry.openingMinor : row.openingMinor;
+            int64_t fromLog = opening + entry.movedMinor + row.feesMinor - row.inDoubtMinor;
+            log = formatBalance(fromLog / 100.0);
+            ++type.covered;
+            type.coveredBalanceMinor += balance;
+            type.loggedMinor += fromLog;
+            if (entry.closed) {
+                report(account.getAccountNumber(), account.getAccountType(), "logged as closed", balance, history, log);
+            }
+            if (fromLog == balance) {
+                ++logAgree;
+            } else {
+                ++logOff;
+                report(account.getAccountNumber(), account.getAccountType(), "log disagrees", balance, history, log);
+            }
+        } else {
+            ++uncovered;
+        }
+
+        if (row.legacyLines) {
+            ++legacy;
+        } else if (row.historyMinor == balance) {
+            ++historyAgree;
+        } else {
+            ++historyOff;
+            report(account.getAccountNumber(), account.getAccountType(), "history disagrees", balance, history, log);
+        }
+    }
+    // Opened in the log, never closed, and gone
+    for (const auto& entry : logged.accounts) {
+        if (!entry.second.created || entry.second.closed) continue;
+        auto row = lower_bound(rows.begin(), rows.end(), entry.first, [](const ReconciledAccount& r, uint64_t id) {
+            return r.account->getId() < id;
+        });
+        if (row == rows.end() || row->account->getId() != entry.first) {
+            report("ACCT" + to_string(entry.first), "", "missing", 0, "", "");
+        }
+    }
+
+    AggregateSnapshot live = bank.aggregateSnapshot();
+    LedgerCheck ledger = bank.checkLedger();
+    cout << fixed << setprecision(2);
+    cout << left << setw(16) << "Type" << right << setw(10) << "Accounts" << setw(18) << "Balances" << setw(18)
+         << "History" << setw(18) << "Live totals" << setw(10) << "Logged" << setw(18) << "Log" << endl;
+    TypeTotals all;
+    for (uint8_t code = 0; code < ProductRegistry::instance().size(); ++code) {
+        const TypeTotals& type = totals[code];
+        if (type.accounts == 0 && live.heldMinor[code] == 0) continue;
+        bool agree = type.balanceMinor == type.historyMinor && type.balanceMinor == live.heldMinor[code] &&
+                     type.coveredBalanceMinor == type.loggedMinor;
+        cout << left << setw(16) << productInfo(code).name << right << setw(10) << type.accounts << setw(18)
+             << type.balanceMinor / 100.0 << setw(18) << type.historyMinor / 100.0 << setw(18)
+             << live.heldMinor[code] / 100.0 << setw(10) << type.covered << setw(18) << type.loggedMinor / 100.0
+             << (agree ? "" : "  *") << endl;
+        if (!agree) report("", productInfo(code).name, "type totals disagree", type.balanceMinor,
+                           formatBalance(type.historyMinor / 100.0), formatBalance(type.loggedMinor / 100.0));
+        all.accounts += type.accounts;
+        all.covered += type.covered;
+        all.balanceMinor += type.balanceMinor;
+        all.historyMinor += type.historyMinor;
+        all.loggedMinor += type.loggedMinor;
+    }
+    int64_t liveTotal = 0;
+    for (int64_t held : live.heldMinor) liveTotal += held;
+    cout << left << setw(16) << "Total" << right << setw(10) << all.accounts << setw(18) << all.balanceMinor / 100.0
+         << setw(18) << all.historyMinor / 100.0 << setw(18) << liveTotal / 100.0 << setw(10) << all.covered
+         << setw(18) << all.loggedMinor / 100.0 << endl;
+    if (!ledger.clean()) report("", "", "ledger does not balance", ledger.trialBalanceMinor, "", "");
+    for (const string& line : firstFew) cout << "  " << line << endl;
+
+    cout << "History: " << historyAgree << " agree, " << historyOff << " disagree, " << legacy
+         << " with legacy lines not checked" << endl;
+    cout << "Log:     " << logAgree << " agree, " << logOff << " disagree, " << uncovered
+         << " opened before the log begins; " << logged.operations << " operations, " << logged.unparsed
+         << " unparsed lines" << endl;
+    cout << "Ledger:  trial balance " << (ledger.trialBalanceMinor == 0 ? "agrees" : "is off") << ", "
+         << ledger.accountMismatches << " accounts off" << endl;
+    cout << "Loaded in " << setprecision(2) << loadSeconds << " s; reconciled " << logged.operations
+         << " logged operations (" << setprecision(0) << logBytes / 1e6 << " MB) in " << setprecision(2)
+         << tallySeconds << " s on " << workers << " workers" << endl;
+    cout << discrepancies << " discrepancies" << (discrepancies ? " written to " + outPath : "") << endl;
+    return discrepancies == 0 ? 0 : 1;
+}
+
+int runCommand(int argc, char* argv[]) {
+    string command = argv[1];
+    if (command == "crash-test") {
+#ifndef _WIN32
+        int iterations = argc > 2 ? atoi(argv[2]) : 100;
+        unsigned seed = argc > 3 ? (unsigned)strtoul(argv[3], nullptr, 10) : (unsigned)time(0);
+        return runCrashTest(iterations, seed);
+#else
+        cerr << "crash-test requires a POSIX system." << endl;
+        return 2;
+#endif
+    }
+
+    if (command == "import") {
+        if (argc < 3) {
+            cerr << "Usage: " << argv[0] << " import <customers.csv> [rejects.csv]" << endl;
+            return 2;
+        }
+        string rejectPath = argc > 3 ? argv[3] : string(argv[2]) + ".rejects.csv";
+        auto start = chrono::steady_clock::now();
+        BankingSystem bank;
+        ImportReport report = bank.importAccounts(argv[2], rejectPath);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Imported " << report.accepted << " of " << report.rows << " rows in " << fixed
+             << setprecision(2) << seconds << " s";
+        if (report.accepted > 0) cout << " (" << report.firstAccount << " to " << report.lastAccount << ")";
+        cout << endl;
+        if (report.rejected > 0) cout << report.rejected << " rejected rows written to " << rejectPath << endl;
+        if (report.accepted > 0 && !report.committed) {
+            cerr << "Import could not be checkpointed." << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (command == "batch") {
+        if (argc < 3) {
+            cerr << "Usage: " << argv[0] << " batch <operations-file> [batch size]" << endl;
+            return 2;
+        }
+        size_t batchSize = argc > 3 ? strtoul(argv[3], nullptr, 10) : 1000;
+        return runBatchFile(argv[2], max<size_t>(1, batchSize));
+    }
+
+    if (command == "tellers") {
+#ifndef _WIN32
+        return runTellers(argc > 2 ? argv[2] : "/tmp/bms-tellers.sock");
+#else
+        cerr << "tellers requires Unix domain sockets." << endl;
+        return 2;
+#endif
+    }
+
+    if (command == "shards") {
+        if (argc < 3) {
+            cerr << "Usage: " << argv[0] << " shards <count> [socket]" << endl;
+            return 2;
+        }
+#ifndef _WIN32
+        size_t count = strtoul(argv[2], nullptr, 10);
+        return runShards(max<size_t>(1, count), argc > 3 ? argv[3] : "/tmp/bms.sock");
+#else
+        cerr << "shards requires Unix domain sockets and fork()." << endl;
+        return 2;
+#endif
+    }
+
+    if (command == "bench-shards") {
+#ifndef _WIN32
+        size_t maxShards = argc > 2 ? strtoul(argv[2], nullptr, 10) : 4;
+        double seconds = argc > 3 ? atof(argv[3]) : 5.0;
+        size_t clients = argc > 4 ? strtoul(argv[4], nullptr, 10) : 16;
+        return runShardBenchmark(max<size_t>(1, maxShards), max(0.5, seconds), max<size_t>(1, clients));
+#else
+        cerr << "bench-shards requires Unix domain sockets and fork()." << endl;
+        return 2;
+#endif
+    }
+
+    if (command == "bench-tellers") {
+        size_t sessions = argc > 2 ? strtoul(argv[2], nullptr, 10) : 10000;
+        size_t rounds = argc > 3 ? strtoul(argv[3], nullptr, 10) : 20;
+        return runTellerBenchmark(max<size_t>(1, sessions), rounds);
+    }
+
+    if (command == "serve") {
+#ifndef _WIN32
+        return runDaemon(argc > 2 ? argv[2] : "/tmp/bms.sock");
+#else
+        cerr << "serve requires Unix domain sockets." << endl;
+        return 2;
+#endif
+    }
+
+    if (command == "loadgen") {
+        return runLoadgen(argc, argv);
+    }
+
+    if (command == "bench-accounts") {
+        size_t accountCount = argc > 2 ? strtoul(argv[2], nullptr, 10) : 200000;
+        size_t operations = argc > 3 ? strtoul(argv[3], nullptr, 10) : 2000000;
+        return runAccountBenchmark(max<size_t>(1, accountCount), max<size_t>(1, operations));
+    }
+
+    if (command == "replay") {
+        return runReplay(argc, argv);
+    }
+
+    if (command == "reconcile") {
+        return runReconciliation(argc, argv);
+    }
+
+    if (command == "shm-owner" || command == "shm-teller") {
+#ifndef _WIN32
+        map<string, string> options = parseOptions(argc, argv, 2);
+        string name = optionOr(options, "name", "/bms-accounts");
+        if (command == "shm-teller") return runSharedTeller(name);
+        return runSharedOwner(name, (uint32_t)strtoul(optionOr(options, "room", "100000").c_str(), nullptr, 10));
+#else
+        cerr << command << " requires POSIX shared memory." << endl;
+        return 2;
+#endif
+    }
+
+    if (command == "as-of") {
+        // The time may be quoted with the date or given as its own argument
+        int next = 3;
+        string moment = argc > 2 ? argv[2] : "";
+        if (argc > next && strchr(argv[next], ':')) moment += string(" ") + argv[next++];
+        time_t when;
+        if (!parseDateTime(moment, when)) {
+            cerr << "Usage: " << argv[0] << " as-of <YYYY-MM-DD> [HH:MM[:SS]] [account]" << endl;
+            return 2;
+        }
+        BankingSystem bank;
+        if (argc > next) {
+            double balance = 0.0;
+            if (!bank.lookupAccount(argv[next])) {
+                cerr << "Account not found." << endl;
+                return 1;
+            }
+            if (!bank.balanceAsOf(argv[next], when, balance)) {
+                cout << argv[next] << " was not open on " << formatCtime(when) << endl;
                 return 0;
-            default:
-                cout << "Invalid choice. Please enter a number between 1 and 8." << endl;
+            }
+            cout << argv[next] << " balance on " << formatCtime(when) << ": " << fixed << setprecision(2)
+                 << balance << " BDT" << endl;
+            return 0;
+        }
+        auto start = chrono::steady_clock::now();
+        vector<AsOfBalance> rows = bank.balancesAsOf(when);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << renderAsOfReport(rows, when);
+        cerr << "Computed " << rows.size() << " balances in " << fixed << setprecision(3) << seconds << " s" << endl;
+        return 0;
+    }
+
+    if (command == "statements") {
+        StatementPeriod period;
+        if (argc < 3 || !parseStatementMonth(argv[2], period)) {
+            cerr << "Usage: " << argv[0] << " statements <YYYY-MM> [--out prefix] [--workers N]" << endl;
+            return 2;
+        }
+        map<string, string> options = parseOptions(argc, argv, 3);
+        string prefix = optionOr(options, "out", "statements-" + period.label);
+        size_t workers = strtoul(optionOr(options, "workers", to_string(max(1u, thread::hardware_concurrency()))).c_str(),
+                                 nullptr, 10);
+        BankingSystem bank;
+        StatementReport report = bank.generateStatements(period, prefix, max<size_t>(1, workers));
+        if (!report.ok) {
+            cerr << "Could not write statements to " << prefix << "-*.txt" << endl;
+            return 1;
         }
+        cout << "Wrote " << report.statements << " statements (" << fixed << setprecision(1) << report.bytes / 1e6
+             << " MB) to " << report.shards << " shards " << prefix << "-*.txt in " << setprecision(3)
+             << report.seconds << " s, " << setprecision(0) << report.statements / max(report.seconds, 1e-9)
+             << " statements/s" << endl;
+        return 0;
+    }
 
-        cout << "\nPress Enter to continue...";
-        cin.ignore();
-        cin.get();
+    if (command == "bench-rules") {
+        size_t accountCount = argc > 2 ? strtoul(argv[2], nullptr, 10) : 100000;
+        size_t operations = argc > 3 ? strtoul(argv[3], nullptr, 10) : 2000000;
+        return runVelocityBenchmark(max<size_t>(1, accountCount), max<size_t>(1, operations));
     }
 
-    return 0;
+    if (command == "bench-orders") {
+        size_t count = argc > 2 ? strtoul(argv[2], nullptr, 10) : 1000000;
+        long days = argc > 3 ? strtol(argv[3], nullptr, 10) : 60;
+        return runOrderBenchmark(max<size_t>(1, count), max(1L, days));
+    }
+
+    if (command == "ledger") {
+        BankingSystem bank;
+        LedgerCheck check = bank.checkLedger();
+        cout << renderLedgerCheck(check);
+        return check.clean() ? 0 : 1;
+    }
+
+    if (command == "bench-ledger") {
+        size_t accountCount = argc > 2 ? strtoul(argv[2], nullptr, 10) : 1000000;
+        size_t entries = argc > 3 ? strtoul(argv[3], nullptr, 10) : 20000000;
+        return runLedgerBenchmark(max<size_t>(1, accountCount), entries);
+    }
+
+    if (command == "bench-history") {
+        size_t accountCount = argc > 2 ? strtoul(argv[2], nullptr, 10) : 10000;
+        size_t entries = argc > 3 ? strtoul(argv[3], nullptr, 10) : 200;
+        return runHistoryBenchmark(max<size_t>(1, accountCount), max<size_t>(1, entries));
+    }
+
+    cerr << "Unknown command: " << command << endl;
+    cerr << "Usage: " << argv[0] << " [command]" << endl;
+    cerr << "  import <customers.csv> [rejects]    Open accounts in bulk from a CSV file" << endl;
+    cerr << "  batch <file> [size]                 Apply DEPOSIT/WITHDRAW/TRANSFER/BALANCE lines in batches" << endl;
+    cerr << "  serve [socket]                      Serve the line protocol on a Unix socket" << endl;
+    cerr << "  tellers [socket]                    Serve interactive teller sessions on a Unix socket" << endl;
+    cerr << "  shards <count> [socket]             Serve the line protocol from account-range shards" << endl;
+    cerr << "  loadgen build|run [options]         Build synthetic data or drive a mixed workload" << endl;
+    cerr << "  shm-owner [--name n] [--room N]     Share live accounts through POSIX shared memory" << endl;
+    cerr << "  shm-teller [--name n]               Serve protocol lines from stdin on the shared accounts" << endl;
+    cerr << "  crash-test [iterations] [seed]      Kill workers at random points and verify recovery" << endl;
+    cerr << "  bench-history [accounts] [entries]  Measure history compression and decode speed" << endl;
+    cerr << "  bench-accounts [accounts] [ops]     Measure account memory and deposit throughput" << endl;
+    cerr << "  bench-rules [accounts] [ops]        Measure the latency velocity rules add to a withdrawal" << endl;
+    cerr << "  bench-orders [orders] [days]        Measure standing-order scheduling and execution" << endl;
+    cerr << "  bench-tellers [sessions] [rounds]   Measure idle teller session memory and switching" << endl;
+    cerr << "  bench-shards [max] [secs] [clients] Measure throughput with 1, 2, 4 ... shards" << endl;
+    cerr << "  bench-ledger [accounts] [entries]   Measure ledger posting and validation speed" << endl;
+    cerr << "  ledger                              Trial balance; checks every balance against the ledger" << endl;
+    cerr << "  as-of <date> [time] [account]       Balances at a past moment, for one account or all" << endl;
+    cerr << "  statements <YYYY-MM> [options]      Monthly statements for every account [--out p] [--workers N]" << endl;
+    cerr << "  replay [--log f] [--data dir]       Re-execute the transaction log and verify balances" << endl;
+    cerr << "         [--pace max|recorded] [--speed x]" << endl;
+    cerr << "  reconcile [--log f] [--out f]       End-of-day check of balances against history and log" << endl;
+    cerr << "            [--workers N]" << endl;
+    return 2;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1) {
+        return runCommand(argc, argv);
+    }
+
+    return runConsoleSession();
 }